@@ -18,6 +18,8 @@
 #include <anvill/Decl.h>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/IR/DataLayout.h>
 #include <llvm/IR/DebugInfoMetadata.h>
 #include <llvm/IR/Function.h>
 #include <llvm/IR/Instructions.h>
@@ -33,9 +35,14 @@
 
 #include <algorithm>
 #include <bitset>
+#include <condition_variable>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <vector>
 
 #if __has_include(<llvm/Support/JSON.h>)
 
@@ -43,6 +50,42 @@ DECLARE_string(arch);
 DECLARE_string(os);
 DEFINE_string(bc_file, "",
               "Path to BITcode file containing data to be specified");
+DEFINE_uint32(jobs, 1,
+              "Number of worker threads to use when specifying functions");
+
+namespace {
+
+// Number of functions whose declarations are created and serialized by one
+// worker at a time.
+static constexpr size_t kBatchSize = 256u;
+
+// Compact JSON of the declarations of one batch of functions, or `nullptr`
+// if the batch isn't done yet.
+using BatchOutput = std::unique_ptr<std::string>;
+
+// Create and serialize the declarations of the functions in
+// `[begin, end)`, one per line.
+static BatchOutput SpecifyBatch(llvm::Function * const *begin,
+                                llvm::Function * const *end,
+                                const remill::Arch::ArchPtr &arch,
+                                const llvm::DataLayout &dl,
+                                anvill::SignatureCache &signatures) {
+  BatchOutput output(new std::string);
+  llvm::raw_string_ostream os(*output);
+  for (auto it = begin; it != end; ++it) {
+    auto maybe_func = anvill::FunctionDecl::Create(**it, arch, &signatures);
+    if (remill::IsError(maybe_func)) {
+      LOG(ERROR) << remill::GetErrorString(maybe_func);
+    } else {
+      auto &func = remill::GetReference(maybe_func);
+      os << ",\n" << llvm::json::Value(func.SerializeToJSON(dl));
+    }
+  }
+  os.flush();
+  return output;
+}
+
+}  // namespace
 
 int main(int argc, char *argv[]) {
   google::ParseCommandLineFlags(&argc, &argv, true);
@@ -68,36 +111,97 @@ int main(int argc, char *argv[]) {
   std::string arch_name = remill::GetArchName(arch->arch_name);
   std::string os_name = remill::GetOSName(arch->os_name);
 
-  llvm::json::Object json;
-  json.insert(llvm::json::Object::KV{llvm::json::ObjectKey("arch"), arch_name});
-  json.insert(llvm::json::Object::KV{llvm::json::ObjectKey("os"), os_name});
-
-  llvm::json::Array funcs_json;
-
-  const auto &dl = module->getDataLayout();
+  std::vector<llvm::Function *> funcs;
   for (auto &function : *module) {
 
     // Skip llvm debug intrinsics
-    if (function.getIntrinsicID()) {
-      continue;
+    if (!function.getIntrinsicID()) {
+      funcs.push_back(&function);
     }
+  }
 
-    auto maybe_func = anvill::FunctionDecl::Create(function, arch);
-    if (remill::IsError(maybe_func)) {
-      LOG(ERROR) << remill::GetErrorString(maybe_func);
-    } else {
-      auto &func = remill::GetReference(maybe_func);
-      funcs_json.push_back(func.SerializeToJSON(dl));
+  const auto num_batches = (funcs.size() + kBatchSize - 1u) / kBatchSize;
+  const auto num_jobs = static_cast<unsigned>(std::min<size_t>(
+      std::max(1u, FLAGS_jobs), std::max<size_t>(1u, num_batches)));
+
+  // NOTE(pag): Workers only run a few batches ahead of the batch being
+  //            printed, so that memory use stays flat however many
+  //            functions there are in the module.
+  const auto max_pending_batches = 4u * num_jobs;
+
+  std::vector<BatchOutput> outputs(num_batches);
+  std::mutex outputs_lock;
+  std::condition_variable batch_done;
+  std::condition_variable batch_printed;
+  size_t next_batch = 0u;
+  size_t num_printed = 0u;
+
+  // NOTE(pag): Declarations are created from the one module and context in
+  //            parallel. The signature cache serializes the parts of that
+  //            which may create types, and every worker uses its own copy of
+  //            the data layout, as data layouts lazily cache the layouts of
+  //            structures.
+  anvill::SignatureCache signatures;
+  std::vector<std::thread> workers;
+  workers.reserve(num_jobs);
+  for (auto i = 0u; i < num_jobs; ++i) {
+    workers.emplace_back([&] {
+      const llvm::DataLayout dl(module->getDataLayout());
+      std::unique_lock<std::mutex> locker(outputs_lock);
+      while (next_batch < num_batches) {
+        if (next_batch >= num_printed + max_pending_batches) {
+          batch_printed.wait(locker);
+          continue;
+        }
+
+        const auto batch = next_batch++;
+        locker.unlock();
+
+        const auto begin = batch * kBatchSize;
+        const auto end = std::min(begin + kBatchSize, funcs.size());
+        auto output = SpecifyBatch(funcs.data() + begin, funcs.data() + end,
+                                   arch, dl, signatures);
+
+        locker.lock();
+        outputs[batch] = std::move(output);
+        batch_done.notify_all();
+      }
+    });
+  }
+
+  // Print the JSON as the batches are done, in the order of the functions in
+  // the module. Every function declaration in a batch is preceded by `",\n"`,
+  // which is dropped from the first one.
+  llvm::raw_fd_ostream S(STDOUT_FILENO, false);
+  S << "{\"arch\": " << llvm::json::Value(arch_name)
+    << ", \"os\": " << llvm::json::Value(os_name) << ", \"functions\": [";
+
+  auto is_first = true;
+  for (size_t batch = 0u; batch < num_batches; ++batch) {
+    BatchOutput output;
+    {
+      std::unique_lock<std::mutex> locker(outputs_lock);
+      batch_done.wait(locker, [&] { return outputs[batch] != nullptr; });
+      output = std::move(outputs[batch]);
     }
+
+    if (!output->empty()) {
+      S << llvm::StringRef(*output).drop_front(is_first ? 2u : 0u);
+      is_first = false;
+    }
+
+    {
+      std::lock_guard<std::mutex> locker(outputs_lock);
+      num_printed = batch + 1u;
+    }
+    batch_printed.notify_all();
   }
 
-  // Insert functions array into top level JSON
-  json.insert(llvm::json::Object::KV{llvm::json::ObjectKey("functions"),
-                                     llvm::json::Value(std::move(funcs_json))});
+  S << "]}\n";
 
-  // Print JSON
-  llvm::raw_fd_ostream S(STDOUT_FILENO, false);
-  S << llvm::formatv("{0:4}", llvm::json::Value(std::move(json)));
+  for (auto &worker : workers) {
+    worker.join();
+  }
 
   return EXIT_SUCCESS;
 }
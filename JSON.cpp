@@ -15,14 +15,28 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <fcntl.h>
 #include <gflags/gflags.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
 #include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
 #include <ios>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include "anvill/Version.h"
 
@@ -59,10 +73,20 @@ static void SetVersion(void) {
 
 // clang-format off
 #  include <remill/BC/Compat/CTypes.h>
+#  include <llvm/ADT/SmallVector.h>
+#  include <llvm/ADT/StringRef.h>
+#  include <llvm/Bitcode/BitcodeWriter.h>
 #  include <llvm/IR/LLVMContext.h>
 #  include <llvm/IR/Module.h>
+#  include <llvm/IRReader/IRReader.h>
+#  include <llvm/Linker/Linker.h>
+#  include <llvm/Support/FileSystem.h>
+#  include <llvm/Support/FormatVariadic.h>
 #  include <llvm/Support/JSON.h>
 #  include <llvm/Support/MemoryBuffer.h>
+#  include <llvm/Support/SourceMgr.h>
+#  include <llvm/Support/raw_ostream.h>
+#  include <llvm/Transforms/Utils/Cloning.h>
 
 // clang-format on
 
@@ -76,9 +100,15 @@ static void SetVersion(void) {
 
 #  include "anvill/Analyze.h"
 #  include "anvill/Decl.h"
+#  include "anvill/Hex.h"
 #  include "anvill/Lift.h"
+#  include "anvill/LiftCache.h"
 #  include "anvill/Optimize.h"
+#  include "anvill/Partition.h"
 #  include "anvill/Program.h"
+#  include "anvill/Semantics.h"
+#  include "anvill/Shard.h"
+#  include "anvill/Stats.h"
 #  include "anvill/TypeParser.h"
 #  include "anvill/Util.h"
 
@@ -90,6 +120,106 @@ DEFINE_string(ir_out, "", "Path to file where the LLVM IR should be saved.");
 DEFINE_string(bc_out, "",
               "Path to file where the LLVM bitcode should be "
               "saved.");
+DEFINE_string(shards_out, "",
+              "Path to a directory where the LLVM bitcode should be saved as "
+              "--num_shards separate modules, along with a manifest.json "
+              "that lists the functions and variables defined by each.");
+DEFINE_uint32(num_shards, 8,
+              "Number of modules to split the output into with --shards_out.");
+DEFINE_uint32(jobs, 1,
+              "Number of worker threads to use when lifting and optimizing "
+              "functions. Each worker lifts or optimizes into its own LLVM "
+              "context, and the results are linked together.");
+DEFINE_string(lift_cache, "",
+              "Path to a directory in which to cache lifted functions. "
+              "Functions whose code and declarations, and whose callees' "
+              "declarations, are unchanged since a previous run are loaded "
+              "from the cache instead of being lifted again.");
+DEFINE_string(stats_out, "",
+              "Path to a file where timings of the phases of decompilation, "
+              "and counters such as the number of instructions decoded, "
+              "should be saved.");
+DEFINE_string(stats_format, "json",
+              "Format of the file named by --stats_out. Either 'json', for a "
+              "summary of the total time of each phase and the counters, or "
+              "'chrome', for a Chrome trace event file.");
+DEFINE_string(memory_report, "",
+              "Path to a file where a JSON report of the memory used by the "
+              "program, the size of the module, and the peak resident set "
+              "size at the end of each phase of decompilation should be "
+              "saved.");
+DEFINE_string(pass_manager, "legacy",
+              "LLVM pass manager that runs the function-level optimizations. "
+              "Either 'legacy', or 'new', which caches analyses across "
+              "optimization rounds.");
+DEFINE_string(opt_profile, "default",
+              "How much effort to put into optimizing the lifted code. One "
+              "of 'fast', to lift and lightly clean up, 'default', or "
+              "'thorough', for deep analysis.");
+DEFINE_uint64(inline_budget, 0,
+              "Maximum number of instructions that a lifted function may "
+              "grow to by inlining the semantics of its instructions, or 0 "
+              "for no limit.");
+DEFINE_string(roots, "",
+              "Comma-separated list of the hexadecimal addresses of root "
+              "functions. If non-empty, then only the root functions, and "
+              "the functions that they transitively call, are lifted. The "
+              "other functions are left as declarations.");
+DEFINE_uint32(max_call_depth, 0,
+              "When lifting from --roots, the maximum number of calls from a "
+              "root function to a lifted callee, or 0 for no limit.");
+DEFINE_uint64(max_function_instructions, 0,
+              "Maximum number of instructions to decode when lifting any one "
+              "function, or 0 for no limit. Functions that exceed the limit "
+              "are left as declarations.");
+DEFINE_uint64(max_function_blocks, 0,
+              "Maximum number of basic blocks to create when lifting any one "
+              "function, or 0 for no limit. Functions that exceed the limit "
+              "are left as declarations.");
+DEFINE_uint64(max_function_opt_ms, 0,
+              "Maximum wall time, in milliseconds, to spend optimizing any "
+              "one function, or 0 for no limit. Functions that exceed the "
+              "limit are left minimally optimized.");
+DEFINE_string(semantics_snapshots, "",
+              "Path to a directory of semantics snapshots. The semantics of "
+              "each architecture are saved there the first time that they "
+              "are loaded. Later runs load just the instruction semantics "
+              "that the lifted code uses.");
+DEFINE_bool(server, false,
+            "Run as a server that reads length-prefixed specs from stdin, "
+            "and writes each decompiled module to stdout. The semantics of "
+            "each architecture are only loaded once.");
+DEFINE_string(server_format, "bc",
+              "Format of the modules sent by --server. Either 'bc', for "
+              "LLVM bitcode, or 'ir', for textual LLVM IR.");
+DEFINE_uint64(server_max_request_mib, 4096,
+              "Largest request, in MiB, that --server accepts. A larger "
+              "request is rejected, and stops the server, as the rest of its "
+              "input can't be trusted.");
+DEFINE_uint32(server_recycle_requests, 1000,
+              "Number of requests after which --server recreates its LLVM "
+              "context, and the semantics that it keeps loaded, so that the "
+              "types, constants, and metadata of earlier requests don't "
+              "accumulate. 0 for no limit.");
+DEFINE_uint64(server_recycle_rss_mib, 0,
+              "Resident set size, in MiB, past which --server recreates its "
+              "LLVM context, and the semantics that it keeps loaded, after "
+              "a request. 0 for no limit.");
+DEFINE_string(workers, "",
+              "Semicolon-separated list of shell commands, each of which "
+              "starts a worker that runs this tool with --server, e.g. on "
+              "another node with 'ssh node1 anvill-decompile-json --server'. "
+              "If non-empty, then the functions of --spec are split into "
+              "partitions that call each other as little as possible, each "
+              "partition is decompiled by one of the workers, and the "
+              "results are linked together.");
+DEFINE_uint32(num_partitions, 0,
+              "Number of partitions to split --spec into with --workers, or "
+              "0 for two per worker.");
+DEFINE_uint64(worker_max_response_mib, 16384,
+              "Largest decompiled module, in MiB, that is accepted from a "
+              "worker started by --workers. A worker that sends a larger "
+              "one is no longer used.");
 
 namespace {
 
@@ -145,7 +275,7 @@ static bool ParseValue(const remill::Arch *arch, anvill::ValueDecl &decl,
 // reflective of what you would see if you compiled C/C++ source code to
 // LLVM bitcode, and inspected the type of the corresponding parameter in
 // the bitcode.
-static bool ParseParameter(const remill::Arch *arch, llvm::LLVMContext &context,
+static bool ParseParameter(const remill::Arch *arch, anvill::TypeCache &types,
                            anvill::ParameterDecl &decl,
                            llvm::json::Object *obj) {
 
@@ -162,7 +292,7 @@ static bool ParseParameter(const remill::Arch *arch, llvm::LLVMContext &context,
     return false;
   }
 
-  auto maybe_type = anvill::ParseType(context, *maybe_type_str);
+  auto maybe_type = types.ParseType(*maybe_type_str);
   if (remill::IsError(maybe_type)) {
     LOG(ERROR) << remill::GetErrorString(maybe_type);
     return false;
@@ -173,8 +303,7 @@ static bool ParseParameter(const remill::Arch *arch, llvm::LLVMContext &context,
 }
 
 // Parse a return value from the JSON spec.
-static bool ParseReturnValue(const remill::Arch *arch,
-                             llvm::LLVMContext &context,
+static bool ParseReturnValue(const remill::Arch *arch, anvill::TypeCache &types,
                              anvill::ValueDecl &decl, llvm::json::Object *obj) {
 
   auto maybe_type_str = obj->getString("type");
@@ -183,7 +312,7 @@ static bool ParseReturnValue(const remill::Arch *arch,
     return false;
   }
 
-  auto maybe_type = anvill::ParseType(context, *maybe_type_str);
+  auto maybe_type = types.ParseType(*maybe_type_str);
   if (remill::IsError(maybe_type)) {
     LOG(ERROR) << remill::GetErrorString(maybe_type);
     return false;
@@ -196,7 +325,7 @@ static bool ParseReturnValue(const remill::Arch *arch,
 // Try to unserialize function info from a JSON specification. These
 // are really function prototypes / declarations, and not any isntruction
 // data (that is separate, if present).
-static bool ParseFunction(const remill::Arch *arch, llvm::LLVMContext &context,
+static bool ParseFunction(const remill::Arch *arch, anvill::TypeCache &types,
                           anvill::Program &program, llvm::json::Object *obj) {
 
   anvill::FunctionDecl decl;
@@ -214,7 +343,7 @@ static bool ParseFunction(const remill::Arch *arch, llvm::LLVMContext &context,
     for (llvm::json::Value &maybe_param : *params) {
       if (auto param_obj = maybe_param.getAsObject()) {
         decl.params.emplace_back();
-        if (!ParseParameter(arch, context, decl.params.back(), param_obj)) {
+        if (!ParseParameter(arch, types, decl.params.back(), param_obj)) {
           return false;
         }
       } else {
@@ -275,7 +404,7 @@ static bool ParseFunction(const remill::Arch *arch, llvm::LLVMContext &context,
     for (llvm::json::Value &maybe_ret : *returns) {
       if (auto ret_obj = maybe_ret.getAsObject()) {
         decl.returns.emplace_back();
-        if (!ParseReturnValue(arch, context, decl.returns.back(), ret_obj)) {
+        if (!ParseReturnValue(arch, types, decl.returns.back(), ret_obj)) {
           return false;
         }
       } else {
@@ -299,6 +428,19 @@ static bool ParseFunction(const remill::Arch *arch, llvm::LLVMContext &context,
     decl.calling_convention = static_cast<llvm::CallingConv::ID>(*maybe_cc);
   }
 
+  // NOTE(pag): Specs can override the redzone given by the ABI, e.g. for
+  //            functions compiled with `-mno-red-zone`.
+  if (auto maybe_redzone = obj->getInteger("redzone")) {
+    if (*maybe_redzone < 0) {
+      LOG(ERROR) << "Negative 'redzone' of function at address '" << std::hex
+                 << decl.address << std::dec << "'";
+      return false;
+    }
+    decl.num_bytes_in_redzone = static_cast<uint64_t>(*maybe_redzone);
+  } else {
+    decl.num_bytes_in_redzone = anvill::DefaultRedzoneSize(arch);
+  }
+
   auto err = program.DeclareFunction(decl);
   if (remill::IsError(err)) {
     LOG(ERROR) << remill::GetErrorString(err);
@@ -309,7 +451,7 @@ static bool ParseFunction(const remill::Arch *arch, llvm::LLVMContext &context,
 }
 
 // Try to unserialize variable information.
-static bool ParseVariable(const remill::Arch *arch, llvm::LLVMContext &context,
+static bool ParseVariable(const remill::Arch *arch, anvill::TypeCache &types,
                           anvill::Program &program, llvm::json::Object *obj) {
   anvill::GlobalVarDecl decl;
 
@@ -327,7 +469,7 @@ static bool ParseVariable(const remill::Arch *arch, llvm::LLVMContext &context,
     return false;
   }
 
-  auto maybe_type = anvill::ParseType(context, *maybe_type_str);
+  auto maybe_type = types.ParseType(*maybe_type_str);
   if (remill::IsError(maybe_type)) {
     LOG(ERROR) << remill::GetErrorString(maybe_type);
     return false;
@@ -343,8 +485,11 @@ static bool ParseVariable(const remill::Arch *arch, llvm::LLVMContext &context,
   return true;
 }
 
-// Parse a memory range.
-static bool ParseRange(anvill::Program &program, llvm::json::Object *obj) {
+// Parse a memory range. If the spec came from a binary spec container, then
+// `image` is the contents of that container, and the bytes of the range may
+// be referenced by `offset` and `size` rather than hex-encoded in `data`.
+static bool ParseRange(anvill::Program &program, llvm::json::Object *obj,
+                       llvm::StringRef image) {
 
   auto maybe_ea = obj->getInteger("address");
   if (!maybe_ea) {
@@ -365,6 +510,32 @@ static bool ParseRange(anvill::Program &program, llvm::json::Object *obj) {
     range.is_executable = *perm;
   }
 
+  auto maybe_offset = obj->getInteger("offset");
+  auto maybe_size = obj->getInteger("size");
+  if (maybe_offset && maybe_size) {
+    const auto offset = static_cast<uint64_t>(*maybe_offset);
+    const auto size = static_cast<uint64_t>(*maybe_size);
+    if (offset > image.size() || size > (image.size() - offset)) {
+      LOG(ERROR) << "Bytes of memory range specification at address '"
+                 << std::hex << range.address << std::dec
+                 << "' are outside of the binary spec file '" << FLAGS_spec
+                 << "'.";
+      return false;
+    }
+
+    range.begin = image.bytes_begin() + offset;
+    range.end = range.begin + size;
+
+    // NOTE(pag): The memory buffer of `image` outlives `program`.
+    auto err = program.MapExternalRange(range);
+    if (remill::IsError(err)) {
+      LOG(ERROR) << remill::GetErrorString(err);
+      return false;
+    }
+
+    return true;
+  }
+
   auto maybe_bytes = obj->getString("data");
   if (!maybe_bytes) {
     LOG(ERROR) << "Missing byte string in memory range specification "
@@ -381,29 +552,103 @@ static bool ParseRange(anvill::Program &program, llvm::json::Object *obj) {
     return false;
   }
 
-  std::vector<uint8_t> decoded_bytes;
-  decoded_bytes.reserve(bytes.size() / 2);
+  // Decode the hex-encoded byte sequence directly into the program's
+  // storage for the range.
+  auto err = program.MapRange(
+      range.address, bytes.size() / 2, range.is_writeable,
+      range.is_executable, [&](uint8_t *data) -> llvm::Error {
+        auto decode_err = anvill::DecodeHex(bytes, data);
+        if (remill::IsError(decode_err)) {
+          return llvm::createStringError(
+              std::make_error_code(std::errc::invalid_argument),
+              "%s in memory range specification at address '%lx'",
+              remill::GetErrorString(decode_err).c_str(), range.address);
+        }
+        return llvm::Error::success();
+      });
+
+  if (remill::IsError(err)) {
+    LOG(ERROR) << remill::GetErrorString(err);
+    return false;
+  }
+
+  return true;
+}
 
-  // Parse out the hex-encoded byte sequence.
-  for (auto i = 0ul; i < bytes.size(); i += 2) {
-    char nibbles[3] = {bytes[i], bytes[i + 1], '\0'};
-    char *parsed_to = nullptr;
-    auto byte_val = strtol(nibbles, &parsed_to, 16);
+// Parse a symbol, which is an array of an address and a name.
+static bool ParseSymbol(anvill::Program &program, llvm::json::Array *ea_name) {
+  if (ea_name->size() != 2) {
+    LOG(ERROR) << "Symbol entry doesn't have two values in spec file '"
+               << FLAGS_spec << "'";
+    return false;
+  }
+  auto &maybe_ea = ea_name->operator[](0);
+  auto &maybe_name = ea_name->operator[](1);
 
-    if (parsed_to != &(nibbles[2])) {
-      LOG(ERROR) << "Invalid hex byte value '" << nibbles << "' in memory "
-                 << "range specification at address '" << std::hex
-                 << range.address << std::dec << "'.";
+  if (auto ea = maybe_ea.getAsInteger(); ea) {
+    if (auto name = maybe_name.getAsString(); name) {
+      program.AddNameToAddress(name->str(),
+                               static_cast<uint64_t>(ea.getValue()));
+      return true;
+    } else {
+      LOG(ERROR)
+          << "Second value in symbol entry must be a string in spec file '"
+          << FLAGS_spec << "'";
       return false;
     }
+  } else {
+    LOG(ERROR)
+        << "First value in symbol entry must be an integer in spec file '"
+        << FLAGS_spec << "'";
+    return false;
+  }
+}
+
+// Parse the extended metadata of a byte, e.g. the targets of an indirect jump
+// or call recovered by an earlier analysis.
+static bool ParseExtendedMeta(anvill::Program &program,
+                              llvm::json::Object *obj) {
+  auto maybe_ea = obj->getInteger("address");
+  if (!maybe_ea) {
+    LOG(ERROR) << "Missing address in extended metadata specification";
+    return false;
+  }
+
+  const auto ea = static_cast<uint64_t>(*maybe_ea);
+  anvill::ByteExtendedMeta meta;
+
+  if (auto is_inst_start = obj->getBoolean("is_instruction_start")) {
+    meta.is_instruction_start = *is_inst_start;
+  }
 
-    decoded_bytes.push_back(static_cast<uint8_t>(byte_val));
+  if (auto targets = obj->getArray("targets")) {
+    for (auto &maybe_target : *targets) {
+      if (auto target = maybe_target.getAsInteger(); target) {
+        meta.targets.push_back(static_cast<uint64_t>(*target));
+      } else {
+        LOG(ERROR) << "Non-integer target in extended metadata specification "
+                   << "at address '" << std::hex << ea << std::dec << "'";
+        return false;
+      }
+    }
   }
 
-  range.begin = decoded_bytes.data();
-  range.end = decoded_bytes.data() + decoded_bytes.size();
+  if (auto table = obj->getObject("jump_table")) {
+    auto table_ea = table->getInteger("address");
+    auto table_size = table->getInteger("size");
+    if (!table_ea || !table_size) {
+      LOG(ERROR) << "Jump table in extended metadata specification at address '"
+                 << std::hex << ea << std::dec
+                 << "' must have an address and a size";
+      return false;
+    }
+
+    meta.jump_table_begin = static_cast<uint64_t>(*table_ea);
+    meta.jump_table_end =
+        meta.jump_table_begin + static_cast<uint64_t>(*table_size);
+  }
 
-  auto err = program.MapRange(range);
+  auto err = program.SetExtendedMeta(ea, std::move(meta));
   if (remill::IsError(err)) {
     LOG(ERROR) << remill::GetErrorString(err);
     return false;
@@ -412,6 +657,230 @@ static bool ParseRange(anvill::Program &program, llvm::json::Object *obj) {
   return true;
 }
 
+// The unparsed text of each top-level value in a JSON spec, keyed by name.
+//
+// NOTE(pag): Spec files can be gigabytes in size, and so we don't build
+//            an `llvm::json::Value` for the whole file. Instead, we find
+//            where each top-level value is in the text, and only parse one
+//            element of the top-level arrays at a time, so that peak memory
+//            usage is bounded by the size of the largest element.
+using SpecSections = std::unordered_map<std::string, llvm::StringRef>;
+
+static void SkipWhitespace(llvm::StringRef text, size_t &i) {
+  for (const auto size = text.size(); i < size; ++i) {
+    switch (text[i]) {
+      case ' ':
+      case '\t':
+      case '\n':
+      case '\r': continue;
+      default: return;
+    }
+  }
+}
+
+// Skip over the string in `text` starting at the quote at `i`.
+static bool SkipString(llvm::StringRef text, size_t &i) {
+  for (const auto size = text.size(); ++i < size;) {
+    if (text[i] == '\\') {
+      ++i;
+    } else if (text[i] == '"') {
+      ++i;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Skip over the JSON value in `text` starting at `i`, without parsing it.
+// This doesn't fully validate the value; that is left to `llvm::json::parse`.
+static bool SkipValue(llvm::StringRef text, size_t &i) {
+  const auto size = text.size();
+  SkipWhitespace(text, i);
+  if (i >= size) {
+    return false;
+  }
+
+  switch (text[i]) {
+    case '"': return SkipString(text, i);
+
+    case '{':
+    case '[': {
+      auto depth = 0u;
+      do {
+        switch (text[i]) {
+          case '"':
+            if (!SkipString(text, i)) {
+              return false;
+            }
+            continue;
+          case '{':
+          case '[': ++depth; break;
+          case '}':
+          case ']': --depth; break;
+          default: break;
+        }
+        ++i;
+      } while (depth && i < size);
+      return !depth;
+    }
+
+    // Numbers, `true`, `false`, and `null`.
+    default: {
+      const auto begin = i;
+      for (; i < size; ++i) {
+        const auto ch = text[i];
+        if (ch == ',' || ch == '}' || ch == ']' || ch == ' ' || ch == '\t' ||
+            ch == '\n' || ch == '\r') {
+          break;
+        }
+      }
+      return begin < i;
+    }
+  }
+}
+
+// Find the text of each top-level value of the JSON object in `text`.
+static bool ScanSpecSections(llvm::StringRef text, SpecSections &sections) {
+  size_t i = 0;
+  SkipWhitespace(text, i);
+  if (i >= text.size() || text[i] != '{') {
+    LOG(ERROR) << "JSON spec file '" << FLAGS_spec
+               << "' must contain a single object.";
+    return false;
+  }
+
+  ++i;
+  SkipWhitespace(text, i);
+  if (i < text.size() && text[i] == '}') {
+    return true;
+  }
+
+  while (i < text.size()) {
+    const auto key_begin = i;
+    if (text[i] != '"' || !SkipString(text, i)) {
+      break;
+    }
+
+    auto maybe_key = llvm::json::parse(text.slice(key_begin, i));
+    if (remill::IsError(maybe_key)) {
+      break;
+    }
+
+    const auto key = remill::GetReference(maybe_key).getAsString();
+    SkipWhitespace(text, i);
+    if (!key || i >= text.size() || text[i] != ':') {
+      break;
+    }
+
+    ++i;
+    SkipWhitespace(text, i);
+    const auto value_begin = i;
+    if (!SkipValue(text, i)) {
+      break;
+    }
+
+    sections[key->str()] = text.slice(value_begin, i);
+
+    SkipWhitespace(text, i);
+    if (i >= text.size()) {
+      break;
+    } else if (text[i] == '}') {
+      return true;
+    } else if (text[i] != ',') {
+      break;
+    }
+
+    ++i;
+    SkipWhitespace(text, i);
+  }
+
+  LOG(ERROR) << "Malformed JSON in spec file '" << FLAGS_spec
+             << "' near offset " << i;
+  return false;
+}
+
+// Get the string value of the top-level key `key` in the spec.
+static bool GetSpecString(const SpecSections &sections, const char *key,
+                          std::string &out) {
+  auto it = sections.find(key);
+  if (it == sections.end()) {
+    return false;
+  }
+
+  auto maybe_val = llvm::json::parse(it->second);
+  if (remill::IsError(maybe_val)) {
+    LOG(ERROR) << "Unable to parse '" << key << "' in spec file '"
+               << FLAGS_spec << "': " << remill::GetErrorString(maybe_val);
+    return false;
+  }
+
+  if (auto str = remill::GetReference(maybe_val).getAsString(); str) {
+    out = str->str();
+    return true;
+  } else {
+    return false;
+  }
+}
+
+// Parse each element of the top-level array `key` of the spec, one at a
+// time, and call `cb` on it.
+static bool
+ForEachSpecElement(const SpecSections &sections, const char *key,
+                   std::function<bool(llvm::json::Value &)> cb) {
+  auto it = sections.find(key);
+  if (it == sections.end()) {
+    return true;
+  }
+
+  const auto text = it->second;
+  if (!text.startswith("[")) {
+    LOG(ERROR) << "Non-JSON array value for '" << key << "' in spec file '"
+               << FLAGS_spec << "'";
+    return false;
+  }
+
+  size_t i = 1;
+  SkipWhitespace(text, i);
+  if (i < text.size() && text[i] == ']') {
+    return true;
+  }
+
+  while (i < text.size()) {
+    const auto elem_begin = i;
+    if (!SkipValue(text, i)) {
+      break;
+    }
+
+    auto maybe_elem = llvm::json::parse(text.slice(elem_begin, i));
+    if (remill::IsError(maybe_elem)) {
+      LOG(ERROR) << "Unable to parse element of '" << key
+                 << "' array in spec file '" << FLAGS_spec
+                 << "': " << remill::GetErrorString(maybe_elem);
+      return false;
+    }
+
+    if (!cb(remill::GetReference(maybe_elem))) {
+      return false;
+    }
+
+    SkipWhitespace(text, i);
+    if (i >= text.size()) {
+      break;
+    } else if (text[i] == ']') {
+      return true;
+    } else if (text[i] != ',') {
+      break;
+    }
+
+    ++i;
+    SkipWhitespace(text, i);
+  }
+
+  LOG(ERROR) << "Malformed '" << key << "' array in spec file '" << FLAGS_spec
+             << "'";
+  return false;
+}
+
 // Parse the core data out of a JSON specification, and do a small
 // amount of validation. A JSON spec contains the following:
 //
@@ -434,219 +903,1270 @@ static bool ParseRange(anvill::Program &program, llvm::json::Object *obj) {
 //  - For each memory range:
 //    - Starting address. No alignment restrictions apply.
 //    - Permissions (is_readable, is_writeable, is_executable).
-//    - Data (hex-encoded byte string).
-static bool ParseSpec(const remill::Arch *arch, llvm::LLVMContext &context,
-                      anvill::Program &program, llvm::json::Object *spec) {
-
-  auto num_funcs = 0;
-  if (auto funcs = spec->getArray("functions")) {
-    for (llvm::json::Value &func : *funcs) {
-      if (auto func_obj = func.getAsObject()) {
-        if (!ParseFunction(arch, context, program, func_obj)) {
-          return false;
-        } else {
-          ++num_funcs;
-        }
+//    - Data (hex-encoded byte string), or, in a binary spec, the offset and
+//      size of the raw bytes within the binary spec file.
+//
+//  - For each symbol:
+//    - Address.
+//    - Name.
+//
+//  - Optionally, for each byte with extended metadata:
+//    - Address.
+//    - Whether or not it starts an instruction.
+//    - Targets of the indirect jump or call that starts there.
+//    - Address and size of the jump table read by that jump.
+static bool ParseSpec(const remill::Arch *arch, anvill::TypeCache &types,
+                      anvill::Program &program, const SpecSections &spec,
+                      llvm::StringRef image) {
+
+  auto ok = ForEachSpecElement(spec, "functions", [&](llvm::json::Value &func) {
+    if (auto func_obj = func.getAsObject()) {
+      return ParseFunction(arch, types, program, func_obj);
+    } else {
+      LOG(ERROR) << "Non-JSON object in 'functions' array of spec file '"
+                 << FLAGS_spec << "'";
+      return false;
+    }
+  });
+
+  ok = ok && ForEachSpecElement(spec, "variables", [&](llvm::json::Value &var) {
+    if (auto var_obj = var.getAsObject()) {
+      return ParseVariable(arch, types, program, var_obj);
+    } else {
+      LOG(ERROR) << "Non-JSON object in 'variables' array of spec file '"
+                 << FLAGS_spec << "'";
+      return false;
+    }
+  });
+
+  if (ok) {
+    anvill::ScopedStatTimer timer("ParseSpec.MapRanges");
+    ok = ForEachSpecElement(spec, "memory", [&](llvm::json::Value &range) {
+      if (auto range_obj = range.getAsObject()) {
+        return ParseRange(program, range_obj, image);
       } else {
-        LOG(ERROR) << "Non-JSON object in 'functions' array of spec file '"
+        LOG(ERROR) << "Non-JSON object in 'bytes' array of spec file '"
                    << FLAGS_spec << "'";
         return false;
       }
+    });
+  }
+
+  ok = ok && ForEachSpecElement(spec, "symbols", [&](llvm::json::Value &sym) {
+    if (auto ea_name = sym.getAsArray(); ea_name) {
+      return ParseSymbol(program, ea_name);
+    } else {
+      LOG(ERROR)
+          << "Expected array entries inside of 'symbols' array in spec file '"
+          << FLAGS_spec << "'";
+      return false;
     }
-  } else if (spec->find("functions") != spec->end()) {
-    LOG(ERROR) << "Non-JSON array value for 'functions' in spec file '"
-               << FLAGS_spec << "'";
+  });
+
+  ok = ok &&
+       ForEachSpecElement(spec, "extended_meta", [&](llvm::json::Value &ext) {
+         if (auto ext_obj = ext.getAsObject()) {
+           return ParseExtendedMeta(program, ext_obj);
+         } else {
+           LOG(ERROR) << "Non-JSON object in 'extended_meta' array of spec "
+                      << "file '" << FLAGS_spec << "'";
+           return false;
+         }
+       });
+
+  return ok;
+}
+
+// Header of a binary spec file. A binary spec is a JSON spec, followed
+// by the raw bytes of each memory range, each starting at a page-aligned
+// offset in the file. All fields are little-endian.
+struct BinarySpecHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t json_offset;
+  uint64_t json_size;
+};
+
+static_assert(sizeof(BinarySpecHeader) == 32,
+              "Invalid packing of `struct BinarySpecHeader`.");
+
+static constexpr char kBinarySpecMagic[] = "ANVLSPEC";
+static constexpr uint32_t kBinarySpecVersion = 1;
+
+// Returns `true` if `buff` looks like a binary spec file.
+static bool IsBinarySpec(llvm::StringRef buff) {
+  return buff.startswith(
+      llvm::StringRef(kBinarySpecMagic, sizeof(kBinarySpecMagic) - 1u));
+}
+
+// Find the JSON part of a binary spec file.
+static bool GetBinarySpecJSON(llvm::StringRef buff, llvm::StringRef &json) {
+  if (buff.size() < sizeof(BinarySpecHeader)) {
+    LOG(ERROR) << "Binary spec file '" << FLAGS_spec
+               << "' is too small to contain a header.";
     return false;
   }
 
-  if (auto vars = spec->getArray("variables")) {
-    for (llvm::json::Value &var : *vars) {
-      if (auto var_obj = var.getAsObject()) {
-        if (!ParseVariable(arch, context, program, var_obj)) {
-          return false;
-        }
-      } else {
-        LOG(ERROR) << "Non-JSON object in 'variables' array of spec file '"
-                   << FLAGS_spec << "'";
+  BinarySpecHeader header;
+  memcpy(&header, buff.data(), sizeof(header));
+
+  if (header.version != kBinarySpecVersion) {
+    LOG(ERROR) << "Unsupported version " << header.version
+               << " of binary spec file '" << FLAGS_spec << "'.";
+    return false;
+  }
+
+  if (header.json_offset > buff.size() ||
+      header.json_size > (buff.size() - header.json_offset)) {
+    LOG(ERROR) << "JSON of binary spec file '" << FLAGS_spec
+               << "' is outside of the file.";
+    return false;
+  }
+
+  json = buff.substr(header.json_offset, header.json_size);
+  return true;
+}
+
+// Options that apply to every spec that is decompiled.
+struct DecompileOptions {
+  anvill::LiftOptions lift_options;
+  anvill::OptimizationOptions opt_options;
+};
+
+// Architectures, and their semantics modules, keyed by OS and architecture
+// name. A server keeps the semantics of each architecture that it has seen
+// loaded, and hands out copies of them, so that only its first request for
+// an architecture pays for parsing the semantics bitcode.
+class SemanticsCache {
+ public:
+  explicit SemanticsCache(llvm::LLVMContext &context_, bool keep_loaded_)
+      : context(context_),
+        keep_loaded(keep_loaded_) {}
+
+  // Get the architecture for `os_str` and `arch_str`, and a semantics module
+  // into which code for that architecture can be lifted. Returns `false` if
+  // the architecture isn't supported.
+  bool Get(const std::string &os_str, const std::string &arch_str,
+           const remill::Arch *&arch_out,
+           std::unique_ptr<llvm::Module> &semantics_out) {
+    auto &entry = entries[os_str + ':' + arch_str];
+    if (!entry.arch) {
+      entry.arch = remill::Arch::Build(&context, remill::GetOSName(os_str),
+                                       remill::GetArchName(arch_str));
+      if (!entry.arch) {
         return false;
       }
     }
-  } else if (spec->find("variables") != spec->end()) {
-    LOG(ERROR) << "Non-JSON array value for 'variables' in spec file '"
-               << FLAGS_spec << "'";
-    return false;
-  }
 
-  if (auto ranges = spec->getArray("memory")) {
-    for (llvm::json::Value &range : *ranges) {
-      if (auto range_obj = range.getAsObject()) {
-        if (!ParseRange(program, range_obj)) {
-          return false;
-        }
-      } else {
-        LOG(ERROR) << "Non-JSON object in 'bytes' array of spec file '"
-                   << FLAGS_spec << "'";
+    arch_out = entry.arch.get();
+    if (entry.semantics) {
+      anvill::ScopedStatTimer timer("CloneArchSemantics");
+      semantics_out = llvm::CloneModule(*entry.semantics);
+      return true;
+    }
+
+    auto maybe_semantics =
+        anvill::LoadSemantics(entry.arch.get(), FLAGS_semantics_snapshots);
+    if (remill::IsError(maybe_semantics)) {
+      LOG(ERROR) << remill::GetErrorString(maybe_semantics);
+      return false;
+    }
+
+    semantics_out = std::move(remill::GetReference(maybe_semantics));
+    if (keep_loaded) {
+
+      // NOTE(pag): Cloning a lazily loaded module doesn't clone the bodies
+      //            of functions that aren't materialized yet.
+      if (auto err = semantics_out->materializeAll(); remill::IsError(err)) {
+        LOG(ERROR) << remill::GetErrorString(err);
         return false;
       }
+      entry.semantics = llvm::CloneModule(*semantics_out);
     }
-  } else if (spec->find("memory") != spec->end()) {
-    LOG(ERROR) << "Non-JSON array value for 'memory' in spec file '"
-               << FLAGS_spec << "'";
+    return true;
+  }
+
+ private:
+  struct Entry {
+    remill::Arch::ArchPtr arch;
+
+    // Pristine copy of the semantics, which is never lifted into.
+    std::unique_ptr<llvm::Module> semantics;
+  };
+
+  llvm::LLVMContext &context;
+  const bool keep_loaded;
+  std::unordered_map<std::string, Entry> entries;
+};
+
+static anvill::StatCounter gLiftedInsts("module.instructions_lifted");
+static anvill::StatCounter gOptimizedInsts("module.instructions_optimized");
+
+// Count the instructions in the function definitions of `module` into
+// `counter`, so that the stats show how much code each phase leaves.
+static void CountInstructions(llvm::Module &module,
+                              anvill::StatCounter &counter) {
+  if (!anvill::StatsEnabled()) {
+    return;
+  }
+  for (auto &func : module) {
+    counter.Add(func.getInstructionCount());
+  }
+}
+
+// Memory usage at the end of each phase of decompilation, to be saved to
+// `--memory_report`.
+static llvm::json::Array gMemoryReport;
+
+// Record the memory used by `program`, the size of `module`, and the peak
+// resident set size at the end of `phase`.
+static void RecordMemoryUsage(const char *phase,
+                              const anvill::Program &program,
+                              llvm::Module &module) {
+  if (FLAGS_memory_report.empty()) {
+    return;
+  }
+
+  // NOTE(pag): JSON integers are signed.
+  int64_t num_funcs = 0;
+  int64_t num_defined_funcs = 0;
+  int64_t num_insts = 0;
+  for (auto &func : module) {
+    num_funcs += 1;
+    if (!func.isDeclaration()) {
+      num_defined_funcs += 1;
+      num_insts += func.getInstructionCount();
+    }
+  }
+
+  const auto usage = program.MemoryUsage();
+  const auto size = [](uint64_t val) { return static_cast<int64_t>(val); };
+
+  gMemoryReport.push_back(llvm::json::Object{
+      {"spec", FLAGS_spec},
+      {"phase", phase},
+      {"peak_rss_kib", size(anvill::PeakResidentSetSizeKiB())},
+      {"program",
+       llvm::json::Object{
+           {"mapped_bytes", size(usage.mapped_bytes)},
+           {"copied_bytes", size(usage.copied_bytes)},
+           {"meta_bytes", size(usage.meta_bytes)},
+           {"extended_meta_bytes", size(usage.extended_meta_bytes)},
+           {"range_index_bytes", size(usage.range_index_bytes)},
+           {"function_decl_bytes", size(usage.function_decl_bytes)},
+           {"variable_decl_bytes", size(usage.variable_decl_bytes)},
+           {"symbol_bytes", size(usage.symbol_bytes)},
+           {"total_bytes", size(usage.Total())}}},
+      {"module", llvm::json::Object{{"functions", num_funcs},
+                                    {"defined_functions", num_defined_funcs},
+                                    {"instructions", num_insts},
+                                    {"global_variables",
+                                     size(module.global_size())}}}});
+}
+
+// Save the memory usage recorded by `RecordMemoryUsage` to `--memory_report`.
+static bool WriteMemoryReport(void) {
+  std::error_code ec;
+  llvm::raw_fd_ostream os(FLAGS_memory_report, ec, llvm::sys::fs::OF_Text);
+  if (ec) {
+    LOG(ERROR) << "Unable to open memory report file '"
+               << FLAGS_memory_report << "': " << ec.message();
     return false;
   }
 
-  if (auto symbols = spec->getArray("symbols")) {
-    for (llvm::json::Value &maybe_ea_name : *symbols) {
-      if (auto ea_name = maybe_ea_name.getAsArray(); ea_name) {
-        if (ea_name->size() != 2) {
-          LOG(ERROR) << "Symbol entry doesn't have two values in spec file '"
-                     << FLAGS_spec << "'";
-          return false;
-        }
-        auto &maybe_ea = ea_name->operator[](0);
-        auto &maybe_name = ea_name->operator[](1);
-
-        if (auto ea = maybe_ea.getAsInteger(); ea) {
-          if (auto name = maybe_name.getAsString(); name) {
-            program.AddNameToAddress(name->str(),
-                                     static_cast<uint64_t>(ea.getValue()));
-          } else {
-            LOG(ERROR)
-                << "Second value in symbol entry must be a string in spec file '"
-                << FLAGS_spec << "'";
-            return false;
+  llvm::json::Value report(
+      llvm::json::Object{{"phases", std::move(gMemoryReport)}});
+  os << llvm::formatv("{0:2}", report) << '\n';
+  os.close();
+  if (os.has_error()) {
+    os.clear_error();
+    LOG(ERROR) << "Unable to write memory report file '"
+               << FLAGS_memory_report << "'";
+    return false;
+  }
+  return true;
+}
+
+// Decompile the spec in `buff`, which is either a JSON spec or a binary spec,
+// and return the resulting module, or `nullptr` on failure.
+static std::unique_ptr<llvm::Module>
+DecompileSpec(llvm::StringRef buff, anvill::TypeCache &types,
+              SemanticsCache &semantics_cache,
+              const DecompileOptions &options) {
+  llvm::StringRef image;
+  llvm::StringRef json_data = buff;
+  if (IsBinarySpec(json_data)) {
+    image = json_data;
+    if (!GetBinarySpecJSON(image, json_data)) {
+      return nullptr;
+    }
+  }
+
+  SpecSections spec;
+  {
+    anvill::ScopedStatTimer timer("ScanSpec");
+    if (!ScanSpecSections(json_data, spec)) {
+      return nullptr;
+    }
+  }
+
+  // Take the architecture and OS names out of the JSON spec, and
+  // fall back on the command-line flags if those are missing.
+  auto arch_str = FLAGS_arch;
+  GetSpecString(spec, "arch", arch_str);
+
+  auto os_str = FLAGS_os;
+  GetSpecString(spec, "os", os_str);
+
+  const remill::Arch *arch = nullptr;
+  std::unique_ptr<llvm::Module> semantics;
+  if (!semantics_cache.Get(os_str, arch_str, arch, semantics)) {
+    LOG(ERROR) << "Unable to load semantics for architecture '" << arch_str
+               << "' and OS '" << os_str << "' of spec file '" << FLAGS_spec
+               << "'";
+    return nullptr;
+  }
+
+  anvill::Program program;
+  {
+    anvill::ScopedStatTimer timer("ParseSpec");
+    if (!ParseSpec(arch, types, program, spec, image)) {
+      return nullptr;
+    }
+  }
+
+  // The program is complete, and is only read from here on, possibly by
+  // many threads at once.
+  program.Freeze();
+  RecordMemoryUsage("ParseSpec", program, *semantics);
+
+  std::unique_ptr<anvill::LiftCache> lift_cache;
+  if (!FLAGS_lift_cache.empty()) {
+    auto maybe_cache = anvill::LiftCache::Open(FLAGS_lift_cache, arch, program,
+                                               semantics->getDataLayout());
+    if (remill::IsError(maybe_cache)) {
+      LOG(ERROR) << remill::GetErrorString(maybe_cache);
+      return nullptr;
+    }
+    lift_cache = std::move(remill::GetReference(maybe_cache));
+  }
+
+  // NOTE(pag): A coordinator running with `--workers` lists the functions
+  //            of one partition in `lift_only`, and the other functions are
+  //            decompiled by other workers.
+  auto lift_options = options.lift_options;
+  lift_options.cache = lift_cache.get();
+  if (spec.count("lift_only")) {
+    lift_options.root_addresses.clear();
+    lift_options.lift_callees = false;
+    auto ok = ForEachSpecElement(
+        spec, "lift_only", [&](llvm::json::Value &addr) {
+          if (auto maybe_ea = addr.getAsInteger(); maybe_ea) {
+            lift_options.root_addresses.push_back(
+                static_cast<uint64_t>(*maybe_ea));
+            return true;
           }
-        } else {
-          LOG(ERROR)
-              << "First value in symbol entry must be an integer in spec file '"
-              << FLAGS_spec << "'";
+          LOG(ERROR) << "Non-integer address in 'lift_only' array of spec "
+                     << "file '" << FLAGS_spec << "'";
           return false;
-        }
-      } else {
-        LOG(ERROR)
-            << "Expected array entries inside of 'symbols' array in spec file '"
-            << FLAGS_spec << "'";
-        return false;
-      }
+        });
+    if (!ok) {
+      return nullptr;
+    }
+  }
+
+  {
+    anvill::ScopedStatTimer timer("LiftCodeIntoModule");
+    if (!anvill::LiftCodeIntoModule(arch, program, *semantics,
+                                    lift_options)) {
+      LOG(ERROR) << "Unable to lift code from JSON spec file '" << FLAGS_spec
+                 << "'";
+      return nullptr;
     }
-  } else if (spec->find("symbols") != spec->end()) {
-    LOG(ERROR) << "Non-JSON array value for 'symbols' in spec file '"
-               << FLAGS_spec << "'";
-    return false;
   }
 
+  CountInstructions(*semantics, gLiftedInsts);
+  RecordMemoryUsage("LiftCodeIntoModule", program, *semantics);
+  anvill::OptimizeModule(arch, program, *semantics, options.opt_options);
+  CountInstructions(*semantics, gOptimizedInsts);
+  RecordMemoryUsage("OptimizeModule", program, *semantics);
+
+  // Apply symbol names to functions if we have the names.
+  for (const auto &named : program.NamedAddresses()) {
+    llvm::Value *gval = nullptr;
+    if (program.FindVariable(named.address)) {
+      gval = semantics->getGlobalVariable(
+          anvill::CreateVariableName(named.address));
+    } else if (program.FindFunction(named.address)) {
+      gval = semantics->getFunction(
+          anvill::CreateFunctionName(named.address));
+    }
+
+    if (gval) {
+      gval->setName(llvm::StringRef(named.name.data(), named.name.size()));
+    }
+  }
+
+  return semantics;
+}
+
+// Header of a response sent by the server. It is followed by `size` bytes,
+// which are the decompiled module if `status` is `kServerOK`, and an error
+// message otherwise. All fields are in the host's byte order.
+struct ServerResponseHeader {
+  uint32_t status;
+  uint32_t reserved;
+  uint64_t size;
+};
+
+static_assert(sizeof(ServerResponseHeader) == 16,
+              "Invalid packing of `struct ServerResponseHeader`.");
+
+static constexpr uint32_t kServerOK = 0;
+static constexpr uint32_t kServerError = 1;
+
+// Read exactly `size` bytes from `fd` into `data`. Returns `false` on an
+// error, or if the end of the input is reached first.
+static bool ReadFully(int fd, char *data, size_t size) {
+  while (size) {
+    const auto num_read = ::read(fd, data, size);
+    if (0 < num_read) {
+      data += num_read;
+      size -= static_cast<size_t>(num_read);
+    } else if (!num_read || errno != EINTR) {
+      return false;
+    }
+  }
   return true;
 }
 
-}  // namespace
+static void SendResponse(llvm::raw_ostream &os, uint32_t status,
+                         llvm::StringRef data) {
+  ServerResponseHeader header = {};
+  header.status = status;
+  header.size = data.size();
+  os.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  os << data;
+  os.flush();
+}
 
-int main(int argc, char *argv[]) {
-  SetVersion();
-  google::ParseCommandLineFlags(&argc, &argv, true);
-  google::InitGoogleLogging(argv[0]);
+// The state that a server keeps between requests.
+//
+// NOTE(pag): The context is shared by every request, so that the semantics
+//            modules kept by `semantics_cache` can be cloned into the modules
+//            for each request. Types, constants, and metadata are never
+//            freed from a context, and so the whole state is recreated from
+//            time to time. `context` is declared first so that it is
+//            destroyed last.
+struct ServerState {
+  llvm::LLVMContext context;
+  SemanticsCache semantics_cache;
+  anvill::TypeCache types;
+
+  ServerState(void)
+      : semantics_cache(context, true /* keep_loaded */),
+        types(context) {}
+
+  // Warm up the semantics of the architecture given on the command-line, if
+  // any, so that even the first request is fast.
+  bool WarmUp(void) {
+    if (FLAGS_arch.empty()) {
+      return true;
+    }
+
+    const remill::Arch *arch = nullptr;
+    std::unique_ptr<llvm::Module> semantics;
+    if (!semantics_cache.Get(FLAGS_os, FLAGS_arch, arch, semantics)) {
+      LOG(ERROR) << "Unable to load semantics for architecture '"
+                 << FLAGS_arch << "' and OS '" << FLAGS_os << "'";
+      return false;
+    }
+    return true;
+  }
+};
+
+// Serve decompilation requests from `stdin` until the end of the input. Each
+// request is a `uint64_t` size, in the host's byte order, followed by that
+// many bytes of a JSON or binary spec. Each response is a
+// `ServerResponseHeader` followed by the decompiled module, written to
+// `stdout`.
+static int Serve(const DecompileOptions &options) {
+  if (FLAGS_server_format != "bc" && FLAGS_server_format != "ir") {
+    LOG(ERROR) << "Unsupported --server_format '" << FLAGS_server_format
+               << "'; expected 'bc' or 'ir'";
+    return EXIT_FAILURE;
+  }
+
+  auto state = std::make_unique<ServerState>();
+  if (!state->WarmUp()) {
+    return EXIT_FAILURE;
+  }
+
+  const auto max_request_size = FLAGS_server_max_request_mib << 20u;
+  const auto recycle_rss_kib = FLAGS_server_recycle_rss_mib << 10u;
+  uint64_t num_requests_since_recycle = 0;
+
+  llvm::raw_fd_ostream os(STDOUT_FILENO, false /* shouldClose */);
+  std::vector<char> request;
+  for (uint64_t request_id = 0;; ++request_id) {
+    uint64_t size = 0;
+    if (!ReadFully(STDIN_FILENO, reinterpret_cast<char *>(&size),
+                   sizeof(size))) {
+      break;
+    }
+
+    // NOTE(pag): The bytes of an oversized request aren't read, so the
+    //            framing of any later requests is lost.
+    if (size > max_request_size) {
+      LOG(ERROR) << "Server request " << request_id << " has " << size
+                 << " bytes, which is more than the "
+                 << FLAGS_server_max_request_mib
+                 << " MiB allowed by --server_max_request_mib";
+      SendResponse(os, kServerError,
+                   "Request " + std::to_string(request_id) + " is too big");
+      return EXIT_FAILURE;
+    }
+
+    request.resize(size);
+    if (!ReadFully(STDIN_FILENO, request.data(), request.size())) {
+      LOG(ERROR) << "Truncated server request " << request_id;
+      return EXIT_FAILURE;
+    }
+
+    // NOTE(pag): Error messages name the spec file, so name the request.
+    FLAGS_spec = "<request " + std::to_string(request_id) + ">";
+
+    {
+      auto module = DecompileSpec(llvm::StringRef(request.data(), size),
+                                  state->types, state->semantics_cache,
+                                  options);
+      if (!module) {
+        SendResponse(os, kServerError,
+                     "Unable to decompile " + FLAGS_spec +
+                         "; see the server's log for details");
+      } else {
+        std::string data;
+        llvm::raw_string_ostream data_os(data);
+        if (FLAGS_server_format == "bc") {
+          llvm::WriteBitcodeToFile(*module, data_os);
+        } else {
+          module->print(data_os, nullptr);
+        }
+        data_os.flush();
+        SendResponse(os, kServerOK, data);
+      }
+    }
+
+    // Recreate the context once enough requests have been served, or once
+    // the server has grown too big. The module of the last request lives in
+    // the context, and so is already destroyed.
+    ++num_requests_since_recycle;
+    if ((FLAGS_server_recycle_requests &&
+         num_requests_since_recycle >= FLAGS_server_recycle_requests) ||
+        (recycle_rss_kib &&
+         anvill::ResidentSetSizeKiB() > recycle_rss_kib)) {
+      anvill::ScopedStatTimer timer("RecycleServerState");
+      num_requests_since_recycle = 0;
+      state.reset();
+      state = std::make_unique<ServerState>();
+      if (!state->WarmUp()) {
+        return EXIT_FAILURE;
+      }
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
 
+// Open the spec file named by `--spec`.
+//
+// NOTE(pag): We don't require a NUL terminator so that large spec files
+//            can be memory-mapped. The bytes of memory ranges in binary
+//            spec files are mapped into the program directly from this
+//            buffer, and so it must outlive the program.
+static std::unique_ptr<llvm::MemoryBuffer> OpenSpecFile(void) {
   if (FLAGS_spec.empty()) {
     LOG(ERROR)
         << "Please specify a path to a JSON specification file in --spec.";
-    return EXIT_FAILURE;
+    return nullptr;
   }
 
   if (FLAGS_spec == "/dev/stdin") {
     FLAGS_spec = "-";
   }
 
-  auto maybe_buff = llvm::MemoryBuffer::getFileOrSTDIN(FLAGS_spec);
+  auto maybe_buff =
+      llvm::MemoryBuffer::getFileOrSTDIN(FLAGS_spec, -1, false);
   if (remill::IsError(maybe_buff)) {
     LOG(ERROR) << "Unable to read JSON spec file '" << FLAGS_spec
                << "': " << remill::GetErrorString(maybe_buff);
+    return nullptr;
+  }
+
+  return std::move(remill::GetReference(maybe_buff));
+}
+
+// Save `module` to the files named by `--ir_out`, `--bc_out`, and
+// `--shards_out`.
+static int SaveModule(llvm::Module &module) {
+  int ret = EXIT_SUCCESS;
+
+  if (!FLAGS_ir_out.empty()) {
+    anvill::ScopedStatTimer timer("WriteIR");
+    if (!remill::StoreModuleIRToFile(&module, FLAGS_ir_out, true)) {
+      LOG(ERROR) << "Could not save LLVM IR to " << FLAGS_ir_out;
+      ret = EXIT_FAILURE;
+    }
+  }
+  if (!FLAGS_bc_out.empty()) {
+    anvill::ScopedStatTimer timer("WriteBitcode");
+    if (!remill::StoreModuleToFile(&module, FLAGS_bc_out, true)) {
+      LOG(ERROR) << "Could not save LLVM bitcode to " << FLAGS_bc_out;
+      ret = EXIT_FAILURE;
+    }
+  }
+
+  // NOTE(pag): This comes last, as it drops the definitions from the module
+  //            as the shards are written.
+  if (!FLAGS_shards_out.empty()) {
+    if (auto err = anvill::WriteModuleShards(module, FLAGS_shards_out,
+                                             FLAGS_num_shards);
+        remill::IsError(err)) {
+      LOG(ERROR) << "Could not save LLVM bitcode shards to "
+                 << FLAGS_shards_out << ": " << remill::GetErrorString(err);
+      ret = EXIT_FAILURE;
+    }
+  }
+
+  return ret;
+}
+
+// Decompile the single spec file named by `--spec`.
+static int DecompileSpecFile(const DecompileOptions &options) {
+  const auto buff = OpenSpecFile();
+  if (!buff) {
     return EXIT_FAILURE;
   }
 
-  const auto &buff = remill::GetReference(maybe_buff);
-  auto maybe_json = llvm::json::parse(buff->getBuffer());
-  if (remill::IsError(maybe_json)) {
-    LOG(ERROR) << "Unable to parse JSON spec file '" << FLAGS_spec
-               << "': " << remill::GetErrorString(maybe_json);
+  llvm::LLVMContext context;
+  SemanticsCache semantics_cache(context, false /* keep_loaded */);
+  anvill::TypeCache types(context);
+  auto semantics =
+      DecompileSpec(buff->getBuffer(), types, semantics_cache, options);
+  if (!semantics) {
     return EXIT_FAILURE;
   }
 
-  auto &json = remill::GetReference(maybe_json);
-  const auto spec = json.getAsObject();
-  if (!spec) {
-    LOG(ERROR) << "JSON spec file '" << FLAGS_spec
-               << "' must contain a single object.";
+  return SaveModule(*semantics);
+}
+
+// Write all `size` bytes of `data` to `fd`. Returns `false` on an error.
+static bool WriteFully(int fd, const char *data, size_t size) {
+  while (size) {
+    const auto num_written = ::write(fd, data, size);
+    if (0 < num_written) {
+      data += num_written;
+      size -= static_cast<size_t>(num_written);
+    } else if (!num_written || errno != EINTR) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// A worker process started by `--workers`, which serves decompilation
+// requests, like `Serve`, over its `stdin` and `stdout`.
+class WorkerProcess {
+ public:
+  explicit WorkerProcess(std::string command_) : command(std::move(command_)) {}
+
+  // NOTE(pag): The worker exits once it reaches the end of its input.
+  ~WorkerProcess(void) {
+    Disconnect();
+    if (pid != -1) {
+      int status = 0;
+      while (::waitpid(pid, &status, 0) == -1 && errno == EINTR) {
+      }
+    }
+  }
+
+  // Start the worker by running its command with `/bin/sh`.
+  //
+  // NOTE(pag): Our ends of the pipes are closed on `exec`, so that workers
+  //            started later don't keep this worker's input open.
+  bool Start(void) {
+    int to_fds[2] = {-1, -1};
+    int from_fds[2] = {-1, -1};
+    if (::pipe(to_fds) || ::pipe(from_fds)) {
+      LOG(ERROR) << "Unable to create the pipes of worker '" << command
+                 << "': " << strerror(errno);
+      for (auto fd : {to_fds[0], to_fds[1], from_fds[0], from_fds[1]}) {
+        if (fd != -1) {
+          ::close(fd);
+        }
+      }
+      return false;
+    }
+
+    for (auto fd : {to_fds[0], to_fds[1], from_fds[0], from_fds[1]}) {
+      ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+
+    pid = ::fork();
+    if (!pid) {
+      ::dup2(to_fds[0], STDIN_FILENO);
+      ::dup2(from_fds[1], STDOUT_FILENO);
+      ::execl("/bin/sh", "sh", "-c", command.c_str(), nullptr);
+      ::_exit(127);
+    }
+
+    ::close(to_fds[0]);
+    ::close(from_fds[1]);
+    to_worker = to_fds[1];
+    from_worker = from_fds[0];
+
+    if (pid == -1) {
+      LOG(ERROR) << "Unable to start worker '" << command
+                 << "': " << strerror(errno);
+      return false;
+    }
+    return true;
+  }
+
+  // Send the spec in `request` to the worker, and read back its response.
+  // Returns `false` if the worker can no longer be reached.
+  //
+  // NOTE(pag): A response bigger than `--worker_max_response_mib` is turned
+  //            into an error response, and the worker is then disconnected,
+  //            as the rest of its output can't be framed.
+  bool Decompile(llvm::StringRef request, ServerResponseHeader &header,
+                 std::string &response) {
+    const uint64_t size = request.size();
+    if (!WriteFully(to_worker, reinterpret_cast<const char *>(&size),
+                    sizeof(size)) ||
+        !WriteFully(to_worker, request.data(), request.size()) ||
+        !ReadFully(from_worker, reinterpret_cast<char *>(&header),
+                   sizeof(header))) {
+      return false;
+    }
+
+    if (header.size > (FLAGS_worker_max_response_mib << 20u)) {
+      response = "Response of " + std::to_string(header.size) +
+                 " bytes is bigger than --worker_max_response_mib";
+      header.status = kServerError;
+      header.size = response.size();
+      Disconnect();
+      return true;
+    }
+
+    response.resize(header.size);
+    return ReadFully(from_worker, &(response[0]), response.size());
+  }
+
+  const std::string command;
+
+ private:
+  WorkerProcess(const WorkerProcess &) = delete;
+  WorkerProcess &operator=(const WorkerProcess &) = delete;
+
+  // Close our ends of the worker's pipes. Later requests to the worker fail.
+  void Disconnect(void) {
+    if (to_worker != -1) {
+      ::close(to_worker);
+      to_worker = -1;
+    }
+    if (from_worker != -1) {
+      ::close(from_worker);
+      from_worker = -1;
+    }
+  }
+
+  pid_t pid{-1};
+  int to_worker{-1};
+  int from_worker{-1};
+};
+
+// A memory range of a spec, which is copied into the spec of each partition
+// that needs it.
+struct SpecRange {
+  uint64_t address{0};
+  uint64_t size{0};
+  bool is_writeable{false};
+  bool is_executable{false};
+};
+
+// Find the memory ranges of `spec`.
+static bool GetSpecRanges(const SpecSections &spec,
+                          std::vector<SpecRange> &ranges) {
+  return ForEachSpecElement(spec, "memory", [&](llvm::json::Value &val) {
+    auto obj = val.getAsObject();
+    auto maybe_ea = obj ? obj->getInteger("address") : llvm::None;
+    if (!maybe_ea) {
+      LOG(ERROR) << "Missing address in memory range specification";
+      return false;
+    }
+
+    SpecRange range;
+    range.address = static_cast<uint64_t>(*maybe_ea);
+    range.is_writeable = obj->getBoolean("is_writeable").getValueOr(false);
+    range.is_executable = obj->getBoolean("is_executable").getValueOr(false);
+    if (auto maybe_size = obj->getInteger("size"); maybe_size) {
+      range.size = static_cast<uint64_t>(*maybe_size);
+    } else if (auto maybe_data = obj->getString("data"); maybe_data) {
+      range.size = maybe_data->size() / 2u;
+    }
+    ranges.push_back(range);
+    return true;
+  });
+}
+
+// Returns `true` if some range of `code_ranges`, which are sorted and don't
+// overlap, overlaps with `range`.
+static bool
+OverlapsCode(const SpecRange &range,
+             const std::vector<std::pair<uint64_t, uint64_t>> &code_ranges) {
+  const auto range_end = range.address + range.size;
+  auto it = std::upper_bound(
+      code_ranges.begin(), code_ranges.end(), range.address,
+      [](uint64_t addr, const std::pair<uint64_t, uint64_t> &code) {
+        return addr < code.second;
+      });
+  return it != code_ranges.end() && it->first < range_end;
+}
+
+static constexpr uint64_t kBinarySpecAlignment = 4096u;
+
+// Build the binary spec of `partition` into `out`. The spec declares every
+// function, with the JSON in `functions_json`, but lists only the functions
+// of `partition` in `lift_only`. It has the data ranges of `spec`, and
+// the executable ranges that hold the code of `partition`. Every other
+// section of `spec` is copied as-is.
+static bool BuildPartitionSpec(const anvill::Program &program,
+                               const SpecSections &spec,
+                               llvm::StringRef functions_json,
+                               const std::vector<SpecRange> &ranges,
+                               const anvill::ProgramPartition &partition,
+                               std::string &out) {
+  out.assign(kBinarySpecAlignment, '\0');
+
+  llvm::json::Array memory;
+  for (const auto &range : ranges) {
+    if (range.is_executable && !OverlapsCode(range, partition.code_ranges)) {
+      continue;
+    }
+
+    const auto offset = out.size();
+    for (uint64_t num_copied = 0; num_copied < range.size;) {
+      const auto seq = program.FindBytes(range.address + num_copied,
+                                         range.size - num_copied);
+      const auto data = seq.ToString();
+      if (data.empty()) {
+        LOG(ERROR) << "Unable to copy the bytes of the memory range at "
+                   << std::hex << range.address << std::dec << " of spec '"
+                   << FLAGS_spec << "'";
+        return false;
+      }
+      out.append(data.data(), data.size());
+      num_copied += data.size();
+    }
+
+    memory.push_back(llvm::json::Object{
+        {"address", static_cast<int64_t>(range.address)},
+        {"is_writeable", range.is_writeable},
+        {"is_executable", range.is_executable},
+        {"offset", static_cast<int64_t>(offset)},
+        {"size", static_cast<int64_t>(range.size)}});
+    out.resize((out.size() + kBinarySpecAlignment - 1u) &
+               ~(kBinarySpecAlignment - 1u));
+  }
+
+  llvm::json::Array lift_only;
+  for (auto decl : partition.functions) {
+    lift_only.push_back(static_cast<int64_t>(decl->address));
+  }
+
+  const auto json_offset = out.size();
+  llvm::raw_string_ostream os(out);
+  os << '{';
+  for (const auto &[key, text] : spec) {
+    if (key != "functions" && key != "memory" && key != "lift_only") {
+      os << llvm::json::Value(key) << ':' << text << ',';
+    }
+  }
+  os << "\"functions\":" << functions_json
+     << ",\"memory\":" << llvm::json::Value(std::move(memory))
+     << ",\"lift_only\":" << llvm::json::Value(std::move(lift_only)) << '}';
+  os.flush();
+
+  BinarySpecHeader header = {};
+  memcpy(header.magic, kBinarySpecMagic, sizeof(header.magic));
+  header.version = kBinarySpecVersion;
+  header.json_offset = json_offset;
+  header.json_size = out.size() - json_offset;
+  memcpy(&(out[0]), &header, sizeof(header));
+  return true;
+}
+
+// Link the decompiled module of a partition, in `data`, into `module`.
+//
+// NOTE(pag): Every worker decompiles into a copy of the same semantics, and
+//            so definitions other than those of the partition's functions,
+//            e.g. of helpers with external linkage, may already be in
+//            `module`. Those copies are turned into declarations first.
+static bool LinkPartition(llvm::Module &module, llvm::StringRef data,
+                          const std::string &name) {
+  llvm::SMDiagnostic diag;
+  auto partition = llvm::parseIR(llvm::MemoryBufferRef(data, name), diag,
+                                 module.getContext());
+  if (!partition) {
+    LOG(ERROR) << "Unable to parse " << name << ": "
+               << diag.getMessage().str();
+    return false;
+  }
+
+  for (auto &func : *partition) {
+    if (!func.isDeclaration() && !func.hasLocalLinkage()) {
+      if (auto existing = module.getFunction(func.getName());
+          existing && !existing->isDeclaration()) {
+        func.deleteBody();
+        func.setComdat(nullptr);
+      }
+    }
+  }
+
+  for (auto &var : partition->globals()) {
+    if (var.hasInitializer() && !var.hasLocalLinkage() &&
+        !var.hasAppendingLinkage()) {
+      if (auto existing = module.getGlobalVariable(var.getName());
+          existing && existing->hasInitializer()) {
+        var.setInitializer(nullptr);
+        var.setLinkage(llvm::GlobalValue::ExternalLinkage);
+        var.setComdat(nullptr);
+      }
+    }
+  }
+
+  if (llvm::Linker::linkModules(module, std::move(partition))) {
+    LOG(ERROR) << "Unable to link " << name << " into module";
+    return false;
+  }
+  return true;
+}
+
+// Decompile the spec file named by `--spec` with the workers of `--workers`.
+// The spec is split into partitions with `PartitionProgram`, the workers
+// take partitions until there are none left, and then the decompiled
+// modules of the partitions are linked together. A partition whose worker
+// is lost is handed to another worker.
+static int Coordinate(void) {
+  std::vector<std::unique_ptr<WorkerProcess>> workers;
+  llvm::SmallVector<llvm::StringRef, 4> commands;
+  llvm::StringRef(FLAGS_workers).split(commands, ';', -1, false);
+  for (auto command : commands) {
+    if (command = command.trim(); !command.empty()) {
+      workers.emplace_back(new WorkerProcess(command.str()));
+    }
+  }
+
+  if (workers.empty()) {
+    LOG(ERROR) << "No worker commands in --workers";
     return EXIT_FAILURE;
   }
 
-  // Take the architecture and OS names out of the JSON spec, and
-  // fall back on the command-line flags if those are missing.
-  auto maybe_arch = spec->getString("arch");
-  auto arch_str = FLAGS_arch;
-  if (maybe_arch) {
-    arch_str = maybe_arch->str();
+  const auto buff = OpenSpecFile();
+  if (!buff) {
+    return EXIT_FAILURE;
   }
 
-  auto maybe_os = spec->getString("os");
-  auto os_str = FLAGS_os;
-  if (maybe_os) {
-    os_str = maybe_os->str();
+  llvm::StringRef image;
+  llvm::StringRef json_data = buff->getBuffer();
+  if (IsBinarySpec(json_data)) {
+    image = json_data;
+    if (!GetBinarySpecJSON(image, json_data)) {
+      return EXIT_FAILURE;
+    }
+  }
+
+  SpecSections spec;
+  {
+    anvill::ScopedStatTimer timer("ScanSpec");
+    if (!ScanSpecSections(json_data, spec)) {
+      return EXIT_FAILURE;
+    }
   }
 
+  auto arch_str = FLAGS_arch;
+  GetSpecString(spec, "arch", arch_str);
+
+  auto os_str = FLAGS_os;
+  GetSpecString(spec, "os", os_str);
+
+  // NOTE(pag): Only the workers lift code, and so the coordinator doesn't
+  //            need the semantics of the architecture.
   llvm::LLVMContext context;
-  auto arch = remill::Arch::Build(&context, remill::GetOSName(os_str),
-                                  remill::GetArchName(arch_str));
+  const auto arch = remill::Arch::Build(&context, remill::GetOSName(os_str),
+                                        remill::GetArchName(arch_str));
   if (!arch) {
+    LOG(ERROR) << "Unsupported architecture '" << arch_str << "' and OS '"
+               << os_str << "' of spec file '" << FLAGS_spec << "'";
     return EXIT_FAILURE;
   }
 
-  auto semantics = remill::LoadArchSemantics(arch);
-
+  anvill::TypeCache types(context);
   anvill::Program program;
-  if (!ParseSpec(arch.get(), context, program, spec)) {
-    return EXIT_FAILURE;
+  std::vector<SpecRange> ranges;
+  {
+    anvill::ScopedStatTimer timer("ParseSpec");
+    if (!ParseSpec(arch.get(), types, program, spec, image) ||
+        !GetSpecRanges(spec, ranges)) {
+      return EXIT_FAILURE;
+    }
   }
 
-  anvill::LiftCodeIntoModule(arch.get(), program, *semantics);
-  anvill::OptimizeModule(arch.get(), program, *semantics);
+  // The workers build the specs of partitions from the program at the same
+  // time.
+  program.Freeze();
 
-  // Apply symbol names to functions if we have the names.
-  program.ForEachNamedAddress([&](uint64_t addr, const std::string &name,
-                                  const anvill::FunctionDecl *fdecl,
-                                  const anvill::GlobalVarDecl *vdecl) {
+  std::vector<anvill::ProgramPartition> partitions;
+  {
+    anvill::ScopedStatTimer timer("PartitionProgram");
+    auto num_partitions = FLAGS_num_partitions;
+    if (!num_partitions) {
+      num_partitions = static_cast<unsigned>(2u * workers.size());
+    }
+    partitions = anvill::PartitionProgram(arch.get(), program, num_partitions);
+  }
 
-    llvm::Value *gval = nullptr;
-    if (vdecl) {
-      gval = semantics->getGlobalVariable(
-          anvill::CreateVariableName(vdecl->address));
-    } else if (fdecl) {
-      gval = semantics->getFunction(
-          anvill::CreateFunctionName(fdecl->address));
-    } else {
-      return true;
+  // Every partition declares every function, so that calls between
+  // partitions are to the same declarations.
+  std::string functions_json;
+  {
+    const auto dl = arch->DataLayout();
+    llvm::raw_string_ostream os(functions_json);
+    auto sep = "[";
+    for (auto decl : program.Functions()) {
+      os << sep << llvm::json::Value(decl->SerializeToJSON(dl));
+      sep = ",";
     }
+    os << (program.Functions().empty() ? "[]" : "]");
+  }
 
-    if (gval) {
-      gval->setName(name);
+  // NOTE(pag): A worker that dies makes our writes to its pipe fail, rather
+  //            than killing us.
+  ::signal(SIGPIPE, SIG_IGN);
+  for (auto &worker : workers) {
+    if (!worker->Start()) {
+      return EXIT_FAILURE;
     }
+  }
 
+  struct PartitionResult {
+    bool ok{false};
+    std::string module;
+  };
+
+  std::vector<PartitionResult> results(partitions.size());
+
+  // NOTE(pag): A partition stays unfinished until some worker decompiles
+  //            it, or fails to. The partition of a lost worker goes back
+  //            into `pending`, and so threads wait for more work until every
+  //            partition is finished, or until they are the last ones left.
+  std::mutex pending_lock;
+  std::condition_variable pending_cond;
+  std::deque<size_t> pending;
+  size_t num_unfinished = partitions.size();
+  for (size_t i = 0u; i < partitions.size(); ++i) {
+    pending.push_back(i);
+  }
+
+  auto next_partition = [&](size_t &i) {
+    std::unique_lock<std::mutex> locker(pending_lock);
+    pending_cond.wait(locker, [&](void) {
+      return !pending.empty() || !num_unfinished;
+    });
+    if (pending.empty()) {
+      return false;
+    }
+    i = pending.front();
+    pending.pop_front();
     return true;
-  });
+  };
 
-  int ret = EXIT_SUCCESS;
+  auto finish_partition = [&](void) {
+    std::lock_guard<std::mutex> locker(pending_lock);
+    if (!--num_unfinished) {
+      pending_cond.notify_all();
+    }
+  };
+
+  auto requeue_partition = [&](size_t i) {
+    std::lock_guard<std::mutex> locker(pending_lock);
+    pending.push_back(i);
+    pending_cond.notify_one();
+  };
+
+  std::vector<std::thread> threads;
+  threads.reserve(workers.size());
+  anvill::ScopedStatTimer timer("DecompilePartitions");
+  for (auto &worker : workers) {
+    threads.emplace_back([&, worker = worker.get()](void) {
+      std::string request;
+      ServerResponseHeader header = {};
+      for (size_t i = 0u; next_partition(i);) {
+        auto &result = results[i];
+        if (!BuildPartitionSpec(program, spec, functions_json, ranges,
+                                partitions[i], request)) {
+          finish_partition();
+          continue;
+        }
 
-  if (!FLAGS_ir_out.empty()) {
-    if (!remill::StoreModuleIRToFile(semantics.get(), FLAGS_ir_out, true)) {
-      LOG(ERROR) << "Could not save LLVM IR to " << FLAGS_ir_out;
-      ret = EXIT_FAILURE;
+        if (!worker->Decompile(request, header, result.module)) {
+          LOG(ERROR) << "Lost worker '" << worker->command
+                     << "' while it was decompiling partition " << i;
+          result.module.clear();
+          requeue_partition(i);
+          return;
+        }
+
+        if (header.status != kServerOK) {
+          LOG(ERROR) << "Worker '" << worker->command
+                     << "' was unable to decompile partition " << i << ": "
+                     << result.module;
+          result.module.clear();
+        } else {
+          result.ok = true;
+        }
+        finish_partition();
+      }
+    });
+  }
+
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  if (num_unfinished) {
+    LOG(ERROR) << "Every worker was lost with " << num_unfinished << " of "
+               << partitions.size() << " partitions of spec file '"
+               << FLAGS_spec << "' left to decompile";
+    return EXIT_FAILURE;
+  }
+
+  auto module = std::make_unique<llvm::Module>(FLAGS_spec, context);
+  arch->PrepareModule(module.get());
+
+  auto ok = true;
+  for (size_t i = 0u; i < results.size(); ++i) {
+    auto &result = results[i];
+    if (!result.ok) {
+      LOG(ERROR) << "Unable to decompile partition " << i << " of "
+                 << partitions[i].functions.size()
+                 << " functions of spec file '" << FLAGS_spec << "'";
+      ok = false;
+    } else {
+      ok = LinkPartition(*module, result.module,
+                         "partition " + std::to_string(i)) &&
+           ok;
     }
+    result.module.clear();
+    result.module.shrink_to_fit();
   }
-  if (!FLAGS_bc_out.empty()) {
-    if (!remill::StoreModuleToFile(semantics.get(), FLAGS_bc_out, true)) {
-      LOG(ERROR) << "Could not save LLVM bitcode to " << FLAGS_bc_out;
+
+  if (!ok) {
+    return EXIT_FAILURE;
+  }
+
+  return SaveModule(*module);
+}
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  SetVersion();
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  if (!FLAGS_stats_out.empty()) {
+    if (FLAGS_stats_format != "json" && FLAGS_stats_format != "chrome") {
+      LOG(ERROR) << "Unsupported --stats_format '" << FLAGS_stats_format
+                 << "'; expected 'json' or 'chrome'";
+      return EXIT_FAILURE;
+    }
+    anvill::EnableStats();
+  }
+
+  auto pass_manager = anvill::PassManagerKind::kLegacy;
+  if (FLAGS_pass_manager == "new") {
+    pass_manager = anvill::PassManagerKind::kNew;
+  } else if (FLAGS_pass_manager != "legacy") {
+    LOG(ERROR) << "Unsupported --pass_manager '" << FLAGS_pass_manager
+               << "'; expected 'legacy' or 'new'";
+    return EXIT_FAILURE;
+  }
+
+  DecompileOptions options;
+  options.lift_options.num_jobs = FLAGS_jobs;
+  options.lift_options.pass_manager = pass_manager;
+  options.lift_options.inline_budget = FLAGS_inline_budget;
+  options.lift_options.max_call_depth = FLAGS_max_call_depth;
+  options.lift_options.max_function_instructions =
+      FLAGS_max_function_instructions;
+  options.lift_options.max_function_blocks = FLAGS_max_function_blocks;
+  options.lift_options.semantics_snapshot_dir = FLAGS_semantics_snapshots;
+
+  // NOTE(pag): The module is optimized right after lifting, so the unused
+  //            semantics needn't stay around until then.
+  options.lift_options.prune_semantics = true;
+
+  llvm::SmallVector<llvm::StringRef, 4> roots;
+  llvm::StringRef(FLAGS_roots).split(roots, ',', -1, false);
+  for (auto root : roots) {
+    uint64_t addr = 0;
+    root = root.trim();
+    root.consume_front("0x");
+    if (root.getAsInteger(16, addr)) {
+      LOG(ERROR) << "Invalid root function address '" << root.str()
+                 << "' in --roots";
+      return EXIT_FAILURE;
+    }
+    options.lift_options.root_addresses.push_back(addr);
+  }
+
+  auto &opt_options = options.opt_options;
+  opt_options.num_jobs = FLAGS_jobs;
+  opt_options.pass_manager = pass_manager;
+  opt_options.max_function_ms = FLAGS_max_function_opt_ms;
+  if (FLAGS_opt_profile == "fast") {
+    opt_options.profile = anvill::OptimizationProfile::kFast;
+  } else if (FLAGS_opt_profile == "thorough") {
+    opt_options.profile = anvill::OptimizationProfile::kThorough;
+  } else if (FLAGS_opt_profile != "default") {
+    LOG(ERROR) << "Unsupported --opt_profile '" << FLAGS_opt_profile
+               << "'; expected 'fast', 'default', or 'thorough'";
+    return EXIT_FAILURE;
+  }
+
+  auto ret = EXIT_SUCCESS;
+  if (FLAGS_server) {
+    ret = Serve(options);
+  } else if (!FLAGS_workers.empty()) {
+    ret = Coordinate();
+  } else {
+    ret = DecompileSpecFile(options);
+  }
+
+  if (!FLAGS_stats_out.empty()) {
+    if (auto err = anvill::WriteStats(FLAGS_stats_out, FLAGS_stats_format);
+        remill::IsError(err)) {
+      LOG(ERROR) << remill::GetErrorString(err);
       ret = EXIT_FAILURE;
     }
   }
 
+  if (!FLAGS_memory_report.empty() && !WriteMemoryReport()) {
+    ret = EXIT_FAILURE;
+  }
+
   return ret;
 }
 
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2020 Trail of Bits, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+// Micro-benchmark for hex decoding of memory ranges in JSON specs.
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "anvill/Hex.h"
+
+DEFINE_uint64(size_mib, 64, "Size, in MiB, of the decoded byte string.");
+DEFINE_uint32(iterations, 10, "Number of times to decode the byte string.");
+
+namespace {
+
+// The decoder used by `ParseRange` prior to `anvill::DecodeHex`, kept as a
+// baseline.
+static llvm::Error DecodeHexStrtol(llvm::StringRef hex, uint8_t *out) {
+  for (auto i = 0ul; i < hex.size(); i += 2) {
+    char nibbles[3] = {hex[i], hex[i + 1], '\0'};
+    char *parsed_to = nullptr;
+    auto byte_val = strtol(nibbles, &parsed_to, 16);
+    if (parsed_to != &(nibbles[2])) {
+      return llvm::createStringError(
+          std::make_error_code(std::errc::invalid_argument),
+          "Invalid hex byte value '%s'", &(nibbles[0]));
+    }
+    out[i / 2] = static_cast<uint8_t>(byte_val);
+  }
+  return llvm::Error::success();
+}
+
+// Time `decoder` on `hex`, and check its output against `expected`.
+static bool
+RunBenchmark(const char *name,
+             std::function<llvm::Error(llvm::StringRef, uint8_t *)> decoder,
+             const std::string &hex, const std::vector<uint8_t> &expected) {
+  std::vector<uint8_t> out(expected.size());
+  auto best_secs = 0.0;
+
+  for (auto i = 0u; i < FLAGS_iterations; ++i) {
+    const auto start = std::chrono::steady_clock::now();
+    auto err = decoder(hex, out.data());
+    const auto end = std::chrono::steady_clock::now();
+
+    if (err) {
+      LOG(ERROR) << name << ": " << llvm::toString(std::move(err));
+      return false;
+    }
+
+    const auto secs = std::chrono::duration<double>(end - start).count();
+    if (!i || secs < best_secs) {
+      best_secs = secs;
+    }
+  }
+
+  if (out != expected) {
+    LOG(ERROR) << name << ": decoded bytes don't match the input";
+    return false;
+  }
+
+  const auto mib = static_cast<double>(hex.size()) / (1024.0 * 1024.0);
+  printf("%-8s %10.3f ms %10.1f MiB/s (of hex)\n", name, best_secs * 1000.0,
+         mib / best_secs);
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  if (!FLAGS_size_mib || !FLAGS_iterations) {
+    LOG(ERROR) << "--size_mib and --iterations must be non-zero";
+    return EXIT_FAILURE;
+  }
+
+  const auto num_bytes = FLAGS_size_mib * 1024u * 1024u;
+  std::vector<uint8_t> bytes(num_bytes);
+  std::mt19937_64 rng(0);
+  for (auto &b : bytes) {
+    b = static_cast<uint8_t>(rng());
+  }
+
+  static const char kDigits[] = "0123456789abcdef";
+  std::string hex(num_bytes * 2u, '\0');
+  for (size_t i = 0; i < num_bytes; ++i) {
+    hex[i * 2u] = kDigits[bytes[i] >> 4];
+    hex[i * 2u + 1u] = kDigits[bytes[i] & 0xFu];
+  }
+
+  auto ok = RunBenchmark("strtol", DecodeHexStrtol, hex, bytes);
+  ok = RunBenchmark("scalar", anvill::DecodeHexScalar, hex, bytes) && ok;
+  ok = RunBenchmark("best", anvill::DecodeHex, hex, bytes) && ok;
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,358 @@
+/*
+ * Copyright (c) 2020 Trail of Bits, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Generator of synthetic specs, with configurable numbers of functions,
+// ranges, and symbols, call graph shapes, and function sizes, for measuring
+// how the decompiler scales.
+//
+// The code of every function is a run of `add rax, imm8` instructions, with
+// `call rel32` instructions to its callees spread evenly through it, and a
+// final `ret`. The functions are declared and mapped into an
+// `anvill::Program`, and the spec is then written out from that program, so
+// the spec is in whatever form `ParseSpec` reads back.
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/raw_ostream.h>
+#include <remill/Arch/Arch.h>
+#include <remill/Arch/Name.h>
+#include <remill/BC/Util.h>
+#include <remill/OS/OS.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "anvill/Decl.h"
+#include "anvill/Program.h"
+#include "anvill/Semantics.h"
+
+DEFINE_string(spec_out, "", "Path to the file where the spec should be saved.");
+DEFINE_string(os, "linux", "OS of the generated code.");
+DEFINE_uint64(functions, 1000, "Number of functions.");
+DEFINE_uint64(instructions, 32,
+              "Number of instructions in each function, including its calls "
+              "and its final return.");
+DEFINE_uint64(calls, 2, "Number of calls made by each function.");
+DEFINE_string(call_graph, "random",
+              "Shape of the call graph: 'none', 'chain' (each function calls "
+              "the next ones), 'tree' (each function calls its children in "
+              "a balanced tree), 'star' (every function calls the first "
+              "ones), or 'random'.");
+DEFINE_uint64(ranges, 1,
+              "Number of executable memory ranges that the functions are "
+              "spread across.");
+DEFINE_uint64(symbols, 1, "Number of names given to each function.");
+DEFINE_uint64(address, 0x100000, "Address of the first function.");
+DEFINE_uint64(seed, 0, "Seed of the random call graph.");
+
+namespace {
+
+static constexpr uint64_t kPageSize = 4096u;
+static constexpr uint64_t kFunctionAlignment = 16u;
+static constexpr uint64_t kAddSize = 4u;  // `add rax, imm8`.
+static constexpr uint64_t kCallSize = 5u;  // `call rel32`.
+static constexpr uint64_t kRetSize = 1u;  // `ret`.
+
+// The layout of one synthetic function.
+struct SyntheticFunction {
+  uint64_t address{0};
+  uint64_t size{0};
+  std::vector<uint64_t> callees;
+};
+
+// The layout of one synthetic executable range.
+struct SyntheticRange {
+  uint64_t address{0};
+  std::vector<uint8_t> data;
+};
+
+// Choose the callees of the function at `index`, as indices of functions.
+static std::vector<uint64_t> ChooseCallees(uint64_t index, uint64_t num_calls,
+                                           std::mt19937_64 &rng) {
+  std::vector<uint64_t> callees;
+  const auto num_funcs = FLAGS_functions;
+  for (uint64_t i = 0; i < num_calls; ++i) {
+    if (FLAGS_call_graph == "chain") {
+      const auto callee = index + i + 1u;
+      if (callee < num_funcs) {
+        callees.push_back(callee);
+      }
+    } else if (FLAGS_call_graph == "tree") {
+      const auto callee = index * num_calls + i + 1u;
+      if (callee < num_funcs) {
+        callees.push_back(callee);
+      }
+    } else if (FLAGS_call_graph == "star") {
+      if (index != i && i < num_funcs) {
+        callees.push_back(i);
+      }
+    } else if (FLAGS_call_graph == "random") {
+      callees.push_back(rng() % num_funcs);
+    }
+  }
+  return callees;
+}
+
+// Lay out the functions across the ranges, and choose their callees.
+static void LayOutFunctions(std::vector<SyntheticFunction> &funcs,
+                            std::vector<SyntheticRange> &ranges) {
+  std::mt19937_64 rng(FLAGS_seed);
+
+  const auto num_calls = std::min(FLAGS_calls, FLAGS_instructions - 1u);
+  const auto num_adds = FLAGS_instructions - 1u - num_calls;
+  const auto func_size = num_adds * kAddSize + num_calls * kCallSize + kRetSize;
+  const auto funcs_per_range =
+      (FLAGS_functions + FLAGS_ranges - 1u) / FLAGS_ranges;
+
+  funcs.resize(FLAGS_functions);
+  auto ea = FLAGS_address;
+  for (uint64_t i = 0; i < FLAGS_functions; ++i) {
+
+    // Leave an unmapped page between ranges.
+    if (!(i % funcs_per_range)) {
+      if (i) {
+        ea = (ea + kPageSize - 1u) & ~(kPageSize - 1u);
+        ea += kPageSize;
+      }
+      ranges.emplace_back();
+      ranges.back().address = ea;
+    }
+
+    auto &func = funcs[i];
+    func.address = ea;
+    func.size = func_size;
+    func.callees = ChooseCallees(i, num_calls, rng);
+    ea += (func_size + kFunctionAlignment - 1u) & ~(kFunctionAlignment - 1u);
+  }
+
+  // Each range runs up to the end of its last function. The alignment
+  // padding between functions is filled with `int3`s.
+  for (uint64_t i = 0; i < FLAGS_functions; ++i) {
+    auto &range = ranges[i / funcs_per_range];
+    const auto end = funcs[i].address + funcs[i].size;
+    range.data.resize(end - range.address, 0xccu);
+  }
+}
+
+// Emit the code of `func` into its range. A function calls each of its
+// callees after an even share of its `add`s.
+static void EmitFunction(const SyntheticFunction &func,
+                         const std::vector<SyntheticFunction> &funcs,
+                         SyntheticRange &range) {
+  auto out = &(range.data[func.address - range.address]);
+  auto ea = func.address;
+  const auto num_calls = func.callees.size();
+  const auto num_adds =
+      (func.size - kRetSize - num_calls * kCallSize) / kAddSize;
+  const auto adds_per_call = num_calls ? num_adds / (num_calls + 1u) : 0u;
+
+  auto emit_add = [&](uint64_t i) {
+    const uint8_t add[kAddSize] = {0x48, 0x83, 0xc0,
+                                   static_cast<uint8_t>(i & 0x7fu)};
+    out = std::copy(add, add + kAddSize, out);
+    ea += kAddSize;
+  };
+
+  uint64_t num_emitted_adds = 0;
+  for (auto callee : func.callees) {
+    for (uint64_t i = 0; i < adds_per_call; ++i) {
+      emit_add(num_emitted_adds++);
+    }
+
+    const auto next_ea = ea + kCallSize;
+    const auto disp = static_cast<uint32_t>(
+        static_cast<int32_t>(funcs[callee].address - next_ea));
+    *out++ = 0xe8u;
+    for (auto b = 0u; b < 4u; ++b) {
+      *out++ = static_cast<uint8_t>(disp >> (b * 8u));
+    }
+    ea = next_ea;
+  }
+
+  while (num_emitted_adds < num_adds) {
+    emit_add(num_emitted_adds++);
+  }
+
+  *out = 0xc3u;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  if (FLAGS_spec_out.empty()) {
+    LOG(ERROR) << "Please specify a path to a spec file with --spec_out";
+    return EXIT_FAILURE;
+  }
+
+  if (!FLAGS_functions || !FLAGS_instructions || !FLAGS_ranges) {
+    LOG(ERROR) << "--functions, --instructions, and --ranges must be non-zero";
+    return EXIT_FAILURE;
+  }
+
+  if (FLAGS_call_graph != "none" && FLAGS_call_graph != "chain" &&
+      FLAGS_call_graph != "tree" && FLAGS_call_graph != "star" &&
+      FLAGS_call_graph != "random") {
+    LOG(ERROR) << "Unsupported --call_graph '" << FLAGS_call_graph
+               << "'; expected 'none', 'chain', 'tree', 'star', or 'random'";
+    return EXIT_FAILURE;
+  }
+
+  std::vector<SyntheticFunction> funcs;
+  std::vector<SyntheticRange> ranges;
+  LayOutFunctions(funcs, ranges);
+
+  // NOTE(pag): Calls are `rel32`, which can't reach past 2 GiB.
+  if ((funcs.back().address + funcs.back().size - FLAGS_address) >> 31u) {
+    LOG(ERROR) << "Synthetic code is too big for its calls to reach";
+    return EXIT_FAILURE;
+  }
+
+  const auto funcs_per_range =
+      (FLAGS_functions + FLAGS_ranges - 1u) / FLAGS_ranges;
+  for (uint64_t i = 0; i < FLAGS_functions; ++i) {
+    EmitFunction(funcs[i], funcs, ranges[i / funcs_per_range]);
+  }
+
+  // NOTE(pag): The synthetic code is amd64 code.
+  llvm::LLVMContext context;
+  const auto arch = remill::Arch::Build(&context, remill::GetOSName(FLAGS_os),
+                                        remill::kArchAMD64);
+  if (!arch) {
+    LOG(ERROR) << "Unsupported OS '" << FLAGS_os << "'";
+    return EXIT_FAILURE;
+  }
+
+  // NOTE(pag): The registers of the architecture are only known once its
+  //            semantics are loaded.
+  auto maybe_semantics = anvill::LoadSemantics(arch.get(), "");
+  if (remill::IsError(maybe_semantics)) {
+    LOG(ERROR) << remill::GetErrorString(maybe_semantics);
+    return EXIT_FAILURE;
+  }
+
+  anvill::Program program;
+  for (const auto &range : ranges) {
+    anvill::ByteRange byte_range;
+    byte_range.address = range.address;
+    byte_range.begin = range.data.data();
+    byte_range.end = range.data.data() + range.data.size();
+    byte_range.is_executable = true;
+    if (auto err = program.MapRange(byte_range); remill::IsError(err)) {
+      LOG(ERROR) << remill::GetErrorString(err);
+      return EXIT_FAILURE;
+    }
+  }
+
+  const auto i64 = llvm::Type::getInt64Ty(context);
+  const auto sp_reg = arch->RegisterByName(arch->StackPointerRegisterName());
+  const auto ret_reg = arch->RegisterByName("RAX");
+
+  anvill::FunctionDecl tpl;
+  tpl.arch = arch.get();
+  tpl.return_address.mem_reg = sp_reg;
+  tpl.return_address.type = i64;
+  tpl.return_stack_pointer = sp_reg;
+  tpl.return_stack_pointer_offset = 8;
+  tpl.num_bytes_in_redzone = anvill::DefaultRedzoneSize(arch.get());
+  tpl.returns.emplace_back();
+  tpl.returns.back().reg = ret_reg;
+  tpl.returns.back().type = i64;
+
+  for (uint64_t i = 0; i < FLAGS_functions; ++i) {
+    tpl.address = funcs[i].address;
+    if (auto maybe_decl = program.DeclareFunction(tpl);
+        remill::IsError(maybe_decl)) {
+      LOG(ERROR) << remill::GetErrorString(maybe_decl);
+      return EXIT_FAILURE;
+    }
+
+    for (uint64_t j = 0; j < FLAGS_symbols; ++j) {
+      auto name = "func_" + std::to_string(i);
+      if (j) {
+        name += "_alias" + std::to_string(j);
+      }
+      program.AddNameToAddress(name, funcs[i].address);
+    }
+  }
+
+  program.Freeze();
+
+  llvm::json::Array functions;
+  const auto dl = arch->DataLayout();
+  for (auto decl : program.Functions()) {
+    functions.push_back(decl->SerializeToJSON(dl));
+  }
+
+  llvm::json::Array memory;
+  for (const auto &range : ranges) {
+    const auto seq = program.FindBytes(range.address, range.data.size());
+    if (seq.Size() != range.data.size()) {
+      LOG(ERROR) << "Unable to read back the range at " << std::hex
+                 << range.address << std::dec;
+      return EXIT_FAILURE;
+    }
+
+    memory.push_back(llvm::json::Object{
+        {"address", static_cast<int64_t>(range.address)},
+        {"is_writeable", false},
+        {"is_executable", true},
+        {"data", llvm::toHex(seq.ToString(), true /* LowerCase */)}});
+  }
+
+  llvm::json::Array symbols;
+  for (const auto &named : program.NamedAddresses()) {
+    symbols.push_back(llvm::json::Array{
+        static_cast<int64_t>(named.address),
+        std::string(named.name.data(), named.name.size())});
+  }
+
+  llvm::json::Object spec{{"arch", remill::GetArchName(remill::kArchAMD64)},
+                          {"os", FLAGS_os},
+                          {"functions", std::move(functions)},
+                          {"memory", std::move(memory)},
+                          {"symbols", std::move(symbols)}};
+
+  std::error_code ec;
+  llvm::raw_fd_ostream os(FLAGS_spec_out, ec, llvm::sys::fs::OF_Text);
+  if (ec) {
+    LOG(ERROR) << "Unable to open " << FLAGS_spec_out << ": " << ec.message();
+    return EXIT_FAILURE;
+  }
+
+  os << llvm::json::Value(std::move(spec)) << '\n';
+  os.close();
+  if (os.has_error()) {
+    os.clear_error();
+    LOG(ERROR) << "Unable to write " << FLAGS_spec_out;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
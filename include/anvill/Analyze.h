@@ -17,13 +17,19 @@
 
 #pragma once
 
+#include <llvm/ADT/DenseMap.h>
 #include <remill/BC/Compat/Error.h>
 
 #include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
 
 namespace llvm {
 class Constant;
 class ConstantExpr;
+class Function;
 class GlobalValue;
 class Instruction;
 class Module;
@@ -34,11 +40,30 @@ namespace anvill {
 
 class Program;
 
+// Maps the globals of a module to the addresses that they represent.
+using GlobalAddressMap = llvm::DenseMap<const llvm::GlobalValue *, uint64_t>;
+
+// Index the globals of `module` by the addresses they represent in `program`.
+// A global is resolved by its name, either through the symbol table of
+// `program`, where the lowest address given a name wins, or by being named
+// according to `CreateFunctionName` or `CreateVariableName` for a declared
+// function or variable.
+//
+// NOTE(pag): The map is only valid so long as no globals are added to,
+//            removed from, or renamed in `module`.
+GlobalAddressMap IndexGlobalAddresses(const Program &program,
+                                      const llvm::Module &module);
+
 // Fold constant expressions into possible cross-references.
 class XrefExprFolder {
  public:
   XrefExprFolder(const Program &program_, llvm::Module &module_);
 
+  // Fold using the shared `global_addresses_`, which must outlive the folder,
+  // instead of indexing the globals of `module_` again.
+  XrefExprFolder(const Program &program_, llvm::Module &module_,
+                 const GlobalAddressMap &global_addresses_);
+
   const Program &program;
   llvm::Module &module;
 
@@ -77,6 +102,38 @@ class XrefExprFolder {
   uint64_t VisitConst(llvm::Constant *c);
 
  private:
+
+  // The effect of folding a value, starting from a cleared folder. If `resets`
+  // is `false`, then this is applied on top of the folder's state, otherwise
+  // it replaces the folder's state.
+  struct Fold {
+    uint64_t value{0};
+    bool is_ci_relative{false};
+    bool is_pc_relative{false};
+    bool is_sp_relative{false};
+    bool is_ra_relative{false};
+    bool is_gv_relative{false};
+
+    // The value of `is_pointer` after the fold, depending on its value before
+    // the fold.
+    bool is_pointer_if_not_pointer{false};
+    bool is_pointer_if_pointer{false};
+
+    // Was the folder reset while folding the value?
+    bool resets{false};
+
+    bool has_error{false};
+    unsigned left_shift_amount{0};
+    unsigned right_shift_amount{0};
+    uint64_t bits_xor{0};
+    uint64_t bits_and{0};
+    std::string error_message;
+  };
+
+  void Clear(void);
+  Fold Capture(uint64_t value);
+  void Apply(const Fold &fold);
+  uint64_t VisitUncached(llvm::Value *v);
   uint64_t VisitGEP(llvm::Value *gep);
   uint64_t VisitAdd(llvm::Value *lhs, llvm::Value *rhs);
   uint64_t VisitSub(llvm::Value *lhs, llvm::Value *rhs);
@@ -97,11 +154,32 @@ class XrefExprFolder {
   uint64_t VisitSExt(llvm::Value *op, llvm::Type *type);
   uint64_t VisitTrunc(llvm::Value *op, llvm::Type *type);
   std::pair<bool, uint64_t> TryResolveGlobal(llvm::GlobalValue *gv);
+
+  // The addresses of the globals in `module`. This is either shared with
+  // other folders, or owned by this folder.
+  std::unique_ptr<GlobalAddressMap> owned_global_addresses;
+  const GlobalAddressMap *global_addresses{nullptr};
+
+  // Memoized folds of instructions and constant expressions. These remain
+  // valid so long as the module isn't changed.
+  std::unordered_map<llvm::Value *, Fold> memo;
+
+  // Number of times that `Reset` has been called.
+  unsigned num_resets{0};
 };
 
 
 // Recover higher-level memory accesses in the lifted functions declared
-// in `program` and defined in `module`.
-void RecoverMemoryAccesses(const Program &program, llvm::Module &module);
+// in `program` and defined in `module`. Possible cross-references are found
+// from the uses of the stack pointer, program counter, return address, and
+// immediate constant bases in one traversal, in up to `num_jobs` functions
+// at a time. Stack accesses become accesses into a per-function frame, and
+// accesses to declared variables become typed pointers into the variables.
+//
+// If `changed_funcs` is non-null, then the functions whose code may have
+// been rewritten are added to it.
+void RecoverMemoryAccesses(
+    const Program &program, llvm::Module &module, unsigned num_jobs = 1u,
+    std::unordered_set<llvm::Function *> *changed_funcs = nullptr);
 
 }  // namespace anvill
@@ -20,6 +20,7 @@
 #include <llvm/IR/CallingConv.h>
 
 #include <cstdint>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -49,6 +50,7 @@ struct Register;
 namespace anvill {
 
 class Program;
+class SignatureCache;
 
 // A value, such as a parameter or a return value. Values are resident
 // in one of two locations: either in a register, represented by a non-
@@ -181,9 +183,19 @@ struct FunctionDecl {
   ANVILL_WITH_JSON(
       llvm::json::Object SerializeToJSON(const llvm::DataLayout &dl) const;)
 
-  // Create a function declaration from an LLVM function.
-  static llvm::Expected<FunctionDecl> Create(llvm::Function &func,
-                                             const remill::Arch::ArchPtr &arch);
+  // Create a function declaration from an LLVM function. If `cache` is
+  // non-null, then the parameter and return value locations are reused from
+  // a previously created declaration with the same calling convention and
+  // function type, if any.
+  static llvm::Expected<FunctionDecl>
+  Create(llvm::Function &func, const remill::Arch::ArchPtr &arch,
+         SignatureCache *cache = nullptr);
+
+  // Return a copy of this function declaration whose registers and types
+  // belong to `arch` and its LLVM context. This lets a lifter that owns a
+  // private `llvm::LLVMContext` (e.g. a worker thread) use declarations
+  // that were parsed into a different context.
+  FunctionDecl Recontextualize(const remill::Arch *arch) const;
 
  private:
   friend class Program;
@@ -192,4 +204,33 @@ struct FunctionDecl {
   void *owner{nullptr};
 };
 
+// Returns the number of bytes below the stack pointer that the ABI of `arch`
+// lets every function use without moving the stack pointer, e.g. 128 bytes
+// on amd64 outside of Windows.
+uint64_t DefaultRedzoneSize(const remill::Arch *arch);
+
+// Memoizes the parameter and return value locations that calling conventions
+// allocate for the functions passed to `FunctionDecl::Create`. Big bitcode
+// files tend to have many functions with the same type, and so the locations
+// of each function type are only allocated once per calling convention.
+//
+// NOTE(pag): The cache is keyed on `llvm::FunctionType` pointers, and so
+//            it must not outlive the `llvm::LLVMContext` of the functions
+//            whose declarations it creates. A cache can be shared by threads
+//            that create declarations for functions in the same context.
+class SignatureCache {
+ public:
+  SignatureCache(void);
+  ~SignatureCache(void);
+
+ private:
+  friend struct FunctionDecl;
+
+  SignatureCache(const SignatureCache &) = delete;
+  SignatureCache &operator=(const SignatureCache &) = delete;
+
+  class Impl;
+  std::unique_ptr<Impl> impl;
+};
+
 }  // namespace anvill
@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2020 Trail of Bits, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <remill/Arch/Instruction.h>
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace anvill {
+
+// The result of decoding the bytes at an address.
+struct DecodedInstruction {
+  remill::Instruction inst;
+
+  // `true` if the architecture could decode `inst`.
+  bool is_decoded{false};
+};
+
+// The targets recovered from the jump table read by an indirect jump.
+struct ResolvedJumpTable {
+
+  // The bytes `[table_begin, table_end)` that were read while recovering the
+  // targets. This includes the entry that ended the table, if any.
+  uint64_t table_begin{0};
+  uint64_t table_end{0};
+
+  // The targets of the jump, in the order of their entries in the table.
+  // Empty if the table could not be recovered.
+  std::vector<uint64_t> targets;
+
+  // The non-executable target of the entry that ended the table, or zero.
+  uint64_t end_target{0};
+};
+
+// A cache of decoded instructions, keyed by address. Code that is shared by
+// several functions, e.g. tail-called blocks, thunks, or code within the
+// overlapping bounds of two functions, is decoded once and then reused by
+// every `MCToIRLifter` sharing the cache, across `LiftFunction` calls and
+// across threads.
+//
+// NOTE(pag): Instructions decoded by one lifter's architecture are handed
+//            out to the other lifters sharing the cache, and so all of those
+//            architectures must be for the same machine, and must outlive
+//            any use of the cached instructions.
+class DecodeCache {
+ public:
+  DecodeCache(void);
+  ~DecodeCache(void);
+
+  // Returns the instruction decoded at `addr`, or `nullptr` if no instruction
+  // has been decoded there yet.
+  const DecodedInstruction *Find(uint64_t addr, bool is_delayed) const;
+
+  // Add the result of decoding the instruction at `addr`, and return the
+  // cached result. If another thread raced to decode the same instruction,
+  // then the first result added is kept.
+  const DecodedInstruction *Add(uint64_t addr, bool is_delayed,
+                                DecodedInstruction decoded);
+
+  // Returns the jump table recovered for the indirect jump at `addr`, or
+  // `nullptr` if no recovery has been attempted there yet.
+  const ResolvedJumpTable *FindJumpTable(uint64_t addr) const;
+
+  // Add the jump table recovered for the indirect jump at `addr`, and return
+  // the cached result. If another thread raced to recover the same table,
+  // then the first result added is kept.
+  const ResolvedJumpTable *AddJumpTable(uint64_t addr,
+                                        ResolvedJumpTable table);
+
+ private:
+  DecodeCache(const DecodeCache &) = delete;
+  DecodeCache &operator=(const DecodeCache &) = delete;
+
+  class Impl;
+  std::unique_ptr<Impl> impl;
+};
+
+}  // namespace anvill
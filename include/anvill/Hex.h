@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2020 Trail of Bits, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/Error.h>
+
+#include <cstdint>
+
+namespace anvill {
+
+// Decode the hex-encoded byte string `hex` into `out`, which must have room
+// for `hex.size() / 2` bytes. Both upper and lower case digits are accepted.
+// Returns an error giving the offset of the first invalid character if `hex`
+// is malformed, in which case the contents of `out` are unspecified.
+//
+// This uses the fastest implementation available on the host (AVX2, SSE2,
+// or NEON), falling back on `DecodeHexScalar`.
+llvm::Error DecodeHex(llvm::StringRef hex, uint8_t *out);
+
+// Portable, table-driven implementation of `DecodeHex`.
+llvm::Error DecodeHexScalar(llvm::StringRef hex, uint8_t *out);
+
+}  // namespace anvill
@@ -23,7 +23,12 @@
 
 #include <llvm/IR/IRBuilder.h>
 
+#include <cstdint>
+#include <string>
 #include <unordered_map>
+#include <vector>
+
+#include "anvill/Optimize.h"
 
 namespace llvm {
 class BasicBlock;
@@ -39,6 +44,7 @@ class IntrinsicTable;
 
 namespace anvill {
 
+class LiftCache;
 class Program;
 struct ValueDecl;
 
@@ -57,7 +63,66 @@ llvm::Value *StoreNativeValue(llvm::Value *native_val, const ValueDecl &decl,
                               llvm::BasicBlock *in_block,
                               llvm::Value *state_ptr, llvm::Value *mem_ptr);
 
+// Options for `LiftCodeIntoModule`.
+struct LiftOptions {
+
+  // If greater than one, then functions are lifted in parallel by `num_jobs`
+  // worker threads, each with its own `llvm::LLVMContext`, architecture, and
+  // copy of the semantics, and the lifted code is linked into the module as
+  // the workers produce it. The program is frozen before the workers start.
+  unsigned num_jobs{1u};
+
+  // If non-null, then functions whose code and declarations are unchanged
+  // since they were cached are loaded from `cache` instead of being lifted,
+  // and the other functions are lifted and then added to `cache`.
+  const LiftCache *cache{nullptr};
+
+  // The pass manager that runs the light cleanup optimizations over each
+  // lifted function.
+  PassManagerKind pass_manager{PassManagerKind::kLegacy};
+
+  // The maximum number of instructions that a lifted function can grow
+  // to by inlining the semantics of its instructions, or zero for no limit.
+  // Calls that would exceed the budget are left in place.
+  uint64_t inline_budget{0u};
+
+  // If non-empty, then only the functions at these addresses, and the
+  // functions that they transitively call or tail-call, are lifted. Every
+  // other function is left as a declaration. Callees are discovered as the
+  // code that calls them is lifted.
+  std::vector<uint64_t> root_addresses;
+
+  // If lifting from `root_addresses`, then the maximum number of calls from
+  // a root function to a lifted callee, or zero for no limit. For example,
+  // with a limit of one, only the roots and their direct callees are lifted.
+  unsigned max_call_depth{0u};
+
+  // If lifting from `root_addresses`, and this is `false`, then only the
+  // roots are lifted, and the code calls the declarations of every other
+  // function, e.g. because another process lifts them.
+  bool lift_callees{true};
+
+  // The maximum number of instructions to decode, and of basic blocks to
+  // create, when lifting any one function, or zero for no limit. A function
+  // that exceeds either limit is left as a declaration, and the stats record
+  // why.
+  uint64_t max_function_instructions{0u};
+  uint64_t max_function_blocks{0u};
+
+  // If non-empty, then each worker loads its semantics lazily from the
+  // snapshot in this directory (see `LoadSemantics`), and so it only
+  // materializes the semantics of the instructions that it lifts.
+  std::string semantics_snapshot_dir;
+
+  // If `true`, then the semantics that no lifted code uses are removed from
+  // the module as soon as lifting is done, rather than in `OptimizeModule`.
+  // Nothing more can be lifted into the module after this.
+  bool prune_semantics{false};
+};
+
+// Lift all functions in `program` into `module`.
 bool LiftCodeIntoModule(const remill::Arch *arch, const Program &program,
-                        llvm::Module &module);
+                        llvm::Module &module,
+                        const LiftOptions &options = LiftOptions());
 
 }  // namespace anvill
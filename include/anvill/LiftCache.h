@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2020 Trail of Bits, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/IR/DataLayout.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace remill {
+class Arch;
+}  // namespace remill
+namespace anvill {
+
+class Program;
+struct FunctionDecl;
+struct LiftDependencies;
+
+// An on-disk cache of lifted functions, so that re-lifting a program after
+// changing some of its declarations only needs to lift the functions that
+// were affected by the change.
+//
+// Each entry holds the bitcode of one lifted (and lightly optimized)
+// function, and is named by a hash of the architecture, the OS, and the
+// function's declaration. An entry also records the dependencies of the
+// function, i.e. the addresses of the instructions that were decoded, and
+// the addresses at which callees were looked up, and the jump tables that
+// were read, along with a hash of the bytes and the callee declarations
+// found at those addresses. An entry is
+// only used if that hash still matches the program.
+//
+// NOTE(pag): The whole-module optimizations in `OptimizeModule` are
+//            interprocedural, and so they always run over the entire
+//            program, and are not cached.
+class LiftCache {
+ public:
+  // Open the cache in the directory `dir`, creating the directory if it
+  // doesn't already exist.
+  static llvm::Expected<std::unique_ptr<LiftCache>>
+  Open(const std::string &dir, const remill::Arch *arch,
+       const Program &program, const llvm::DataLayout &dl);
+
+  // Return the cached bitcode of the function declared by `decl`, or
+  // `nullptr` if there is no entry, or if the entry is stale. If `deps` is
+  // non-null, then the dependencies of a valid entry are stored there.
+  std::unique_ptr<llvm::MemoryBuffer>
+  Load(const FunctionDecl &decl, LiftDependencies *deps = nullptr) const;
+
+  // Store the `bitcode` of the function declared by `decl`, which depends
+  // on the inputs in `deps`.
+  llvm::Error Store(const FunctionDecl &decl, const LiftDependencies &deps,
+                    llvm::StringRef bitcode) const;
+
+ private:
+  LiftCache(const std::string &dir_, const remill::Arch *arch_,
+            const Program &program_, const llvm::DataLayout &dl_);
+
+  // Returns the path to the entry for `decl`.
+  std::string EntryPath(const FunctionDecl &decl) const;
+
+  // Hash the current state of the dependencies in `deps`.
+  std::string HashDependencies(const LiftDependencies &deps) const;
+
+  const std::string dir;
+  const remill::Arch * const arch;
+  const Program &program;
+  const llvm::DataLayout dl;
+
+  // NOTE(pag): `dl` caches the layouts of structure types as they are
+  //            queried, and so its users are serialized, as entries are
+  //            loaded and stored by many threads at once.
+  mutable std::mutex dl_lock;
+};
+
+}  // namespace anvill
@@ -17,18 +17,25 @@
 
 #pragma once
 
+#include <llvm/ADT/DenseMap.h>
 #include <remill/Arch/Instruction.h>
 #include <remill/BC/IntrinsicTable.h>
 #include <remill/BC/Lifter.h>
 
-#include <set>
+#include <cstdint>
+#include <memory>
+#include <string>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
 namespace llvm {
 class BasicBlock;
 class Function;
+class Instruction;
 class Module;
 class LLVMContext;
+class Value;
 }  // namespace llvm
 
 namespace remill {
@@ -37,6 +44,8 @@ class Arch;
 
 namespace anvill {
 
+class DecodeCache;
+struct ResolvedJumpTable;
 class Program;
 struct FunctionDecl;
 
@@ -61,6 +70,56 @@ struct FunctionEntry {
   llvm::Function *native_to_lifted;
 };
 
+// The inputs, apart from the function's own declaration, that were consulted
+// from the `Program` while lifting a function. Lifting the same declaration
+// again produces the same code so long as these inputs are unchanged.
+struct LiftDependencies {
+
+  // Addresses at which instructions were decoded. Up to the architecture's
+  // maximum instruction size worth of bytes are read at each address.
+  std::vector<uint64_t> decoded_addresses;
+
+  // Addresses at which function declarations were looked up.
+  std::vector<uint64_t> function_lookups;
+
+  // Ranges of bytes, as pairs of an address and a size, that were read as
+  // data, e.g. the entries of jump tables.
+  std::vector<std::pair<uint64_t, uint64_t>> data_reads;
+};
+
+// Limits on how much code `MCToIRLifter::LiftFunction` lifts into one
+// function. A limit of zero means no limit.
+struct LiftBudget {
+
+  // Maximum number of instructions to decode.
+  uint64_t max_instructions{0u};
+
+  // Maximum number of basic blocks to create.
+  uint64_t max_blocks{0u};
+};
+
+// The lifted code of one instruction encoding, which is stamped into the
+// blocks of every instruction with the same bytes. See
+// `MCToIRLifter::LiftIntoBlock`.
+struct LiftedFragment {
+
+  // The lifted code, in its own block of `MCToIRLifter::fragment_func`, or
+  // `nullptr` if the code lifted at one address can't be turned into the
+  // code lifted at another address by adjusting PC-relative constants.
+  llvm::BasicBlock *block{nullptr};
+
+  // The address of the instruction that was lifted into `block`.
+  uint64_t pc{0};
+
+  // The operands of the code in `block` that are constants relative to `pc`,
+  // as pairs of the index of an instruction and the index of its operand.
+  std::vector<std::pair<unsigned, unsigned>> pc_relative_operands;
+
+  // The values of the entry block of `MCToIRLifter::fragment_func` that are
+  // used by the code in `block`.
+  std::vector<const llvm::Value *> entry_values;
+};
+
 class MCToIRLifter {
  private:
   const remill::Arch *arch;
@@ -72,24 +131,103 @@ class MCToIRLifter {
   remill::IntrinsicTable intrinsics;
   remill::InstructionLifter inst_lifter;
 
+  // If non-null, then the dependencies of the function being lifted are
+  // recorded here.
+  LiftDependencies *deps{nullptr};
+
+  // If non-null, then the declarations of the functions that are called, or
+  // tail-called, by the function being lifted are recorded here.
+  std::vector<const FunctionDecl *> *callees{nullptr};
+
+  // Cache of decoded instructions, which is either shared with other
+  // lifters, or is `own_decode_cache`.
+  std::unique_ptr<DecodeCache> own_decode_cache;
+  DecodeCache *decode_cache{nullptr};
+
+  const LiftBudget budget;
+
   // A work list of instructions to lift. The first entry in the work list
   // is the instruction PC; the second entry is the PC of how we got to even
-  // ask about the first entry (provenance).
-  std::set<std::pair<uint64_t, uint64_t>> work_list;
+  // ask about the first entry (provenance). The work list is a min-heap, so
+  // that instructions are lifted in order of their addresses.
+  //
+  // NOTE(pag): The work list and the block map are cleared, but keep their
+  //            storage, between calls to `LiftFunction`.
+  std::vector<std::pair<uint64_t, uint64_t>> work_list;
 
   // Result maps
-  std::unordered_map<uint64_t, llvm::BasicBlock *> addr_to_block;
+  //
+  // NOTE(pag): `llvm::DenseMap` reserves the keys `~0` and `~0 - 1`, which
+  //            are the last two addresses of the 64-bit address space, and
+  //            so cannot be the start of a whole instruction.
+  llvm::DenseMap<uint64_t, llvm::BasicBlock *> addr_to_block;
+
+  // Straight-line runs of instructions are lifted into one block, and so
+  // this maps the address of every lifted instruction to the first LLVM
+  // instruction lifted from it, whose parent is the block containing it.
+  llvm::DenseMap<uint64_t, llvm::Instruction *> inst_starts;
+
+  // Blocks of branch targets that are in the middle of an already-lifted
+  // block. The lifted code from the target onward is moved into these blocks
+  // once the function is fully lifted.
+  std::vector<std::pair<uint64_t, llvm::BasicBlock *>> pending_splits;
+
+  // If non-null, then the next instruction to lift is the fall-through
+  // instruction at `fall_through_pc`, which is lifted into the same block.
+  llvm::BasicBlock *fall_through_block{nullptr};
+  uint64_t fall_through_pc{0};
 
   // Maps program counters to function entries.
-  std::unordered_map<uint64_t, FunctionEntry> addr_to_func;
+  llvm::DenseMap<uint64_t, FunctionEntry> addr_to_func;
+
+  // The lifted code of every instruction encoding seen so far, keyed by the
+  // instruction bytes. The code lives in the blocks of `fragment_func`, which
+  // is erased along with the lifter.
+  std::unordered_map<std::string, LiftedFragment> fragments;
+  llvm::Function *fragment_func{nullptr};
+
+  // Maps the arguments and entry block values of `fragment_func` to those of
+  // `lifted_func`. This is cleared between calls to `LiftFunction`.
+  llvm::DenseMap<const llvm::Value *, llvm::Value *> fragment_values;
+
+  // Lift `inst` into the end of `block`, by stamping out the lifted code of
+  // another instruction with the same bytes if there is one.
+  void LiftIntoBlock(remill::Instruction &inst, llvm::BasicBlock *block);
+
+  // Get or create the lifted fragment for the bytes of `inst`.
+  const LiftedFragment &GetOrCreateFragment(remill::Instruction &inst);
+
+  // Lift `inst` into a new block of `fragment_func`.
+  llvm::BasicBlock *LiftFragmentBlock(remill::Instruction &inst);
+
+  // Copy the code of `frag` to the end of `block`, adjusting its PC-relative
+  // constants for `inst`. Returns `false`, leaving `block` unchanged, if
+  // `lifted_func` lacks one of the entry block values used by `frag`.
+  bool StampFragment(const LiftedFragment &frag,
+                     const remill::Instruction &inst, llvm::BasicBlock *block);
 
   // Declare the function decl `decl` and return an `llvm::Function *`. The
   // returned function is a "high-level" function.
   FunctionEntry GetOrDeclareFunction(const FunctionDecl &decl);
 
-  // Helper
+  // Get or create the block for the instruction at `addr`. If a new block is
+  // created, then the instruction is added to the work list, unless it was
+  // already lifted into the middle of another block, in which case the block
+  // is split once lifting is done.
   llvm::BasicBlock *GetOrCreateBlock(const uint64_t addr);
 
+  // Split the lifted blocks at the targets in `pending_splits`.
+  void SplitBlocks(void);
+
+  // Try to recover the targets of the indirect jump `inst` from the jump
+  // table that it reads.
+  const ResolvedJumpTable *ResolveJumpTable(const remill::Instruction &inst);
+
+  // Terminate `block` with a switch over the program counter that branches
+  // to the blocks of `targets`, and otherwise tail-calls the jump intrinsic.
+  void AddJumpSwitch(llvm::BasicBlock *block,
+                     const std::vector<uint64_t> &targets);
+
   // Visitors used to add terminators to instruction basic blocks
   void VisitInvalid(const remill::Instruction &inst,
                     llvm::BasicBlock *block);
@@ -136,12 +274,27 @@ class MCToIRLifter {
                              remill::Instruction *inst_out);
 
  public:
+  // If `decode_cache` is non-null, then instructions are decoded through it,
+  // and so may be shared with other lifters using the same cache. Otherwise,
+  // the lifter caches the instructions that it decodes for itself.
   MCToIRLifter(const remill::Arch *arch, const Program &program,
-               llvm::Module &module);
+               llvm::Module &module, DecodeCache *decode_cache = nullptr,
+               const LiftBudget &budget = LiftBudget());
 
+  ~MCToIRLifter(void);
 
-  // Lift the function decl `decl` and return an `FunctionEntry`.
-  FunctionEntry LiftFunction(const FunctionDecl &decl);
+  // Lift the function decl `decl` and return an `FunctionEntry`. If `deps`
+  // is non-null, then the inputs consulted while lifting are recorded there.
+  // If `callees` is non-null, then the declarations of the functions that
+  // the lifted code calls, or tail-calls, are added to it. A callee may be
+  // added more than once.
+  //
+  // If lifting the function exceeds the budget of the lifter, then the
+  // `lifted` function of the returned entry is left as a declaration.
+  FunctionEntry LiftFunction(const FunctionDecl &decl,
+                             LiftDependencies *deps = nullptr,
+                             std::vector<const FunctionDecl *> *callees =
+                                 nullptr);
 };
 
 }  // namespace anvill
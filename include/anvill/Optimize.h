@@ -17,6 +17,8 @@
 
 #pragma once
 
+#include <cstdint>
+
 namespace llvm {
 class Module;
 }
@@ -28,9 +30,60 @@ namespace anvill {
 
 class Program;
 
+// The LLVM pass manager that runs the function-local optimizations.
+enum class PassManagerKind {
+
+  // LLVM's legacy pass manager. Analyses are recomputed every time that the
+  // optimizations are run over a function.
+  kLegacy,
+
+  // LLVM's new pass manager. Analyses are cached across runs of the
+  // optimizations over a function, and across anvill's own transformations
+  // of the function where they are known to be preserved.
+  kNew
+};
+
+// How much effort `OptimizeModule` puts into optimizing a module.
+enum class OptimizationProfile {
+
+  // Lift and lightly clean up. Nothing is inlined, only a few cheap function
+  // passes are run, and constant memory reads are folded only once. This is
+  // meant for throughput-sensitive batch jobs, e.g. triage.
+  kFast,
+
+  // The full pipeline.
+  kDefault,
+
+  // The full pipeline, with more aggressive inlining, and with instruction
+  // combining, jump threading, and aggressive dead code elimination added to
+  // the function passes. This is meant for deep analysis.
+  kThorough
+};
+
+// Options for `OptimizeModule`.
+struct OptimizationOptions {
+
+  // If greater than one, then the function-local optimizations are run
+  // concurrently over partitions of the module's functions, each in its own
+  // LLVM context, and the module-level optimizations run between them.
+  unsigned num_jobs{1u};
+
+  // The pass manager that runs the function-local optimizations.
+  PassManagerKind pass_manager{PassManagerKind::kLegacy};
+
+  OptimizationProfile profile{OptimizationProfile::kDefault};
+
+  // The maximum wall time, in milliseconds, to spend running the function
+  // passes over any one function, or zero for no limit. A function that
+  // exceeds its budget is no longer optimized, and so ends up minimally
+  // optimized, and the stats record why.
+  uint64_t max_function_ms{0u};
+};
+
 // Optimize a module. This can be a module with semantics code, lifted
 // code, etc.
 void OptimizeModule(const remill::Arch *arch, const Program &program,
-                    llvm::Module &module);
+                    llvm::Module &module,
+                    const OptimizationOptions &options = OptimizationOptions());
 
 }  // namespace anvill
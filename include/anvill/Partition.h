@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2020 Trail of Bits, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace remill {
+class Arch;
+}  // namespace remill
+namespace anvill {
+
+class Program;
+struct FunctionDecl;
+
+// A group of functions of a program that are decompiled together, e.g. by one
+// worker of a distributed decompilation.
+struct ProgramPartition {
+  std::vector<const FunctionDecl *> functions;
+
+  // The `[begin, end)` address ranges, ordered by address, of the instructions
+  // that were decoded while finding the callees of `functions`.
+  std::vector<std::pair<uint64_t, uint64_t>> code_ranges;
+
+  // The number of instructions decoded from `functions`.
+  uint64_t num_instructions{0};
+};
+
+// Split the functions of `program` into at most `num_partitions` partitions
+// with similar numbers of instructions, such that few direct calls and
+// tail-calls go from a function in one partition to a function in another.
+// The callees of each function are found by decoding its instructions and
+// following its direct control flow, without lifting it. Every function is
+// in exactly one partition, and no partition is empty.
+std::vector<ProgramPartition> PartitionProgram(const remill::Arch *arch,
+                                               const Program &program,
+                                               unsigned num_partitions);
+
+}  // namespace anvill
@@ -17,12 +17,14 @@
 
 #pragma once
 
+#include <llvm/ADT/ArrayRef.h>
 #include <remill/BC/Compat/Error.h>
 
 #include <cstdint>
 #include <functional>
 #include <memory>
 #include <string_view>
+#include <vector>
 
 namespace anvill {
 
@@ -73,6 +75,11 @@ struct Byte {
     return data ? IsUndefinedImpl() : true;
   }
 
+  // Does this byte have extended metadata? See `Program::FindExtendedMeta`.
+  inline bool HasExtendedMeta(void) const {
+    return data ? HasExtendedMetaImpl() : false;
+  }
+
   inline bool SetUndefined(bool is_undef = true) const {
     if (data) {
       return SetUndefinedImpl(is_undef);
@@ -103,6 +110,7 @@ struct Byte {
   bool IsExecutableImpl(void) const;
 
   bool IsUndefinedImpl(void) const;
+  bool HasExtendedMetaImpl(void) const;
   bool SetUndefinedImpl(bool is_undef) const;
 
   explicit inline Byte(uint64_t addr_, Data *data_, Meta *meta_)
@@ -126,6 +134,25 @@ struct ByteSequence {
     return size;
   }
 
+  // Returns `true` if any byte in this sequence is writeable.
+  bool IsWriteable(void) const;
+
+  // Returns `true` if any byte in this sequence is undefined.
+  bool IsUndefined(void) const;
+
+  // Returns the address of the first byte of this sequence, at or after `ea`,
+  // that is executable, that isn't executable, or that is the head of a
+  // function or of a variable. Returns the address just past the end of the
+  // sequence if there is no such byte.
+  //
+  // NOTE(pag): These, and `IsWriteable` and `IsUndefined`, test the metadata
+  //            of eight bytes at a time, rather than testing one `Byte` of
+  //            the sequence at a time.
+  uint64_t FindNextExecutable(uint64_t ea) const;
+  uint64_t FindNextNonExecutable(uint64_t ea) const;
+  uint64_t FindNextFunctionHead(uint64_t ea) const;
+  uint64_t FindNextVariableHead(uint64_t ea) const;
+
   // Convert this byte sequence to a string.
   std::string_view ToString(void) const;
 
@@ -139,6 +166,10 @@ struct ByteSequence {
  private:
   friend class Program;
 
+  // Returns the address of the first byte at or after `ea` in which `bit` of
+  // the metadata is set, or is clear if `want_set` is `false`.
+  uint64_t FindNext(uint64_t ea, uint8_t bit, bool want_set) const;
+
   explicit inline ByteSequence(uint64_t addr_, Byte::Data *first_data_,
                                Byte::Meta *first_meta_, size_t size_)
       : address(addr_),
@@ -155,6 +186,81 @@ struct ByteSequence {
 struct FunctionDecl;
 struct GlobalVarDecl;
 
+// Extended metadata of a byte, e.g. information recovered by an earlier
+// analysis about the instruction that starts at that byte. Very few bytes
+// have extended metadata, and so it is stored on the side, and the byte's
+// own metadata only records whether or not it has any.
+struct ByteExtendedMeta {
+
+  // Is this byte known to be the start of an instruction?
+  bool is_instruction_start{false};
+
+  // The known targets of the indirect jump or indirect call that starts at
+  // this byte.
+  std::vector<uint64_t> targets;
+
+  // The bounds, `[jump_table_begin, jump_table_end)`, of the jump table read
+  // by the indirect jump that starts at this byte, if any.
+  uint64_t jump_table_begin{0};
+  uint64_t jump_table_end{0};
+};
+
+// A name of an address. The characters of the name are owned by the
+// `Program`, and each distinct name is only stored once.
+struct NamedAddress {
+  uint64_t address;
+  std::string_view name;
+};
+
+// An estimate of the memory used by a `Program`, in bytes, broken down by what
+// it is used for. Hash tables are estimated as one heap-allocated node per
+// entry, plus their table of buckets.
+struct ProgramMemoryUsage {
+
+  // Total size of the mapped ranges, including the ones whose bytes are
+  // referenced in place, and the size of the copies of the bytes that the
+  // program owns.
+  uint64_t mapped_bytes{0};
+  uint64_t copied_bytes{0};
+
+  // Metadata of the bytes, including the lazily allocated pages of metadata
+  // of externally backed ranges, and the extended metadata.
+  uint64_t meta_bytes{0};
+  uint64_t extended_meta_bytes{0};
+
+  // The index of mapped ranges.
+  uint64_t range_index_bytes{0};
+
+  // The function and variable declarations, including their parameters and
+  // return values, and their indexes.
+  uint64_t function_decl_bytes{0};
+  uint64_t variable_decl_bytes{0};
+
+  // The interned names, and the indexes of names and addresses.
+  uint64_t symbol_bytes{0};
+
+  // Returns the total memory owned by the program.
+  inline uint64_t Total(void) const {
+    return copied_bytes + meta_bytes + extended_meta_bytes + range_index_bytes +
+           function_decl_bytes + variable_decl_bytes + symbol_bytes;
+  }
+};
+
+// Changes to a `Program` that are reported to the subscribers of its events.
+// A function or variable is defined if the byte at its address is mapped, and
+// is otherwise only declared. A declared function or variable is defined, and
+// reported again, once a range containing its address is mapped.
+enum ProgramEvent {
+  kFunctionDeclared,
+  kFunctionDefined,
+  kGlobalVariableDeclared,
+  kGlobalVariableDefined
+};
+
+// Called with a change to a `Program`, and the address of the function or
+// variable that was changed.
+using ProgramEventCallback = std::function<void(ProgramEvent, uint64_t)>;
+
 // A view into a program binary and its data.
 //
 // NOTE(pag): A variable and a function can be co-located,
@@ -169,6 +275,11 @@ struct GlobalVarDecl;
 //            as the intended target, which would could be a
 //            function defined in a shared library, also present
 //            in the address space.
+//
+// NOTE(pag): A program is built up by one thread, and then frozen with
+//            `Freeze`. A frozen program can no longer be changed, except for
+//            marking bytes as undefined, and is safe to read from many
+//            threads at once.
 class Program {
  public:
   Program(void);
@@ -182,6 +293,15 @@ class Program {
   static llvm::Expected<Program> Containing(const FunctionDecl *decl);
   static llvm::Expected<Program> Containing(const GlobalVarDecl *decl);
 
+  // Finalize the indexes of this program, i.e. sort the functions, the
+  // variables, and the names. Afterward, mapping ranges and declaring
+  // functions, variables, or names fails. Freezing a frozen program does
+  // nothing.
+  void Freeze(void) const;
+
+  // Returns `true` if this program has been frozen.
+  bool IsFrozen(void) const;
+
   // Map a range of bytes into the program.
   //
   // This expects that none of the bytes already in that range
@@ -189,6 +309,32 @@ class Program {
   // of the mapped bytes.
   llvm::Error MapRange(const ByteRange &range);
 
+  // Map several ranges of bytes into the program. This has the same
+  // requirements as `MapRange`, but sorts the ranges once up-front, which
+  // makes mapping many ranges cheaper. Mapping stops at the first range
+  // that fails to map, and the error for that range is returned; ranges
+  // that were already mapped remain mapped.
+  llvm::Error MapRanges(const std::vector<ByteRange> &ranges);
+
+  // Map a range of `size` bytes at `address` into the program, where the
+  // bytes are written directly into the program's storage for the range by
+  // `init`. This avoids an intermediate copy when the bytes need decoding.
+  // If `init` returns an error, then the range is not mapped.
+  llvm::Error MapRange(uint64_t address, size_t size, bool is_writeable,
+                       bool is_executable,
+                       std::function<llvm::Error(uint8_t *)> init);
+
+  // Map a range of bytes into the program without copying them. This is
+  // useful when the bytes come from a memory-mapped file, e.g. a core dump
+  // or a process snapshot.
+  //
+  // This has the same requirements as `MapRange`, and additionally requires
+  // that the bytes in `[range.begin, range.end)` outlive this program.
+  // Metadata for the bytes is allocated lazily, one page at a time, as they
+  // are accessed, and so `FindBytes` may return fewer bytes for such ranges
+  // than it would for copied ranges.
+  llvm::Error MapExternalRange(const ByteRange &range);
+
   // Declare a function in this view. This takes in a function
   // declaration that will act as a sort of "template" for the
   // declaration that we will make and will be owned by `Program`.
@@ -217,6 +363,17 @@ class Program {
   void
   ForEachFunction(std::function<bool(const FunctionDecl *)> callback) const;
 
+  // Returns all functions, ordered by address.
+  //
+  // NOTE(pag): The returned functions, and those returned by
+  //            `FunctionsInRange`, are invalidated by `DeclareFunction`.
+  llvm::ArrayRef<const FunctionDecl *> Functions(void) const;
+
+  // Returns the functions whose addresses are in the range
+  // `[begin_address, end_address)`, ordered by address.
+  llvm::ArrayRef<const FunctionDecl *>
+  FunctionsInRange(uint64_t begin_address, uint64_t end_address) const;
+
   // Search for a specific function by its address.
   const FunctionDecl *FindFunction(uint64_t address) const;
 
@@ -251,6 +408,20 @@ class Program {
                          const GlobalVarDecl *)>
           cb) const;
 
+  // Returns the names of the address `address`, in the order in which they
+  // were added.
+  //
+  // NOTE(pag): The returned names, and those returned by `AddressesOfName`
+  //            and `NamedAddresses`, are invalidated by `AddNameToAddress`.
+  llvm::ArrayRef<NamedAddress> NamesOfAddress(uint64_t address) const;
+
+  // Returns the addresses of the named symbol `name`, in the order in which
+  // they were added.
+  llvm::ArrayRef<NamedAddress> AddressesOfName(std::string_view name) const;
+
+  // Returns every address/name pair, ordered by address.
+  llvm::ArrayRef<NamedAddress> NamedAddresses(void) const;
+
   // Declare a variable in this view. This takes in a variable
   // declaration that will act as a sort of "template" for the
   // declaration that we will make and will be owned by `Program`.
@@ -274,6 +445,17 @@ class Program {
   void
   ForEachVariable(std::function<bool(const GlobalVarDecl *)> callback) const;
 
+  // Returns all variables, ordered by address.
+  //
+  // NOTE(pag): The returned variables, and those returned by
+  //            `VariablesInRange`, are invalidated by `DeclareVariable`.
+  llvm::ArrayRef<const GlobalVarDecl *> Variables(void) const;
+
+  // Returns the variables whose addresses are in the range
+  // `[begin_address, end_address)`, ordered by address.
+  llvm::ArrayRef<const GlobalVarDecl *>
+  VariablesInRange(uint64_t begin_address, uint64_t end_address) const;
+
   // Search for a specific variable by its address.
   const GlobalVarDecl *FindVariable(uint64_t address) const;
 
@@ -289,6 +471,19 @@ class Program {
   // Access memory, looking for a specific byte. Returns the byte found, if any.
   Byte FindByte(uint64_t address) const;
 
+  // Attach the extended metadata `meta` to the mapped byte at `address`,
+  // replacing any extended metadata that it already has.
+  llvm::Error SetExtendedMeta(uint64_t address, ByteExtendedMeta meta) const;
+
+  // Returns the extended metadata of the byte at `address`, or `nullptr` if
+  // it has none.
+  const ByteExtendedMeta *FindExtendedMeta(uint64_t address) const;
+
+  // Apply a function `cb` to the address and extended metadata of each byte
+  // with extended metadata, in order of address.
+  void ForEachExtendedMeta(
+      std::function<bool(uint64_t, const ByteExtendedMeta &)> cb) const;
+
   // Find the next byte.
   Byte FindNextByte(Byte byte) const;
 
@@ -297,6 +492,27 @@ class Program {
   // but not including `address+size`.
   ByteSequence FindBytes(uint64_t address, size_t size) const;
 
+  // Subscribe `callback` to the events of this program, and return an
+  // identifier for the subscription, which is never zero.
+  //
+  // Events are delivered on the thread changing the program, once the
+  // change is complete, e.g. after `DeclareFunction` has added the function,
+  // and so a callback can look up the changed function or variable. A
+  // callback may itself change the program, e.g. to declare the callees of
+  // a newly defined function; the events of those changes are delivered
+  // after the remaining events of the current change.
+  uint64_t SubscribeToEvents(ProgramEventCallback callback) const;
+
+  // Stop delivering events to the subscription `id`. This is safe to call
+  // from within a callback, including the subscription's own callback.
+  void UnsubscribeFromEvents(uint64_t id) const;
+
+  // Estimate the memory used by this program.
+  //
+  // NOTE(pag): This is safe to call on a frozen program, or from the thread
+  //            that is building the program.
+  ProgramMemoryUsage MemoryUsage(void) const;
+
   class Impl;
 
  private:
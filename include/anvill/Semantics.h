@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2020 Trail of Bits, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <llvm/IR/Module.h>
+#include <llvm/Support/Error.h>
+
+#include <memory>
+#include <string>
+
+namespace remill {
+class Arch;
+}  // namespace remill
+namespace anvill {
+
+// Load the semantics of `arch`. If `snapshot_dir` is empty, then this is the
+// same as `remill::LoadArchSemantics`. Otherwise, the semantics are loaded
+// from a snapshot in `snapshot_dir`, which is created from remill's semantics
+// if it doesn't exist yet.
+//
+// A snapshot is the semantics module, prepared for lifting, e.g. with its
+// debug information stripped. Snapshots are loaded lazily: the bodies of the
+// instruction semantics are only parsed once they are needed, i.e. when they
+// are inlined into lifted code, or when `OptimizeModule` finds that they
+// are still used.
+//
+// NOTE(pag): Snapshots are named by the versions of anvill and LLVM, and by
+//            the architecture and OS. They should be recreated, e.g. by
+//            deleting `snapshot_dir`, whenever remill's semantics change
+//            without anvill changing too.
+llvm::Expected<std::unique_ptr<llvm::Module>>
+LoadSemantics(const remill::Arch *arch, const std::string &snapshot_dir);
+
+// Write a snapshot of the semantics of `arch` into `snapshot_dir`, replacing
+// any existing snapshot.
+llvm::Error WriteSemanticsSnapshot(const remill::Arch *arch,
+                                   const std::string &snapshot_dir);
+
+}  // namespace anvill
@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2020 Trail of Bits, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <llvm/Support/Error.h>
+
+#include <string>
+
+namespace llvm {
+class Module;
+}  // namespace llvm
+namespace anvill {
+
+// Write `module` out as up to `num_shards` bitcode files in the directory
+// `dir`, so that downstream tools can process a very large program one shard
+// at a time. Function definitions are spread across the shards by size, and
+// variable definitions go into the first shard. Each shard declares what it
+// references in the other shards, and has its own copies of the definitions
+// with local linkage that it uses, and so linking all shards together gives
+// back `module`. If `textual_ir` is `true`, then the shards are saved as
+// textual LLVM IR instead.
+//
+// Each shard is written as soon as it's extracted, and the definitions that
+// it holds are then dropped from `module`, so that memory usage falls as the
+// shards are written out. Once they are all written, a `manifest.json` is
+// saved in `dir`, listing the path of each shard, and the functions and
+// variables that it defines.
+//
+// NOTE(pag): `module` is left with only declarations, plus the definitions
+//            with local linkage that the shards made copies of.
+llvm::Error WriteModuleShards(llvm::Module &module, const std::string &dir,
+                              unsigned num_shards, bool textual_ir = false);
+
+}  // namespace anvill
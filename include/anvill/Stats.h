@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2020 Trail of Bits, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <llvm/Support/Error.h>
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+namespace anvill {
+
+// Lightweight instrumentation of the decompilation pipeline. Nothing is
+// recorded unless `EnableStats` has been called, so that the timers and
+// counters can be left in place in hot code.
+
+// Start recording timers and counters.
+void EnableStats(void);
+
+// Returns `true` if timers and counters are being recorded.
+bool StatsEnabled(void);
+
+// Returns the peak resident set size of this process so far, in KiB. This is
+// available whether or not stats are enabled.
+uint64_t PeakResidentSetSizeKiB(void);
+
+// Returns the current resident set size of this process, in KiB, or zero if
+// it can't be determined.
+uint64_t ResidentSetSizeKiB(void);
+
+// A named counter, e.g. of the number of instructions decoded. Counters are
+// meant to be defined as globals, and are safe to increment from multiple
+// threads.
+class StatCounter {
+ public:
+  explicit StatCounter(const char *name_);
+
+  inline void Add(uint64_t delta = 1u) {
+    if (StatsEnabled()) {
+      value.fetch_add(delta, std::memory_order_relaxed);
+    }
+  }
+
+ private:
+  friend llvm::Error WriteStats(const std::string &path,
+                                const std::string &format);
+
+  StatCounter(const StatCounter &) = delete;
+  StatCounter &operator=(const StatCounter &) = delete;
+
+  const char * const name;
+  std::atomic<uint64_t> value{0};
+
+  // Next counter in the list of all counters.
+  StatCounter *next{nullptr};
+};
+
+// Times the dynamic scope of one phase of the pipeline, e.g. lifting or one
+// step of optimization. Phases can nest, and can be timed on any thread.
+class ScopedStatTimer {
+ public:
+  explicit ScopedStatTimer(const char *name_);
+  ~ScopedStatTimer(void);
+
+ private:
+  ScopedStatTimer(const ScopedStatTimer &) = delete;
+  ScopedStatTimer &operator=(const ScopedStatTimer &) = delete;
+
+  const char * const name;
+
+  // Start time of this phase, in microseconds since stats were enabled, or
+  // `-1` if stats were not enabled when the phase started.
+  int64_t start_us{-1};
+};
+
+// Record a notable event, e.g. that a function exceeded its lifting budget,
+// along with a description of the event. Nothing is recorded unless stats
+// are enabled.
+void RecordStatEvent(const char *name, std::string description);
+
+// Write out the recorded timers, counters, and events to the file at `path`.
+// The counters also include the peak resident set size of the process, as
+// `process.peak_rss_kib`. The `format` is either `json`, which reports the
+// total time of each phase, the final value of each counter, and every
+// event, or `chrome`, which reports every timed phase and event in the Chrome
+// trace event format, as understood by `chrome://tracing` and Perfetto.
+llvm::Error WriteStats(const std::string &path, const std::string &format);
+
+}  // namespace anvill
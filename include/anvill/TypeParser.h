@@ -17,6 +17,7 @@
 
 #pragma once
 
+#include <llvm/ADT/StringMap.h>
 #include <llvm/Support/Error.h>
 
 namespace llvm {
@@ -56,4 +57,34 @@ namespace anvill {
 llvm::Expected<llvm::Type *> ParseType(llvm::LLVMContext &context,
                                        llvm::StringRef spec);
 
+// Memoizes the types parsed from type specifications in one
+// `llvm::LLVMContext`. Specifications tend to repeat a few type specifications
+// many times, e.g. for the parameters of every function, and so each one is
+// only parsed once. The types of bracketed specifications nested inside of
+// other specifications are memoized too, so that e.g. a large structure
+// type is parsed once even if it is used by many pointer types.
+class TypeCache {
+ public:
+  explicit TypeCache(llvm::LLVMContext &context_);
+  ~TypeCache(void);
+
+  // Parse a type specification into an LLVM type, or return the type that
+  // was previously parsed from `spec`. See `ParseType`.
+  llvm::Expected<llvm::Type *> ParseType(llvm::StringRef spec);
+
+ private:
+  TypeCache(const TypeCache &) = delete;
+  TypeCache &operator=(const TypeCache &) = delete;
+
+  llvm::LLVMContext &context;
+
+  // Types of whole type specifications.
+  llvm::StringMap<llvm::Type *> types;
+
+  // Types of bracketed type specifications that are nested inside of other
+  // type specifications. These are kept apart from `types` because they
+  // needn't be sized, e.g. function types.
+  llvm::StringMap<llvm::Type *> nested_types;
+};
+
 }  // namespace anvill
@@ -18,6 +18,7 @@
 #include "anvill/Analyze.h"
 
 #include <glog/logging.h>
+#include <llvm/ADT/ArrayRef.h>
 
 // clang-format off
 #include <remill/BC/Compat/CTypes.h>
@@ -40,8 +41,11 @@
 #include <remill/BC/Optimizer.h>
 #include <remill/BC/Util.h>
 
+#include <algorithm>
+#include <atomic>
 #include <map>
 #include <set>
+#include <thread>
 #include <tuple>
 #include <unordered_map>
 #include <unordered_set>
@@ -50,15 +54,62 @@
 
 #include "anvill/Decl.h"
 #include "anvill/Program.h"
+#include "anvill/Util.h"
 
 namespace anvill {
 
+// Index the globals of `module` by the addresses they represent in `program`.
+GlobalAddressMap IndexGlobalAddresses(const Program &program,
+                                      const llvm::Module &module) {
+  GlobalAddressMap global_addresses;
+
+  // NOTE(pag): The named addresses are ordered by address, so the first
+  //            address of a name is the one that sticks.
+  for (const auto &named : program.NamedAddresses()) {
+    const llvm::StringRef name(named.name.data(), named.name.size());
+    if (auto gv = module.getNamedValue(name); gv) {
+      global_addresses.try_emplace(gv, named.address);
+    }
+  }
+
+  for (auto decl : program.Functions()) {
+    if (auto gv = module.getNamedValue(CreateFunctionName(decl->address));
+        gv) {
+      global_addresses.try_emplace(gv, decl->address);
+    }
+  }
+
+  for (auto decl : program.Variables()) {
+    if (auto gv = module.getNamedValue(CreateVariableName(decl->address));
+        gv) {
+      global_addresses.try_emplace(gv, decl->address);
+    }
+  }
+
+  return global_addresses;
+}
+
 XrefExprFolder::XrefExprFolder(const Program &program_, llvm::Module &module_)
     : program(program_),
       module(module_),
-      error(llvm::Error::success()) {}
+      error(llvm::Error::success()),
+      owned_global_addresses(new GlobalAddressMap(
+          IndexGlobalAddresses(program_, module_))),
+      global_addresses(owned_global_addresses.get()) {}
+
+XrefExprFolder::XrefExprFolder(const Program &program_, llvm::Module &module_,
+                               const GlobalAddressMap &global_addresses_)
+    : program(program_),
+      module(module_),
+      error(llvm::Error::success()),
+      global_addresses(&global_addresses_) {}
 
 void XrefExprFolder::Reset(void) {
+  ++num_resets;
+  Clear();
+}
+
+void XrefExprFolder::Clear(void) {
   is_ci_relative = false;
   is_pc_relative = false;
   is_sp_relative = false;
@@ -74,7 +125,103 @@ void XrefExprFolder::Reset(void) {
   llvm::handleAllErrors(std::move(error), [](llvm::ErrorInfoBase &) {});
 }
 
+// Capture the state of the folder, and the folded `value`, into a `Fold`.
+// This consumes `error`.
+XrefExprFolder::Fold XrefExprFolder::Capture(uint64_t value) {
+  Fold fold;
+  fold.value = value;
+  fold.is_ci_relative = is_ci_relative;
+  fold.is_pc_relative = is_pc_relative;
+  fold.is_sp_relative = is_sp_relative;
+  fold.is_ra_relative = is_ra_relative;
+  fold.is_gv_relative = is_gv_relative;
+  fold.is_pointer_if_not_pointer = is_pointer;
+  fold.is_pointer_if_pointer = is_pointer;
+  fold.left_shift_amount = left_shift_amount;
+  fold.right_shift_amount = right_shift_amount;
+  fold.bits_xor = bits_xor;
+  fold.bits_and = bits_and;
+  if (error) {
+    fold.has_error = true;
+    llvm::handleAllErrors(std::move(error), [&](llvm::ErrorInfoBase &eib) {
+      if (!fold.error_message.empty()) {
+        fold.error_message += "; ";
+      }
+      fold.error_message += eib.message();
+    });
+  }
+  return fold;
+}
+
+// Apply the effect of a memoized fold to the state of the folder. This
+// mirrors how the state is updated when visiting the value directly.
+void XrefExprFolder::Apply(const Fold &fold) {
+  if (fold.resets) {
+    ++num_resets;
+    Clear();
+  }
+
+  is_ci_relative = is_ci_relative || fold.is_ci_relative;
+  is_pc_relative = is_pc_relative || fold.is_pc_relative;
+  is_sp_relative = is_sp_relative || fold.is_sp_relative;
+  is_ra_relative = is_ra_relative || fold.is_ra_relative;
+  is_gv_relative = is_gv_relative || fold.is_gv_relative;
+  is_pointer =
+      is_pointer ? fold.is_pointer_if_pointer : fold.is_pointer_if_not_pointer;
+  left_shift_amount += fold.left_shift_amount;
+  right_shift_amount += fold.right_shift_amount;
+  bits_xor |= fold.bits_xor;
+  bits_and |= fold.bits_and;
+
+  if (fold.has_error) {
+    error = llvm::createStringError(std::errc::address_not_available, "%s",
+                                    fold.error_message.c_str());
+  }
+}
+
 uint64_t XrefExprFolder::Visit(llvm::Value *v) {
+
+  // NOTE(pag): The memoized folds are computed from an error-free state, and
+  //            visiting instructions is short-circuited once there's an
+  //            error, so don't use the memo if there is already an error.
+  if (error ||
+      (!llvm::isa<llvm::Instruction>(v) && !llvm::isa<llvm::ConstantExpr>(v))) {
+    return VisitUncached(v);
+  }
+
+  if (auto it = memo.find(v); it != memo.end()) {
+    Apply(it->second);
+    return it->second.value;
+  }
+
+  // Fold `v` starting from a cleared state, and then restore our state.
+  auto saved = Capture(0);
+  const auto saved_num_resets = num_resets;
+
+  Clear();
+  auto fold = Capture(VisitUncached(v));
+  fold.resets = saved_num_resets != num_resets;
+
+  // `is_pointer` is the only piece of state that the operators read back, so
+  // find out what it becomes if we had started off thinking this was a
+  // pointer.
+  if (!fold.resets) {
+    Clear();
+    is_pointer = true;
+    (void) VisitUncached(v);
+    fold.is_pointer_if_pointer = is_pointer;
+  }
+
+  Clear();
+  Apply(saved);
+  num_resets = saved_num_resets;
+
+  const auto &memo_fold = memo.emplace(v, std::move(fold)).first->second;
+  Apply(memo_fold);
+  return memo_fold.value;
+}
+
+uint64_t XrefExprFolder::VisitUncached(llvm::Value *v) {
   if (auto c = llvm::dyn_cast<llvm::Constant>(v); c) {
     return VisitConst(c);
 
@@ -494,17 +641,12 @@ uint64_t XrefExprFolder::VisitTrunc(llvm::Value *op, llvm::Type *type) {
 
 std::pair<bool, uint64_t>
 XrefExprFolder::TryResolveGlobal(llvm::GlobalValue *gv) {
-  std::pair<bool, uint64_t> ret = {false, 0};
-
-  program.ForEachAddressOfName(
-      gv->getName().str(),
-      [&ret](uint64_t ea, const FunctionDecl *, const GlobalVarDecl *) {
-        ret.first = true;
-        ret.second = ea;
-        return false;
-      });
+  const auto it = global_addresses->find(gv);
+  if (it == global_addresses->end()) {
+    return {false, 0};
+  }
 
-  return ret;
+  return {true, it->second};
 }
 
 namespace {
@@ -634,25 +776,48 @@ static bool ClassifyCell(const llvm::DataLayout &dl, Cell &cell) {
   }
 }
 
-static void FindPossibleCrossReferences(
-    const Program &program, llvm::Module &module, const char *gv_name,
-    std::vector<std::pair<llvm::Use *, Byte>> &ptr_fixups,
-    std::vector<std::pair<llvm::Use *, Byte>> &maybe_fixups,
-    std::vector<std::pair<llvm::Use *, uint64_t>> &imm_fixups) {
+// Possible cross-references found by `FindPossibleCrossReferences`.
+struct CrossReferences {
+  std::vector<std::pair<llvm::Use *, Byte>> ptr_fixups;
+  std::vector<std::pair<llvm::Use *, Byte>> maybe_fixups;
+  std::vector<std::pair<llvm::Use *, uint64_t>> imm_fixups;
 
-  std::vector<std::tuple<llvm::Use *, llvm::Value *, bool>> work_list;
-  std::vector<std::tuple<llvm::Use *, llvm::Value *, bool>> next_work_list;
+  // Offsets from the stack pointer.
+  std::vector<std::pair<llvm::Use *, uint64_t>> sp_fixups;
+};
 
-  if (auto gv = module.getGlobalVariable(gv_name); gv) {
-    for (auto &use : gv->uses()) {
-      next_work_list.emplace_back(&use, gv, true);
+// Classify the use `use`, whose value `folder` folded to `ea`, as a possible
+// cross-reference.
+static void AddCrossReference(const Program &program,
+                              const XrefExprFolder &folder, llvm::Use *use,
+                              uint64_t ea, CrossReferences &xrefs) {
+  if (folder.is_sp_relative) {
+    xrefs.sp_fixups.emplace_back(use, ea);
+
+  } else if (auto byte = program.FindByte(ea);
+             byte && !folder.is_ra_relative) {
+    if (folder.is_pointer) {
+      xrefs.ptr_fixups.emplace_back(use, byte);
+    } else {
+      xrefs.maybe_fixups.emplace_back(use, byte);
     }
   } else {
-    LOG(ERROR) << "Couldn't find " << gv_name;
-    return;
+    xrefs.imm_fixups.emplace_back(use, ea);
   }
+}
 
-  XrefExprFolder folder(program, module);
+using XrefWorkList = std::vector<std::tuple<llvm::Use *, llvm::Value *, bool>>;
+
+// Fold the uses in `next_work_list` into possible cross-references, ascending
+// the usage graph from each use.
+//
+// NOTE(pag): `folder` memoizes what it folds, so the same folder must not be
+//            used across changes to the module.
+static void FindPossibleCrossReferences(const Program &program,
+                                        XrefExprFolder &folder,
+                                        XrefWorkList next_work_list,
+                                        CrossReferences &xrefs) {
+  XrefWorkList work_list;
   std::unordered_set<llvm::Use *> seen;
 
   while (!next_work_list.empty()) {
@@ -665,10 +830,9 @@ static void FindPossibleCrossReferences(
       llvm::Value * const val = val_;
       const bool report_failure = report_failure_;
 
-      if (seen.count(use)) {
+      if (!seen.insert(use).second) {
         continue;
       }
-      seen.insert(use);
 
       folder.Reset();
       const auto ea = folder.Visit(val);
@@ -682,16 +846,7 @@ static void FindPossibleCrossReferences(
         continue;
       }
 
-      if (auto byte = program.FindByte(ea);
-          byte && !folder.is_sp_relative && !folder.is_ra_relative) {
-        if (folder.is_pointer) {
-          ptr_fixups.emplace_back(use, byte);
-        } else {
-          maybe_fixups.emplace_back(use, byte);
-        }
-      } else {
-        imm_fixups.emplace_back(use, ea);
-      }
+      AddCrossReference(program, folder, use, ea, xrefs);
 
       // Recursively ascend the usage graph.
       const auto user = use->getUser();
@@ -704,27 +859,167 @@ static void FindPossibleCrossReferences(
   folder.Reset();
 }
 
+// Find possible cross-references from the uses of the global variables named
+// by `root_names`, in one traversal of the usage graph, so that a use reached
+// from several roots is only folded once. The uses by constant expressions
+// are followed up-front, and then each function using any of the roots is
+// processed independently of the others, in up to `num_jobs` threads.
+static void FindPossibleCrossReferences(const Program &program,
+                                        llvm::Module &module,
+                                        llvm::ArrayRef<const char *> root_names,
+                                        unsigned num_jobs,
+                                        CrossReferences &xrefs) {
+
+  // Fold the uses by constants, which are shared by all functions, up-front,
+  // and group the uses by instructions by function.
+  // NOTE(pag): Nothing is changed in the module while finding the
+  //            cross-references, so all folders share one index of globals.
+  const auto global_addresses = IndexGlobalAddresses(program, module);
+  XrefExprFolder const_folder(program, module, global_addresses);
+  std::unordered_map<llvm::Function *, size_t> func_index;
+  std::vector<XrefWorkList> func_work_lists;
+  std::unordered_set<llvm::Use *> seen;
+
+  // NOTE(pag): Not every root is used by every module, e.g. `__anvill_ci` is
+  //            only present if an immediate constant was lifted as such.
+  std::vector<std::pair<llvm::Use *, bool>> uses;
+  for (auto it = root_names.rbegin(); it != root_names.rend(); ++it) {
+    if (auto gv = module.getGlobalVariable(*it); gv) {
+      for (auto &use : gv->uses()) {
+        uses.emplace_back(&use, true);
+      }
+    }
+  }
+
+  while (!uses.empty()) {
+    const auto [use, report_failure] = uses.back();
+    uses.pop_back();
+    if (!seen.insert(use).second) {
+      continue;
+    }
+
+    const auto user = use->getUser();
+    if (auto inst = llvm::dyn_cast<llvm::Instruction>(user); inst) {
+      const auto [it, added] =
+          func_index.emplace(inst->getFunction(), func_work_lists.size());
+      if (added) {
+        func_work_lists.emplace_back();
+      }
+      func_work_lists[it->second].emplace_back(use, use->get(),
+                                               report_failure);
+      continue;
+    }
+
+    const_folder.Reset();
+    const auto ea = const_folder.Visit(use->get());
+    if (const_folder.error) {
+      llvm::handleAllErrors(
+          std::move(const_folder.error), [=](llvm::ErrorInfoBase &eib) {
+            LOG_IF(ERROR, report_failure)
+                << "Unable to handle possible cross-reference to " << std::hex
+                << ea << std::dec << ": " << eib.message();
+          });
+      continue;
+    }
+
+    AddCrossReference(program, const_folder, use, ea, xrefs);
+
+    for (auto &use_of_user : user->uses()) {
+      uses.emplace_back(&use_of_user, false);
+    }
+  }
+  const_folder.Reset();
+
+  // Each function gets its own folder and results, and nothing is changed in
+  // the module until all functions are processed.
+  std::vector<CrossReferences> func_xrefs(func_work_lists.size());
+  std::atomic<size_t> next_func(0u);
+
+  auto process_funcs = [&](void) {
+    XrefExprFolder folder(program, module, global_addresses);
+    for (auto i = next_func.fetch_add(1u); i < func_work_lists.size();
+         i = next_func.fetch_add(1u)) {
+      FindPossibleCrossReferences(program, folder,
+                                  std::move(func_work_lists[i]),
+                                  func_xrefs[i]);
+    }
+  };
+
+  num_jobs = std::max(
+      1u, std::min<unsigned>(num_jobs,
+                             static_cast<unsigned>(func_work_lists.size())));
+  std::vector<std::thread> workers;
+  for (auto i = 1u; i < num_jobs; ++i) {
+    workers.emplace_back(process_funcs);
+  }
+  process_funcs();
+  for (auto &worker : workers) {
+    worker.join();
+  }
+
+  // Merge in function order, so that the result doesn't depend on how the
+  // functions were divided among the workers.
+  for (auto &func_xref : func_xrefs) {
+    xrefs.ptr_fixups.insert(xrefs.ptr_fixups.end(),
+                            func_xref.ptr_fixups.begin(),
+                            func_xref.ptr_fixups.end());
+    xrefs.maybe_fixups.insert(xrefs.maybe_fixups.end(),
+                              func_xref.maybe_fixups.begin(),
+                              func_xref.maybe_fixups.end());
+    xrefs.imm_fixups.insert(xrefs.imm_fixups.end(),
+                            func_xref.imm_fixups.begin(),
+                            func_xref.imm_fixups.end());
+    xrefs.sp_fixups.insert(xrefs.sp_fixups.end(),
+                           func_xref.sp_fixups.begin(),
+                           func_xref.sp_fixups.end());
+  }
+}
+
 static constexpr uint64_t kStackBias = 4096 * 3;
 
+// NOTE(pag): This is based off of the amd64 ABI redzone, and hopefully
+//            represents an appropriate redzone size for functions without
+//            a declaration. Declared functions get the redzone of their
+//            architecture's ABI (see `DefaultRedzoneSize`), unless their
+//            spec says otherwise.
+static constexpr uint64_t kDefaultRedzoneSize = 128;
+
 struct StackFrame {
  public:
+  explicit StackFrame(llvm::Function *func_, uint64_t redzone_size)
+      : func(func_),
+        min_ea(kStackBias - redzone_size) {}
+
+  llvm::Function *func;
+
   std::vector<Cell> cells;
 
-  // NOTE(pag): This is based off of the amd64 ABI redzone, and
-  //            hopefully represents an appropriate redzone size.
-  //
-  //            Consider having additional info in the `FunctionDecl`
-  //            for either frame size or redzone size.
-  uint64_t min_ea{kStackBias - 128};
+  // The frame spans at least the redzone below the stack pointer on entry
+  // to the function, and grows to cover every cell.
+  uint64_t min_ea;
 
   uint64_t max_ea{kStackBias};
 };
 
 static void RecoverStackMemoryAccesses(
+    const Program &program,
     const std::vector<std::pair<llvm::Use *, uint64_t>> &sp_fixups,
     llvm::Module &module) {
 
-  std::unordered_map<llvm::Function *, StackFrame> frames;
+  // The redzone of each lifted function with a declaration.
+  std::unordered_map<llvm::Function *, uint64_t> redzone_sizes;
+  for (auto decl : program.Functions()) {
+    if (auto func = module.getFunction(CreateFunctionName(decl->address));
+        func) {
+      redzone_sizes.emplace(func, decl->num_bytes_in_redzone);
+    }
+  }
+
+  // NOTE(pag): Frames are kept in the order in which their functions are
+  //            first seen, so that the recovered frames don't depend on
+  //            hashing.
+  std::unordered_map<llvm::Function *, size_t> frame_index;
+  std::vector<StackFrame> frames;
 
   auto &context = module.getContext();
   const auto &dl = module.getDataLayout();
@@ -740,7 +1035,15 @@ static void RecoverStackMemoryAccesses(
     }
 
     auto func = inst->getFunction();
-    auto &frame = frames[func];
+    const auto [it, added] = frame_index.emplace(func, frames.size());
+    if (added) {
+      const auto redzone_it = redzone_sizes.find(func);
+      frames.emplace_back(func, redzone_it != redzone_sizes.end()
+                                    ? redzone_it->second
+                                    : kDefaultRedzoneSize);
+    }
+
+    auto &frame = frames[it->second];
     frame.cells.emplace_back();
     auto &cell = frame.cells.back();
 
@@ -800,8 +1103,8 @@ static void RecoverStackMemoryAccesses(
   // Types within the stack frame for a given function.
   std::vector<llvm::Type *> types;
 
-  for (auto &[func, frame_] : frames) {
-    StackFrame &frame = frame_;
+  for (auto &frame : frames) {
+    const auto func = frame.func;
 
     // Sort the cells, grouped by bytes, ordering larger cells
     std::sort(frame.cells.begin(), frame.cells.end(), order_cells);
@@ -843,51 +1146,179 @@ static void RecoverStackMemoryAccesses(
     }
 
     llvm::IRBuilder<> ir(&(func->getEntryBlock().front()));
-    std::stringstream frame_ss;
     const auto frame_type = llvm::StructType::create(
         context, types, func->getName().str() + ".frame_type", false);
     const auto frame_ptr = ir.CreateAlloca(frame_type);
 
-    std::unordered_map<uint64_t, llvm::Value *> offset_cache;
+    // The sorted cells are coalesced by offset and type, so that all uses of
+    // one cell share one pointer into the frame, and one conversion of that
+    // pointer to each type used. These are all in the entry block, and so
+    // they dominate every use.
+    llvm::Value *cell_ptr = nullptr;
+    const Cell *prev_cell = nullptr;
+    std::unordered_map<llvm::Type *, llvm::Value *> cell_ptr_casts;
 
     for (const auto &cell : frame.cells) {
-      auto &gep = offset_cache[cell.address_const];
-      if (!gep) {
+      if (!prev_cell || prev_cell->address_const != cell.address_const ||
+          prev_cell->type != cell.type) {
         const auto goal_offset = cell.address_const - frame.min_ea;
-        gep = remill::BuildPointerToOffset(
+        cell_ptr = remill::BuildPointerToOffset(
             ir, frame_ptr, goal_offset, llvm::PointerType::get(cell.type, 0));
+        cell_ptr_casts.clear();
+        prev_cell = &cell;
       }
 
-      auto dest_type = cell.use->get()->getType();
-      if (dest_type->isIntegerTy()) {
-        gep = ir.CreatePtrToInt(gep, dest_type);
-      } else if (dest_type->isPointerTy()) {
-        gep = ir.CreateBitCast(gep, dest_type);
+      const auto dest_type = cell.use->get()->getType();
+      auto &cell_ptr_cast = cell_ptr_casts[dest_type];
+      if (!cell_ptr_cast) {
+        if (dest_type->isIntegerTy()) {
+          cell_ptr_cast = ir.CreatePtrToInt(cell_ptr, dest_type);
+        } else if (dest_type->isPointerTy()) {
+          cell_ptr_cast = ir.CreateBitCast(cell_ptr, dest_type);
+        } else {
+          cell_ptr_cast = cell_ptr;
+        }
       }
-      cell.use->set(gep);
+      cell.use->set(cell_ptr_cast);
     }
   }
 }
 
-}  // namespace
+// Find the declared variable containing the address `ea`, or `nullptr`.
+static const GlobalVarDecl *FindContainingVariable(const Program &program,
+                                                   const llvm::DataLayout &dl,
+                                                   uint64_t ea) {
+  const auto vars = program.Variables();
+  auto it = std::upper_bound(
+      vars.begin(), vars.end(), ea,
+      [](uint64_t a, const GlobalVarDecl *decl) { return a < decl->address; });
+  if (it == vars.begin()) {
+    return nullptr;
+  }
 
-// Recover higher-level memory accesses in the lifted functions declared
-// in `program` and defined in `module`.
-void RecoverMemoryAccesses(const Program &program, llvm::Module &module) {
+  const auto decl = *--it;
+  if (!decl->type->isSized(nullptr) ||
+      (ea - decl->address) >= dl.getTypeAllocSize(decl->type)) {
+    return nullptr;
+  }
+  return decl;
+}
 
-  std::vector<std::pair<llvm::Use *, Byte>> fixups;
-  std::vector<std::pair<llvm::Use *, Byte>> maybe_fixups;
-  std::vector<std::pair<llvm::Use *, uint64_t>> sp_fixups;
-  std::vector<std::pair<llvm::Use *, uint64_t>> ci_fixups;
+// Rewrite the uses in `ptr_fixups`, which resolve to addresses within
+// declared variables, into typed pointers into those variables, so that
+// later optimizations can reason about which variable is accessed. Only the
+// outermost use of an address is rewritten, i.e. the arithmetic that computes
+// an address is left for dead when all of its uses are rewritten.
+static void RecoverGlobalMemoryAccesses(
+    const Program &program,
+    const std::vector<std::pair<llvm::Use *, Byte>> &ptr_fixups,
+    llvm::Module &module) {
+
+  const auto &dl = module.getDataLayout();
+  const auto i8_type = llvm::Type::getInt8Ty(module.getContext());
+
+  std::unordered_set<llvm::Use *> fixed_uses;
+  for (auto [use, byte] : ptr_fixups) {
+    fixed_uses.insert(use);
+  }
+
+  // Is every use of `val` also being rewritten?
+  auto all_uses_fixed = [&fixed_uses](llvm::Value *val) {
+    if (val->use_empty()) {
+      return false;
+    }
+    for (auto &use : val->uses()) {
+      if (!fixed_uses.count(&use)) {
+        return false;
+      }
+    }
+    return true;
+  };
+
+  std::unordered_map<const GlobalVarDecl *, llvm::GlobalVariable *> vars;
+
+  for (auto [use, byte] : ptr_fixups) {
+    const auto inst = llvm::dyn_cast<llvm::Instruction>(use->getUser());
+    if (!inst || all_uses_fixed(inst)) {
+      continue;
+    }
+
+    const auto ea = byte.Address();
+    const auto decl = FindContainingVariable(program, dl, ea);
+    if (!decl) {
+      continue;
+    }
 
-  FindPossibleCrossReferences(program, module, "__anvill_sp", fixups,
-                              maybe_fixups, sp_fixups);
+    const auto dest_type = use->get()->getType();
+    if (!dest_type->isIntegerTy() && !dest_type->isPointerTy()) {
+      continue;
+    }
 
-  RecoverStackMemoryAccesses(sp_fixups, module);
+    auto &var = vars[decl];
+    if (!var) {
+      var = decl->DeclareInModule(CreateVariableName(decl->address), module,
+                                  true);
+      if (!var) {
+        continue;
+      }
+    }
+
+    Cell cell;
+    cell.use = use;
+    if (!ClassifyCell(dl, cell) || cell.type->isFunctionTy()) {
+      cell.type = i8_type;
+    }
+
+    // NOTE(pag): The incoming value of a PHI node must be computed in the
+    //            incoming block.
+    llvm::IRBuilder<> ir(inst);
+    if (auto phi = llvm::dyn_cast<llvm::PHINode>(inst); phi) {
+      ir.SetInsertPoint(phi->getIncomingBlock(*use)->getTerminator());
+    }
+
+    llvm::Value *ptr = remill::BuildPointerToOffset(
+        ir, var, ea - decl->address, llvm::PointerType::get(cell.type, 0));
+    if (dest_type->isIntegerTy()) {
+      ptr = ir.CreatePtrToInt(ptr, dest_type);
+    } else {
+      ptr = ir.CreatePointerBitCastOrAddrSpaceCast(ptr, dest_type);
+    }
+    use->set(ptr);
+  }
+}
+
+}  // namespace
+
+// Recover higher-level memory accesses in the lifted functions declared
+// in `program` and defined in `module`. Possible cross-references are found
+// in up to `num_jobs` functions at a time.
+void RecoverMemoryAccesses(
+    const Program &program, llvm::Module &module, unsigned num_jobs,
+    std::unordered_set<llvm::Function *> *changed_funcs) {
+
+  static const char * const kRootNames[] = {"__anvill_sp", "__anvill_pc",
+                                            "__anvill_ra", "__anvill_ci"};
+
+  CrossReferences xrefs;
+  FindPossibleCrossReferences(program, module, kRootNames, num_jobs, xrefs);
+
+  // NOTE(pag): Only the uses by instructions are rewritten.
+  if (changed_funcs) {
+    auto add_func = [=](llvm::Use *use) {
+      if (auto inst = llvm::dyn_cast<llvm::Instruction>(use->getUser())) {
+        changed_funcs->insert(inst->getFunction());
+      }
+    };
+    for (const auto &fixup : xrefs.sp_fixups) {
+      add_func(fixup.first);
+    }
+    for (const auto &fixup : xrefs.ptr_fixups) {
+      add_func(fixup.first);
+    }
+  }
 
-  fixups.clear();
-  maybe_fixups.clear();
-  sp_fixups.clear();
+  RecoverStackMemoryAccesses(program, xrefs.sp_fixups, module);
+  RecoverGlobalMemoryAccesses(program, xrefs.ptr_fixups, module);
 }
 
 }  // namespace anvill
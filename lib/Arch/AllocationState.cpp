@@ -79,10 +79,12 @@ AllocationState::AllocationState(
     const remill::Arch *_arch, const CallingConvention *_conv)
     : constraints(_constraints),
       arch(_arch),
-      reserved(_constraints.size(), false),
-      fill(constraints.size(), 0),
       conv(_conv),
-      ptr_size_constraint(arch->address_size == 32 ? kMinBit32 : kMinBit64) {}
+      ptr_size_constraint(arch->address_size == 32 ? kMinBit32 : kMinBit64) {
+  CHECK_LE(constraints.size(), kMaxNumRegisters)
+      << "Too many registers in calling convention constraints";
+  fill.fill(0u);
+}
 
 // Returns whether or not the register at index i is completely filled
 bool AllocationState::IsFilled(size_t i) {
@@ -20,6 +20,8 @@
 #include <llvm/IR/Attributes.h>
 #include <remill/BC/Util.h>
 
+#include <array>
+#include <bitset>
 #include <vector>
 
 #include "Arch.h"
@@ -44,6 +46,11 @@ struct AllocationConfig {
 // registers.
 struct AllocationState {
  public:
+  // The maximum number of registers in the constraints of an allocation.
+  // Calling conventions only pass values in a handful of registers, so this
+  // lets the state of an allocation live inline.
+  static constexpr size_t kMaxNumRegisters = 64u;
+
   ~AllocationState(void);
 
   AllocationState(const std::vector<RegisterConstraint> &_constraints,
@@ -75,8 +82,8 @@ struct AllocationState {
 
   const std::vector<RegisterConstraint> &constraints;
   const remill::Arch *arch;
-  std::vector<bool> reserved;
-  std::vector<uint64_t> fill;
+  std::bitset<kMaxNumRegisters> reserved;
+  std::array<uint64_t, kMaxNumRegisters> fill;
   const CallingConvention *conv;
   AllocationConfig config;
   const SizeConstraint ptr_size_constraint;
@@ -23,6 +23,7 @@
 #include <glog/logging.h>
 #include <llvm/ADT/StringRef.h>
 #include <llvm/Demangle/Demangle.h>
+#include <llvm/IR/Attributes.h>
 #include <llvm/IR/DataLayout.h>
 #include <llvm/IR/DerivedTypes.h>
 #include <llvm/IR/Function.h>
@@ -36,11 +37,38 @@
 #include <remill/BC/ABI.h>
 #include <remill/BC/IntrinsicTable.h>
 #include <remill/BC/Util.h>
+#include <remill/OS/OS.h>
+
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <utility>
 
 #include "Arch/Arch.h"
 
 namespace anvill {
 
+// Returns the number of bytes below the stack pointer that the ABI of `arch`
+// lets every function use without moving the stack pointer.
+uint64_t DefaultRedzoneSize(const remill::Arch *arch) {
+  if (!arch) {
+    return 0u;
+
+  // NOTE(pag): The System V amd64 ABI has a 128-byte redzone, but the
+  //            Windows x64 ABI has none.
+  } else if (arch->IsAMD64()) {
+    return arch->os_name == remill::kOSWindows ? 0u : 128u;
+
+  // NOTE(pag): Apple's arm64 ABI has a 128-byte redzone, whereas the
+  //            standard AArch64 procedure call standard has none.
+  } else if (arch->IsAArch64()) {
+    return arch->os_name == remill::kOSmacOS ? 128u : 0u;
+
+  } else {
+    return 0u;
+  }
+}
+
 // Declare this global variable in an LLVM module.
 llvm::GlobalVariable *
 GlobalVarDecl::DeclareInModule(const std::string &name,
@@ -250,6 +278,10 @@ FunctionDecl::SerializeToJSON(const llvm::DataLayout &dl) const {
       llvm::json::Object::KV{llvm::json::ObjectKey("calling_convention"),
                              llvm::json::Value(calling_convention)});
 
+  json.insert(llvm::json::Object::KV{
+      llvm::json::ObjectKey("redzone"),
+      static_cast<int64_t>(this->num_bytes_in_redzone)});
+
   return json;
 }
 
@@ -301,45 +333,296 @@ ValueDecl::SerializeToJSON(const llvm::DataLayout &dl) const {
 }
 #endif
 
+namespace {
+
+// Rebind the registers and type of `decl` to live inside of `arch`.
+static void RecontextualizeValueDecl(ValueDecl &decl,
+                                     const remill::Arch *arch) {
+  if (decl.reg) {
+    decl.reg = arch->RegisterByName(decl.reg->name);
+  }
+  if (decl.mem_reg) {
+    decl.mem_reg = arch->RegisterByName(decl.mem_reg->name);
+  }
+  if (decl.type) {
+    decl.type = remill::RecontextualizeType(decl.type, *(arch->context));
+  }
+}
+
+}  // namespace
+
+// Return a copy of this function declaration whose registers and types
+// belong to `arch` and its LLVM context.
+FunctionDecl FunctionDecl::Recontextualize(const remill::Arch *new_arch) const {
+  FunctionDecl decl(*this);
+  decl.arch = new_arch;
+  decl.type = llvm::dyn_cast<llvm::FunctionType>(
+      remill::RecontextualizeType(type, *(new_arch->context)));
+
+  RecontextualizeValueDecl(decl.return_address, new_arch);
+  if (return_stack_pointer) {
+    decl.return_stack_pointer =
+        new_arch->RegisterByName(return_stack_pointer->name);
+  }
+
+  for (auto &param : decl.params) {
+    RecontextualizeValueDecl(param, new_arch);
+  }
+
+  for (auto &ret : decl.returns) {
+    RecontextualizeValueDecl(ret, new_arch);
+  }
+
+  return decl;
+}
+
+namespace {
+
+// Identifies the signatures that a calling convention allocates the same
+// way. Aside from the function type, conventions look at which parameter,
+// if any, is marked as `sret`, and at the data layout of the module.
+struct SignatureKey {
+  const remill::Arch *arch;
+  llvm::CallingConv::ID cc_id;
+  llvm::FunctionType *type;
+  unsigned sret_param;
+  std::string data_layout;
+
+  bool operator<(const SignatureKey &that) const {
+    return std::tie(arch, cc_id, type, sret_param, data_layout) <
+           std::tie(that.arch, that.cc_id, that.type, that.sret_param,
+                    that.data_layout);
+  }
+};
+
+// The argument for which a parameter was allocated, and the index of the
+// part of that argument, if it was split across several locations. The
+// `arg` of a parameter that wasn't allocated for any argument, e.g. an
+// injected `sret` pointer, is negative.
+struct ParamOrigin {
+  int arg;
+  int part;
+};
+
+// The locations allocated by a calling convention for a function type.
+struct Signature {
+  ValueDecl return_address;
+  const remill::Register *return_stack_pointer{nullptr};
+  int64_t return_stack_pointer_offset{0};
+  std::vector<ParameterDecl> params;
+  std::vector<ValueDecl> returns;
+
+  // The names of the arguments of the function whose signature this is.
+  std::vector<std::string> param_names;
+
+  // The origin of each parameter in `params`, or empty if the origins can't
+  // be told apart, in which case the signature is only reused by functions
+  // with the same parameter names.
+  std::vector<ParamOrigin> origins;
+};
+
+// Returns `1 + i` if the `i`th parameter of `func` is the `sret` parameter,
+// or `0` if there is no `sret` parameter. Calling conventions only look at
+// the first two parameters.
+static unsigned FindStructRetParam(const llvm::Function &func) {
+  if (!func.hasStructRetAttr()) {
+    return 0u;
+  } else if (func.hasParamAttribute(0, llvm::Attribute::StructRet)) {
+    return 1u;
+  } else if (func.hasParamAttribute(1, llvm::Attribute::StructRet)) {
+    return 2u;
+  } else {
+    return 0u;
+  }
+}
+
+// Figure out the argument for which each of `params` was allocated, based
+// on how calling conventions name parameters: a parameter holding a whole
+// argument takes the name of the argument, and the parts of an argument
+// that is split across several locations take the name of the argument,
+// suffixed by the index of the part. Returns `false` if the origins of the
+// parameters can't be told apart.
+static bool FindParamOrigins(const std::vector<ParameterDecl> &params,
+                             const std::vector<std::string> &names,
+                             std::vector<ParamOrigin> &origins) {
+  int arg = 0;
+  int part = 0;
+  const auto num_args = static_cast<int>(names.size());
+
+  origins.clear();
+  for (const auto &param : params) {
+
+    // Try to continue an argument that was split into several parts.
+    if (part) {
+      if (param.name == names[arg] + std::to_string(part)) {
+        origins.push_back({arg, part++});
+        continue;
+      }
+      ++arg;
+      part = 0;
+    }
+
+    if (arg < num_args && param.name == names[arg]) {
+      origins.push_back({arg++, -1});
+
+    } else if (arg < num_args && param.name == names[arg] + "0") {
+      origins.push_back({arg, part++});
+
+    // Parameters that weren't allocated for an argument, e.g. an injected
+    // `sret` pointer, are expected to come first.
+    } else if (!arg && !part) {
+      origins.push_back({-1, -1});
+
+    } else {
+      return false;
+    }
+  }
+
+  if (part) {
+    ++arg;
+  }
+
+  if (arg != num_args) {
+    return false;
+  }
+
+  for (const auto &name : names) {
+    if (name.empty()) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// Fill in the locations of `decl` from the cached `sig`, naming the
+// parameters after `names`.
+static void ApplySignature(FunctionDecl &decl, const Signature &sig,
+                           const std::vector<std::string> &names) {
+  decl.return_address = sig.return_address;
+  decl.return_stack_pointer = sig.return_stack_pointer;
+  decl.return_stack_pointer_offset = sig.return_stack_pointer_offset;
+  decl.params = sig.params;
+  decl.returns = sig.returns;
+
+  if (names == sig.param_names) {
+    return;
+  }
+
+  for (auto i = 0u; i < decl.params.size(); ++i) {
+    const auto &origin = sig.origins[i];
+    if (origin.arg < 0) {
+      continue;
+    }
+
+    auto &name = decl.params[i].name;
+    name = names[static_cast<unsigned>(origin.arg)];
+    if (origin.part >= 0) {
+      name += std::to_string(origin.part);
+    }
+  }
+}
+
+// Create the calling convention with ID `cc_id` for `arch`. The default
+// calling convention, `llvm::CallingConv::C`, is chosen based on the triple
+// of `arch`.
+static llvm::Expected<std::unique_ptr<CallingConvention>>
+CreateCallingConvention(llvm::CallingConv::ID cc_id, llvm::Function &func,
+                        const remill::Arch *arch) {
+  llvm::Expected<std::unique_ptr<CallingConvention>> maybe_cc =
+      cc_id != llvm::CallingConv::C
+          ? CallingConvention::CreateCCFromCCID(cc_id, arch)
+          : CallingConvention::CreateCCFromArch(arch);
+
+  if (remill::IsError(maybe_cc)) {
+    const auto sub_error = remill::GetErrorString(maybe_cc);
+    return llvm::createStringError(
+        std::make_error_code(std::errc::invalid_argument),
+        "Calling convention of function '%s' is not supported: %s",
+        func.getName().str().c_str(), sub_error.c_str());
+  }
+
+  return maybe_cc;
+}
+
+}  // namespace
+
+class SignatureCache::Impl {
+ public:
+  // Calling conventions, by architecture and ID.
+  std::map<std::pair<const remill::Arch *, llvm::CallingConv::ID>,
+           std::unique_ptr<CallingConvention>>
+      conventions;
+
+  std::map<SignatureKey, Signature> signatures;
+
+  std::mutex lock;
+};
+
+SignatureCache::SignatureCache(void) : impl(new Impl) {}
+
+SignatureCache::~SignatureCache(void) {}
+
 // Create a Function Declaration from an `llvm::Function`.
 llvm::Expected<FunctionDecl>
-FunctionDecl::Create(llvm::Function &func, const remill::Arch::ArchPtr &arch) {
+FunctionDecl::Create(llvm::Function &func, const remill::Arch::ArchPtr &arch,
+                     SignatureCache *cache) {
 
   FunctionDecl decl;
   decl.arch = arch.get();
+  decl.num_bytes_in_redzone = DefaultRedzoneSize(decl.arch);
   decl.type = func.getFunctionType();
   decl.is_variadic = func.isVarArg();
   decl.is_noreturn = func.hasFnAttribute(llvm::Attribute::NoReturn);
 
   // If the function calling convention is not the default llvm::CallingConv::C
   // then use it. Otherwise, get the CallingConvention from the remill::Arch
-  std::unique_ptr<CallingConvention> cc;
-  llvm::CallingConv::ID cc_id = func.getCallingConv();
+  const llvm::CallingConv::ID cc_id = func.getCallingConv();
 
-  // The value is not default so use it.
-  if (cc_id != llvm::CallingConv::C) {
-    auto maybe_cc = CallingConvention::CreateCCFromCCID(cc_id, arch.get());
+  if (!cache) {
+    auto maybe_cc = CreateCallingConvention(cc_id, func, arch.get());
     if (remill::IsError(maybe_cc)) {
-      const auto sub_error = remill::GetErrorString(maybe_cc);
-      return llvm::createStringError(
-          std::make_error_code(std::errc::invalid_argument),
-          "Calling convention of function '%s' is not supported: %s",
-          func.getName().str().c_str(), sub_error.c_str());
-    } else {
-      remill::GetReference(maybe_cc).swap(cc);
+      return maybe_cc.takeError();
     }
 
-  // Figure out the default calling convention for this triple.
-  } else {
-    auto maybe_cc = CallingConvention::CreateCCFromArch(arch.get());
+    auto &cc = remill::GetReference(maybe_cc);
+    auto err = cc->AllocateSignature(decl, func);
+    if (remill::IsError(err)) {
+      return std::move(err);
+    }
+
+    decl.calling_convention = cc->getIdentity();
+    return decl;
+  }
+
+  // NOTE(pag): Recovering the parameter names scans the whole function, and
+  //            so it is done before taking the lock. Calling conventions
+  //            may create types in the context of `func`, and so allocation
+  //            happens with the lock held.
+  SignatureKey key{arch.get(), cc_id, decl.type, FindStructRetParam(func),
+                   func.getParent()->getDataLayout().getStringRepresentation()};
+  auto param_names = TryRecoverParamNames(func);
+
+  std::lock_guard<std::mutex> locker(cache->impl->lock);
+
+  auto &cc = cache->impl->conventions[{arch.get(), cc_id}];
+  if (!cc) {
+    auto maybe_cc = CreateCallingConvention(cc_id, func, arch.get());
     if (remill::IsError(maybe_cc)) {
-      const auto sub_error = remill::GetErrorString(maybe_cc);
-      return llvm::createStringError(
-          std::make_error_code(std::errc::invalid_argument),
-          "Calling convention of function '%s' is not supported: %s",
-          func.getName().str().c_str(), sub_error.c_str());
-    } else {
-      remill::GetReference(maybe_cc).swap(cc);
+      return maybe_cc.takeError();
+    }
+    remill::GetReference(maybe_cc).swap(cc);
+  }
+
+  decl.calling_convention = cc->getIdentity();
+
+  auto sig_it = cache->impl->signatures.find(key);
+  if (sig_it != cache->impl->signatures.end()) {
+    const auto &sig = sig_it->second;
+    if (!sig.origins.empty() || sig.params.empty() ||
+        param_names == sig.param_names) {
+      ApplySignature(decl, sig, param_names);
+      return decl;
     }
   }
 
@@ -348,7 +631,22 @@ FunctionDecl::Create(llvm::Function &func, const remill::Arch::ArchPtr &arch) {
     return std::move(err);
   }
 
-  decl.calling_convention = cc->getIdentity();
+  // NOTE(pag): A signature whose parameters can't be traced back to their
+  //            arguments is still cached, so that it is reused by functions
+  //            of the same type whose parameters have the same names.
+  if (sig_it == cache->impl->signatures.end()) {
+    Signature sig;
+    sig.return_address = decl.return_address;
+    sig.return_stack_pointer = decl.return_stack_pointer;
+    sig.return_stack_pointer_offset = decl.return_stack_pointer_offset;
+    sig.params = decl.params;
+    sig.returns = decl.returns;
+    if (!FindParamOrigins(decl.params, param_names, sig.origins)) {
+      sig.origins.clear();
+    }
+    sig.param_names = std::move(param_names);
+    cache->impl->signatures.emplace(std::move(key), std::move(sig));
+  }
 
   return decl;
 }
@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2020 Trail of Bits, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "anvill/DecodeCache.h"
+
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+
+namespace anvill {
+namespace {
+
+// Number of independently locked shards of the cache, so that lifting
+// threads rarely contend with each other.
+static constexpr unsigned kNumShards = 16u;
+
+// One shard of the cache. Decoded instructions and jump tables are allocated
+// out of `arena` and `table_arena`, which never move their elements, so that
+// the pointers handed out by the cache remain valid without holding the
+// shard's lock.
+struct DecodeCacheShard {
+  std::mutex lock;
+  std::deque<DecodedInstruction> arena;
+  std::deque<ResolvedJumpTable> table_arena;
+
+  // Maps addresses to the instructions decoded at those addresses, indexed
+  // by whether or not the instructions were decoded as delayed instructions.
+  std::unordered_map<uint64_t, const DecodedInstruction *> entries[2];
+
+  // Maps the addresses of indirect jumps to their recovered jump tables.
+  std::unordered_map<uint64_t, const ResolvedJumpTable *> tables;
+};
+
+}  // namespace
+
+class DecodeCache::Impl {
+ public:
+  DecodeCacheShard &ShardFor(uint64_t addr) {
+
+    // NOTE(pag): Instructions are often close together, so mix the address
+    //            bits before picking a shard.
+    return shards[((addr * 0x9E3779B97F4A7C15ull) >> 32u) % kNumShards];
+  }
+
+  DecodeCacheShard shards[kNumShards];
+};
+
+DecodeCache::DecodeCache(void) : impl(new Impl) {}
+
+DecodeCache::~DecodeCache(void) {}
+
+// Returns the instruction decoded at `addr`, or `nullptr` if no instruction
+// has been decoded there yet.
+const DecodedInstruction *DecodeCache::Find(uint64_t addr,
+                                            bool is_delayed) const {
+  auto &shard = impl->ShardFor(addr);
+  std::lock_guard<std::mutex> locker(shard.lock);
+  const auto &entries = shard.entries[is_delayed];
+  if (auto it = entries.find(addr); it != entries.end()) {
+    return it->second;
+  } else {
+    return nullptr;
+  }
+}
+
+// Add the result of decoding the instruction at `addr`, and return the
+// cached result.
+const DecodedInstruction *DecodeCache::Add(uint64_t addr, bool is_delayed,
+                                           DecodedInstruction decoded) {
+  auto &shard = impl->ShardFor(addr);
+  std::lock_guard<std::mutex> locker(shard.lock);
+  auto &entry = shard.entries[is_delayed][addr];
+  if (!entry) {
+    entry = &(shard.arena.emplace_back(std::move(decoded)));
+  }
+  return entry;
+}
+
+// Returns the jump table recovered for the indirect jump at `addr`, or
+// `nullptr` if no recovery has been attempted there yet.
+const ResolvedJumpTable *DecodeCache::FindJumpTable(uint64_t addr) const {
+  auto &shard = impl->ShardFor(addr);
+  std::lock_guard<std::mutex> locker(shard.lock);
+  if (auto it = shard.tables.find(addr); it != shard.tables.end()) {
+    return it->second;
+  } else {
+    return nullptr;
+  }
+}
+
+// Add the jump table recovered for the indirect jump at `addr`, and return
+// the cached result.
+const ResolvedJumpTable *DecodeCache::AddJumpTable(uint64_t addr,
+                                                   ResolvedJumpTable table) {
+  auto &shard = impl->ShardFor(addr);
+  std::lock_guard<std::mutex> locker(shard.lock);
+  auto &entry = shard.tables[addr];
+  if (!entry) {
+    entry = &(shard.table_arena.emplace_back(std::move(table)));
+  }
+  return entry;
+}
+
+}  // namespace anvill
@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2020 Trail of Bits, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Extract.h"
+
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/GlobalVariable.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/ValueMapper.h>
+
+#include <unordered_set>
+#include <vector>
+
+namespace anvill {
+namespace {
+
+// Collect the global values referenced by `val`, looking through constant
+// expressions and aggregates.
+static void CollectReferencedGlobals(
+    const llvm::Value *val, std::vector<const llvm::GlobalValue *> &globals,
+    std::unordered_set<const llvm::Constant *> &seen) {
+  if (auto gv = llvm::dyn_cast<llvm::GlobalValue>(val); gv) {
+    globals.push_back(gv);
+
+  } else if (auto c = llvm::dyn_cast<llvm::Constant>(val); c) {
+    if (seen.insert(c).second) {
+      for (auto &op : c->operands()) {
+        CollectReferencedGlobals(op.get(), globals, seen);
+      }
+    }
+  }
+}
+
+}  // namespace
+
+// Extract the definitions of `defs` out of `module` and into a new module.
+std::unique_ptr<llvm::Module>
+ExtractDefinitions(llvm::Module &module,
+                   llvm::ArrayRef<const llvm::GlobalValue *> defs) {
+  std::unordered_set<const llvm::GlobalValue *> keep;
+  std::vector<const llvm::GlobalValue *> work_list;
+  std::unordered_set<const llvm::Constant *> seen;
+
+  for (auto def : defs) {
+    if (keep.insert(def).second) {
+      work_list.push_back(def);
+    }
+  }
+
+  std::vector<const llvm::GlobalValue *> referenced;
+  while (!work_list.empty()) {
+    const auto gv = work_list.back();
+    work_list.pop_back();
+
+    referenced.clear();
+    if (auto f = llvm::dyn_cast<llvm::Function>(gv); f) {
+      for (auto &block : *f) {
+        for (auto &inst : block) {
+          for (auto &op : inst.operands()) {
+            CollectReferencedGlobals(op.get(), referenced, seen);
+          }
+        }
+      }
+    } else if (auto var = llvm::dyn_cast<llvm::GlobalVariable>(gv);
+               var && var->hasInitializer()) {
+      CollectReferencedGlobals(var->getInitializer(), referenced, seen);
+    }
+
+    for (auto ref : referenced) {
+      if (ref->hasLocalLinkage() && !ref->isDeclaration() &&
+          keep.insert(ref).second) {
+        work_list.push_back(ref);
+      }
+    }
+  }
+
+  llvm::ValueToValueMapTy value_map;
+  auto extracted =
+      llvm::CloneModule(module, value_map, [&](const llvm::GlobalValue *gv) {
+        return keep.count(gv) != 0;
+      });
+
+  // Remove the declarations that the extracted code doesn't use.
+  std::vector<llvm::GlobalValue *> to_erase;
+  for (auto &f : *extracted) {
+    if (f.isDeclaration() && f.use_empty()) {
+      to_erase.push_back(&f);
+    }
+  }
+  for (auto &var : extracted->globals()) {
+    if (var.isDeclaration() && var.use_empty()) {
+      to_erase.push_back(&var);
+    }
+  }
+  for (auto gv : to_erase) {
+    gv->eraseFromParent();
+  }
+
+  return extracted;
+}
+
+}  // namespace anvill
@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2020 Trail of Bits, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <llvm/ADT/ArrayRef.h>
+
+#include <memory>
+
+namespace llvm {
+class GlobalValue;
+class Module;
+}  // namespace llvm
+namespace anvill {
+
+// Extract the definitions of `defs` out of `module` and into a new module.
+// Definitions with local linkage that `defs` depend upon (e.g. the
+// `.lifted_to_native` wrappers of lifted callees) are extracted along with
+// them; everything else is left as a declaration, to be resolved when the new
+// module is linked with the modules holding those definitions.
+std::unique_ptr<llvm::Module>
+ExtractDefinitions(llvm::Module &module,
+                   llvm::ArrayRef<const llvm::GlobalValue *> defs);
+
+}  // namespace anvill
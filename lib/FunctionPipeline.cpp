@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2020 Trail of Bits, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "FunctionPipeline.h"
+
+#include <llvm/Analysis/AliasAnalysis.h>
+#include <llvm/Analysis/CGSCCPassManager.h>
+#include <llvm/Analysis/LoopAnalysisManager.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Passes/PassBuilder.h>
+
+namespace anvill {
+
+struct FunctionPipeline::Impl {
+  // Used by `PassManagerKind::kLegacy`.
+  std::unique_ptr<llvm::legacy::FunctionPassManager> legacy_fpm;
+
+  // Used by `PassManagerKind::kNew`.
+  //
+  // NOTE(pag): The analysis managers are declared in this order so that
+  //            they are destroyed in the order that their cross-registered
+  //            proxies expect.
+  llvm::PassBuilder pb;
+  llvm::LoopAnalysisManager lam;
+  llvm::FunctionAnalysisManager fam;
+  llvm::CGSCCAnalysisManager cgam;
+  llvm::ModuleAnalysisManager mam;
+  llvm::FunctionPassManager fpm;
+};
+
+FunctionPipeline::FunctionPipeline(llvm::Module &module, PassManagerKind kind,
+                                   const LegacyPasses &add_legacy_passes,
+                                   const NewPasses &add_new_passes)
+    : impl(new Impl) {
+
+  if (kind == PassManagerKind::kLegacy) {
+    impl->legacy_fpm.reset(new llvm::legacy::FunctionPassManager(&module));
+    add_legacy_passes(*(impl->legacy_fpm));
+    return;
+  }
+
+  impl->fam.registerPass([this] { return impl->pb.buildDefaultAAPipeline(); });
+  impl->pb.registerModuleAnalyses(impl->mam);
+  impl->pb.registerCGSCCAnalyses(impl->cgam);
+  impl->pb.registerFunctionAnalyses(impl->fam);
+  impl->pb.registerLoopAnalyses(impl->lam);
+  impl->pb.crossRegisterProxies(impl->lam, impl->fam, impl->cgam, impl->mam);
+  add_new_passes(impl->fpm);
+}
+
+FunctionPipeline::~FunctionPipeline(void) {}
+
+// Run the pipeline over `func`.
+void FunctionPipeline::Run(llvm::Function &func) {
+  if (func.isDeclaration()) {
+    return;
+  }
+
+  if (impl->legacy_fpm) {
+    impl->legacy_fpm->doInitialization();
+    impl->legacy_fpm->run(func);
+    impl->legacy_fpm->doFinalization();
+
+  } else {
+    // NOTE(pag): The pass manager invalidates the function's analyses after
+    //            each pass, according to what that pass preserved.
+    (void) impl->fpm.run(func, impl->fam);
+  }
+}
+
+// Invalidate the cached analyses of `func`, which was changed outside of
+// the pipeline.
+void FunctionPipeline::Invalidate(llvm::Function &func, bool preserves_cfg) {
+  if (impl->legacy_fpm) {
+    return;
+  }
+
+  llvm::PreservedAnalyses pa;
+  if (preserves_cfg) {
+    pa.preserveSet<llvm::CFGAnalyses>();
+  }
+  impl->fam.invalidate(func, pa);
+}
+
+// Forget about `func`, which is about to be deleted or replaced.
+void FunctionPipeline::Forget(llvm::Function &func) {
+  if (!impl->legacy_fpm) {
+    impl->fam.clear(func, func.getName());
+  }
+}
+
+// Invalidate every cached analysis.
+void FunctionPipeline::InvalidateAll(void) {
+  if (!impl->legacy_fpm) {
+    impl->fam.clear();
+    impl->cgam.clear();
+    impl->mam.clear();
+  }
+}
+
+}  // namespace anvill
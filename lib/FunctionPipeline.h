@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2020 Trail of Bits, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/IR/PassManager.h>
+
+#include <functional>
+#include <memory>
+
+#include "anvill/Optimize.h"
+
+namespace llvm {
+class Function;
+class Module;
+}  // namespace llvm
+namespace anvill {
+
+// A pipeline of function passes, run by either LLVM's legacy pass manager,
+// or by its new pass manager. With the new pass manager, the analyses
+// computed by one run of the pipeline (e.g. dominator trees, alias analysis)
+// are kept for the next run, unless they are invalidated, either by the
+// pipeline itself, or explicitly, by the code that changes the function
+// between runs.
+class FunctionPipeline {
+ public:
+  using LegacyPasses = std::function<void(llvm::legacy::FunctionPassManager &)>;
+  using NewPasses = std::function<void(llvm::FunctionPassManager &)>;
+
+  // Create a pipeline for functions in `module`. Only one of
+  // `add_legacy_passes` and `add_new_passes` is used, depending on `kind`.
+  FunctionPipeline(llvm::Module &module, PassManagerKind kind,
+                   const LegacyPasses &add_legacy_passes,
+                   const NewPasses &add_new_passes);
+
+  ~FunctionPipeline(void);
+
+  // Run the pipeline over `func`.
+  void Run(llvm::Function &func);
+
+  // Invalidate the cached analyses of `func`, which was changed outside of
+  // the pipeline. If `preserves_cfg` is `true`, then the change didn't add,
+  // remove, or reorder any basic blocks, and so analyses of the control-flow
+  // graph, like dominator trees, are kept.
+  void Invalidate(llvm::Function &func, bool preserves_cfg = false);
+
+  // Forget about `func`, which is about to be deleted or replaced.
+  void Forget(llvm::Function &func);
+
+  // Invalidate every cached analysis, e.g. after running module passes.
+  void InvalidateAll(void);
+
+ private:
+  FunctionPipeline(const FunctionPipeline &) = delete;
+  FunctionPipeline &operator=(const FunctionPipeline &) = delete;
+
+  struct Impl;
+  std::unique_ptr<Impl> impl;
+};
+
+}  // namespace anvill
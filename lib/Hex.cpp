@@ -0,0 +1,255 @@
+/*
+ * Copyright (c) 2020 Trail of Bits, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "anvill/Hex.h"
+
+#include <array>
+#include <system_error>
+
+#if defined(__x86_64__) || defined(__i386__)
+#  include <immintrin.h>
+#  define ANVILL_HEX_X86 1
+#elif defined(__aarch64__)
+#  include <arm_neon.h>
+#  define ANVILL_HEX_NEON 1
+#endif
+
+namespace anvill {
+namespace {
+
+// Maps an ASCII character to its nibble value, or to `-1` if it isn't a
+// hex digit.
+static constexpr std::array<int8_t, 256> kNibbleTable = [] {
+  std::array<int8_t, 256> table = {};
+  for (auto i = 0u; i < 256u; ++i) {
+    if ('0' <= i && i <= '9') {
+      table[i] = static_cast<int8_t>(i - '0');
+    } else if ('a' <= i && i <= 'f') {
+      table[i] = static_cast<int8_t>(i - 'a' + 10);
+    } else if ('A' <= i && i <= 'F') {
+      table[i] = static_cast<int8_t>(i - 'A' + 10);
+    } else {
+      table[i] = -1;
+    }
+  }
+  return table;
+}();
+
+static llvm::Error InvalidHexError(llvm::StringRef hex, size_t offset) {
+  return llvm::createStringError(
+      std::make_error_code(std::errc::invalid_argument),
+      "Invalid hex digit '%c' at offset %zu of hex-encoded byte string",
+      hex[offset], offset);
+}
+
+// Decode `num_bytes` bytes starting at byte `i` of the output.
+static llvm::Error DecodeHexTail(llvm::StringRef hex, uint8_t *out, size_t i,
+                                 size_t num_bytes) {
+  const auto chars = reinterpret_cast<const uint8_t *>(hex.data());
+  for (; i < num_bytes; ++i) {
+    const auto hi = kNibbleTable[chars[i * 2u]];
+    const auto lo = kNibbleTable[chars[i * 2u + 1u]];
+    if ((hi | lo) < 0) {
+      return InvalidHexError(hex, hi < 0 ? i * 2u : i * 2u + 1u);
+    }
+    out[i] = static_cast<uint8_t>((hi << 4) | lo);
+  }
+  return llvm::Error::success();
+}
+
+#ifdef ANVILL_HEX_X86
+
+// Convert 16 hex characters into 16 nibbles, returning a mask of which
+// characters were valid hex digits.
+static inline __m128i NibblesSSE2(__m128i chars, int &valid_mask) {
+  const auto digits = _mm_sub_epi8(chars, _mm_set1_epi8('0'));
+  const auto is_digit = _mm_and_si128(_mm_cmpgt_epi8(chars, _mm_set1_epi8('/')),
+                                      _mm_cmplt_epi8(chars, _mm_set1_epi8(':')));
+
+  const auto lower = _mm_or_si128(chars, _mm_set1_epi8(0x20));
+  const auto letters = _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10));
+  const auto is_letter =
+      _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                    _mm_cmplt_epi8(lower, _mm_set1_epi8('g')));
+
+  valid_mask = _mm_movemask_epi8(_mm_or_si128(is_digit, is_letter));
+  return _mm_or_si128(_mm_and_si128(digits, is_digit),
+                      _mm_and_si128(letters, is_letter));
+}
+
+// Combine pairs of nibbles `[hi, lo]` into 16-bit lanes of `(hi << 4) | lo`.
+static inline __m128i CombineSSE2(__m128i nibbles) {
+  const auto hi = _mm_and_si128(nibbles, _mm_set1_epi16(0x00FF));
+  const auto lo = _mm_srli_epi16(nibbles, 8);
+  return _mm_or_si128(_mm_slli_epi16(hi, 4), lo);
+}
+
+static llvm::Error DecodeHexSSE2(llvm::StringRef hex, uint8_t *out) {
+  const auto num_bytes = hex.size() / 2u;
+  size_t i = 0;
+  for (; (i + 16u) <= num_bytes; i += 16u) {
+    const auto chars = hex.data() + (i * 2u);
+    int mask_a = 0;
+    int mask_b = 0;
+    const auto a = NibblesSSE2(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(chars)), mask_a);
+    const auto b = NibblesSSE2(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(chars + 16)), mask_b);
+    if ((mask_a & mask_b) != 0xFFFF) {
+      return DecodeHexTail(hex, out, i, num_bytes);  // Finds the bad offset.
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i),
+                     _mm_packus_epi16(CombineSSE2(a), CombineSSE2(b)));
+  }
+  return DecodeHexTail(hex, out, i, num_bytes);
+}
+
+#  if defined(__GNUC__) || defined(__clang__)
+#    define ANVILL_HEX_AVX2 1
+
+__attribute__((target("avx2"))) static inline __m256i
+NibblesAVX2(__m256i chars, unsigned &valid_mask) {
+  const auto digits = _mm256_sub_epi8(chars, _mm256_set1_epi8('0'));
+  const auto is_digit =
+      _mm256_and_si256(_mm256_cmpgt_epi8(chars, _mm256_set1_epi8('/')),
+                       _mm256_cmpgt_epi8(_mm256_set1_epi8(':'), chars));
+
+  const auto lower = _mm256_or_si256(chars, _mm256_set1_epi8(0x20));
+  const auto letters = _mm256_sub_epi8(lower, _mm256_set1_epi8('a' - 10));
+  const auto is_letter =
+      _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)),
+                       _mm256_cmpgt_epi8(_mm256_set1_epi8('g'), lower));
+
+  valid_mask = static_cast<unsigned>(
+      _mm256_movemask_epi8(_mm256_or_si256(is_digit, is_letter)));
+  return _mm256_or_si256(_mm256_and_si256(digits, is_digit),
+                         _mm256_and_si256(letters, is_letter));
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+CombineAVX2(__m256i nibbles) {
+  const auto hi = _mm256_and_si256(nibbles, _mm256_set1_epi16(0x00FF));
+  const auto lo = _mm256_srli_epi16(nibbles, 8);
+  return _mm256_or_si256(_mm256_slli_epi16(hi, 4), lo);
+}
+
+__attribute__((target("avx2"))) static llvm::Error
+DecodeHexAVX2(llvm::StringRef hex, uint8_t *out) {
+  const auto num_bytes = hex.size() / 2u;
+  size_t i = 0;
+  for (; (i + 32u) <= num_bytes; i += 32u) {
+    const auto chars = hex.data() + (i * 2u);
+    unsigned mask_a = 0;
+    unsigned mask_b = 0;
+    const auto a = NibblesAVX2(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(chars)), mask_a);
+    const auto b = NibblesAVX2(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(chars + 32)),
+        mask_b);
+    if ((mask_a & mask_b) != 0xFFFFFFFFu) {
+      return DecodeHexTail(hex, out, i, num_bytes);  // Finds the bad offset.
+    }
+
+    // NOTE(pag): `_mm256_packus_epi16` packs within each 128-bit lane, so
+    //            we need to put the 64-bit quarters back in order.
+    const auto packed = _mm256_packus_epi16(CombineAVX2(a), CombineAVX2(b));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i),
+                        _mm256_permute4x64_epi64(packed, 0xD8));
+  }
+  return DecodeHexTail(hex, out, i, num_bytes);
+}
+
+static bool HasAVX2(void) {
+  static const bool has_avx2 = __builtin_cpu_supports("avx2");
+  return has_avx2;
+}
+
+#  endif  // defined(__GNUC__) || defined(__clang__)
+#endif  // ANVILL_HEX_X86
+
+#ifdef ANVILL_HEX_NEON
+
+// Convert 8 hex characters into 8 nibbles, and set `valid` to all ones for
+// the characters that are valid hex digits.
+static inline uint8x8_t NibblesNEON(uint8x8_t chars, uint8x8_t &valid) {
+  const auto digits = vsub_u8(chars, vdup_n_u8('0'));
+  const auto is_digit = vcle_u8(digits, vdup_n_u8(9));
+
+  const auto lower = vorr_u8(chars, vdup_n_u8(0x20));
+  const auto letters = vsub_u8(lower, vdup_n_u8('a'));
+  const auto is_letter = vcle_u8(letters, vdup_n_u8(5));
+
+  valid = vorr_u8(is_digit, is_letter);
+  return vorr_u8(vand_u8(digits, is_digit),
+                 vand_u8(vadd_u8(letters, vdup_n_u8(10)), is_letter));
+}
+
+static llvm::Error DecodeHexNEON(llvm::StringRef hex, uint8_t *out) {
+  const auto num_bytes = hex.size() / 2u;
+  size_t i = 0;
+  for (; (i + 8u) <= num_bytes; i += 8u) {
+
+    // De-interleave the high and low nibble characters.
+    const auto chars =
+        vld2_u8(reinterpret_cast<const uint8_t *>(hex.data() + (i * 2u)));
+    uint8x8_t valid_hi;
+    uint8x8_t valid_lo;
+    const auto hi = NibblesNEON(chars.val[0], valid_hi);
+    const auto lo = NibblesNEON(chars.val[1], valid_lo);
+    if (vminv_u8(vand_u8(valid_hi, valid_lo)) != 0xFFu) {
+      return DecodeHexTail(hex, out, i, num_bytes);  // Finds the bad offset.
+    }
+    vst1_u8(out + i, vorr_u8(vshl_n_u8(hi, 4), lo));
+  }
+  return DecodeHexTail(hex, out, i, num_bytes);
+}
+
+#endif  // ANVILL_HEX_NEON
+
+}  // namespace
+
+// Portable, table-driven implementation of `DecodeHex`.
+llvm::Error DecodeHexScalar(llvm::StringRef hex, uint8_t *out) {
+  if (hex.size() % 2u) {
+    return llvm::createStringError(
+        std::make_error_code(std::errc::invalid_argument),
+        "Hex-encoded byte string must have an even number of characters");
+  }
+  return DecodeHexTail(hex, out, 0, hex.size() / 2u);
+}
+
+// Decode the hex-encoded byte string `hex` into `out`.
+llvm::Error DecodeHex(llvm::StringRef hex, uint8_t *out) {
+  if (hex.size() % 2u) {
+    return DecodeHexScalar(hex, out);
+  }
+
+#if defined(ANVILL_HEX_AVX2)
+  if (HasAVX2()) {
+    return DecodeHexAVX2(hex, out);
+  }
+#endif
+
+#if defined(ANVILL_HEX_X86) && defined(__SSE2__)
+  return DecodeHexSSE2(hex, out);
+#elif defined(ANVILL_HEX_NEON)
+  return DecodeHexNEON(hex, out);
+#else
+  return DecodeHexScalar(hex, out);
+#endif
+}
+
+}  // namespace anvill
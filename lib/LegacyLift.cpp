@@ -328,17 +328,11 @@ class TraceManagerImpl final : public TraceManager {
     auto name = ss.str();
 
     // Go try to find a name from our symbol table.
-    program.ForEachNameOfAddress(
-        addr,
-        [=, &name](const std::string &found_name,
-                   const FunctionDecl *found_decl, const GlobalVarDecl *) {
-          if (found_decl) {
-            name = found_name;
-            return false;
-          } else {
-            return true;
-          }
-        });
+    if (program.FindFunction(addr)) {
+      if (const auto names = program.NamesOfAddress(addr); !names.empty()) {
+        name = std::string(names.front().name);
+      }
+    }
 
     return name;
   }
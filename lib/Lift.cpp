@@ -18,22 +18,69 @@
 #include "anvill/Lift.h"
 
 #include <glog/logging.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/IR/Dominators.h>
+#include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/LegacyPassManager.h>
 #include <llvm/IR/Module.h>
+#include <llvm/IR/ValueHandle.h>
+#include <llvm/Linker/Linker.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/SHA1.h>
+#include <llvm/Support/raw_ostream.h>
 #include <llvm/Transforms/Scalar.h>
+#include <llvm/Transforms/Scalar/DCE.h>
+#include <llvm/Transforms/Scalar/DeadStoreElimination.h>
+#include <llvm/Transforms/Scalar/Reassociate.h>
+#include <llvm/Transforms/Scalar/SROA.h>
+#include <llvm/Transforms/Scalar/SimplifyCFG.h>
 #include <llvm/Transforms/Utils.h>
 #include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/FunctionComparator.h>
+#include <llvm/Transforms/Utils/Local.h>
+#include <llvm/Transforms/Utils/Mem2Reg.h>
+#include <llvm/Transforms/Utils/PromoteMemToReg.h>
+#include <remill/Arch/Arch.h>
 #include <remill/BC/Util.h>
-
+#include <remill/BC/Version.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <tuple>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "anvill/DecodeCache.h"
 #include "anvill/Decl.h"
+#include "anvill/LiftCache.h"
 #include "anvill/MCToIRLifter.h"
 #include "anvill/Program.h"
+#include "anvill/Semantics.h"
+#include "anvill/Stats.h"
 #include "anvill/Util.h"
+#include "Extract.h"
+#include "FunctionPipeline.h"
 
 namespace anvill {
 
 namespace {
 
+static StatCounter gFunctionsLifted("lift.functions_lifted");
+static StatCounter gCacheHits("lift.cache_hits");
+static StatCounter gCacheMisses("lift.cache_misses");
+static StatCounter gCallsInlined("lift.calls_inlined");
+static StatCounter gInlineBudgetsExceeded("lift.inline_budgets_exceeded");
+static StatCounter gFunctionsDeduplicated("lift.functions_deduplicated");
+static StatCounter gSemanticsPruned("lift.semantics_pruned");
+
 // Adapt `src` to another type (likely an integer type) that is `dest_type`.
 static llvm::Value *AdaptToType(llvm::IRBuilder<> &ir, llvm::Value *src,
                                 llvm::Type *dest_type) {
@@ -161,35 +208,89 @@ GetMemoryEscapeFunc(const remill::IntrinsicTable &intrinsics) {
                                 module);
 }
 
-// Define the function that marshals native state to lifted state.
-static void DefineNativeToLiftedWrapper(const remill::Arch *arch,
-                                        const FunctionDecl &decl,
-                                        const FunctionEntry &entry) {
+// Returns a key that identifies how values are marshalled between the
+// native and lifted forms of the function declared by `decl`. Functions whose
+// declarations have the same type, calling convention, and value locations
+// share their marshalling code, no matter their addresses.
+static std::string MarshallingKey(const FunctionDecl &decl) {
+  std::string material;
+  llvm::raw_string_ostream os(material);
+
+  auto describe = [&os](const ValueDecl &val) {
+    if (val.reg) {
+      os << val.reg->name;
+    } else if (val.mem_reg) {
+      os << '[' << val.mem_reg->name << '+' << val.mem_offset << ']';
+    }
+    os << ':' << remill::LLVMThingToString(val.type) << ';';
+  };
+
+  os << remill::LLVMThingToString(decl.type) << ';' << decl.calling_convention
+     << ';' << decl.is_noreturn << decl.is_variadic << ';';
+  describe(decl.return_address);
+  if (decl.return_stack_pointer) {
+    os << decl.return_stack_pointer->name;
+  }
+  os << '+' << decl.return_stack_pointer_offset << ';';
+  for (const auto &param_decl : decl.params) {
+    describe(param_decl);
+  }
+  os << '|';
+  for (const auto &ret_decl : decl.returns) {
+    describe(ret_decl);
+  }
+  os.flush();
+
+  return llvm::toHex(llvm::SHA1::hash(llvm::arrayRefFromStringRef(material)),
+                     true /* LowerCase */);
+}
+
+// Get or define the helper that marshals native state to lifted state for
+// the functions laid out like `decl`. The helper takes the native function's
+// parameters, followed by the lifted function to call, and the program
+// counter to call it with.
+//
+// NOTE(pag): The helper is always inlined into the native functions that
+//            delegate to it, at which point the call to the lifted function
+//            becomes direct, and so it is inlined in turn.
+static llvm::Function *
+GetOrDefineNativeToLiftedHelper(const remill::Arch *arch,
+                                const FunctionDecl &decl,
+                                const FunctionEntry &entry) {
   const auto native_func = entry.native_to_lifted;
   const auto lifted_func = entry.lifted;
 
-  // Set inlining attributes for lifted function
-  lifted_func->removeFnAttr(llvm::Attribute::NoInline);
-  lifted_func->addFnAttr(llvm::Attribute::InlineHint);
-  lifted_func->addFnAttr(llvm::Attribute::AlwaysInline);
-
   // Get module and context from the lifted function
   auto module = lifted_func->getParent();
   auto &ctx = module->getContext();
 
-  // Declare native function
-  CHECK(native_func->isDeclaration());
-  native_func->removeFnAttr(llvm::Attribute::InlineHint);
-  native_func->removeFnAttr(llvm::Attribute::AlwaysInline);
-  native_func->addFnAttr(llvm::Attribute::NoInline);
+  const auto name = "__anvill_native_to_lifted." + MarshallingKey(decl);
+  if (auto helper = module->getFunction(name); helper) {
+    return helper;
+  }
 
-  // Get arch from the native function
-  CHECK_EQ(arch->context, &ctx);
+  auto pc_reg = arch->RegisterByName(arch->ProgramCounterRegisterName());
 
-  // Create a state structure and a stack frame in the native function
-  // and we'll call the lifted function with that. The lifted function
-  // will get inlined into this function.
-  auto block = llvm::BasicBlock::Create(ctx, "", native_func);
+  const auto native_func_type = native_func->getFunctionType();
+  llvm::SmallVector<llvm::Type *, 8> param_types(
+      native_func_type->param_begin(), native_func_type->param_end());
+  param_types.push_back(lifted_func->getType());
+  param_types.push_back(pc_reg->type);
+
+  const auto helper_type = llvm::FunctionType::get(
+      native_func_type->getReturnType(), param_types, false);
+  const auto helper = llvm::Function::Create(
+      helper_type, llvm::GlobalValue::InternalLinkage, name, module);
+  helper->addFnAttr(llvm::Attribute::InlineHint);
+  helper->addFnAttr(llvm::Attribute::AlwaysInline);
+
+  const auto num_params = native_func_type->getNumParams();
+  const auto callee = remill::NthArgument(helper, num_params);
+  const auto pc = remill::NthArgument(helper, num_params + 1u);
+
+  // Create a state structure and a stack frame in the helper, and we'll
+  // call the lifted function with that.
+  auto block = llvm::BasicBlock::Create(ctx, "", helper);
   llvm::IRBuilder<> ir(block);
 
   // Create a memory pointer.
@@ -222,19 +323,8 @@ static void DefineNativeToLiftedWrapper(const remill::Arch *arch,
   //  });
 
   // Store the program counter into the state.
-  auto pc_reg = arch->RegisterByName(arch->ProgramCounterRegisterName());
   auto pc_reg_ptr = pc_reg->AddressOf(state_ptr, block);
 
-  auto base_pc = module->getGlobalVariable("__anvill_pc");
-  if (!base_pc) {
-    base_pc = new llvm::GlobalVariable(
-        *module, llvm::Type::getInt8Ty(ctx), false,
-        llvm::GlobalValue::ExternalLinkage, nullptr, "__anvill_pc");
-  }
-
-  auto pc = llvm::ConstantExpr::getAdd(
-      llvm::ConstantExpr::getPtrToInt(base_pc, pc_reg->type),
-      llvm::ConstantInt::get(pc_reg->type, decl.address, false));
   ir.SetInsertPoint(block);
   ir.CreateStore(pc, pc_reg_ptr);
 
@@ -269,18 +359,17 @@ static void DefineNativeToLiftedWrapper(const remill::Arch *arch,
 
   // Store the function parameters either into the state struct
   // or into memory (likely the stack).
-  auto arg_index = 0u;
-  for (auto &arg : native_func->args()) {
-    const auto &param_decl = decl.params[arg_index++];
-    mem_ptr = StoreNativeValue(&arg, param_decl, intrinsics, block, state_ptr,
-                               mem_ptr);
+  for (auto i = 0u; i < num_params; ++i) {
+    mem_ptr = StoreNativeValue(remill::NthArgument(helper, i), decl.params[i],
+                               intrinsics, block, state_ptr, mem_ptr);
   }
 
   llvm::Value *lifted_func_args[remill::kNumBlockArgs] = {};
   lifted_func_args[remill::kStatePointerArgNum] = state_ptr;
   lifted_func_args[remill::kMemoryPointerArgNum] = mem_ptr;
   lifted_func_args[remill::kPCArgNum] = pc;
-  auto call_to_lifted_func = ir.CreateCall(lifted_func, lifted_func_args);
+  auto call_to_lifted_func = ir.CreateCall(lifted_func->getFunctionType(),
+                                           callee, lifted_func_args);
   mem_ptr = call_to_lifted_func;
 
   llvm::Value *ret_val = nullptr;
@@ -291,7 +380,7 @@ static void DefineNativeToLiftedWrapper(const remill::Arch *arch,
     ir.SetInsertPoint(block);
 
   } else if (1 < decl.returns.size()) {
-    ret_val = llvm::UndefValue::get(native_func->getReturnType());
+    ret_val = llvm::UndefValue::get(helper->getReturnType());
     auto index = 0u;
     for (auto &ret_decl : decl.returns) {
       auto partial_ret_val =
@@ -312,33 +401,163 @@ static void DefineNativeToLiftedWrapper(const remill::Arch *arch,
   } else {
     ir.CreateRetVoid();
   }
+
+  return helper;
 }
 
-// Define a function that marshals lifted state to native state.
-static void DefineLiftedToNativeWrapper(const FunctionDecl &decl,
+// Define the function that marshals native state to lifted state. The
+// marshalling itself is shared by all functions laid out like `decl`.
+static void DefineNativeToLiftedWrapper(const remill::Arch *arch,
+                                        const FunctionDecl &decl,
                                         const FunctionEntry &entry) {
-  const auto lifted_func = entry.lifted_to_native;
-  CHECK(lifted_func->isDeclaration());
-
-  remill::IntrinsicTable intrinsics(lifted_func->getParent());
+  const auto native_func = entry.native_to_lifted;
+  const auto lifted_func = entry.lifted;
 
-  remill::CloneBlockFunctionInto(lifted_func);
+  // Set inlining attributes for lifted function
   lifted_func->removeFnAttr(llvm::Attribute::NoInline);
   lifted_func->addFnAttr(llvm::Attribute::InlineHint);
   lifted_func->addFnAttr(llvm::Attribute::AlwaysInline);
-  lifted_func->setLinkage(llvm::GlobalValue::InternalLinkage);
 
-  auto mem_ptr = remill::NthArgument(lifted_func, remill::kMemoryPointerArgNum);
-  auto state_ptr =
-      remill::NthArgument(lifted_func, remill::kStatePointerArgNum);
-  auto block = &(lifted_func->getEntryBlock());
+  // Get module and context from the lifted function
+  auto module = lifted_func->getParent();
+  auto &ctx = module->getContext();
+
+  // Declare native function
+  CHECK(native_func->isDeclaration());
+  native_func->removeFnAttr(llvm::Attribute::InlineHint);
+  native_func->removeFnAttr(llvm::Attribute::AlwaysInline);
+  native_func->addFnAttr(llvm::Attribute::NoInline);
+
+  // Get arch from the native function
+  CHECK_EQ(arch->context, &ctx);
+
+  const auto helper = GetOrDefineNativeToLiftedHelper(arch, decl, entry);
+
+  auto pc_reg = arch->RegisterByName(arch->ProgramCounterRegisterName());
+  auto base_pc = module->getGlobalVariable("__anvill_pc");
+  if (!base_pc) {
+    base_pc = new llvm::GlobalVariable(
+        *module, llvm::Type::getInt8Ty(ctx), false,
+        llvm::GlobalValue::ExternalLinkage, nullptr, "__anvill_pc");
+  }
+
+  auto pc = llvm::ConstantExpr::getAdd(
+      llvm::ConstantExpr::getPtrToInt(base_pc, pc_reg->type),
+      llvm::ConstantInt::get(pc_reg->type, decl.address, false));
+
+  llvm::SmallVector<llvm::Value *, 8> helper_args;
+  for (auto &arg : native_func->args()) {
+    helper_args.push_back(&arg);
+  }
+  helper_args.push_back(lifted_func);
+  helper_args.push_back(pc);
+
+  auto block = llvm::BasicBlock::Create(ctx, "", native_func);
+  llvm::IRBuilder<> ir(block);
+  auto ret_val = ir.CreateCall(helper, helper_args);
+  if (native_func->getReturnType()->isVoidTy()) {
+    ir.CreateRetVoid();
+  } else {
+    ir.CreateRet(ret_val);
+  }
+}
+
+// Promote the allocas, and remove the dead instructions, of `func`. This
+// strips the unused parts of the basic block function that `func` was
+// cloned from.
+static void CleanUpWrapperTemplate(llvm::Function *func) {
+  std::vector<llvm::AllocaInst *> allocas;
+  for (auto &inst : func->getEntryBlock()) {
+    if (auto alloca = llvm::dyn_cast<llvm::AllocaInst>(&inst);
+        alloca && llvm::isAllocaPromotable(alloca)) {
+      allocas.push_back(alloca);
+    }
+  }
+
+  if (!allocas.empty()) {
+    llvm::DominatorTree dt(*func);
+    llvm::PromoteMemToReg(allocas, dt);
+  }
+
+  for (auto changed = true; changed;) {
+    changed = false;
+    for (auto &block : *func) {
+      for (auto it = block.begin(); it != block.end();) {
+        auto &inst = *it++;
+        if (llvm::isInstructionTriviallyDead(&inst)) {
+          inst.eraseFromParent();
+          changed = true;
+        }
+      }
+    }
+  }
+}
+
+// Get or define the template of the functions that marshal lifted state to
+// native state for the functions laid out like `decl`. The template calls
+// a placeholder declaration, named like the template but with a `.callee`
+// suffix, in place of the native function.
+static llvm::Function *
+GetOrDefineLiftedToNativeTemplate(const FunctionDecl &decl,
+                                  llvm::Module &module) {
+  const auto name = "__anvill_lifted_to_native." + MarshallingKey(decl);
+  if (auto tpl = module.getFunction(name); tpl) {
+    return tpl;
+  }
+
+  remill::IntrinsicTable intrinsics(&module);
+
+  const auto tpl = remill::DeclareLiftedFunction(&module, name);
+  remill::CloneBlockFunctionInto(tpl);
+  tpl->setLinkage(llvm::GlobalValue::InternalLinkage);
+
+  auto mem_ptr = remill::NthArgument(tpl, remill::kMemoryPointerArgNum);
+  auto state_ptr = remill::NthArgument(tpl, remill::kStatePointerArgNum);
+  auto block = &(tpl->getEntryBlock());
 
   llvm::IRBuilder<> ir(block);
-  auto new_mem_ptr =
-      decl.CallFromLiftedBlock(CreateFunctionName(decl.address), intrinsics,
-                               block, state_ptr, mem_ptr, true);
+  auto new_mem_ptr = decl.CallFromLiftedBlock(
+      name + ".callee", intrinsics, block, state_ptr, mem_ptr, true);
 
   ir.CreateRet(new_mem_ptr);
+  CleanUpWrapperTemplate(tpl);
+  return tpl;
+}
+
+// Define a function that marshals lifted state to native state. The body is
+// cloned from the template shared by all functions laid out like `decl`,
+// with the template's placeholder callee replaced by the native function.
+static void DefineLiftedToNativeWrapper(const FunctionDecl &decl,
+                                        const FunctionEntry &entry) {
+  const auto lifted_func = entry.lifted_to_native;
+  CHECK(lifted_func->isDeclaration());
+
+  auto &module = *lifted_func->getParent();
+  const auto tpl = GetOrDefineLiftedToNativeTemplate(decl, module);
+  const auto tpl_callee = module.getFunction(tpl->getName().str() + ".callee");
+  const auto native_func =
+      decl.DeclareInModule(CreateFunctionName(decl.address), module, true);
+
+  llvm::ValueToValueMapTy value_map;
+  for (auto &arg : tpl->args()) {
+    value_map[&arg] = remill::NthArgument(lifted_func, arg.getArgNo());
+  }
+  value_map[tpl_callee] = native_func;
+
+  llvm::SmallVector<llvm::ReturnInst *, 4> returns;
+#if LLVM_VERSION_NUMBER >= LLVM_VERSION(13, 0)
+  llvm::CloneFunctionInto(lifted_func, tpl, value_map,
+                          llvm::CloneFunctionChangeType::LocalChangesOnly,
+                          returns);
+#else
+  llvm::CloneFunctionInto(lifted_func, tpl, value_map,
+                          false /* ModuleLevelChanges */, returns);
+#endif
+
+  lifted_func->removeFnAttr(llvm::Attribute::NoInline);
+  lifted_func->addFnAttr(llvm::Attribute::InlineHint);
+  lifted_func->addFnAttr(llvm::Attribute::AlwaysInline);
+  lifted_func->setLinkage(llvm::GlobalValue::InternalLinkage);
 }
 
 // Clear out LLVM variable names. They're usually not helpful.
@@ -353,43 +572,935 @@ static void ClearVariableNames(llvm::Function *func) {
   }
 }
 
-// Optimize a function.
-static void OptimizeFunction(llvm::Function *func) {
-  std::vector<llvm::CallInst *> calls_to_inline;
-  for (auto changed = true; changed; changed = !calls_to_inline.empty()) {
-    calls_to_inline.clear();
+// Add the cleanup optimizations run over each lifted function to `fpm`.
+static void AddLegacyCleanupPasses(llvm::legacy::FunctionPassManager &fpm) {
+  fpm.add(llvm::createCFGSimplificationPass());
+  fpm.add(llvm::createPromoteMemoryToRegisterPass());
+  fpm.add(llvm::createReassociatePass());
+  fpm.add(llvm::createDeadStoreEliminationPass());
+  fpm.add(llvm::createDeadCodeEliminationPass());
+  fpm.add(llvm::createSROAPass());
+}
+
+// Add the cleanup optimizations run over each lifted function to `fpm`. This
+// mirrors `AddLegacyCleanupPasses`.
+static void AddNewCleanupPasses(llvm::FunctionPassManager &fpm) {
+  fpm.addPass(llvm::SimplifyCFGPass());
+  fpm.addPass(llvm::PromotePass());
+  fpm.addPass(llvm::ReassociatePass());
+  fpm.addPass(llvm::DSEPass());
+  fpm.addPass(llvm::DCEPass());
+  fpm.addPass(llvm::SROA());
+}
+
+// Returns `true` if `call_inst` is a call that `InlineCallees` can inline.
+static bool IsInlinableCall(llvm::CallInst *call_inst) {
+  const auto called_func = call_inst->getCalledFunction();
+  return called_func && !called_func->isDeclaration() &&
+         !called_func->hasFnAttribute(llvm::Attribute::NoInline);
+}
+
+// Inline the callees of `func`. The calls in `func` seed a work list, and
+// inlining a call only adds the calls that it exposed to the work list, so
+// that `func` is never rescanned.
+//
+// If `inline_budget` is non-zero, then a call is only inlined if doing so
+// keeps `func` within `inline_budget` instructions; other calls are left in
+// place.
+static void InlineCallees(llvm::Function *func, uint64_t inline_budget) {
+  std::vector<llvm::WeakTrackingVH> work_list;
+  for (auto &block : *func) {
+    for (auto &inst : block) {
+      if (auto call_inst = llvm::dyn_cast<llvm::CallInst>(&inst);
+          call_inst && IsInlinableCall(call_inst)) {
+        work_list.emplace_back(call_inst);
+      }
+    }
+  }
+
+  uint64_t num_insts = func->getInstructionCount();
+  auto over_budget = false;
+
+  // NOTE(pag): The work list is processed in order, so that shallower calls
+  //            are inlined before the calls that they expose, which matters
+  //            when the budget runs out.
+  for (size_t i = 0; i < work_list.size(); ++i) {
+    auto call_inst = llvm::dyn_cast_or_null<llvm::CallInst>(work_list[i]);
+    if (!call_inst || !IsInlinableCall(call_inst)) {
+      continue;
+    }
+
+    // The callee may not have been materialized yet if the semantics were
+    // loaded lazily, e.g. from a snapshot.
+    const auto callee = call_inst->getCalledFunction();
+    if (callee->isMaterializable()) {
+      if (auto err = callee->materialize(); remill::IsError(err)) {
+        LOG(ERROR) << "Unable to materialize " << callee->getName().str()
+                   << ": " << remill::GetErrorString(err);
+        continue;
+      }
+    }
+
+    const auto callee_num_insts = callee->getInstructionCount();
+    if (inline_budget && num_insts + callee_num_insts > inline_budget) {
+      over_budget = true;
+      continue;
+    }
+
+    llvm::InlineFunctionInfo info;
+    if (!llvm::InlineFunction(call_inst, info)) {
+      continue;
+    }
+
+    gCallsInlined.Add();
+    num_insts += callee_num_insts;
+    for (auto call_site : info.InlinedCallSites) {
+#if LLVM_VERSION_NUMBER >= LLVM_VERSION(11, 0)
+      work_list.emplace_back(call_site);
+#else
+      work_list.emplace_back(call_site.getInstruction());
+#endif
+    }
+  }
+
+  if (over_budget) {
+    gInlineBudgetsExceeded.Add();
+    LOG(WARNING) << "Function " << func->getName().str()
+                 << " exceeded its inlining budget of " << inline_budget
+                 << " instructions";
+  }
+}
+
+// Optimize a function, inlining its callees and then running the cleanup
+// optimizations of `pipeline` over it.
+static void OptimizeFunction(llvm::Function *func, FunctionPipeline &pipeline,
+                             uint64_t inline_budget) {
+  InlineCallees(func, inline_budget);
+  pipeline.Run(*func);
+  ClearVariableNames(func);
+}
+
+// Returns the budget of each lifted function in `options`.
+static LiftBudget GetLiftBudget(const LiftOptions &options) {
+  LiftBudget budget;
+  budget.max_instructions = options.max_function_instructions;
+  budget.max_blocks = options.max_function_blocks;
+  return budget;
+}
+
+// Returns `true` if any instruction of `func` uses `gv`, possibly through
+// constant expressions.
+static bool UsesGlobal(llvm::Function *func, llvm::GlobalValue *gv) {
+  std::vector<const llvm::User *> users(gv->user_begin(), gv->user_end());
+  std::unordered_set<const llvm::User *> seen;
+  while (!users.empty()) {
+    const auto user = users.back();
+    users.pop_back();
+    if (!seen.insert(user).second) {
+      continue;
+    } else if (auto inst = llvm::dyn_cast<llvm::Instruction>(user); inst) {
+      if (inst->getFunction() == func) {
+        return true;
+      }
+    } else if (llvm::isa<llvm::Constant>(user)) {
+      users.insert(users.end(), user->user_begin(), user->user_end());
+    }
+  }
+  return false;
+}
+
+// The optimized functions of a module, indexed by a structural hash of their
+// lifted code. A function whose lifted code and marshalling are identical to
+// those of an already optimized function is cloned from that function, rather
+// than being optimized itself. Statically linked binaries are full of such
+// functions, e.g. copies of library code.
+//
+// NOTE(pag): Two such functions only differ in the program counter that they
+//            pass to their lifted code, and the program counter is always
+//            relative to `__anvill_pc`, so the clone is the optimized function
+//            with `__anvill_pc` displaced by the distance between the two.
+class OptimizedFunctionIndex {
+ public:
+  // Define the native function of `entry`, whose lifted code hashes to
+  // `hash`, as a clone of an identical optimized function. Returns `false`
+  // if there is no such function.
+  bool CloneIdentical(uint64_t hash, const FunctionDecl &decl,
+                      const FunctionEntry &entry);
+
+  // Add the function of `entry`, whose lifted code hashes to `hash`, and
+  // whose native function has been optimized.
+  void Add(uint64_t hash, const FunctionDecl &decl, const FunctionEntry &entry);
+
+ private:
+  struct Optimized {
+    uint64_t address;
+    std::string marshalling_key;
+    FunctionEntry entry;
+  };
+
+  llvm::GlobalNumberState global_numbers;
+  std::unordered_map<uint64_t, std::vector<Optimized>> functions;
+};
+
+bool OptimizedFunctionIndex::CloneIdentical(uint64_t hash,
+                                            const FunctionDecl &decl,
+                                            const FunctionEntry &entry) {
+  const auto it = functions.find(hash);
+  if (it == functions.end()) {
+    return false;
+  }
+
+  const auto native_func = entry.native_to_lifted;
+  const auto module = native_func->getParent();
+  const auto base_pc = module->getGlobalVariable("__anvill_pc");
+  if (!base_pc || UsesGlobal(entry.lifted, base_pc)) {
+    return false;
+  }
+
+  const auto marshalling_key = MarshallingKey(decl);
+  for (const auto &optimized : it->second) {
+    if (optimized.marshalling_key != marshalling_key ||
+        llvm::FunctionComparator(optimized.entry.lifted, entry.lifted,
+                                 &global_numbers)
+            .compare()) {
+      continue;
+    }
+
+    const auto orig_func = optimized.entry.native_to_lifted;
+    const auto &dl = module->getDataLayout();
+    const auto distance = llvm::ConstantInt::get(
+        llvm::Type::getIntNTy(module->getContext(), dl.getPointerSizeInBits(0)),
+        decl.address - optimized.address, false);
+
+    llvm::ValueToValueMapTy value_map;
+    for (auto &arg : orig_func->args()) {
+      value_map[&arg] = remill::NthArgument(native_func, arg.getArgNo());
+    }
+    value_map[orig_func] = native_func;
+    value_map[optimized.entry.lifted] = entry.lifted;
+    value_map[base_pc] = llvm::ConstantExpr::getGetElementPtr(
+        base_pc->getValueType(), base_pc, distance);
+
+    native_func->deleteBody();
+    llvm::SmallVector<llvm::ReturnInst *, 4> returns;
+#if LLVM_VERSION_NUMBER >= LLVM_VERSION(13, 0)
+    llvm::CloneFunctionInto(native_func, orig_func, value_map,
+                            llvm::CloneFunctionChangeType::LocalChangesOnly,
+                            returns);
+#else
+    llvm::CloneFunctionInto(native_func, orig_func, value_map,
+                            false /* ModuleLevelChanges */, returns);
+#endif
+    return true;
+  }
+
+  return false;
+}
+
+void OptimizedFunctionIndex::Add(uint64_t hash, const FunctionDecl &decl,
+                                 const FunctionEntry &entry) {
+  functions[hash].push_back({decl.address, MarshallingKey(decl), entry});
+}
+
+// Lift `decl`, and define its wrappers, into the module of `lifter`, and
+// then clean up the lifted code with `pipeline`, unless the lifted code is
+// identical to that of a function in `optimized`, in which case the function
+// is cloned from there. If `deps` is non-null, then the inputs consulted
+// while lifting are recorded there. If `callees` is non-null, then the
+// functions called by the lifted code are added to it.
+//
+// Returns `false` if lifting the function exceeded its budget, in which case
+// the function is left as a declaration.
+static bool LiftAndWrapFunction(
+    const remill::Arch *arch, MCToIRLifter &lifter, FunctionPipeline &pipeline,
+    OptimizedFunctionIndex &optimized, const LiftOptions &options,
+    const FunctionDecl &decl, LiftDependencies *deps = nullptr,
+    std::vector<const FunctionDecl *> *callees = nullptr) {
+  gFunctionsLifted.Add();
+  const auto entry = lifter.LiftFunction(decl, deps, callees);
+
+  // NOTE(pag): The wrapper is already defined if an earlier caller of this
+  //            function was pushed by a lifting worker before this function
+  //            was lifted. See `DefineCalleeWrappers`.
+  if (entry.lifted_to_native->isDeclaration()) {
+    DefineLiftedToNativeWrapper(decl, entry);
+  }
+  if (entry.lifted->isDeclaration()) {
+    return false;
+  }
+
+  DefineNativeToLiftedWrapper(arch, decl, entry);
+
+  const auto hash = llvm::FunctionComparator::functionHash(*entry.lifted);
+  if (optimized.CloneIdentical(hash, decl, entry)) {
+    gFunctionsDeduplicated.Add();
+    return true;
+  }
+
+  OptimizeFunction(entry.native_to_lifted, pipeline, options.inline_budget);
+  optimized.Add(hash, decl, entry);
+  return true;
+}
+
+// Functions waiting to be lifted. When lifting from root functions, the
+// callees of lifted functions are added as they are discovered, and so a
+// worker that finds the work list empty waits for the other workers to
+// finish lifting their functions before it gives up.
+class FunctionWorkList {
+ public:
+  explicit FunctionWorkList(const LiftOptions &options)
+      : max_call_depth(options.max_call_depth),
+        lift_callees(options.lift_callees) {}
+
+  // Add `decl`, which is `depth` calls away from a root function, unless it
+  // has already been added.
+  void Add(const FunctionDecl *decl, unsigned depth) {
+    std::lock_guard<std::mutex> locker(lock);
+    AddLocked(decl, depth);
+  }
+
+  // Get the next function to lift, along with its depth. Returns `false`
+  // once every function has been lifted.
+  bool Next(const FunctionDecl *&decl, unsigned &depth) {
+    std::unique_lock<std::mutex> locker(lock);
+    cond.wait(locker, [this] { return !pending.empty() || !num_in_flight; });
+    if (pending.empty()) {
+      return false;
+    }
+
+    std::tie(decl, depth) = pending.front();
+    pending.pop_front();
+    ++num_in_flight;
+    return true;
+  }
+
+  // Mark a function returned by `Next`, at `depth`, as lifted, and add its
+  // `callees` if they are within the call depth limit.
+  void Done(unsigned depth, const std::vector<const FunctionDecl *> &callees) {
+    std::lock_guard<std::mutex> locker(lock);
+    if (lift_callees && (!max_call_depth || depth < max_call_depth)) {
+      for (auto callee : callees) {
+        AddLocked(callee, depth + 1u);
+      }
+    }
+    --num_in_flight;
+    cond.notify_all();
+  }
+
+ private:
+  FunctionWorkList(const FunctionWorkList &) = delete;
+  FunctionWorkList &operator=(const FunctionWorkList &) = delete;
+
+  void AddLocked(const FunctionDecl *decl, unsigned depth) {
+    if (seen.insert(decl->address).second) {
+      pending.emplace_back(decl, depth);
+      cond.notify_one();
+    }
+  }
+
+  const unsigned max_call_depth;
+  const bool lift_callees;
+
+  std::mutex lock;
+  std::condition_variable cond;
+  std::deque<std::pair<const FunctionDecl *, unsigned>> pending;
+  std::unordered_set<uint64_t> seen;
+  size_t num_in_flight{0u};
+};
+
+// Add the root functions of `options` to `work_list`. Returns `false` if
+// there is no declaration for one of the roots.
+static bool AddRootFunctions(const Program &program, const LiftOptions &options,
+                             FunctionWorkList &work_list) {
+  auto ok = true;
+  for (auto addr : options.root_addresses) {
+    if (auto decl = program.FindFunction(addr); decl) {
+      work_list.Add(decl, 0u);
+    } else {
+      LOG(ERROR) << "Missing declaration for root function at " << std::hex
+                 << addr << std::dec;
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+// Find the callees of the function declared by `decl`, whose lifted code
+// was loaded from the lift cache, using the addresses at which functions
+// were looked up while lifting it.
+static void FindCachedCallees(const Program &program, const FunctionDecl &decl,
+                              const LiftDependencies &deps,
+                              std::vector<const FunctionDecl *> &callees) {
+  for (auto addr : deps.function_lookups) {
+    if (addr != decl.address) {
+      if (auto callee = program.FindFunction(addr); callee) {
+        callees.push_back(callee);
+      }
+    }
+  }
+}
+
+// Define the `.lifted_to_native` wrappers of the functions of `decls` that
+// are called from the lifted code in `module`, but that haven't been lifted
+// into `module`, e.g. because another worker lifted them, or because they
+// weren't reachable from a root function. The wrappers call the external
+// native function.
+static void DefineCalleeWrappers(const remill::Arch *arch,
+                                 llvm::ArrayRef<const FunctionDecl *> decls,
+                                 llvm::Module &module) {
+  for (auto decl : decls) {
+    const auto name = CreateFunctionName(decl->address) + ".lifted_to_native";
+    auto func = module.getFunction(name);
+    if (func && func->isDeclaration() && !func->use_empty()) {
+      const auto local_decl = decl->Recontextualize(arch);
+      FunctionEntry entry = {};
+      entry.lifted_to_native = func;
+      DefineLiftedToNativeWrapper(local_decl, entry);
+    }
+  }
+}
+
+// A unit of lifted code, ready to be linked into the destination module.
+// This is either the bitcode of a batch of functions lifted by a worker, or
+// the bitcode of a single lifted function, along with the inputs that were
+// consulted while lifting it, or a function that was loaded from the lift
+// cache.
+struct LiftedCode {
+
+  // If non-null, then `bitcode` is of this function, and is added to the
+  // lift cache before being linked.
+  const FunctionDecl *decl{nullptr};
+  llvm::SmallVector<char, 0> bitcode;
+  LiftDependencies deps;
+
+  // If non-null, then this is the code, loaded from the lift cache.
+  std::unique_ptr<llvm::MemoryBuffer> cached;
+};
+
+// Lifted code that the workers have produced, but that hasn't been linked
+// into the destination module yet. The queue is bounded, so a worker that
+// gets too far ahead of the linking waits. The workers push their code in
+// small batches as it's lifted, so this bounds how much serialized code is
+// held in memory at once.
+//
+// NOTE(pag): Each worker's own module still holds the code that the worker
+//            lifted, as identical functions are cloned from it.
+class LiftedCodeQueue {
+ public:
+  LiftedCodeQueue(unsigned num_producers_, size_t max_size_)
+      : num_producers(num_producers_),
+        max_size(max_size_) {}
+
+  // Add `code` to the queue, waiting for room if the queue is full.
+  void Push(LiftedCode code) {
+    std::unique_lock<std::mutex> locker(lock);
+    cond.wait(locker, [this] { return pending.size() < max_size; });
+    pending.push_back(std::move(code));
+    cond.notify_all();
+  }
+
+  // Mark one of the producers as finished.
+  void Close(void) {
+    std::lock_guard<std::mutex> locker(lock);
+    --num_producers;
+    cond.notify_all();
+  }
+
+  // Get the next unit of lifted code. Returns `false` once every producer
+  // is finished and the queue is empty.
+  bool Pop(LiftedCode &code) {
+    std::unique_lock<std::mutex> locker(lock);
+    cond.wait(locker, [this] { return !pending.empty() || !num_producers; });
+    if (pending.empty()) {
+      return false;
+    }
+
+    code = std::move(pending.front());
+    pending.pop_front();
+    cond.notify_all();
+    return true;
+  }
+
+ private:
+  LiftedCodeQueue(const LiftedCodeQueue &) = delete;
+  LiftedCodeQueue &operator=(const LiftedCodeQueue &) = delete;
+
+  unsigned num_producers;
+  const size_t max_size;
+
+  std::mutex lock;
+  std::condition_variable cond;
+  std::deque<LiftedCode> pending;
+};
+
+// The number of lifted functions that a lifting worker extracts from its
+// module and pushes onto the `LiftedCodeQueue` at once.
+static constexpr size_t kFunctionsPerPush = 16u;
+
+// The state of a worker thread that lifts a shard of the code. The code is
+// serialized to bitcode, and pushed onto a `LiftedCodeQueue`, so that it can
+// cross from the worker's `llvm::LLVMContext` into the context of the
+// destination module.
+struct LiftedShard {
+
+  // The worker's context and architecture. These outlive the worker, because
+  // the instructions decoded by the worker's architecture are shared with
+  // the other workers through the decode cache.
+  std::unique_ptr<llvm::LLVMContext> context;
+  remill::Arch::ArchPtr arch;
+  bool ok{false};
+};
+
+// Returns the names of the functions in `module`, i.e. the semantics, before
+// anything is lifted into it.
+static std::unordered_set<std::string>
+GetPreexistingNames(const llvm::Module &module) {
+  std::unordered_set<std::string> names;
+  for (auto &gv : module.global_values()) {
+    if (gv.hasName()) {
+      names.insert(gv.getName().str());
+    }
+  }
+  return names;
+}
+
+// Returns `true` if the only users of the semantics function `sem` are ISEL
+// variables.
+static bool OnlyUsedByISELs(llvm::Function *sem) {
+  for (auto user : sem->users()) {
+    auto var = llvm::dyn_cast<llvm::GlobalVariable>(user);
+    if (!var || !var->getName().startswith("ISEL_")) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Remove the semantics from `module` that none of the lifted code uses, so
+// that they don't stay resident until `OptimizeModule`. The lifter has already
+// looked up the ISELs of the instructions that it lifted, and the semantics of
+// those instructions are either inlined or still called, so the other ISELs
+// are removed, and then the preexisting (i.e. named in `semantics_names`)
+// definitions that are no longer used are removed. Used functions that haven't
+// been materialized yet, e.g. the callees of semantics that were loaded lazily
+// from a snapshot, are materialized.
+//
+// NOTE(pag): No more code can be lifted into `module` after this, as the
+//            semantics of most instructions are gone.
+static llvm::Error
+PruneUnusedSemantics(llvm::Module &module,
+                     const std::unordered_set<std::string> &semantics_names) {
+  ScopedStatTimer timer("LiftCodeIntoModule.PruneSemantics");
+
+  std::vector<llvm::GlobalVariable *> unused_isels;
+  remill::ForEachISel(
+      &module, [&](llvm::GlobalVariable *isel, llvm::Function *sem) {
+        if (!sem || OnlyUsedByISELs(sem)) {
+          unused_isels.push_back(isel);
+        }
+      });
+
+  for (auto isel : unused_isels) {
+    isel->setInitializer(nullptr);
+    if (isel->use_empty()) {
+      isel->eraseFromParent();
+    }
+  }
+
+  std::vector<llvm::Function *> unused_funcs;
+  for (auto changed = true; changed;) {
+    changed = false;
+    unused_funcs.clear();
+    for (auto &func : module) {
+      if (!semantics_names.count(func.getName().str())) {
+        continue;
+      } else if (func.isMaterializable()) {
+        if (func.use_empty()) {
+          unused_funcs.push_back(&func);
+        } else if (auto err = func.materialize(); err) {
+          return err;
+        } else {
+          changed = true;
+        }
+      } else if (!func.isDeclaration() && func.hasLocalLinkage() &&
+                 func.use_empty()) {
+        unused_funcs.push_back(&func);
+      }
+    }
+
+    for (auto func : unused_funcs) {
+      func->eraseFromParent();
+      changed = true;
+    }
+    gSemanticsPruned.Add(unused_funcs.size());
+  }
+
+  return llvm::Error::success();
+}
+
+// Add the functions with local linkage that `val` references, directly or
+// through constants and variables with local linkage, to `used`.
+static void CollectLocalUses(llvm::Value *val,
+                             std::vector<llvm::Function *> &used,
+                             std::unordered_set<llvm::Value *> &seen) {
+  if (!seen.insert(val).second) {
+    return;
+
+  } else if (auto func = llvm::dyn_cast<llvm::Function>(val); func) {
+    if (func->hasLocalLinkage()) {
+      used.push_back(func);
+    }
+
+  } else if (auto var = llvm::dyn_cast<llvm::GlobalVariable>(val); var) {
+    if (var->hasLocalLinkage() && var->hasInitializer()) {
+      CollectLocalUses(var->getInitializer(), used, seen);
+    }
+
+  } else if (auto c = llvm::dyn_cast<llvm::Constant>(val); c) {
+    for (auto &op : c->operands()) {
+      CollectLocalUses(op.get(), used, seen);
+    }
+  }
+}
+
+// Materialize the functions with local linkage that `funcs` use, e.g. the
+// callees of semantics that were loaded lazily from a snapshot, so that
+// they can be extracted along with `funcs`.
+static llvm::Error
+MaterializeLocalUses(llvm::ArrayRef<llvm::Function *> funcs) {
+  std::vector<llvm::Function *> work_list(funcs.begin(), funcs.end());
+  std::unordered_set<llvm::Value *> seen(funcs.begin(), funcs.end());
+
+  while (!work_list.empty()) {
+    const auto func = work_list.back();
+    work_list.pop_back();
+    if (func->isMaterializable()) {
+      if (auto err = func->materialize(); err) {
+        return err;
+      }
+    }
 
     for (auto &block : *func) {
       for (auto &inst : block) {
-        if (auto call_inst = llvm::dyn_cast<llvm::CallInst>(&inst); call_inst) {
-          if (auto called_func = call_inst->getCalledFunction();
-              called_func && !called_func->isDeclaration() &&
-              !called_func->hasFnAttribute(llvm::Attribute::NoInline)) {
-            calls_to_inline.push_back(call_inst);
-          }
+        for (auto &op : inst.operands()) {
+          CollectLocalUses(op.get(), work_list, seen);
         }
       }
     }
+  }
+
+  return llvm::Error::success();
+}
 
-    for (auto call_inst : calls_to_inline) {
-      llvm::InlineFunctionInfo info;
-      llvm::InlineFunction(call_inst, info);
+// Extract the functions lifted into `module` by `lifted_funcs` out of
+// `module`, serialize them to bitcode, and push them onto `queue`. The calls
+// to the functions of `callees` that haven't been lifted into `module` yet go
+// through wrappers that call the external native functions. If
+// `split_functions` is `true`, then each function is pushed on its own, so
+// that it can be cached, and otherwise the functions are pushed together.
+static llvm::Error
+PushLiftedFunctions(const remill::Arch *arch, llvm::Module &module,
+                    std::vector<LiftedCode> &lifted_funcs,
+                    std::vector<const FunctionDecl *> &callees,
+                    bool split_functions, LiftedCodeQueue &queue) {
+  ScopedStatTimer timer("LiftCodeIntoModule.Push");
+
+  DefineCalleeWrappers(arch, callees, module);
+  callees.clear();
+
+  std::vector<llvm::Function *> funcs;
+  for (const auto &lifted_func : lifted_funcs) {
+    const auto name = CreateFunctionName(lifted_func.decl->address);
+    funcs.push_back(module.getFunction(name));
+
+    // NOTE(pag): The lifted function is usually inlined into its native
+    //            function, but is kept defined for later identical functions
+    //            to be compared against.
+    if (auto func = module.getFunction(name + ".lifted");
+        !split_functions && func && !func->isDeclaration()) {
+      funcs.push_back(func);
     }
   }
 
-  // Initialize cleanup optimizations
-  llvm::legacy::FunctionPassManager fpm(func->getParent());
-  fpm.add(llvm::createCFGSimplificationPass());
-  fpm.add(llvm::createPromoteMemoryToRegisterPass());
-  fpm.add(llvm::createReassociatePass());
-  fpm.add(llvm::createDeadStoreEliminationPass());
-  fpm.add(llvm::createDeadCodeEliminationPass());
-  fpm.add(llvm::createSROAPass());
-  fpm.doInitialization();
-  fpm.run(*func);
-  fpm.doFinalization();
+  if (auto err = MaterializeLocalUses(funcs); err) {
+    return err;
+  }
 
-  ClearVariableNames(func);
+  const std::vector<const llvm::GlobalValue *> defs(funcs.begin(), funcs.end());
+
+  if (split_functions) {
+    for (auto i = 0u; i < lifted_funcs.size(); ++i) {
+      auto &lifted_func = lifted_funcs[i];
+      auto extracted = ExtractDefinitions(module, {defs[i]});
+      llvm::raw_svector_ostream os(lifted_func.bitcode);
+      llvm::WriteBitcodeToFile(*extracted, os);
+      queue.Push(std::move(lifted_func));
+    }
+
+  } else if (!defs.empty()) {
+    auto extracted = ExtractDefinitions(module, defs);
+    LiftedCode batch_code;
+    llvm::raw_svector_ostream os(batch_code.bitcode);
+    llvm::WriteBitcodeToFile(*extracted, os);
+    queue.Push(std::move(batch_code));
+  }
+
+  lifted_funcs.clear();
+  return llvm::Error::success();
+}
+
+// Worker thread for parallel lifting. Each worker owns its own LLVM context,
+// architecture, semantics module, and lifter, and pulls function declarations
+// off of the shared `work_list` until they have all been lifted. The workers
+// share decoded instructions through `decode_cache`. The lifted code is
+// pushed onto `queue`, to be linked by the main thread, every
+// `kFunctionsPerPush` functions. If lifted functions are to be cached, then
+// each lifted function is extracted into its own module.
+//
+// When lifting from root functions, the callees of each lifted function are
+// added to `work_list`, and the lift cache, if any, is consulted as functions
+// are reached, rather than up-front.
+static void LiftShard(const remill::Arch *main_arch, const Program &program,
+                      const LiftOptions &options, DecodeCache &decode_cache,
+                      FunctionWorkList &work_list, LiftedCodeQueue &queue,
+                      LiftedShard &shard) {
+  ScopedStatTimer timer("LiftCodeIntoModule.Worker");
+  shard.context.reset(new llvm::LLVMContext);
+  shard.arch = remill::Arch::Build(shard.context.get(), main_arch->os_name,
+                                   main_arch->arch_name);
+  const auto &arch = shard.arch;
+  if (!arch) {
+    LOG(ERROR) << "Unable to build architecture for lifting worker";
+    return;
+  }
+
+  // NOTE(pag): Loading the semantics lazily from a snapshot means that each
+  //            worker only materializes the semantics of the instructions
+  //            that it lifts.
+  auto maybe_semantics =
+      LoadSemantics(arch.get(), options.semantics_snapshot_dir);
+  if (remill::IsError(maybe_semantics)) {
+    LOG(ERROR) << "Unable to load semantics for lifting worker: "
+               << remill::GetErrorString(maybe_semantics);
+    return;
+  }
+
+  auto semantics = std::move(remill::GetReference(maybe_semantics));
+
+  auto lifter = std::make_unique<MCToIRLifter>(
+      arch.get(), program, *semantics, &decode_cache, GetLiftBudget(options));
+  FunctionPipeline pipeline(*semantics, options.pass_manager,
+                            AddLegacyCleanupPasses, AddNewCleanupPasses);
+  OptimizedFunctionIndex optimized;
+  const auto split_functions = options.cache != nullptr;
+
+  for (auto decl : program.Variables()) {
+    decl->DeclareInModule(CreateVariableName(decl->address), *semantics);
+  }
+
+  const auto find_callees = !options.root_addresses.empty();
+  const auto cache = find_callees ? options.cache : nullptr;
+
+  const FunctionDecl *decl = nullptr;
+  unsigned depth = 0u;
+  std::vector<const FunctionDecl *> callees;
+  std::vector<const FunctionDecl *> batch_callees;
+  std::vector<LiftedCode> lifted_funcs;
+
+  auto push_lifted_funcs = [&](void) {
+    if (auto err = PushLiftedFunctions(arch.get(), *semantics, lifted_funcs,
+                                       batch_callees, split_functions, queue);
+        remill::IsError(err)) {
+      LOG(ERROR) << "Unable to extract code of lifting worker: "
+                 << remill::GetErrorString(err);
+      return false;
+    }
+    return true;
+  };
+
+  while (work_list.Next(decl, depth)) {
+    callees.clear();
+
+    if (cache) {
+      LiftDependencies cached_deps;
+      if (auto cached_func = cache->Load(*decl, &cached_deps); cached_func) {
+        gCacheHits.Add();
+        FindCachedCallees(program, *decl, cached_deps, callees);
+        LiftedCode cached_code;
+        cached_code.cached = std::move(cached_func);
+        queue.Push(std::move(cached_code));
+        work_list.Done(depth, callees);
+        continue;
+      }
+      gCacheMisses.Add();
+    }
+
+    // NOTE(pag): Functions that exceeded their budget aren't cached, as
+    //            the budget isn't part of the key of a cache entry.
+    const auto local_decl = decl->Recontextualize(arch.get());
+    auto &lifted_func = lifted_funcs.emplace_back();
+    lifted_func.decl = decl;
+    if (!LiftAndWrapFunction(arch.get(), *lifter, pipeline, optimized,
+                             options, local_decl,
+                             split_functions ? &(lifted_func.deps) : nullptr,
+                             &callees)) {
+      lifted_funcs.pop_back();
+    }
+
+    batch_callees.insert(batch_callees.end(), callees.begin(), callees.end());
+    if (!find_callees) {
+      callees.clear();
+    }
+    work_list.Done(depth, callees);
+
+    if (lifted_funcs.size() >= kFunctionsPerPush && !push_lifted_funcs()) {
+      return;
+    }
+  }
+
+  shard.ok = push_lifted_funcs();
+}
+
+// Parse the lifted `bitcode` and link it into `module`.
+static bool LinkLiftedBitcode(llvm::Module &module, llvm::StringRef bitcode,
+                              llvm::StringRef name) {
+  llvm::MemoryBufferRef buff(bitcode, name);
+  auto maybe_lifted_module = llvm::parseBitcodeFile(buff, module.getContext());
+  if (remill::IsError(maybe_lifted_module)) {
+    LOG(ERROR) << "Unable to parse " << name.str() << ": "
+               << remill::GetErrorString(maybe_lifted_module);
+    return false;
+  }
+
+  if (llvm::Linker::linkModules(
+          module, std::move(remill::GetReference(maybe_lifted_module)))) {
+    LOG(ERROR) << "Unable to link " << name.str() << " into module";
+    return false;
+  }
+
+  return true;
+}
+
+// Lift all functions in `program`, or those reachable from the root
+// functions of `options`, into `module` using `options.num_jobs` worker
+// threads, linking the lifted code into `module` as the workers produce it.
+// If `options.cache` is non-null, then functions with valid entries in the
+// cache are loaded from there instead of being lifted, and the newly lifted
+// functions are added to the cache.
+static bool LiftCodeIntoModuleInParallel(const remill::Arch *arch,
+                                         const Program &program,
+                                         llvm::Module &module,
+                                         const LiftOptions &options) {
+  const auto cache = options.cache;
+  const auto from_roots = !options.root_addresses.empty();
+  const auto all_decls = program.Functions();
+
+  FunctionWorkList work_list(options);
+  auto ok = true;
+
+  std::vector<const FunctionDecl *> decls;
+  std::vector<std::unique_ptr<llvm::MemoryBuffer>> cached_funcs;
+  if (from_roots) {
+    ok = AddRootFunctions(program, options, work_list);
+    decls.assign(all_decls.begin(), all_decls.end());
+
+  } else if (cache) {
+    ScopedStatTimer timer("LiftCodeIntoModule.LoadCache");
+    for (auto decl : all_decls) {
+      if (auto cached_func = cache->Load(*decl); cached_func) {
+        cached_funcs.push_back(std::move(cached_func));
+        gCacheHits.Add();
+      } else {
+        decls.push_back(decl);
+        gCacheMisses.Add();
+      }
+    }
+
+    DLOG(INFO) << "Loaded " << cached_funcs.size()
+               << " functions from the lift cache, lifting " << decls.size()
+               << " functions";
+  } else {
+    decls.assign(all_decls.begin(), all_decls.end());
+  }
+
+  // NOTE(pag): When lifting from root functions, `decls` are the functions
+  //            that might be lifted, and the lift cache is consulted by the
+  //            workers as they reach functions.
+  if (!from_roots) {
+    for (auto decl : decls) {
+      work_list.Add(decl, 0u);
+    }
+  }
+
+  const auto num_jobs = std::min<unsigned>(
+      std::max(1u, options.num_jobs), std::max<size_t>(1u, decls.size()));
+
+  // NOTE(pag): The queue holds a few units of lifted code per worker, so that
+  //            the workers rarely wait on the linking.
+  DecodeCache decode_cache;
+  std::vector<LiftedShard> shards(num_jobs);
+  std::vector<std::thread> workers;
+  LiftedCodeQueue queue(decls.empty() ? 0u : num_jobs, 4u * num_jobs);
+  workers.reserve(num_jobs);
+
+  if (!decls.empty()) {
+    for (auto i = 0u; i < num_jobs; ++i) {
+      workers.emplace_back([&, i](void) {
+        LiftShard(arch, program, options, decode_cache, work_list, queue,
+                  shards[i]);
+        queue.Close();
+      });
+    }
+  } else {
+    for (auto &shard : shards) {
+      shard.ok = true;
+    }
+  }
+
+  // Link the functions that were loaded from the cache up-front while the
+  // workers lift, and then the workers' code as it's produced.
+  ScopedStatTimer timer("LiftCodeIntoModule.Link");
+  for (auto &cached_func : cached_funcs) {
+    ok = LinkLiftedBitcode(module, cached_func->getBuffer(),
+                           cached_func->getBufferIdentifier()) &&
+         ok;
+  }
+  cached_funcs.clear();
+
+  LiftedCode code;
+  while (queue.Pop(code)) {
+    if (code.cached) {
+      ok = LinkLiftedBitcode(module, code.cached->getBuffer(),
+                             code.cached->getBufferIdentifier()) &&
+           ok;
+      continue;
+    }
+
+    const llvm::StringRef bitcode(code.bitcode.data(), code.bitcode.size());
+    if (!code.decl) {
+      ok = LinkLiftedBitcode(module, bitcode, "anvill-lifted-shard") && ok;
+      continue;
+    }
+
+    const auto decl = code.decl;
+    if (auto err = cache->Store(*decl, code.deps, bitcode); err) {
+      LOG(WARNING) << "Unable to cache lifted function at " << std::hex
+                   << decl->address << std::dec << ": "
+                   << llvm::toString(std::move(err));
+    }
+
+    ok = LinkLiftedBitcode(module, bitcode, "anvill-lifted-function") && ok;
+  }
+
+  for (auto &worker : workers) {
+    worker.join();
+  }
+
+  for (auto &shard : shards) {
+    ok = shard.ok && ok;
+  }
+
+  return ok;
 }
 
 }  // namespace
@@ -484,31 +1595,75 @@ llvm::Value *LoadLiftedValue(const ValueDecl &decl,
 }
 
 bool LiftCodeIntoModule(const remill::Arch *arch, const Program &program,
-                        llvm::Module &module) {
+                        llvm::Module &module, const LiftOptions &options) {
   DLOG(INFO) << "LiftCodeIntoModule";
 
-  // Create our lifter
-  MCToIRLifter lifter(arch, program, module);
+  std::unordered_set<std::string> semantics_names;
+  if (options.prune_semantics) {
+    semantics_names = GetPreexistingNames(module);
+  }
 
   // Declare global variables.
-  program.ForEachVariable([&](const anvill::GlobalVarDecl *decl) {
+  for (auto decl : program.Variables()) {
     decl->DeclareInModule(anvill::CreateVariableName(decl->address), module);
-    return true;
-  });
+  }
+
+  auto ok = true;
 
   // Lift functions.
-  program.ForEachFunction([&](const FunctionDecl *decl) {
-    const auto entry = lifter.LiftFunction(*decl);
-    DefineNativeToLiftedWrapper(arch, *decl, entry);
-    DefineLiftedToNativeWrapper(*decl, entry);
-    OptimizeFunction(entry.native_to_lifted);
-    return true;
-  });
+  if (1u < options.num_jobs || options.cache) {
+
+    // NOTE(pag): The workers all read from `program` at the same time.
+    program.Freeze();
+    ok = LiftCodeIntoModuleInParallel(arch, program, module, options);
+
+  } else if (!options.root_addresses.empty()) {
+    MCToIRLifter lifter(arch, program, module, nullptr,
+                        GetLiftBudget(options));
+    FunctionPipeline pipeline(module, options.pass_manager,
+                              AddLegacyCleanupPasses, AddNewCleanupPasses);
+    OptimizedFunctionIndex optimized;
+    FunctionWorkList work_list(options);
+    ok = AddRootFunctions(program, options, work_list);
+
+    const FunctionDecl *decl = nullptr;
+    unsigned depth = 0u;
+    std::vector<const FunctionDecl *> callees;
+    while (work_list.Next(decl, depth)) {
+      callees.clear();
+      LiftAndWrapFunction(arch, lifter, pipeline, optimized, options, *decl,
+                          nullptr, &callees);
+      work_list.Done(depth, callees);
+    }
+
+    // Calls to functions that weren't reached go through wrappers that call
+    // the declarations of the native functions.
+    DefineCalleeWrappers(arch, program.Functions(), module);
+
+  } else {
+    MCToIRLifter lifter(arch, program, module, nullptr,
+                        GetLiftBudget(options));
+    FunctionPipeline pipeline(module, options.pass_manager,
+                              AddLegacyCleanupPasses, AddNewCleanupPasses);
+    OptimizedFunctionIndex optimized;
+    for (auto decl : program.Functions()) {
+      LiftAndWrapFunction(arch, lifter, pipeline, optimized, options, *decl);
+    }
+  }
+
+  if (options.prune_semantics) {
+    if (auto err = PruneUnusedSemantics(module, semantics_names);
+        remill::IsError(err)) {
+      LOG(ERROR) << "Unable to prune semantics: "
+                 << remill::GetErrorString(err);
+      ok = false;
+    }
+  }
 
   // Verify the module
   CHECK(remill::VerifyModule(&module));
 
-  return true;
+  return ok;
 }
 
 }  // namespace anvill
@@ -0,0 +1,328 @@
+/*
+ * Copyright (c) 2020 Trail of Bits, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "anvill/LiftCache.h"
+
+#include <glog/logging.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/SHA1.h>
+#include <llvm/Support/raw_ostream.h>
+#include <remill/Arch/Arch.h>
+#include <remill/Arch/Name.h>
+#include <remill/OS/OS.h>
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "anvill/Decl.h"
+#include "anvill/MCToIRLifter.h"
+#include "anvill/Program.h"
+#include "anvill/Version.h"
+
+namespace anvill {
+namespace {
+
+// Bump this whenever the lifter changes in a way that changes its output.
+static constexpr uint32_t kLiftCacheVersion = 9u;
+
+static constexpr char kLiftCacheMagic[8] = {'A', 'N', 'V', 'L',
+                                            'L', 'I', 'F', 'T'};
+
+// The header of an entry in the lift cache. It is followed by the decoded
+// instruction addresses, the function lookup addresses, and the address and
+// size of each data read, as arrays of `uint64_t`, and then by the bitcode.
+struct LiftCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t num_decoded_addresses;
+  uint32_t num_function_lookups;
+  uint32_t num_data_reads;
+  char deps_hash[40];
+};
+
+static_assert(sizeof(LiftCacheHeader) == 64,
+              "Unexpected padding in lift cache header");
+
+static std::string Hash(llvm::StringRef data) {
+  return llvm::toHex(llvm::SHA1::hash(llvm::arrayRefFromStringRef(data)),
+                     true /* LowerCase */);
+}
+
+template <typename T>
+static void SortAndUnique(std::vector<T> &addrs) {
+  std::sort(addrs.begin(), addrs.end());
+  addrs.erase(std::unique(addrs.begin(), addrs.end()), addrs.end());
+}
+
+}  // namespace
+
+LiftCache::LiftCache(const std::string &dir_, const remill::Arch *arch_,
+                     const Program &program_, const llvm::DataLayout &dl_)
+    : dir(dir_),
+      arch(arch_),
+      program(program_),
+      dl(dl_) {}
+
+// Open the cache in the directory `dir`, creating the directory if it
+// doesn't already exist.
+llvm::Expected<std::unique_ptr<LiftCache>>
+LiftCache::Open(const std::string &dir, const remill::Arch *arch,
+                const Program &program, const llvm::DataLayout &dl) {
+#if !__has_include(<llvm/Support/JSON.h>)
+  return llvm::createStringError(
+      std::make_error_code(std::errc::not_supported),
+      "The lift cache needs LLVM's JSON support to serialize declarations");
+#endif
+
+  if (auto ec = llvm::sys::fs::create_directories(dir); ec) {
+    return llvm::createStringError(ec, "Unable to create lift cache '%s'",
+                                   dir.c_str());
+  }
+
+  return std::unique_ptr<LiftCache>(new LiftCache(dir, arch, program, dl));
+}
+
+// Returns the path to the entry for `decl`.
+std::string LiftCache::EntryPath(const FunctionDecl &decl) const {
+  std::string material;
+  llvm::raw_string_ostream os(material);
+  os << "anvill-lift-cache:" << kLiftCacheVersion << ';'
+     << LLVM_VERSION_STRING << ';' << Version::GetVersionString() << ';'
+     << Version::GetCommitHash() << ';' << remill::GetArchName(arch->arch_name)
+     << ';' << remill::GetOSName(arch->os_name) << ';'
+     << decl.num_bytes_in_redzone << ';';
+  {
+    std::lock_guard<std::mutex> locker(dl_lock);
+    ANVILL_WITH_JSON(os << llvm::json::Value(decl.SerializeToJSON(dl));)
+  }
+  os.flush();
+
+  llvm::SmallString<256> path(dir);
+  llvm::sys::path::append(path, Hash(material) + ".lift");
+  return path.str().str();
+}
+
+// Hash the current state of the dependencies in `deps`. This mirrors what
+// the lifter reads when decoding an instruction: bytes are read up until the
+// first non-executable byte, or the maximum instruction size, and then the
+// targets in the extended metadata of the instruction's first byte.
+std::string LiftCache::HashDependencies(const LiftDependencies &deps) const {
+  const auto max_inst_size = arch->MaxInstructionSize();
+
+  std::string material;
+  llvm::raw_string_ostream os(material);
+
+  for (auto addr : deps.decoded_addresses) {
+    os << 'I' << addr << ':';
+    for (auto i = 0u; i < max_inst_size; ++i) {
+      const auto byte = program.FindByte(addr + i);
+      if (!byte.IsExecutable()) {
+        os << (byte ? 'r' : '-');
+        break;
+      }
+      os << static_cast<unsigned>(byte.ValueOr(0)) << ',';
+    }
+    if (auto ext_meta = program.FindExtendedMeta(addr); ext_meta) {
+      os << 'T';
+      for (auto target : ext_meta->targets) {
+        os << target << ',';
+      }
+    }
+    os << ';';
+  }
+
+  for (auto addr : deps.function_lookups) {
+    os << 'F' << addr << ':';
+    if (auto decl = program.FindFunction(addr); decl) {
+      os << decl->num_bytes_in_redzone << ',';
+      std::lock_guard<std::mutex> locker(dl_lock);
+      ANVILL_WITH_JSON(os << llvm::json::Value(decl->SerializeToJSON(dl));)
+    } else {
+      os << '-';
+    }
+    os << ';';
+  }
+
+  for (auto [addr, size] : deps.data_reads) {
+    os << 'D' << addr << ':';
+    const auto vars = program.VariablesInRange(addr, addr + size);
+    auto next_var = vars.begin();
+    for (auto i = 0u; i < size; ++i) {
+      const auto byte = program.FindByte(addr + i);
+      if (!byte) {
+        os << '-';
+      } else if (byte.IsWriteable()) {
+        os << 'w';
+      } else {
+        os << static_cast<unsigned>(byte.ValueOr(0)) << ',';
+      }
+      if (next_var != vars.end() && (*next_var)->address == (addr + i)) {
+        os << 'v';
+        ++next_var;
+      }
+    }
+    os << ';';
+  }
+
+  os.flush();
+  return Hash(material);
+}
+
+// Return the cached bitcode of the function declared by `decl`, or `nullptr`
+// if there is no entry, or if the entry is stale. If `deps_out` is non-null,
+// then the dependencies of a valid entry are stored there.
+std::unique_ptr<llvm::MemoryBuffer>
+LiftCache::Load(const FunctionDecl &decl, LiftDependencies *deps_out) const {
+  const auto path = EntryPath(decl);
+  auto maybe_buff = llvm::MemoryBuffer::getFile(path, -1, false);
+  if (!maybe_buff) {
+    return nullptr;
+  }
+
+  const auto data = maybe_buff.get()->getBuffer();
+  LiftCacheHeader header = {};
+  if (data.size() < sizeof(header)) {
+    LOG(WARNING) << "Ignoring truncated lift cache entry " << path;
+    return nullptr;
+  }
+
+  memcpy(&header, data.data(), sizeof(header));
+  if (memcmp(header.magic, kLiftCacheMagic, sizeof(kLiftCacheMagic)) ||
+      header.version != kLiftCacheVersion) {
+    LOG(WARNING) << "Ignoring lift cache entry " << path
+                 << " with an unsupported format";
+    return nullptr;
+  }
+
+  const auto num_addrs = static_cast<uint64_t>(header.num_decoded_addresses) +
+                         static_cast<uint64_t>(header.num_function_lookups) +
+                         2u * static_cast<uint64_t>(header.num_data_reads);
+  const auto bitcode_offset = sizeof(header) + num_addrs * sizeof(uint64_t);
+  if (data.size() <= bitcode_offset) {
+    LOG(WARNING) << "Ignoring truncated lift cache entry " << path;
+    return nullptr;
+  }
+
+  LiftDependencies deps;
+  deps.decoded_addresses.resize(header.num_decoded_addresses);
+  deps.function_lookups.resize(header.num_function_lookups);
+  deps.data_reads.resize(header.num_data_reads);
+
+  auto addrs = data.data() + sizeof(header);
+  memcpy(deps.decoded_addresses.data(), addrs,
+         deps.decoded_addresses.size() * sizeof(uint64_t));
+  addrs += deps.decoded_addresses.size() * sizeof(uint64_t);
+  memcpy(deps.function_lookups.data(), addrs,
+         deps.function_lookups.size() * sizeof(uint64_t));
+  addrs += deps.function_lookups.size() * sizeof(uint64_t);
+  for (auto &[addr, size] : deps.data_reads) {
+    memcpy(&addr, addrs, sizeof(uint64_t));
+    memcpy(&size, addrs + sizeof(uint64_t), sizeof(uint64_t));
+    addrs += 2u * sizeof(uint64_t);
+  }
+
+  // The function's code, or one of its callees, has changed.
+  const auto deps_hash = HashDependencies(deps);
+  if (llvm::StringRef(header.deps_hash, sizeof(header.deps_hash)) !=
+      deps_hash) {
+    return nullptr;
+  }
+
+  if (deps_out) {
+    *deps_out = std::move(deps);
+  }
+
+  return llvm::MemoryBuffer::getMemBufferCopy(data.substr(bitcode_offset),
+                                              path);
+}
+
+// Store the `bitcode` of the function declared by `decl`, which depends on
+// the inputs in `deps`.
+//
+// NOTE(pag): The entry is written to a temporary file that is then renamed,
+//            so that concurrent runs never observe partially written entries.
+llvm::Error LiftCache::Store(const FunctionDecl &decl,
+                             const LiftDependencies &deps_,
+                             llvm::StringRef bitcode) const {
+  LiftDependencies deps = deps_;
+  SortAndUnique(deps.decoded_addresses);
+  SortAndUnique(deps.function_lookups);
+  SortAndUnique(deps.data_reads);
+
+  const auto deps_hash = HashDependencies(deps);
+
+  LiftCacheHeader header = {};
+  memcpy(header.magic, kLiftCacheMagic, sizeof(kLiftCacheMagic));
+  header.version = kLiftCacheVersion;
+  header.num_decoded_addresses =
+      static_cast<uint32_t>(deps.decoded_addresses.size());
+  header.num_function_lookups =
+      static_cast<uint32_t>(deps.function_lookups.size());
+  header.num_data_reads = static_cast<uint32_t>(deps.data_reads.size());
+  CHECK_EQ(deps_hash.size(), sizeof(header.deps_hash));
+  memcpy(header.deps_hash, deps_hash.data(), sizeof(header.deps_hash));
+
+  llvm::SmallString<256> tmp_model(dir);
+  llvm::sys::path::append(tmp_model, "%%%%%%%%%%%%.tmp");
+
+  int fd = -1;
+  llvm::SmallString<256> tmp_path;
+  if (auto ec = llvm::sys::fs::createUniqueFile(tmp_model, fd, tmp_path); ec) {
+    return llvm::createStringError(
+        ec, "Unable to create temporary file in lift cache '%s'", dir.c_str());
+  }
+
+  {
+    llvm::raw_fd_ostream os(fd, true /* shouldClose */);
+    os.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    os.write(reinterpret_cast<const char *>(deps.decoded_addresses.data()),
+             deps.decoded_addresses.size() * sizeof(uint64_t));
+    os.write(reinterpret_cast<const char *>(deps.function_lookups.data()),
+             deps.function_lookups.size() * sizeof(uint64_t));
+    for (auto [addr, size] : deps.data_reads) {
+      os.write(reinterpret_cast<const char *>(&addr), sizeof(addr));
+      os.write(reinterpret_cast<const char *>(&size), sizeof(size));
+    }
+    os << bitcode;
+    os.close();
+
+    if (os.has_error()) {
+      os.clear_error();
+      llvm::sys::fs::remove(tmp_path);
+      return llvm::createStringError(
+          std::make_error_code(std::errc::io_error),
+          "Unable to write lift cache entry for function at %lx",
+          decl.address);
+    }
+  }
+
+  const auto path = EntryPath(decl);
+  if (auto ec = llvm::sys::fs::rename(tmp_path, path); ec) {
+    llvm::sys::fs::remove(tmp_path);
+    return llvm::createStringError(ec, "Unable to create lift cache entry '%s'",
+                                   path.c_str());
+  }
+
+  return llvm::Error::success();
+}
+
+}  // namespace anvill
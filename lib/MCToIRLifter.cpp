@@ -18,22 +18,169 @@
 #include "anvill/MCToIRLifter.h"
 
 #include <glog/logging.h>
+#include <llvm/ADT/APInt.h>
+#include <llvm/ADT/Twine.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/Instructions.h>
 #include <remill/BC/Util.h>
 
+#include <algorithm>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <unordered_set>
+
+#include "anvill/DecodeCache.h"
 #include "anvill/Decl.h"
 #include "anvill/Program.h"
+#include "anvill/Stats.h"
 #include "anvill/Util.h"
 
 namespace anvill {
+namespace {
+
+static StatCounter gInstructionsDecoded("lift.instructions_decoded");
+static StatCounter gDecodeCacheHits("lift.decode_cache_hits");
+static StatCounter gDecodeFailures("lift.decode_failures");
+static StatCounter gBlocksCreated("lift.blocks_created");
+static StatCounter gBlocksSplit("lift.blocks_split");
+static StatCounter gBudgetsExceeded("lift.budgets_exceeded");
+static StatCounter gDevirtualizedJumps("lift.devirtualized_jumps");
+static StatCounter gDevirtualizedCalls("lift.devirtualized_calls");
+static StatCounter gJumpTablesResolved("lift.jump_tables_resolved");
+static StatCounter gFragmentsLifted("lift.fragments_lifted");
+static StatCounter gFragmentsStamped("lift.fragments_stamped");
+static StatCounter gFragmentsUnstampable("lift.fragments_unstampable");
+
+// Maximum number of entries read from any one jump table.
+static constexpr uint64_t kMaxJumpTableEntries = 1024u;
+
+// Maximum distance, in bytes, between an indirect jump and any target that
+// is recovered from its jump table. The targets of a real jump table are in
+// the same function as the jump, and so a farther target means that the
+// table has ended, or that it wasn't a jump table to begin with.
+static constexpr uint64_t kMaxJumpTableTargetDistance = 1u << 20u;
+
+// Returns the address operand of the indirect jump `inst` if it looks like
+// it reads an absolute jump table with `entry_size`-byte entries, i.e.
+// `[index * entry_size + table]`, or `nullptr`.
+static const remill::Operand::Address *
+FindJumpTableOperand(const remill::Instruction &inst, uint64_t entry_size) {
+  const remill::Operand::Address *table_op = nullptr;
+  for (const auto &op : inst.operands) {
+    if (op.type != remill::Operand::kTypeAddress) {
+      continue;
+    }
+
+    const auto &addr = op.addr;
+    const auto &seg_name = addr.segment_base_reg.name;
+    if (!addr.base_reg.name.empty() || addr.index_reg.name.empty() ||
+        addr.scale != static_cast<int64_t>(entry_size) ||
+        !addr.displacement || seg_name == "FS_BASE" || seg_name == "GS_BASE"
+        || table_op) {
+      return nullptr;
+    }
+
+    table_op = &addr;
+  }
+  return table_op;
+}
+
+// Compare the code lifted into `a` from the instruction at `a_pc` with the
+// code lifted into `b` from the same bytes at `b_pc`. Returns `true` if they
+// only differ in integer constants that differ by `b_pc - a_pc`, whose
+// operands are added to `pc_ops`, and if the code in `a` only uses
+// constants, arguments, and named values of the entry block, which are added
+// to `entry_values`, from outside of `a`.
+static bool
+FindPCRelativeOperands(const llvm::BasicBlock *a, uint64_t a_pc,
+                       const llvm::BasicBlock *b, uint64_t b_pc,
+                       std::vector<std::pair<unsigned, unsigned>> &pc_ops,
+                       std::vector<const llvm::Value *> &entry_values) {
+  if (a->size() != b->size() || a->getTerminator() || b->getTerminator()) {
+    return false;
+  }
+
+  const auto &entry = a->getParent()->getEntryBlock();
+  llvm::DenseMap<const llvm::Value *, unsigned> a_index;
+  llvm::DenseMap<const llvm::Value *, unsigned> b_index;
+
+  auto b_it = b->begin();
+  auto i = 0u;
+  for (const auto &a_inst : *a) {
+    const auto &b_inst = *b_it++;
+    if (!a_inst.isSameOperationAs(&b_inst)) {
+      return false;
+    }
+
+    for (auto j = 0u; j < a_inst.getNumOperands(); ++j) {
+      const auto a_op = a_inst.getOperand(j);
+      const auto b_op = b_inst.getOperand(j);
+
+      // Both use the result of the same earlier instruction of their block.
+      if (auto a_op_it = a_index.find(a_op); a_op_it != a_index.end()) {
+        const auto b_op_it = b_index.find(b_op);
+        if (b_op_it == b_index.end() || b_op_it->second != a_op_it->second) {
+          return false;
+        }
+        continue;
+      }
+
+      if (a_op != b_op) {
+        const auto a_ci = llvm::dyn_cast<llvm::ConstantInt>(a_op);
+        const auto b_ci = llvm::dyn_cast<llvm::ConstantInt>(b_op);
+        if (!a_ci || !b_ci || a_ci->getType() != b_ci->getType() ||
+            a_ci->getBitWidth() > 64u ||
+            b_ci->getValue() - a_ci->getValue() !=
+                llvm::APInt(a_ci->getBitWidth(), b_pc - a_pc)) {
+          return false;
+        }
+        pc_ops.emplace_back(i, j);
+
+      } else if (auto op_inst = llvm::dyn_cast<llvm::Instruction>(a_op)) {
+        if (op_inst->getParent() != &entry || !op_inst->hasName()) {
+          return false;
+        }
+        entry_values.push_back(op_inst);
+
+      } else if (!llvm::isa<llvm::Constant>(a_op) &&
+                 !llvm::isa<llvm::Argument>(a_op)) {
+        return false;
+      }
+    }
+
+    a_index.try_emplace(&a_inst, i);
+    b_index.try_emplace(&b_inst, i);
+    ++i;
+  }
+
+  return true;
+}
+
+}  // namespace
 
 MCToIRLifter::MCToIRLifter(const remill::Arch *_arch, const Program &_program,
-                           llvm::Module &_module)
+                           llvm::Module &_module, DecodeCache *_decode_cache,
+                           const LiftBudget &_budget)
     : arch(_arch),
       program(_program),
       module(_module),
       ctx(_module.getContext()),
       intrinsics(remill::IntrinsicTable(&_module)),
-      inst_lifter(remill::InstructionLifter(_arch, &intrinsics)) {}
+      inst_lifter(remill::InstructionLifter(_arch, &intrinsics)),
+      decode_cache(_decode_cache),
+      budget(_budget) {
+  if (!decode_cache) {
+    own_decode_cache.reset(new DecodeCache);
+    decode_cache = own_decode_cache.get();
+  }
+}
+
+MCToIRLifter::~MCToIRLifter(void) {
+  if (fragment_func) {
+    fragment_func->eraseFromParent();
+  }
+}
 
 llvm::BasicBlock *MCToIRLifter::GetOrCreateBlock(const uint64_t addr) {
   auto &block = addr_to_block[addr];
@@ -41,48 +188,101 @@ llvm::BasicBlock *MCToIRLifter::GetOrCreateBlock(const uint64_t addr) {
     return block;
   }
 
-  std::stringstream ss;
-  ss << "inst_" << std::hex << addr;
-  block = llvm::BasicBlock::Create(ctx, ss.str(), lifted_func);
+  // NOTE(pag): The name is only rendered if `ctx` keeps value names.
+  block = llvm::BasicBlock::Create(
+      ctx, llvm::Twine("inst_") + llvm::Twine::utohexstr(addr), lifted_func);
+  gBlocksCreated.Add();
+
+  // The instruction was already lifted as part of a straight-line run of
+  // instructions, e.g. this is the target of a loop's back edge. The block
+  // being lifted into right now may not have a terminator yet, so the split
+  // is deferred.
+  if (inst_starts.count(addr)) {
+    pending_splits.emplace_back(addr, block);
+    gBlocksSplit.Add();
+    return block;
+  }
 
   // Missed an instruction?! This can happen when IDA merges two instructions
   // into one larger synthetic instruction. This might also be a tail-call.
-  work_list.emplace(addr, curr_inst ? curr_inst->pc : 0);
+  work_list.emplace_back(addr, curr_inst ? curr_inst->pc : 0);
+  std::push_heap(work_list.begin(), work_list.end(), std::greater<>());
 
   return block;
 }
 
+// Split the lifted blocks at the targets in `pending_splits`. The lifted
+// code of each target, and of the instructions that follow it in its block,
+// is moved into the target's block, and the original block branches to it.
+//
+// NOTE(pag): A block can be split several times, and so the block containing
+//            a target is only found once it's about to be split.
+void MCToIRLifter::SplitBlocks(void) {
+  for (auto [addr, target_block] : pending_splits) {
+    const auto first_inst = inst_starts[addr];
+    const auto block = first_inst->getParent();
+    target_block->getInstList().splice(target_block->end(),
+                                       block->getInstList(),
+                                       first_inst->getIterator(), block->end());
+    llvm::BranchInst::Create(target_block, block);
+  }
+  pending_splits.clear();
+}
+
 bool MCToIRLifter::DecodeInstructionInto(const uint64_t addr, bool is_delayed,
                                          remill::Instruction *inst_out) {
   static const auto max_inst_size = arch->MaxInstructionSize();
-  inst_out->Reset();
 
-  auto byte = program.FindByte(addr);
-  if (!byte.IsExecutable()) {
-    return false;
+  if (deps) {
+    deps->decoded_addresses.push_back(addr);
   }
 
-  // Read the bytes.
-  auto &inst_bytes = inst_out->bytes;
+  if (auto cached = decode_cache->Find(addr, is_delayed); cached) {
+    gDecodeCacheHits.Add();
+    *inst_out = cached->inst;
+    return cached->is_decoded;
+  }
+
+  gInstructionsDecoded.Add();
+
+  // Read the bytes, up until the first non-executable byte. The bytes of an
+  // instruction almost always fall within one mapped range, and so this
+  // normally finds all of them with a single span.
+  DecodedInstruction decoded;
+  decoded.inst.Reset();
+  auto &inst_bytes = decoded.inst.bytes;
   inst_bytes.reserve(max_inst_size);
-  for (auto i = 0u; i < max_inst_size && byte && byte.IsExecutable();
-       ++i, byte = program.FindNextByte(byte)) {
-    auto maybe_val = byte.Value();
-    if (remill::IsError(maybe_val)) {
-      LOG(ERROR) << "Unable to read value of byte at " << std::hex
-                 << byte.Address() << std::dec << ": "
-                 << remill::GetErrorString(maybe_val);
+  while (inst_bytes.size() < max_inst_size) {
+    const auto seq_addr = addr + inst_bytes.size();
+    const auto seq =
+        program.FindBytes(seq_addr, max_inst_size - inst_bytes.size());
+    if (!seq) {
+      break;
+    }
+
+    const auto data = seq.ToString();
+    const auto num_bytes =
+        static_cast<size_t>(seq.FindNextNonExecutable(seq_addr) - seq_addr);
+
+    inst_bytes.append(data.data(), num_bytes);
+    if (num_bytes < data.size()) {
       break;
-    } else {
-      inst_bytes.push_back(static_cast<char>(remill::GetReference(maybe_val)));
     }
   }
 
-  if (is_delayed) {
-    return arch->DecodeDelayedInstruction(addr, inst_out->bytes, *inst_out);
-  } else {
-    return arch->DecodeInstruction(addr, inst_out->bytes, *inst_out);
+  if (!inst_bytes.empty()) {
+    if (is_delayed) {
+      decoded.is_decoded = arch->DecodeDelayedInstruction(
+          addr, inst_bytes, decoded.inst);
+    } else {
+      decoded.is_decoded =
+          arch->DecodeInstruction(addr, inst_bytes, decoded.inst);
+    }
   }
+
+  const auto cached = decode_cache->Add(addr, is_delayed, std::move(decoded));
+  *inst_out = cached->inst;
+  return cached->is_decoded;
 }
 
 void MCToIRLifter::VisitInvalid(const remill::Instruction &inst,
@@ -97,9 +297,18 @@ void MCToIRLifter::VisitError(const remill::Instruction &inst,
   remill::AddTerminatingTailCall(block, intrinsics.error);
 }
 
+// NOTE(pag): The next instruction is lifted into the same block, unless
+//            something else already branches to it, or it was already
+//            lifted. This keeps straight-line code in one block, rather than
+//            one block per instruction.
 void MCToIRLifter::VisitNormal(const remill::Instruction &inst,
                                llvm::BasicBlock *block) {
-  llvm::BranchInst::Create(GetOrCreateBlock(inst.next_pc), block);
+  if (addr_to_block.count(inst.next_pc) || inst_starts.count(inst.next_pc)) {
+    llvm::BranchInst::Create(GetOrCreateBlock(inst.next_pc), block);
+  } else {
+    fall_through_block = block;
+    fall_through_pc = inst.next_pc;
+  }
 }
 
 void MCToIRLifter::VisitNoOp(const remill::Instruction &inst,
@@ -114,11 +323,122 @@ void MCToIRLifter::VisitDirectJump(const remill::Instruction &inst,
   llvm::BranchInst::Create(GetOrCreateBlock(inst.branch_taken_pc), block);
 }
 
+// Try to recover the targets of the indirect jump `inst` from the jump table
+// that it reads. At most `kMaxJumpTableEntries` entries are read, stopping
+// at the first one that is writeable, unmapped, the start of a variable, or
+// whose target is not executable, or is farther than
+// `kMaxJumpTableTargetDistance` from the jump. The result, even if no targets
+// were found, is cached in `decode_cache`.
+const ResolvedJumpTable *
+MCToIRLifter::ResolveJumpTable(const remill::Instruction &inst) {
+  auto table = decode_cache->FindJumpTable(inst.pc);
+  if (!table) {
+    ResolvedJumpTable new_table;
+    const auto entry_size = arch->address_size / 8u;
+    if (auto table_op = FindJumpTableOperand(inst, entry_size)) {
+      const auto addr_mask = arch->address_size == 64u
+                                 ? ~0ull
+                                 : (1ull << arch->address_size) - 1ull;
+      const auto is_little_endian = module.getDataLayout().isLittleEndian();
+
+      new_table.table_begin =
+          static_cast<uint64_t>(table_op->displacement) & addr_mask;
+      new_table.table_end = new_table.table_begin;
+
+      for (uint64_t i = 0u; i < kMaxJumpTableEntries; ++i) {
+        const auto entry_addr = new_table.table_begin + i * entry_size;
+        new_table.table_end = entry_addr + entry_size;
+
+        const auto seq = program.FindBytes(entry_addr, entry_size);
+        if (seq.Size() != entry_size || seq.IsWriteable() ||
+            (i && program.FindVariable(entry_addr))) {
+          break;
+        }
+
+        const auto data = seq.ToString();
+        uint64_t target = 0u;
+        for (uint64_t b = 0u; b < entry_size; ++b) {
+          const auto byte = static_cast<uint8_t>(
+              data[is_little_endian ? entry_size - b - 1u : b]);
+          target = (target << 8u) | byte;
+        }
+
+        const auto distance = target < inst.pc ? inst.pc - target
+                                               : target - inst.pc;
+        if (distance > kMaxJumpTableTargetDistance) {
+          break;
+        }
+
+        if (!program.FindByte(target).IsExecutable()) {
+          new_table.end_target = target;
+          break;
+        }
+
+        new_table.targets.push_back(target);
+      }
+
+      if (!new_table.targets.empty()) {
+        gJumpTablesResolved.Add();
+      }
+    }
+
+    table = decode_cache->AddJumpTable(inst.pc, std::move(new_table));
+  }
+
+  if (deps && table->table_begin < table->table_end) {
+    deps->data_reads.emplace_back(table->table_begin,
+                                  table->table_end - table->table_begin);
+    if (table->end_target) {
+      deps->decoded_addresses.push_back(table->end_target);
+    }
+  }
+
+  return table;
+}
+
+// Terminate `block` with a switch over the program counter that branches to
+// the blocks of `targets`, and otherwise tail-calls the jump intrinsic.
+void MCToIRLifter::AddJumpSwitch(llvm::BasicBlock *block,
+                                 const std::vector<uint64_t> &targets) {
+  const auto pc = remill::LoadProgramCounter(block);
+  const auto pc_type = llvm::cast<llvm::IntegerType>(pc->getType());
+  const auto default_block = llvm::BasicBlock::Create(ctx, "", lifted_func);
+  remill::AddTerminatingTailCall(default_block, intrinsics.jump);
+
+  const auto dispatcher = llvm::SwitchInst::Create(
+      pc, default_block, static_cast<unsigned>(targets.size()), block);
+
+  std::unordered_set<uint64_t> seen_targets;
+  for (auto target : targets) {
+    if (seen_targets.insert(target).second) {
+      dispatcher->addCase(llvm::ConstantInt::get(pc_type, target),
+                          GetOrCreateBlock(target));
+    }
+  }
+}
+
+// NOTE(pag): If an earlier analysis recorded the targets of the indirect
+//            jump, or if we can recover them from a jump table, then we
+//            switch on the program counter, and only fall back to the jump
+//            intrinsic for unexpected targets.
 void MCToIRLifter::VisitIndirectJump(const remill::Instruction &inst,
                                      remill::Instruction *delayed_inst,
                                      llvm::BasicBlock *block) {
   VisitDelayedInstruction(inst, delayed_inst, block, true);
-  remill::AddTerminatingTailCall(block, intrinsics.jump);
+
+  if (const auto ext_meta = program.FindExtendedMeta(inst.pc);
+      ext_meta && !ext_meta->targets.empty()) {
+    gDevirtualizedJumps.Add();
+    AddJumpSwitch(block, ext_meta->targets);
+
+  } else if (const auto table = ResolveJumpTable(inst);
+             !table->targets.empty()) {
+    gDevirtualizedJumps.Add();
+    AddJumpSwitch(block, table->targets);
+
+  } else {
+    remill::AddTerminatingTailCall(block, intrinsics.jump);
+  }
 }
 
 void MCToIRLifter::VisitFunctionReturn(const remill::Instruction &inst,
@@ -134,7 +454,14 @@ void MCToIRLifter::VisitDirectFunctionCall(const remill::Instruction &inst,
 
   VisitDelayedInstruction(inst, delayed_inst, block, true);
 
+  if (deps) {
+    deps->function_lookups.push_back(inst.branch_taken_pc);
+  }
+
   if (auto decl = program.FindFunction(inst.branch_taken_pc); decl) {
+    if (callees) {
+      callees->push_back(decl);
+    }
     const auto entry = GetOrDeclareFunction(*decl);
     remill::AddCall(block, entry.lifted_to_native);
   } else {
@@ -146,13 +473,60 @@ void MCToIRLifter::VisitDirectFunctionCall(const remill::Instruction &inst,
   llvm::BranchInst::Create(GetOrCreateBlock(inst.next_pc), block);
 }
 
+// NOTE(pag): If an earlier analysis recorded the targets of the indirect
+//            call, then we switch on the program counter and directly call
+//            each declared target, and only fall back to the function call
+//            intrinsic for unexpected targets.
 void MCToIRLifter::VisitIndirectFunctionCall(const remill::Instruction &inst,
                                              remill::Instruction *delayed_inst,
                                              llvm::BasicBlock *block) {
 
   VisitDelayedInstruction(inst, delayed_inst, block, true);
-  remill::AddCall(block, intrinsics.function_call);
-  llvm::BranchInst::Create(GetOrCreateBlock(inst.next_pc), block);
+
+  const auto next_block = GetOrCreateBlock(inst.next_pc);
+  const auto ext_meta = program.FindExtendedMeta(inst.pc);
+  if (!ext_meta || ext_meta->targets.empty()) {
+    remill::AddCall(block, intrinsics.function_call);
+    llvm::BranchInst::Create(next_block, block);
+    return;
+  }
+
+  gDevirtualizedCalls.Add();
+  const auto pc = remill::LoadProgramCounter(block);
+  const auto pc_type = llvm::cast<llvm::IntegerType>(pc->getType());
+  const auto default_block = llvm::BasicBlock::Create(ctx, "", lifted_func);
+  remill::AddCall(default_block, intrinsics.function_call);
+  llvm::BranchInst::Create(next_block, default_block);
+
+  const auto dispatcher = llvm::SwitchInst::Create(
+      pc, default_block, static_cast<unsigned>(ext_meta->targets.size()),
+      block);
+
+  std::unordered_set<uint64_t> seen_targets;
+  for (auto target : ext_meta->targets) {
+    if (!seen_targets.insert(target).second) {
+      continue;
+    }
+
+    if (deps) {
+      deps->function_lookups.push_back(target);
+    }
+
+    const auto decl = program.FindFunction(target);
+    if (!decl) {
+      continue;
+    }
+
+    if (callees) {
+      callees->push_back(decl);
+    }
+
+    const auto entry = GetOrDeclareFunction(*decl);
+    const auto call_block = llvm::BasicBlock::Create(ctx, "", lifted_func);
+    remill::AddCall(call_block, entry.lifted_to_native);
+    llvm::BranchInst::Create(next_block, call_block);
+    dispatcher->addCase(llvm::ConstantInt::get(pc_type, target), call_block);
+  }
 }
 
 void MCToIRLifter::VisitConditionalBranch(const remill::Instruction &inst,
@@ -220,7 +594,18 @@ void MCToIRLifter::VisitInstruction(remill::Instruction &inst,
   // Even when something isn't supported or is invalid, we still lift
   // a call to a semantic, e.g.`INVALID_INSTRUCTION`, so we really want
   // to treat instruction lifting as an operation that can't fail.
-  (void) inst_lifter.LiftIntoBlock(inst, block, false);
+  const auto prev_inst = block->empty() ? nullptr : &(block->back());
+  LiftIntoBlock(inst, block);
+
+  llvm::Instruction *first_inst = nullptr;
+  if (prev_inst) {
+    first_inst = prev_inst->getNextNode();
+  } else if (!block->empty()) {
+    first_inst = &(block->front());
+  }
+  if (first_inst) {
+    inst_starts.try_emplace(inst.pc, first_inst);
+  }
 
   if (arch->MayHaveDelaySlot(inst)) {
     delayed_inst = new (&delayed_inst_storage) remill::Instruction;
@@ -271,6 +656,162 @@ void MCToIRLifter::VisitInstruction(remill::Instruction &inst,
   }
 }
 
+// Lift `inst` into the end of `block`.
+//
+// NOTE(pag): Lifting an instruction produces the same code for the same bytes
+//            at any address, apart from constants derived from the PC, e.g.
+//            the next PC, and the targets of relative branches and
+//            PC-relative memory operands. The lifted code of each distinct
+//            encoding is kept as a fragment, and copied out for each other
+//            instruction with the same bytes, with its PC-relative constants
+//            adjusted, instead of running `inst_lifter` again.
+void MCToIRLifter::LiftIntoBlock(remill::Instruction &inst,
+                                 llvm::BasicBlock *block) {
+  const auto &frag = GetOrCreateFragment(inst);
+  if (frag.block && StampFragment(frag, inst, block)) {
+    gFragmentsStamped.Add();
+  } else {
+    (void) inst_lifter.LiftIntoBlock(inst, block, false);
+  }
+}
+
+// Get or create the lifted fragment for the bytes of `inst`.
+const LiftedFragment &
+MCToIRLifter::GetOrCreateFragment(remill::Instruction &inst) {
+  auto [it, added] = fragments.try_emplace(inst.bytes);
+  auto &frag = it->second;
+  if (!added) {
+    return frag;
+  }
+
+  gFragmentsLifted.Add();
+  if (!fragment_func) {
+    fragment_func =
+        remill::DeclareLiftedFunction(&module, "__anvill_lifted_fragments");
+    remill::CloneBlockFunctionInto(fragment_func);
+    fragment_func->setLinkage(llvm::GlobalValue::InternalLinkage);
+    new llvm::UnreachableInst(ctx, &(fragment_func->getEntryBlock()));
+  }
+
+  // Find the PC-relative constants by lifting the same bytes at two other
+  // addresses, which keep the alignment of `inst.pc`.
+  //
+  // NOTE(pag): The second address is on a different offset within its page
+  //            than `inst.pc`, so that code computed from a page-aligned PC,
+  //            e.g. by AArch64's `adrp`, isn't mistaken for PC-relative code.
+  const auto addr_mask = arch->address_size == 64u
+                             ? ~0ull
+                             : (1ull << arch->address_size) - 1ull;
+  const uint64_t other_pcs[] = {(inst.pc + 0x10010u) & addr_mask,
+                                ((inst.pc ^ 0x800u) + 0x20020u) & addr_mask};
+
+  const auto num_blocks = fragment_func->size();
+  const auto block = LiftFragmentBlock(inst);
+  std::vector<std::pair<unsigned, unsigned>> pc_ops[2];
+  std::vector<const llvm::Value *> entry_values;
+  auto ok = true;
+
+  for (auto i = 0u; ok && i < 2u; ++i) {
+    remill::Instruction other;
+    if (!arch->DecodeInstruction(other_pcs[i], inst.bytes, other) ||
+        other.bytes != inst.bytes || other.function != inst.function) {
+      ok = false;
+      break;
+    }
+
+    const auto other_block = LiftFragmentBlock(other);
+    entry_values.clear();
+    ok = FindPCRelativeOperands(block, inst.pc, other_block, other.pc,
+                                pc_ops[i], entry_values);
+    other_block->eraseFromParent();
+  }
+
+  if (!ok || pc_ops[0] != pc_ops[1] ||
+      fragment_func->size() != num_blocks + 1u) {
+    gFragmentsUnstampable.Add();
+    block->eraseFromParent();
+    return frag;
+  }
+
+  std::sort(entry_values.begin(), entry_values.end());
+  entry_values.erase(std::unique(entry_values.begin(), entry_values.end()),
+                     entry_values.end());
+
+  // NOTE(pag): This keeps `fragment_func` well-formed.
+  new llvm::UnreachableInst(ctx, block);
+
+  frag.block = block;
+  frag.pc = inst.pc;
+  frag.pc_relative_operands = std::move(pc_ops[0]);
+  frag.entry_values = std::move(entry_values);
+  return frag;
+}
+
+// Lift `inst` into a new block of `fragment_func`.
+llvm::BasicBlock *MCToIRLifter::LiftFragmentBlock(remill::Instruction &inst) {
+  const auto block = llvm::BasicBlock::Create(ctx, "", fragment_func);
+  (void) inst_lifter.LiftIntoBlock(inst, block, false);
+  return block;
+}
+
+// Copy the code of `frag` to the end of `block`, adjusting its PC-relative
+// constants for `inst`.
+bool MCToIRLifter::StampFragment(const LiftedFragment &frag,
+                                 const remill::Instruction &inst,
+                                 llvm::BasicBlock *block) {
+  if (fragment_values.empty()) {
+    for (auto &arg : fragment_func->args()) {
+      fragment_values.try_emplace(
+          &arg, remill::NthArgument(lifted_func, arg.getArgNo()));
+    }
+  }
+
+  // NOTE(pag): The lifter creates some of the values of the entry block on
+  //            demand, and so `lifted_func` may not have them yet.
+  for (auto val : frag.entry_values) {
+    auto &mapped_val = fragment_values[val];
+    if (!mapped_val) {
+      mapped_val = remill::FindVarInFunction(&(lifted_func->getEntryBlock()),
+                                             val->getName().str(), true);
+    }
+    if (!mapped_val || mapped_val->getType() != val->getType()) {
+      fragment_values.erase(val);
+      return false;
+    }
+  }
+
+  std::vector<llvm::Instruction *> stamped;
+  for (const auto &frag_inst : *frag.block) {
+    if (frag_inst.isTerminator()) {
+      break;
+    }
+
+    const auto inst_copy = frag_inst.clone();
+    inst_copy->setName(frag_inst.getName());
+    block->getInstList().push_back(inst_copy);
+    for (auto &op : inst_copy->operands()) {
+      if (auto op_it = fragment_values.find(op.get());
+          op_it != fragment_values.end()) {
+        op.set(op_it->second);
+      }
+    }
+
+    // NOTE(pag): This is overwritten by the next stamping of this fragment.
+    fragment_values[&frag_inst] = inst_copy;
+    stamped.push_back(inst_copy);
+  }
+
+  const auto pc_delta = inst.pc - frag.pc;
+  for (auto [i, j] : frag.pc_relative_operands) {
+    const auto ci = llvm::cast<llvm::ConstantInt>(stamped[i]->getOperand(j));
+    stamped[i]->setOperand(
+        j, llvm::ConstantInt::get(
+               ctx, ci->getValue() + llvm::APInt(ci->getBitWidth(), pc_delta)));
+  }
+
+  return true;
+}
+
 // Declare the function decl `decl` and return an `llvm::Function *`.
 FunctionEntry MCToIRLifter::GetOrDeclareFunction(const FunctionDecl &decl) {
   auto &entry = addr_to_func[decl.address];
@@ -294,14 +835,23 @@ FunctionEntry MCToIRLifter::GetOrDeclareFunction(const FunctionDecl &decl) {
   return entry;
 }
 
-FunctionEntry MCToIRLifter::LiftFunction(const FunctionDecl &decl) {
+FunctionEntry
+MCToIRLifter::LiftFunction(const FunctionDecl &decl, LiftDependencies *deps_,
+                           std::vector<const FunctionDecl *> *callees_) {
   const auto entry = GetOrDeclareFunction(decl);
   if (!entry.native_to_lifted->isDeclaration()) {
     return entry;
   }
 
+  deps = deps_;
+  callees = callees_;
+
   work_list.clear();
   addr_to_block.clear();
+  inst_starts.clear();
+  pending_splits.clear();
+  fall_through_block = nullptr;
+  fragment_values.clear();
 
   lifted_func = entry.lifted;
   CHECK(lifted_func->isDeclaration());
@@ -321,32 +871,68 @@ FunctionEntry MCToIRLifter::LiftFunction(const FunctionDecl &decl) {
                            &(lifted_func->getEntryBlock()));
 
   remill::Instruction inst;
+  std::string over_budget;
+  uint64_t num_decoded = 0u;
+
+  // Recursively decode and lift. Fall-through instructions are lifted into
+  // the block of the instruction before them, and everything else comes off
+  // of the work list.
+  while (fall_through_block || !work_list.empty()) {
+    if (budget.max_instructions && num_decoded >= budget.max_instructions) {
+      over_budget = "decoded " + std::to_string(num_decoded) +
+                    " instructions";
+      break;
+    } else if (budget.max_blocks && addr_to_block.size() > budget.max_blocks) {
+      over_budget = "created " + std::to_string(addr_to_block.size()) +
+                    " blocks";
+      break;
+    }
 
-  // Recursively decode and lift
-  while (!work_list.empty()) {
-    const auto ent = *(work_list.begin());
-    work_list.erase(ent);
-    const auto inst_addr = ent.first;
-    const auto from_addr = ent.second;
+    uint64_t inst_addr = 0;
+    uint64_t from_addr = 0;
+    llvm::BasicBlock *block = nullptr;
 
-    const auto block = addr_to_block[inst_addr];
-    CHECK_NOTNULL(block);
+    if (fall_through_block) {
+      inst_addr = fall_through_pc;
+      from_addr = inst.pc;
+      block = fall_through_block;
+      fall_through_block = nullptr;
 
-    if (!block->empty()) {
-      continue;  // Already handled.
+    } else {
+      std::pop_heap(work_list.begin(), work_list.end(), std::greater<>());
+      const auto ent = work_list.back();
+      work_list.pop_back();
+      inst_addr = ent.first;
+      from_addr = ent.second;
+
+      block = addr_to_block[inst_addr];
+      CHECK_NOTNULL(block);
+
+      if (!block->empty()) {
+        continue;  // Already handled.
+      }
     }
 
     // First, try to see if it's actually related to another function. This is
     // equivalent to a tail-call in the original code.
+    if (deps) {
+      deps->function_lookups.push_back(inst_addr);
+    }
+
     if (auto other_decl = program.FindFunction(inst_addr);
-        other_decl && inst_addr != other_decl->address) {
-      const auto other_entry = GetOrDeclareFunction(decl);
+        other_decl && inst_addr != decl.address) {
+      if (callees) {
+        callees->push_back(other_decl);
+      }
+      const auto other_entry = GetOrDeclareFunction(*other_decl);
       remill::AddTerminatingTailCall(block, other_entry.lifted_to_native);
       continue;
     }
 
     // Decode.
+    ++num_decoded;
     if (!DecodeInstructionInto(inst_addr, false /* is_delayed */, &inst)) {
+      gDecodeFailures.Add();
       LOG(ERROR) << "Could not decode instruction at " << std::hex << inst_addr
                  << " reachable from instruction " << from_addr
                  << " in function at " << decl.address << std::dec;
@@ -363,6 +949,29 @@ FunctionEntry MCToIRLifter::LiftFunction(const FunctionDecl &decl) {
     }
   }
 
+  // Leave the function as a declaration, rather than emitting a partially
+  // lifted function.
+  if (!over_budget.empty()) {
+    std::stringstream ss;
+    ss << "Function at " << std::hex << decl.address << std::dec
+       << " exceeded its lifting budget: " << over_budget;
+    LOG(WARNING) << ss.str();
+    gBudgetsExceeded.Add();
+    RecordStatEvent("lift.budget_exceeded", ss.str());
+
+    lifted_func->deleteBody();
+    work_list.clear();
+    addr_to_block.clear();
+    inst_starts.clear();
+    pending_splits.clear();
+    fall_through_block = nullptr;
+
+  } else {
+    SplitBlocks();
+  }
+
+  deps = nullptr;
+  callees = nullptr;
   return entry;
 }
 
@@ -21,6 +21,11 @@
 
 // clang-format off
 #include <remill/BC/Compat/CTypes.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/DenseSet.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
 #include <llvm/IR/BasicBlock.h>
 #include <llvm/IR/Constants.h>
 #include <llvm/IR/DataLayout.h>
@@ -30,11 +35,32 @@
 #include <llvm/IR/InlineAsm.h>
 #include <llvm/IR/Instruction.h>
 #include <llvm/IR/Instructions.h>
+#include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/LegacyPassManager.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/Type.h>
+#include <llvm/Linker/Linker.h>
+#include <llvm/Pass.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
 #include <llvm/Transforms/IPO.h>
+#include <llvm/Transforms/InstCombine/InstCombine.h>
+#include <llvm/Transforms/Scalar.h>
+#include <llvm/Transforms/Scalar/ADCE.h>
+#include <llvm/Transforms/Scalar/BDCE.h>
+#include <llvm/Transforms/Scalar/DCE.h>
+#include <llvm/Transforms/Scalar/DeadStoreElimination.h>
+#include <llvm/Transforms/Scalar/EarlyCSE.h>
+#include <llvm/Transforms/Scalar/InstSimplifyPass.h>
+#include <llvm/Transforms/Scalar/JumpThreading.h>
+#include <llvm/Transforms/Scalar/NewGVN.h>
+#include <llvm/Transforms/Scalar/SCCP.h>
+#include <llvm/Transforms/Scalar/SROA.h>
+#include <llvm/Transforms/Scalar/SimplifyCFG.h>
+#include <llvm/Transforms/Scalar/Sink.h>
+#include <llvm/Transforms/Utils/Cloning.h>
 #include <llvm/Transforms/Utils/Local.h>
+#include <llvm/Transforms/Utils/Mem2Reg.h>
 
 // clang-format on
 
@@ -43,6 +69,16 @@
 #include <remill/BC/Optimizer.h>
 #include <remill/BC/Util.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
@@ -50,11 +86,62 @@
 #include "anvill/Decl.h"
 #include "anvill/Lift.h"
 #include "anvill/Program.h"
+#include "anvill/Stats.h"
 #include "anvill/Util.h"
+#include "FunctionPipeline.h"
 
 namespace anvill {
 namespace {
 
+static StatCounter gFixpointIterations("optimize.fixpoint_iterations");
+static StatCounter gFunctionsChanged("optimize.functions_changed");
+static StatCounter gBudgetsExceeded("optimize.budgets_exceeded");
+
+// Total wall time, in microseconds, spent running the function passes over
+// each function, by function name.
+using FunctionTimes = std::unordered_map<std::string, int64_t>;
+
+// Run `pipeline` over `func`, and return how long it took, in microseconds.
+static int64_t TimedRun(FunctionPipeline &pipeline, llvm::Function &func) {
+  const auto start = std::chrono::steady_clock::now();
+  pipeline.Run(func);
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+// If `module` was loaded lazily, e.g. from a semantics snapshot, then
+// materialize the bodies of only the functions that are still used, and
+// of their transitive callees, and remove the rest. Then materialize the
+// rest of the module.
+static llvm::Error MaterializeUsedFunctions(llvm::Module &module) {
+  ScopedStatTimer timer("OptimizeModule.Materialize");
+  for (auto changed = true; changed;) {
+    changed = false;
+    for (auto &func : module) {
+      if (func.isMaterializable() && !func.use_empty()) {
+        if (auto err = func.materialize(); err) {
+          return err;
+        }
+        changed = true;
+      }
+    }
+  }
+
+  std::vector<llvm::Function *> unused_funcs;
+  for (auto &func : module) {
+    if (func.isMaterializable()) {
+      unused_funcs.push_back(&func);
+    }
+  }
+
+  for (auto func : unused_funcs) {
+    func->eraseFromParent();
+  }
+
+  return module.materializeAll();
+}
+
 // Get a list of all ISELs.
 static std::vector<llvm::GlobalVariable *> FindISELs(llvm::Module &module) {
   std::vector<llvm::GlobalVariable *> isels;
@@ -184,168 +271,212 @@ RemoveUnusedCalls(llvm::Module &module, const char *func_name,
   }
 }
 
-// Remove calls to memory read functions that have undefined
-// addresses.
-static void
-RemoveUndefMemoryReads(llvm::Module &module, const char *func_name,
-                       std::unordered_set<llvm::Function *> &changed_funcs) {
-  auto func = module.getFunction(func_name);
-  if (!func) {
-    return;
-  }
-
-  std::vector<llvm::CallInst *> to_remove;
+// How the calls to a remill memory access intrinsic are rewritten by
+// `RewriteMemoryIntrinsics`.
+enum class MemoryIntrinsicKind {
+  kRead,
+
+  // NOTE(pag): Reads of `long double`s aren't folded into constants, as the
+  //            type in memory isn't the return type of the intrinsic.
+  kReadNoFold,
+  kWrite
+};
+
+using MemoryIntrinsics =
+    std::unordered_map<llvm::Function *, MemoryIntrinsicKind>;
+
+// Classify the memory access intrinsics used by `module`, so that calls to
+// all of them can be rewritten in one pass over each function.
+static MemoryIntrinsics FindMemoryIntrinsics(llvm::Module &module) {
+  static const std::pair<const char *, MemoryIntrinsicKind> kIntrinsics[] = {
+      {"__remill_read_memory_8", MemoryIntrinsicKind::kRead},
+      {"__remill_read_memory_16", MemoryIntrinsicKind::kRead},
+      {"__remill_read_memory_32", MemoryIntrinsicKind::kRead},
+      {"__remill_read_memory_64", MemoryIntrinsicKind::kRead},
+      {"__remill_read_memory_f32", MemoryIntrinsicKind::kRead},
+      {"__remill_read_memory_f64", MemoryIntrinsicKind::kRead},
+      {"__remill_read_memory_f80", MemoryIntrinsicKind::kReadNoFold},
+      {"__remill_write_memory_8", MemoryIntrinsicKind::kWrite},
+      {"__remill_write_memory_16", MemoryIntrinsicKind::kWrite},
+      {"__remill_write_memory_32", MemoryIntrinsicKind::kWrite},
+      {"__remill_write_memory_64", MemoryIntrinsicKind::kWrite},
+      {"__remill_write_memory_f32", MemoryIntrinsicKind::kWrite},
+      {"__remill_write_memory_f64", MemoryIntrinsicKind::kWrite},
+      {"__remill_write_memory_f80", MemoryIntrinsicKind::kWrite},
+  };
 
-  for (auto user : func->users()) {
-    if (auto call_inst = llvm::dyn_cast<llvm::CallInst>(user)) {
-      auto addr = call_inst->getArgOperand(1);
-      if (llvm::isa<llvm::UndefValue>(addr)) {
-        call_inst->replaceAllUsesWith(
-            llvm::UndefValue::get(call_inst->getType()));
-        to_remove.push_back(call_inst);
-      }
+  MemoryIntrinsics intrinsics;
+  for (const auto &[name, kind] : kIntrinsics) {
+    if (auto func = module.getFunction(name)) {
+      intrinsics.emplace(func, kind);
     }
   }
-
-  for (auto call_inst : to_remove) {
-    auto in_block = call_inst->getParent();
-    auto in_func = in_block->getParent();
-    changed_funcs.insert(in_func);
-
-    call_inst->eraseFromParent();
-  }
+  return intrinsics;
 }
 
-// Remove calls to memory write functions that have undefined addresses
-// or undefined values.
+// Add the functions that call any of the functions in `intrinsics` to
+// `funcs`.
 static void
-RemoveUndefMemoryWrites(llvm::Module &module, const char *func_name,
-                        std::unordered_set<llvm::Function *> &changed_funcs) {
-  auto func = module.getFunction(func_name);
-  if (!func) {
-    return;
-  }
-
-  std::vector<llvm::CallInst *> to_remove;
-
-  for (auto user : func->users()) {
-    if (auto call_inst = llvm::dyn_cast<llvm::CallInst>(user)) {
-      auto mem_ptr = call_inst->getArgOperand(0);
-      auto addr = call_inst->getArgOperand(1);
-      auto val = call_inst->getArgOperand(2);
-      if (llvm::isa<llvm::UndefValue>(addr)) {
-        call_inst->replaceAllUsesWith(mem_ptr);
-        to_remove.push_back(call_inst);
-
-      } else if (llvm::isa<llvm::UndefValue>(val)) {
-        call_inst->replaceAllUsesWith(mem_ptr);
-        to_remove.push_back(call_inst);
+FindMemoryIntrinsicCallers(const MemoryIntrinsics &intrinsics,
+                           std::unordered_set<llvm::Function *> &funcs) {
+  for (const auto &[intrinsic, kind] : intrinsics) {
+    for (auto user : intrinsic->users()) {
+      if (auto call_inst = llvm::dyn_cast<llvm::CallInst>(user)) {
+        funcs.insert(call_inst->getParent()->getParent());
       }
     }
   }
+}
 
-  for (auto call_inst : to_remove) {
-    auto in_block = call_inst->getParent();
-    auto in_func = in_block->getParent();
-    changed_funcs.insert(in_func);
-    call_inst->eraseFromParent();
+// Maps the address and type of a read of constant memory to the value that
+// would be read, or to `nullptr` if the memory read isn't constant.
+using ConstMemoryReads =
+    std::map<std::pair<uint64_t, llvm::Type *>, llvm::Constant *>;
+
+// Returns the value that would be read by a read of a `type` from `addr`,
+// or `nullptr` if any of the bytes read are unmapped or writeable.
+static llvm::Constant *ReadConstMemory(const Program &program,
+                                       const llvm::DataLayout &dl,
+                                       uint64_t addr, llvm::Type *type) {
+  const auto size = static_cast<uint64_t>(dl.getTypeStoreSize(type));
+  if (!size || size > sizeof(uint64_t) ||
+      type->getPrimitiveSizeInBits() != size * 8u) {
+    return nullptr;
   }
-}
 
-// Look for reads of constant memory locations, and replace
-// with the values that would have been read.
-static void
-ReplaceConstMemoryReads(const Program &program, llvm::Module &module,
-                        const char *func_name,
-                        std::unordered_set<llvm::Function *> &changed_funcs,
-                        llvm::Type *fp80_type = nullptr) {
+  // NOTE(pag): A read almost always falls within a single byte sequence. It
+  //            only spans more than one if it crosses into an adjacent
+  //            mapped range, or into another lazily-allocated metadata page
+  //            of an externally-backed range.
+  uint8_t bytes[sizeof(uint64_t)] = {};
+  for (uint64_t i = 0; i < size;) {
+    const auto seq = program.FindBytes(addr + i, size - i);
+    if (!seq || seq.IsWriteable()) {
+      return nullptr;
+    }
+    const auto data = seq.ToString();
+    memcpy(&(bytes[i]), data.data(), data.size());
+    i += data.size();
+  }
 
-  auto func = module.getFunction(func_name);
-  if (!func) {
-    return;
+  uint64_t val = 0;
+  for (uint64_t i = 0; i < size; ++i) {
+    const auto byte = dl.isLittleEndian() ? bytes[size - i - 1u] : bytes[i];
+    val = (val << 8u) | byte;
   }
 
-  std::vector<llvm::CallInst *> to_remove;
+  const auto int_type = llvm::Type::getIntNTy(type->getContext(),
+                                              static_cast<unsigned>(size * 8u));
+  return llvm::ConstantExpr::getBitCast(llvm::ConstantInt::get(int_type, val),
+                                        type);
+}
 
-  auto &context = module.getContext();
-  llvm::DataLayout dl(&module);
-  std::vector<uint8_t> bytes;
+// Look for a read of a constant memory location, and replace it with the
+// value that would have been read. Returns `true` if `call_inst` was
+// replaced, and can be removed.
+static bool ReplaceConstMemoryRead(const Program &program,
+                                   const llvm::DataLayout &dl,
+                                   llvm::CallInst *call_inst,
+                                   ConstMemoryReads &const_reads) {
+  auto addr_val = call_inst->getArgOperand(1);
+  auto addr_const = llvm::dyn_cast<llvm::ConstantInt>(addr_val);
+  if (!addr_const) {
+    return false;
+  }
 
-  for (auto user : func->users()) {
-    auto call_inst = llvm::dyn_cast<llvm::CallInst>(user);
-    if (!call_inst) {
-      continue;
-    }
+  const auto addr = addr_const->getZExtValue();
+  const auto type = call_inst->getType();
+  auto [it, added] = const_reads.emplace(std::make_pair(addr, type), nullptr);
+  if (added) {
+    it->second = ReadConstMemory(program, dl, addr, type);
+  }
 
-    auto addr_val = call_inst->getArgOperand(1);
-    auto addr_const = llvm::dyn_cast<llvm::ConstantInt>(addr_val);
-    if (!addr_const) {
-      continue;
-    }
+  if (!it->second) {
+    return false;
+  }
 
-    const auto addr = addr_const->getZExtValue();
-    auto mem_type = fp80_type ? fp80_type : call_inst->getType();
-    auto ret_val_size = dl.getTypeAllocSize(mem_type);
-    bytes.reserve(ret_val_size);
+  call_inst->replaceAllUsesWith(it->second);
+  return true;
+}
 
-    for (size_t i = 0; i < ret_val_size; ++i) {
-      auto byte = program.FindByte(addr);
-      if (byte && !byte.IsWriteable()) {
-        bytes.push_back(*byte.Value());
-      } else {
-        bytes.clear();
-        break;
+// Rewrite the calls to the memory access intrinsics in `func` with a single
+// pass over its instructions:
+//
+//    - reads of undefined addresses are replaced with undefined values;
+//    - writes to undefined addresses, or of undefined values, are removed;
+//    - reads of constant addresses in read-only memory are replaced with the
+//      values that would have been read.
+//
+// Returns `true` if `func` was changed.
+static bool RewriteMemoryIntrinsics(const Program &program,
+                                    const MemoryIntrinsics &intrinsics,
+                                    llvm::Function &func,
+                                    std::vector<llvm::CallInst *> &to_remove) {
+  const auto &dl = func.getParent()->getDataLayout();
+  ConstMemoryReads const_reads;
+  to_remove.clear();
+
+  for (auto &block : func) {
+    for (auto &inst : block) {
+      auto call_inst = llvm::dyn_cast<llvm::CallInst>(&inst);
+      if (!call_inst) {
+        continue;
       }
-    }
 
-    if (bytes.empty()) {
-      continue;
-    }
+      auto callee = call_inst->getCalledFunction();
+      if (!callee) {
+        continue;
+      }
 
-    const auto parent_func = call_inst->getParent()->getParent();
-    changed_funcs.insert(parent_func);
+      auto intrinsic_it = intrinsics.find(callee);
+      if (intrinsic_it == intrinsics.end()) {
+        continue;
+      }
 
-    auto entry_block = &(parent_func->getEntryBlock());
-    llvm::IRBuilder<> ir(entry_block);
+      const auto kind = intrinsic_it->second;
+      auto addr = call_inst->getArgOperand(1);
 
-    // Create a constant out of the bytes that would be read, then
-    // alloca some space for it, store the bytes into the alloca,
-    // and replace the call with the loaded result.
-    auto data_read = llvm::ConstantDataArray::get(context, bytes);
-    auto mem = ir.CreateAlloca(mem_type);
-    auto bc =
-        ir.CreateBitCast(mem, llvm::PointerType::get(data_read->getType(), 0));
-    ir.CreateStore(data_read, bc);
+      if (kind == MemoryIntrinsicKind::kWrite) {
+        auto mem_ptr = call_inst->getArgOperand(0);
+        auto val = call_inst->getArgOperand(2);
+        if (llvm::isa<llvm::UndefValue>(addr) ||
+            llvm::isa<llvm::UndefValue>(val)) {
+          call_inst->replaceAllUsesWith(mem_ptr);
+          to_remove.push_back(call_inst);
+        }
 
-    llvm::Instruction *as_load = new llvm::LoadInst(mem, "", call_inst);
+      } else if (llvm::isa<llvm::UndefValue>(addr)) {
+        call_inst->replaceAllUsesWith(
+            llvm::UndefValue::get(call_inst->getType()));
+        to_remove.push_back(call_inst);
 
-    if (fp80_type) {
-      as_load =
-          new llvm::FPTruncInst(as_load, call_inst->getType(), "", call_inst);
+      } else if (kind == MemoryIntrinsicKind::kRead &&
+                 ReplaceConstMemoryRead(program, dl, call_inst, const_reads)) {
+        to_remove.push_back(call_inst);
+      }
     }
-
-    call_inst->replaceAllUsesWith(as_load);
-    to_remove.push_back(call_inst);
   }
 
   for (auto call_inst : to_remove) {
     call_inst->eraseFromParent();
   }
+
+  return !to_remove.empty();
 }
 
 // Look for compiler barriers (empty inline asm statements marked
 // with side-effects) and try to remove them. If we see some barriers
 // bracketed by extern
-static void RemoveUnneededInlineAsm(const Program &program,
-                                    llvm::Module &module) {
+static void
+RemoveUnneededInlineAsm(const Program &program, llvm::Module &module,
+                        std::unordered_set<llvm::Function *> &changed_funcs) {
   std::vector<llvm::CallInst *> to_remove;
 
-  program.ForEachFunction([&](const FunctionDecl *decl) -> bool {
-
+  for (auto decl : program.Functions()) {
     const auto func = decl->DeclareInModule(
         CreateFunctionName(decl->address), module);
     if (func->isDeclaration()) {
-      return true;
+      continue;
     }
 
     to_remove.clear();
@@ -396,12 +527,14 @@ static void RemoveUnneededInlineAsm(const Program &program,
       }
     }
 
+    if (!to_remove.empty()) {
+      changed_funcs.insert(func);
+    }
+
     for (auto call_inst : to_remove) {
       call_inst->eraseFromParent();
     }
-
-    return true;
-  });
+  }
 }
 
 // Get the address space of a pointer value/type, using `addr_space` as our
@@ -468,6 +601,78 @@ static llvm::Constant *GetAddress(
   return nullptr;
 }
 
+// Index of the `inttoptr` conversions of integer addresses, by block, so
+// that lowering a memory access can find an existing conversion of its
+// address in constant time, rather than by scanning the address's users and
+// the block.
+//
+// NOTE(pag): The indexed conversion of an address in a block is placed as
+//            early in the block as possible, i.e. right after the address is
+//            computed, or at the start of the block if the address comes from
+//            elsewhere. That way, it dominates every memory access in the
+//            block, and no ordering of instructions is ever needed.
+class IntToPtrIndex {
+ public:
+  // Returns an `inttoptr` of `addr` in `block`, or `nullptr`.
+  llvm::IntToPtrInst *Find(llvm::BasicBlock *block, llvm::Value *addr) {
+    if (indexed_addrs.insert(addr).second) {
+      IndexUsers(addr);
+    }
+    const auto it = conversions.find({block, addr});
+    return it != conversions.end() ? it->second : nullptr;
+  }
+
+  // Create and index an `inttoptr` of `addr` to `dest_type` in `block`.
+  llvm::IntToPtrInst *Create(llvm::BasicBlock *block, llvm::Value *addr,
+                             llvm::PointerType *dest_type) {
+    const auto itp = new llvm::IntToPtrInst(addr, dest_type, "",
+                                            EarliestUse(block, addr));
+    conversions[{block, addr}] = itp;
+    return itp;
+  }
+
+ private:
+  // Returns the instruction before which the earliest possible use of `addr`
+  // in `block` can be placed.
+  static llvm::Instruction *EarliestUse(llvm::BasicBlock *block,
+                                        llvm::Value *addr) {
+    const auto addr_inst = llvm::dyn_cast<llvm::Instruction>(addr);
+    if (addr_inst && addr_inst->getParent() == block &&
+        !llvm::isa<llvm::PHINode>(addr_inst)) {
+      return addr_inst->getNextNode();
+    } else {
+      return &*(block->getFirstInsertionPt());
+    }
+  }
+
+  // Index the existing conversions of `addr`, hoisting the first conversion
+  // in each block to the earliest possible use of `addr`.
+  void IndexUsers(llvm::Value *addr) {
+    for (auto user : addr->users()) {
+      const auto itp = llvm::dyn_cast<llvm::IntToPtrInst>(user);
+      if (!itp) {
+        continue;
+      }
+
+      const auto block = itp->getParent();
+      auto &conversion = conversions[{block, addr}];
+      if (conversion) {
+        continue;
+      }
+
+      conversion = itp;
+      if (const auto ipoint = EarliestUse(block, addr); ipoint != itp) {
+        itp->moveBefore(ipoint);
+      }
+    }
+  }
+
+  llvm::DenseSet<llvm::Value *> indexed_addrs;
+  llvm::DenseMap<std::pair<llvm::BasicBlock *, llvm::Value *>,
+                 llvm::IntToPtrInst *>
+      conversions;
+};
+
 static llvm::Value *FindPointer(llvm::IRBuilder<> &ir, llvm::Value *addr,
                                 llvm::Type *elem_type, unsigned addr_space) {
 
@@ -485,12 +690,12 @@ static llvm::Value *FindPointer(llvm::IRBuilder<> &ir, llvm::Value *addr,
 }
 
 static llvm::Value *GetPointer(
-    const Program &program, llvm::Module &module,
+    const Program &program, llvm::Module &module, IntToPtrIndex &itps,
     llvm::IRBuilder<> &ir, llvm::Value *addr,
     llvm::Type *elem_type, unsigned addr_space);
 
 static llvm::Value *GetIndexedPointer(
-    const Program &program, llvm::Module &module,
+    const Program &program, llvm::Module &module, IntToPtrIndex &itps,
     llvm::IRBuilder<> &ir, llvm::Value *lhs,
     llvm::Value *rhs, llvm::Type *dest_type,
     unsigned addr_space) {
@@ -616,7 +821,7 @@ static llvm::Value *GetPointerFromInt(
 // Try to get a pointer for the address operand of a remill memory access
 // intrinsic.
 llvm::Value *GetPointer(
-    const Program &program, llvm::Module &module,
+    const Program &program, llvm::Module &module, IntToPtrIndex &itps,
     llvm::IRBuilder<> &ir, llvm::Value *addr, llvm::Type *elem_type,
     unsigned addr_space) {
 
@@ -629,14 +834,14 @@ llvm::Value *GetPointer(
   // intrinsics.
   if (auto as_itp = llvm::dyn_cast<llvm::IntToPtrInst>(addr); as_itp) {
     llvm::IRBuilder<> sub_ir(as_itp);
-    return GetPointer(program, module, sub_ir, as_itp->getOperand(0),
+    return GetPointer(program, module, itps, sub_ir, as_itp->getOperand(0),
                       elem_type, addr_space);
 
   // It's a `ptrtoint`, but of the wrong type; lets go back and try to use
   // that pointer.
   } else if (auto as_pti = llvm::dyn_cast<llvm::PtrToIntOperator>(addr);
              as_pti) {
-    return GetPointer(program, module, ir, as_pti->getPointerOperand(),
+    return GetPointer(program, module, itps, ir, as_pti->getPointerOperand(),
                       elem_type, addr_space);
 
   // We've found a pointer of the desired type; return :-D
@@ -647,7 +852,7 @@ llvm::Value *GetPointer(
   } else if (auto ci = llvm::dyn_cast<llvm::ConstantInt>(addr); ci) {
     const auto ea = ci->getZExtValue();
     if (auto addr = GetAddress(program, module, ea); addr) {
-      return GetPointer(program, module, ir, addr, elem_type, addr_space);
+      return GetPointer(program, module, itps, ir, addr, elem_type, addr_space);
 
     } else {
       LOG(ERROR) << "Missed cross-reference target " << std::hex << ea
@@ -659,7 +864,7 @@ llvm::Value *GetPointer(
   // as we've already handled `ptrtoint` above.
   } else if (auto ce = llvm::dyn_cast<llvm::ConstantExpr>(addr); ce) {
     if (ce->getOpcode() == llvm::Instruction::IntToPtr) {
-      return GetPointer(program, module, ir, ce->getOperand(0), elem_type,
+      return GetPointer(program, module, itps, ir, ce->getOperand(0), elem_type,
                         addr_space);
 
     } else if (addr_type->isIntegerTy()) {
@@ -701,7 +906,7 @@ llvm::Value *GetPointer(
           ipoint = ipoint->getNextNode();
         }
         llvm::IRBuilder<> sub_ir(ipoint);
-        lhs = GetPointer(program, module, sub_ir, lhs_inst, elem_type,
+        lhs = GetPointer(program, module, itps, sub_ir, lhs_inst, elem_type,
                          addr_space);
 
       } else if (lhs_const && rhs_inst && rhs_inst->hasNUsesOrMore(2)) {
@@ -710,7 +915,7 @@ llvm::Value *GetPointer(
           ipoint = ipoint->getNextNode();
         }
         llvm::IRBuilder<> sub_ir(ipoint);
-        rhs = GetPointer(program, module, sub_ir, rhs_inst, elem_type,
+        rhs = GetPointer(program, module, itps, sub_ir, rhs_inst, elem_type,
                          addr_space);
 
       } else {
@@ -735,12 +940,12 @@ llvm::Value *GetPointer(
     }
 
     if (rhs) {
-      return GetIndexedPointer(program, module, ir, rhs, lhs_op, dest_type,
-                               addr_space);
+      return GetIndexedPointer(program, module, itps, ir, rhs, lhs_op,
+                               dest_type, addr_space);
 
     } else {
-      return GetIndexedPointer(program, module, ir, lhs, rhs_op, dest_type,
-                               addr_space);
+      return GetIndexedPointer(program, module, itps, ir, lhs, rhs_op,
+                               dest_type, addr_space);
     }
 
   } else if (auto as_sub = llvm::dyn_cast<llvm::SubOperator>(addr); as_sub) {
@@ -759,49 +964,37 @@ llvm::Value *GetPointer(
           i32_ty, static_cast<uint64_t>(neg_index), true);
       addr_space = GetPointerAddressSpace(lhs, addr_space);
       dest_type = llvm::PointerType::get(elem_type, addr_space);
-      return GetIndexedPointer(program, module, ir, lhs, const_index, dest_type,
-                               addr_space);
+      return GetIndexedPointer(program, module, itps, ir, lhs, const_index,
+                               dest_type, addr_space);
     }
 
   } else if (auto as_bc = llvm::dyn_cast<llvm::BitCastOperator>(addr); as_bc) {
-    return GetPointer(program, module, ir, as_bc->getOperand(0), elem_type,
-                      addr_space);
+    return GetPointer(program, module, itps, ir, as_bc->getOperand(0),
+                      elem_type, addr_space);
 
   // E.g. loading an address-sized integer register.
   } else if (addr_type->isIntegerTy()) {
     const auto bb = ir.GetInsertBlock();
     const auto addr_inst = &*ir.GetInsertPoint();
 
-    // Go see if we can find multiple uses of `addr` in the same block, such
-    // that each use converts `addr` to a pointer. If so, go and re-use those
-    // `inttoptr` conversions instead of adding new ones.
-    for (auto user : addr->users()) {
-      const auto inst_user = llvm::dyn_cast<llvm::IntToPtrInst>(user);
-      if (!inst_user || inst_user == addr_inst ||
-          inst_user->getParent() != bb) {
-        continue;
-      }
-
-      for (auto next_inst = inst_user->getNextNode(); next_inst;
-           next_inst = next_inst->getNextNode()) {
-        DCHECK_EQ(next_inst->getParent(), bb);
-
-        // We've found `addr_inst`, i.e. the address we're pointer that we're
-        // try to compute follows a previous equivalent computation in the same
-        // block, so we'll go take that one.
-        if (next_inst == addr_inst) {
-          return ir.CreateBitCast(inst_user, dest_type);
-        }
+    // Go see if `addr` is already converted to a pointer in this block, and
+    // if so, re-use that `inttoptr` conversion instead of adding a new one.
+    auto inst_user = itps.Find(bb, addr);
+    if (!inst_user) {
+      if (llvm::isa<llvm::PHINode>(addr)) {
+        return GetPointerFromInt(ir, addr, elem_type, addr_space);
       }
+      inst_user = itps.Create(bb, addr, dest_type);
+    }
 
-      // We found another computation of this pointer, but it follows
-      // `addr_inst` in the block, so we'll move it to where we need it.
-      inst_user->removeFromParent();
-      inst_user->insertBefore(addr_inst);
-      return ir.CreateBitCast(inst_user, dest_type);
+    // The conversion is the insertion point, e.g. when lowering the address
+    // of an `inttoptr`, so cast the pointer after it.
+    if (inst_user == addr_inst) {
+      llvm::IRBuilder<> after_ir(inst_user->getNextNode());
+      return after_ir.CreateBitCast(inst_user, dest_type);
     }
 
-    return GetPointerFromInt(ir, addr, elem_type, addr_space);
+    return ir.CreateBitCast(inst_user, dest_type);
 
   } else {
     CHECK(addr_type->isPointerTy());
@@ -810,8 +1003,11 @@ llvm::Value *GetPointer(
 }
 
 // Lower a memory read intrinsic into a `load` instruction.
-static void ReplaceMemReadOp(const Program &program, llvm::Module &module,
-                             const char *name, llvm::Type *val_type) {
+static void
+ReplaceMemReadOp(const Program &program, llvm::Module &module,
+                 IntToPtrIndex &itps, const char *name,
+                 llvm::Type *val_type,
+                 std::unordered_set<llvm::Function *> &changed_funcs) {
   auto func = module.getFunction(name);
   if (!func) {
     return;
@@ -823,8 +1019,9 @@ static void ReplaceMemReadOp(const Program &program, llvm::Module &module,
   auto callers = remill::CallersOf(func);
   for (auto call_inst : callers) {
     auto addr = call_inst->getArgOperand(1);
+    changed_funcs.insert(call_inst->getFunction());
     llvm::IRBuilder<> ir(call_inst);
-    llvm::Value *ptr = GetPointer(program, module, ir, addr, val_type, 0);
+    llvm::Value *ptr = GetPointer(program, module, itps, ir, addr, val_type, 0);
     llvm::Value *val = ir.CreateLoad(ptr);
     if (val_type->isX86_FP80Ty() || val_type->isFP128Ty()) {
       val = ir.CreateFPTrunc(val, func->getReturnType());
@@ -838,8 +1035,11 @@ static void ReplaceMemReadOp(const Program &program, llvm::Module &module,
 }
 
 // Lower a memory write intrinsic into a `store` instruction.
-static void ReplaceMemWriteOp(const Program &program, llvm::Module &module,
-                              const char *name, llvm::Type *val_type) {
+static void
+ReplaceMemWriteOp(const Program &program, llvm::Module &module,
+                  IntToPtrIndex &itps, const char *name,
+                  llvm::Type *val_type,
+                  std::unordered_set<llvm::Function *> &changed_funcs) {
   auto func = module.getFunction(name);
   if (!func) {
     return;
@@ -854,9 +1054,10 @@ static void ReplaceMemWriteOp(const Program &program, llvm::Module &module,
     auto mem_ptr = call_inst->getArgOperand(0);
     auto addr = call_inst->getArgOperand(1);
     auto val = call_inst->getArgOperand(2);
+    changed_funcs.insert(call_inst->getFunction());
 
     llvm::IRBuilder<> ir(call_inst);
-    llvm::Value *ptr = GetPointer(program, module, ir, addr, val_type, 0);
+    llvm::Value *ptr = GetPointer(program, module, itps, ir, addr, val_type, 0);
     if (val_type->isX86_FP80Ty() || val_type->isFP128Ty()) {
       val = ir.CreateFPExt(val, val_type);
     }
@@ -870,43 +1071,476 @@ static void ReplaceMemWriteOp(const Program &program, llvm::Module &module,
   RemoveFunction(func);
 }
 
-static void LowerMemOps(const Program &program, llvm::Module &module) {
+// Lower the remill memory access intrinsics into loads and stores, adding
+// the functions that called them to `changed_funcs`.
+static void LowerMemOps(const Program &program, llvm::Module &module,
+                        std::unordered_set<llvm::Function *> &changed_funcs) {
   auto &context = module.getContext();
-  ReplaceMemReadOp(program, module, "__remill_read_memory_8",
-                   llvm::Type::getInt8Ty(context));
-  ReplaceMemReadOp(program, module, "__remill_read_memory_16",
-                   llvm::Type::getInt16Ty(context));
-  ReplaceMemReadOp(program, module, "__remill_read_memory_32",
-                   llvm::Type::getInt32Ty(context));
-  ReplaceMemReadOp(program, module, "__remill_read_memory_64",
-                   llvm::Type::getInt64Ty(context));
-  ReplaceMemReadOp(program, module, "__remill_read_memory_f32",
-                   llvm::Type::getFloatTy(context));
-  ReplaceMemReadOp(program, module, "__remill_read_memory_f64",
-                   llvm::Type::getDoubleTy(context));
-
-  ReplaceMemWriteOp(program, module, "__remill_write_memory_8",
-                    llvm::Type::getInt8Ty(context));
-  ReplaceMemWriteOp(program, module, "__remill_write_memory_16",
-                    llvm::Type::getInt16Ty(context));
-  ReplaceMemWriteOp(program, module, "__remill_write_memory_32",
-                    llvm::Type::getInt32Ty(context));
-  ReplaceMemWriteOp(program, module, "__remill_write_memory_64",
-                    llvm::Type::getInt64Ty(context));
-  ReplaceMemWriteOp(program, module, "__remill_write_memory_f32",
-                    llvm::Type::getFloatTy(context));
-  ReplaceMemWriteOp(program, module, "__remill_write_memory_f64",
-                    llvm::Type::getDoubleTy(context));
-
-  ReplaceMemReadOp(program, module, "__remill_read_memory_f80",
-                   llvm::Type::getX86_FP80Ty(context));
-  ReplaceMemReadOp(program, module, "__remill_write_memory_f128",
-                   llvm::Type::getFP128Ty(context));
-
-  ReplaceMemWriteOp(program, module, "__remill_write_memory_f80",
-                    llvm::Type::getX86_FP80Ty(context));
-  ReplaceMemWriteOp(program, module, "__remill_write_memory_f128",
-                    llvm::Type::getFP128Ty(context));
+  IntToPtrIndex itps;
+  ReplaceMemReadOp(program, module, itps, "__remill_read_memory_8",
+                   llvm::Type::getInt8Ty(context), changed_funcs);
+  ReplaceMemReadOp(program, module, itps, "__remill_read_memory_16",
+                   llvm::Type::getInt16Ty(context), changed_funcs);
+  ReplaceMemReadOp(program, module, itps, "__remill_read_memory_32",
+                   llvm::Type::getInt32Ty(context), changed_funcs);
+  ReplaceMemReadOp(program, module, itps, "__remill_read_memory_64",
+                   llvm::Type::getInt64Ty(context), changed_funcs);
+  ReplaceMemReadOp(program, module, itps, "__remill_read_memory_f32",
+                   llvm::Type::getFloatTy(context), changed_funcs);
+  ReplaceMemReadOp(program, module, itps, "__remill_read_memory_f64",
+                   llvm::Type::getDoubleTy(context), changed_funcs);
+
+  ReplaceMemWriteOp(program, module, itps, "__remill_write_memory_8",
+                    llvm::Type::getInt8Ty(context), changed_funcs);
+  ReplaceMemWriteOp(program, module, itps, "__remill_write_memory_16",
+                    llvm::Type::getInt16Ty(context), changed_funcs);
+  ReplaceMemWriteOp(program, module, itps, "__remill_write_memory_32",
+                    llvm::Type::getInt32Ty(context), changed_funcs);
+  ReplaceMemWriteOp(program, module, itps, "__remill_write_memory_64",
+                    llvm::Type::getInt64Ty(context), changed_funcs);
+  ReplaceMemWriteOp(program, module, itps, "__remill_write_memory_f32",
+                    llvm::Type::getFloatTy(context), changed_funcs);
+  ReplaceMemWriteOp(program, module, itps, "__remill_write_memory_f64",
+                    llvm::Type::getDoubleTy(context), changed_funcs);
+
+  ReplaceMemReadOp(program, module, itps, "__remill_read_memory_f80",
+                   llvm::Type::getX86_FP80Ty(context), changed_funcs);
+  ReplaceMemReadOp(program, module, itps, "__remill_write_memory_f128",
+                   llvm::Type::getFP128Ty(context), changed_funcs);
+
+  ReplaceMemWriteOp(program, module, itps, "__remill_write_memory_f80",
+                    llvm::Type::getX86_FP80Ty(context), changed_funcs);
+  ReplaceMemWriteOp(program, module, itps, "__remill_write_memory_f128",
+                    llvm::Type::getFP128Ty(context), changed_funcs);
+}
+
+// What each `OptimizationProfile` runs.
+struct ProfileConfig {
+
+  // Threshold of the module-level inliner, or zero to not inline.
+  unsigned inline_threshold;
+
+  // Run just a few cheap function passes, instead of the full list.
+  bool light_function_passes;
+
+  // Add the more expensive function passes to the full list.
+  bool extra_function_passes;
+
+  // Maximum number of rounds of the memory fixpoint, or zero for no limit.
+  unsigned max_fixpoint_iterations;
+};
+
+static ProfileConfig GetProfileConfig(OptimizationProfile profile) {
+  switch (profile) {
+    case OptimizationProfile::kFast: return {0u, true, false, 1u};
+    case OptimizationProfile::kDefault: break;
+    case OptimizationProfile::kThorough: return {500u, false, true, 0u};
+  }
+  return {250u, false, false, 0u};
+}
+
+// Add the function-local optimization passes of `profile` to `fpm`.
+static void AddLegacyFunctionPasses(llvm::legacy::FunctionPassManager &fpm,
+                                    OptimizationProfile profile) {
+  const auto config = GetProfileConfig(profile);
+  if (config.light_function_passes) {
+    fpm.add(llvm::createEarlyCSEPass(true));
+    fpm.add(llvm::createDeadCodeEliminationPass());
+    fpm.add(llvm::createSROAPass());
+    fpm.add(llvm::createPromoteMemoryToRegisterPass());
+    fpm.add(llvm::createCFGSimplificationPass());
+    return;
+  }
+
+  fpm.add(llvm::createEarlyCSEPass(true));
+  fpm.add(llvm::createDeadCodeEliminationPass());
+  fpm.add(llvm::createConstantPropagationPass());
+  fpm.add(llvm::createSinkingPass());
+  fpm.add(llvm::createNewGVNPass());
+  fpm.add(llvm::createSCCPPass());
+  fpm.add(llvm::createDeadStoreEliminationPass());
+  fpm.add(llvm::createSROAPass());
+  fpm.add(llvm::createPromoteMemoryToRegisterPass());
+  fpm.add(llvm::createBitTrackingDCEPass());
+  fpm.add(llvm::createCFGSimplificationPass());
+  if (config.extra_function_passes) {
+    fpm.add(llvm::createInstructionCombiningPass());
+    fpm.add(llvm::createJumpThreadingPass());
+    fpm.add(llvm::createAggressiveDCEPass());
+    fpm.add(llvm::createCFGSimplificationPass());
+  }
+  fpm.add(llvm::createSinkingPass());
+  fpm.add(llvm::createCFGSimplificationPass());
+}
+
+// Add the function-local optimization passes of `profile` to `fpm`. This
+// mirrors `AddLegacyFunctionPasses`.
+//
+// NOTE(pag): The new pass manager has no constant propagation pass, so
+//            instruction simplification stands in for it.
+static void AddNewFunctionPasses(llvm::FunctionPassManager &fpm,
+                                 OptimizationProfile profile) {
+  const auto config = GetProfileConfig(profile);
+  if (config.light_function_passes) {
+    fpm.addPass(llvm::EarlyCSEPass(true));
+    fpm.addPass(llvm::DCEPass());
+    fpm.addPass(llvm::SROA());
+    fpm.addPass(llvm::PromotePass());
+    fpm.addPass(llvm::SimplifyCFGPass());
+    return;
+  }
+
+  fpm.addPass(llvm::EarlyCSEPass(true));
+  fpm.addPass(llvm::DCEPass());
+  fpm.addPass(llvm::InstSimplifyPass());
+  fpm.addPass(llvm::SinkingPass());
+  fpm.addPass(llvm::NewGVNPass());
+  fpm.addPass(llvm::SCCPPass());
+  fpm.addPass(llvm::DSEPass());
+  fpm.addPass(llvm::SROA());
+  fpm.addPass(llvm::PromotePass());
+  fpm.addPass(llvm::BDCEPass());
+  fpm.addPass(llvm::SimplifyCFGPass());
+  if (config.extra_function_passes) {
+    fpm.addPass(llvm::InstCombinePass());
+    fpm.addPass(llvm::JumpThreadingPass());
+    fpm.addPass(llvm::ADCEPass());
+    fpm.addPass(llvm::SimplifyCFGPass());
+  }
+  fpm.addPass(llvm::SinkingPass());
+  fpm.addPass(llvm::SimplifyCFGPass());
+}
+
+// Add the module-level optimization passes to `mpm`, starting with the
+// inliner if `inline_threshold` is non-zero.
+static void AddModulePasses(llvm::legacy::PassManager &mpm,
+                            unsigned inline_threshold) {
+  if (inline_threshold) {
+    mpm.add(llvm::createFunctionInliningPass(inline_threshold));
+  }
+  mpm.add(llvm::createGlobalOptimizerPass());
+  mpm.add(llvm::createGlobalDCEPass());
+  mpm.add(llvm::createStripDeadDebugInfoPass());
+}
+
+// Create the pipeline of function-local optimizations of `profile`.
+static std::unique_ptr<FunctionPipeline>
+CreateFunctionPipeline(llvm::Module &module, PassManagerKind pass_manager,
+                       OptimizationProfile profile) {
+  return std::make_unique<FunctionPipeline>(
+      module, pass_manager,
+      [=](llvm::legacy::FunctionPassManager &fpm) {
+        AddLegacyFunctionPasses(fpm, profile);
+      },
+      [=](llvm::FunctionPassManager &fpm) {
+        AddNewFunctionPasses(fpm, profile);
+      });
+}
+
+// A partition of the functions to optimize, which is optimized by a worker
+// thread. The partition is serialized to bitcode so that it can cross from
+// the context of the module being optimized into the worker's
+// `llvm::LLVMContext`, and back again.
+struct FunctionPartition {
+  PassManagerKind pass_manager{PassManagerKind::kLegacy};
+  OptimizationProfile profile{OptimizationProfile::kDefault};
+  std::vector<llvm::Function *> funcs;
+  uint64_t num_insts{0};
+  llvm::SmallVector<char, 0> bitcode;
+
+  // How long the function passes took over each function of the partition.
+  std::vector<std::pair<std::string, int64_t>> times;
+  bool ok{false};
+};
+
+// The linkage of a global value that was externalized so that it could be
+// referenced across partitions.
+struct ExternalizedGlobal {
+  std::string name;
+  llvm::GlobalValue::LinkageTypes linkage;
+  bool was_unnamed;
+};
+
+// Extract the functions of `partition` out of `module` and into a new
+// module. Every other global value is left as a declaration, except for
+// constant global variables, which are kept as `available_externally`
+// definitions so that loads from them can still be folded.
+static std::unique_ptr<llvm::Module>
+ExtractPartition(llvm::Module &module, const FunctionPartition &partition) {
+  const std::unordered_set<const llvm::GlobalValue *> funcs(
+      partition.funcs.begin(), partition.funcs.end());
+
+  llvm::ValueToValueMapTy value_map;
+  auto extracted =
+      llvm::CloneModule(module, value_map, [&](const llvm::GlobalValue *gv) {
+        if (auto var = llvm::dyn_cast<llvm::GlobalVariable>(gv); var) {
+          return var->isConstant() && !var->hasAppendingLinkage();
+        }
+        return funcs.count(gv) != 0;
+      });
+
+  // NOTE(pag): These would be duplicated when the partition is linked back
+  //            into `module`.
+  extracted->setModuleInlineAsm("");
+  std::vector<llvm::NamedMDNode *> named_mds;
+  for (auto &md : extracted->named_metadata()) {
+    if (md.getName() != "llvm.module.flags") {
+      named_mds.push_back(&md);
+    }
+  }
+  for (auto md : named_mds) {
+    md->eraseFromParent();
+  }
+
+  std::vector<llvm::GlobalValue *> to_erase;
+  for (auto &func : *extracted) {
+    if (func.isDeclaration() && func.use_empty()) {
+      to_erase.push_back(&func);
+    }
+  }
+  for (auto &var : extracted->globals()) {
+    if (var.use_empty()) {
+      to_erase.push_back(&var);
+    } else if (!var.isDeclaration()) {
+      var.setLinkage(llvm::GlobalValue::AvailableExternallyLinkage);
+      var.setComdat(nullptr);
+    }
+  }
+  for (auto gv : to_erase) {
+    gv->eraseFromParent();
+  }
+
+  return extracted;
+}
+
+// Worker thread for parallel optimization. Each worker parses its partition
+// into its own LLVM context, runs the function passes over every function
+// in the partition, and then serializes the optimized partition.
+static void OptimizePartition(FunctionPartition &partition) {
+  ScopedStatTimer timer("OptimizeModule.FunctionPasses.Worker");
+  llvm::LLVMContext context;
+  llvm::MemoryBufferRef buff(
+      llvm::StringRef(partition.bitcode.data(), partition.bitcode.size()),
+      "anvill-optimized-partition");
+  auto maybe_module = llvm::parseBitcodeFile(buff, context);
+  if (remill::IsError(maybe_module)) {
+    LOG(ERROR) << "Unable to parse partition for optimization: "
+               << remill::GetErrorString(maybe_module);
+    return;
+  }
+
+  auto &module = *remill::GetReference(maybe_module);
+  const auto pipeline =
+      CreateFunctionPipeline(module, partition.pass_manager, partition.profile);
+  for (auto &func : module) {
+    if (!func.isDeclaration()) {
+      const auto time_us = TimedRun(*pipeline, func);
+      partition.times.emplace_back(func.getName().str(), time_us);
+    }
+  }
+
+  llvm::SmallVector<char, 0> bitcode;
+  llvm::raw_svector_ostream os(bitcode);
+  llvm::WriteBitcodeToFile(module, os);
+  partition.bitcode = std::move(bitcode);
+  partition.ok = true;
+}
+
+// Run `pipeline`, which was created according to `options`, over `funcs`,
+// adding the time spent on each function to `times`.
+//
+// If `options.num_jobs` is greater than one, then `funcs` are split into
+// partitions that are optimized concurrently by `OptimizePartition`, and the
+// optimized partitions are then linked back into `module`. Linking replaces
+// each optimized function with a new `llvm::Function`, so this returns the
+// functions that replace `funcs`, in the same order.
+static std::vector<llvm::Function *>
+RunFunctionPasses(llvm::Module &module, FunctionPipeline &pipeline,
+                  const std::vector<llvm::Function *> &funcs,
+                  const OptimizationOptions &options, FunctionTimes &times) {
+  ScopedStatTimer timer("OptimizeModule.FunctionPasses");
+
+  std::vector<llvm::Function *> defs;
+  for (auto func : funcs) {
+    if (!func->isDeclaration()) {
+      defs.push_back(func);
+    }
+  }
+
+  const auto num_jobs = std::min<unsigned>(options.num_jobs,
+                                          std::max<size_t>(1u, defs.size()));
+  if (num_jobs <= 1u) {
+    for (auto func : defs) {
+      const auto time_us = TimedRun(pipeline, *func);
+      if (func->hasName()) {
+        times[func->getName().str()] += time_us;
+      }
+    }
+    return funcs;
+  }
+
+  // Partitions reference each other's functions, and the module's local
+  // global values, by name, so those need to be externally visible, and
+  // named, until the partitions are linked back in.
+  std::vector<ExternalizedGlobal> externalized;
+  for (auto &gv : module.global_values()) {
+    if (!gv.hasLocalLinkage()) {
+      continue;
+    }
+
+    const auto was_unnamed = !gv.hasName();
+    if (was_unnamed) {
+      gv.setName("anvill.optimize.unnamed");
+    }
+    externalized.push_back({gv.getName().str(), gv.getLinkage(), was_unnamed});
+    gv.setLinkage(llvm::GlobalValue::ExternalLinkage);
+  }
+
+  std::vector<std::string> func_names;
+  func_names.reserve(funcs.size());
+  for (auto func : funcs) {
+    if (!func->hasName()) {
+      func->setName("anvill.optimize.unnamed");
+    }
+    func_names.push_back(func->getName().str());
+  }
+
+  // Balance the partitions by their number of instructions, assigning the
+  // biggest functions first.
+  std::sort(defs.begin(), defs.end(),
+            [](llvm::Function *a, llvm::Function *b) {
+              return a->getInstructionCount() > b->getInstructionCount();
+            });
+
+  std::vector<FunctionPartition> partitions(num_jobs);
+  for (auto &partition : partitions) {
+    partition.pass_manager = options.pass_manager;
+    partition.profile = options.profile;
+  }
+  for (auto func : defs) {
+    auto &partition = *std::min_element(
+        partitions.begin(), partitions.end(),
+        [](const FunctionPartition &a, const FunctionPartition &b) {
+          return a.num_insts < b.num_insts;
+        });
+    partition.funcs.push_back(func);
+    partition.num_insts += func->getInstructionCount();
+  }
+
+  for (auto &partition : partitions) {
+    auto extracted = ExtractPartition(module, partition);
+    llvm::raw_svector_ostream os(partition.bitcode);
+    llvm::WriteBitcodeToFile(*extracted, os);
+  }
+
+  std::vector<std::thread> workers;
+  workers.reserve(num_jobs);
+  for (auto &partition : partitions) {
+    workers.emplace_back(OptimizePartition, std::ref(partition));
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+
+  // Link the optimized functions back in, in place of the originals. The
+  // originals are turned into declarations so that the linker resolves them
+  // to the optimized definitions.
+  for (auto &partition : partitions) {
+    if (!partition.ok) {
+      LOG(ERROR) << "Unable to optimize partition of "
+                 << partition.funcs.size() << " functions";
+      continue;
+    }
+
+    llvm::MemoryBufferRef buff(
+        llvm::StringRef(partition.bitcode.data(), partition.bitcode.size()),
+        "anvill-optimized-partition");
+    auto maybe_module = llvm::parseBitcodeFile(buff, module.getContext());
+    if (remill::IsError(maybe_module)) {
+      LOG(FATAL) << "Unable to parse optimized partition: "
+                 << remill::GetErrorString(maybe_module);
+    }
+
+    for (auto func : partition.funcs) {
+      pipeline.Forget(*func);
+      func->deleteBody();
+      func->setComdat(nullptr);
+    }
+
+    if (llvm::Linker::linkModules(
+            module, std::move(remill::GetReference(maybe_module)))) {
+      LOG(FATAL) << "Unable to link optimized partition into module";
+    }
+
+    for (const auto &[name, time_us] : partition.times) {
+      times[name] += time_us;
+    }
+
+    partition.funcs.clear();
+    partition.bitcode.clear();
+    partition.times.clear();
+  }
+
+  std::vector<llvm::Function *> new_funcs;
+  new_funcs.reserve(func_names.size());
+  for (const auto &name : func_names) {
+    auto func = module.getFunction(name);
+    CHECK(func != nullptr) << "Lost function " << name
+                           << " during optimization";
+    new_funcs.push_back(func);
+  }
+
+  for (const auto &global : externalized) {
+    if (auto gv = module.getNamedValue(global.name); gv) {
+      gv->setLinkage(global.linkage);
+      if (global.was_unnamed) {
+        gv->setName("");
+      }
+    }
+  }
+
+  return new_funcs;
+}
+
+// Remove the functions that have used up their optimization budget from
+// `funcs`, recording them in `over_budget`.
+static void
+RemoveFunctionsOverBudget(std::vector<llvm::Function *> &funcs,
+                          const FunctionTimes &times,
+                          const OptimizationOptions &options,
+                          std::unordered_set<std::string> &over_budget) {
+  if (!options.max_function_ms) {
+    return;
+  }
+
+  const auto max_us = static_cast<int64_t>(options.max_function_ms * 1000u);
+  auto is_over_budget = [&](llvm::Function *func) {
+    if (!func->hasName()) {
+      return false;
+    }
+
+    auto name = func->getName().str();
+    if (over_budget.count(name)) {
+      return true;
+    }
+
+    const auto time_it = times.find(name);
+    if (time_it == times.end() || time_it->second <= max_us) {
+      return false;
+    }
+
+    std::stringstream ss;
+    ss << "Function " << name << " exceeded its optimization budget: "
+       << (time_it->second / 1000) << "ms";
+    LOG(WARNING) << ss.str();
+    gBudgetsExceeded.Add();
+    RecordStatEvent("optimize.budget_exceeded", ss.str());
+    over_budget.insert(std::move(name));
+    return true;
+  };
+
+  funcs.erase(std::remove_if(funcs.begin(), funcs.end(), is_over_budget),
+              funcs.end());
 }
 
 }  // namespace
@@ -914,17 +1548,15 @@ static void LowerMemOps(const Program &program, llvm::Module &module) {
 // Optimize a module. This can be a module with semantics code, lifted
 // code, etc.
 void OptimizeModule(const remill::Arch *arch, const Program &program,
-                    llvm::Module &module) {
-
-  if (auto err = module.materializeAll(); remill::IsError(err)) {
-    LOG(FATAL) << remill::GetErrorString(err);
-  }
+                    llvm::Module &module, const OptimizationOptions &options) {
 
   if (auto used = module.getGlobalVariable("llvm.used"); used) {
     used->setLinkage(llvm::GlobalValue::PrivateLinkage);
     used->eraseFromParent();
   }
 
+  ScopedStatTimer timer("OptimizeModule");
+
   auto isels = FindISELs(module);
   LOG(INFO) << "Optimizing module.";
 
@@ -933,6 +1565,12 @@ void OptimizeModule(const remill::Arch *arch, const Program &program,
   RemoveFunction(module, "__remill_intrinsics");
   RemoveFunction(module, "__remill_mark_as_used");
 
+  // NOTE(pag): This comes after removing the ISELs, which otherwise keep all
+  //            semantics alive.
+  if (auto err = MaterializeUsedFunctions(module); remill::IsError(err)) {
+    LOG(FATAL) << remill::GetErrorString(err);
+  }
+
   std::vector<llvm::GlobalVariable *> vars_to_remove;
   for (auto &gv : module.globals()) {
     if (!gv.hasNUsesOrMore(1)) {
@@ -970,37 +1608,39 @@ void OptimizeModule(const remill::Arch *arch, const Program &program,
     memory_escape->eraseFromParent();
   }
 
-  llvm::legacy::PassManager mpm;
-  mpm.add(llvm::createFunctionInliningPass(250));
-  mpm.add(llvm::createGlobalOptimizerPass());
-  mpm.add(llvm::createGlobalDCEPass());
-  mpm.add(llvm::createStripDeadDebugInfoPass());
-  mpm.run(module);
-
-  llvm::legacy::FunctionPassManager fpm(&module);
-  fpm.add(llvm::createEarlyCSEPass(true));
-  fpm.add(llvm::createDeadCodeEliminationPass());
-  fpm.add(llvm::createConstantPropagationPass());
-  fpm.add(llvm::createSinkingPass());
-  fpm.add(llvm::createNewGVNPass());
-  fpm.add(llvm::createSCCPPass());
-  fpm.add(llvm::createDeadStoreEliminationPass());
-  fpm.add(llvm::createSROAPass());
-  fpm.add(llvm::createPromoteMemoryToRegisterPass());
-  fpm.add(llvm::createBitTrackingDCEPass());
-  fpm.add(llvm::createCFGSimplificationPass());
-  fpm.add(llvm::createSinkingPass());
-  fpm.add(llvm::createCFGSimplificationPass());
+  const auto config = GetProfileConfig(options.profile);
 
-  fpm.doInitialization();
-  for (auto &func : module) {
-    fpm.run(func);
+  {
+    llvm::legacy::PassManager mpm;
+    AddModulePasses(mpm, config.inline_threshold);
+    ScopedStatTimer pass_timer("OptimizeModule.ModulePasses");
+    mpm.run(module);
   }
-  fpm.doFinalization();
 
-  RecoverMemoryAccesses(program, module);
+  const auto pipeline =
+      CreateFunctionPipeline(module, options.pass_manager, options.profile);
+
+  // NOTE(pag): Functions that use up their optimization budget are left
+  //            alone from then on, and so are only minimally optimized.
+  FunctionTimes times;
+  std::unordered_set<std::string> over_budget;
+  {
+    std::vector<llvm::Function *> funcs;
+    for (auto &func : module) {
+      funcs.push_back(&func);
+    }
+    funcs = RunFunctionPasses(module, *pipeline, funcs, options, times);
+    RemoveFunctionsOverBudget(funcs, times, options, over_budget);
+  }
 
+  // NOTE(pag): Every custom transformation below adds the functions that it
+  //            changes to `changed_funcs`, and only those functions are
+  //            invalidated and re-optimized.
   std::unordered_set<llvm::Function *> changed_funcs;
+  {
+    ScopedStatTimer pass_timer("OptimizeModule.RecoverMemoryAccesses");
+    RecoverMemoryAccesses(program, module, options.num_jobs, &changed_funcs);
+  }
 
   // These improve optimizability.
   MuteStateEscape(module, "__remill_function_return", changed_funcs);
@@ -1013,72 +1653,89 @@ void OptimizeModule(const remill::Arch *arch, const Program &program,
   RemoveUnusedCalls(module, "__fpclassifyf", changed_funcs);
   RemoveUnusedCalls(module, "__fpclassifyld", changed_funcs);
 
+  for (auto func : changed_funcs) {
+    pipeline->Invalidate(*func);
+  }
 
-  do {
-
-    RemoveUndefMemoryReads(module, "__remill_read_memory_8", changed_funcs);
-    RemoveUndefMemoryReads(module, "__remill_read_memory_16", changed_funcs);
-    RemoveUndefMemoryReads(module, "__remill_read_memory_32", changed_funcs);
-    RemoveUndefMemoryReads(module, "__remill_read_memory_64", changed_funcs);
-    RemoveUndefMemoryReads(module, "__remill_read_memory_f32", changed_funcs);
-    RemoveUndefMemoryReads(module, "__remill_read_memory_f64", changed_funcs);
-    RemoveUndefMemoryReads(module, "__remill_read_memory_f80", changed_funcs);
-
-    RemoveUndefMemoryWrites(module, "__remill_write_memory_8", changed_funcs);
-    RemoveUndefMemoryWrites(module, "__remill_write_memory_16", changed_funcs);
-    RemoveUndefMemoryWrites(module, "__remill_write_memory_32", changed_funcs);
-    RemoveUndefMemoryWrites(module, "__remill_write_memory_64", changed_funcs);
-    RemoveUndefMemoryWrites(module, "__remill_write_memory_f32", changed_funcs);
-    RemoveUndefMemoryWrites(module, "__remill_write_memory_f64", changed_funcs);
-    RemoveUndefMemoryWrites(module, "__remill_write_memory_f80", changed_funcs);
-
-    llvm::legacy::FunctionPassManager pm(&module);
-    pm.add(llvm::createDeadCodeEliminationPass());
-    pm.add(llvm::createSROAPass());
-    pm.add(llvm::createPromoteMemoryToRegisterPass());
-
-    fpm.doInitialization();
-    for (auto func : changed_funcs) {
-      fpm.run(*func);
+  {
+    ScopedStatTimer fixpoint_timer("OptimizeModule.MemoryFixpoint");
+    const auto memory_intrinsics = FindMemoryIntrinsics(module);
+
+    // The first sweep visits every function that accesses memory, and then
+    // later sweeps only revisit the functions that were changed, and thus
+    // re-optimized, by the prior sweep. The functions already changed above
+    // are re-optimized after the first sweep.
+    std::unordered_set<llvm::Function *> funcs_to_visit = changed_funcs;
+    FindMemoryIntrinsicCallers(memory_intrinsics, funcs_to_visit);
+
+    std::vector<llvm::CallInst *> to_remove;
+
+    for (auto iteration = 1u; !funcs_to_visit.empty(); ++iteration) {
+      gFixpointIterations.Add();
+
+      for (auto func : funcs_to_visit) {
+        if (!over_budget.empty() && over_budget.count(func->getName().str())) {
+          continue;
+        }
+
+        if (RewriteMemoryIntrinsics(program, memory_intrinsics, *func,
+                                    to_remove)) {
+          pipeline->Invalidate(*func, true /* preserves_cfg */);
+          changed_funcs.insert(func);
+        }
+      }
+
+      gFunctionsChanged.Add(changed_funcs.size());
+      std::vector<llvm::Function *> funcs(changed_funcs.begin(),
+                                          changed_funcs.end());
+      changed_funcs.clear();
+      RemoveFunctionsOverBudget(funcs, times, options, over_budget);
+
+      // NOTE(pag): Optimizing the functions may replace them.
+      funcs = RunFunctionPasses(module, *pipeline, funcs, options, times);
+      RemoveFunctionsOverBudget(funcs, times, options, over_budget);
+      funcs_to_visit.clear();
+      funcs_to_visit.insert(funcs.begin(), funcs.end());
+
+      if (config.max_fixpoint_iterations &&
+          iteration >= config.max_fixpoint_iterations) {
+        break;
+      }
     }
-    fpm.doFinalization();
+  }
 
+  // Re-optimize the functions in `changed_funcs`, which only had
+  // instructions added or removed.
+  auto reoptimize_changed_funcs = [&](void) {
+    std::vector<llvm::Function *> funcs(changed_funcs.begin(),
+                                        changed_funcs.end());
     changed_funcs.clear();
+    for (auto func : funcs) {
+      pipeline->Invalidate(*func, true /* preserves_cfg */);
+    }
+    gFunctionsChanged.Add(funcs.size());
+    RemoveFunctionsOverBudget(funcs, times, options, over_budget);
+    RunFunctionPasses(module, *pipeline, funcs, options, times);
+  };
 
-    ReplaceConstMemoryReads(program, module, "__remill_read_memory_8",
-                            changed_funcs);
-    ReplaceConstMemoryReads(program, module, "__remill_read_memory_16",
-                            changed_funcs);
-    ReplaceConstMemoryReads(program, module, "__remill_read_memory_32",
-                            changed_funcs);
-    ReplaceConstMemoryReads(program, module, "__remill_read_memory_64",
-                            changed_funcs);
-    ReplaceConstMemoryReads(program, module, "__remill_read_memory_f32",
-                            changed_funcs);
-    ReplaceConstMemoryReads(program, module, "__remill_read_memory_f64",
-                            changed_funcs);
-
-    //  ReplaceConstMemoryReads(
-    //      program, module, "__remill_read_memory_f80", changed_funcs,
-    //      fp80_type);
-  } while (!changed_funcs.empty());
-
-  LowerMemOps(program, module);
-
-  llvm::legacy::FunctionPassManager pm(&module);
-  pm.add(llvm::createDeadCodeEliminationPass());
-  pm.add(llvm::createSROAPass());
-  pm.add(llvm::createPromoteMemoryToRegisterPass());
-
-  fpm.doInitialization();
-  for (auto &func : module) {
-    fpm.run(func);
+  {
+    ScopedStatTimer pass_timer("OptimizeModule.LowerMemOps");
+    LowerMemOps(program, module, changed_funcs);
   }
-  fpm.doFinalization();
+  reoptimize_changed_funcs();
 
-  RemoveUnneededInlineAsm(program, module);
+  {
+    ScopedStatTimer pass_timer("OptimizeModule.RemoveUnneededInlineAsm");
+    RemoveUnneededInlineAsm(program, module, changed_funcs);
+  }
+  reoptimize_changed_funcs();
 
-  mpm.run(module);
+  {
+    llvm::legacy::PassManager mpm;
+    AddModulePasses(mpm, config.inline_threshold);
+    ScopedStatTimer pass_timer("OptimizeModule.ModulePasses");
+    mpm.run(module);
+  }
 
   RemoveUndefFuncCalls(module);
 
@@ -0,0 +1,344 @@
+/*
+ * Copyright (c) 2020 Trail of Bits, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "anvill/Partition.h"
+
+#include <glog/logging.h>
+#include <remill/Arch/Arch.h>
+#include <remill/Arch/Instruction.h>
+
+#include <algorithm>
+#include <queue>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "anvill/Decl.h"
+#include "anvill/Program.h"
+#include "anvill/Stats.h"
+
+namespace anvill {
+namespace {
+
+static StatCounter gPartitionedFunctions("partition.functions");
+static StatCounter gPartitionedCalls("partition.calls");
+static StatCounter gCutCalls("partition.cut_calls");
+
+// NOTE(pag): This bounds the cost of finding the callees of a function whose
+//            bounds are wrong, e.g. one that falls through into padding.
+static constexpr uint64_t kMaxInstructionsPerFunction = 1u << 16;
+
+// The direct callees of one function, and the code decoded to find them.
+struct FunctionCalls {
+
+  // Indices of the callees into `Program::Functions`, with one entry for
+  // each call site.
+  std::vector<size_t> callees;
+
+  // The `[begin, end)` address ranges of the decoded instructions.
+  std::vector<std::pair<uint64_t, uint64_t>> code_ranges;
+
+  uint64_t num_instructions{0};
+};
+
+// Decode the instruction at `addr` into `inst`, reading up until the first
+// non-executable byte, just like `MCToIRLifter` does.
+static bool DecodeInstruction(const remill::Arch *arch, const Program &program,
+                              uint64_t addr, remill::Instruction &inst) {
+  const auto max_inst_size = arch->MaxInstructionSize();
+  std::string inst_bytes;
+  while (inst_bytes.size() < max_inst_size) {
+    const auto seq_addr = addr + inst_bytes.size();
+    const auto seq =
+        program.FindBytes(seq_addr, max_inst_size - inst_bytes.size());
+    if (!seq) {
+      break;
+    }
+
+    const auto data = seq.ToString();
+    const auto num_bytes =
+        static_cast<size_t>(seq.FindNextNonExecutable(seq_addr) - seq_addr);
+
+    inst_bytes.append(data.data(), num_bytes);
+    if (num_bytes < data.size()) {
+      break;
+    }
+  }
+
+  inst.Reset();
+  return !inst_bytes.empty() &&
+         arch->DecodeInstruction(addr, inst_bytes, inst);
+}
+
+// Sort `ranges` and merge the ones that overlap or touch.
+static void MergeRanges(std::vector<std::pair<uint64_t, uint64_t>> &ranges) {
+  std::sort(ranges.begin(), ranges.end());
+  size_t num_merged = 0u;
+  for (const auto &range : ranges) {
+    if (num_merged && range.first <= ranges[num_merged - 1u].second) {
+      auto &last = ranges[num_merged - 1u];
+      last.second = std::max(last.second, range.second);
+    } else {
+      ranges[num_merged++] = range;
+    }
+  }
+  ranges.resize(num_merged);
+}
+
+// Find the callees of `decl` by following its direct control flow from its
+// entry point. Like in `MCToIRLifter`, a jump to the entry point of another
+// function is a tail-call, and the known targets of indirect jumps and calls
+// come from the extended metadata of the program.
+static FunctionCalls
+FindCalls(const remill::Arch *arch, const Program &program,
+          const FunctionDecl &decl,
+          const std::unordered_map<uint64_t, size_t> &func_indices) {
+  FunctionCalls calls;
+  std::vector<uint64_t> work_list = {decl.address};
+  std::unordered_set<uint64_t> seen = {decl.address};
+
+  auto add_callee = [&](uint64_t target) {
+    if (target == decl.address) {
+      return false;
+    }
+    auto it = func_indices.find(target);
+    if (it == func_indices.end()) {
+      return false;
+    }
+    calls.callees.push_back(it->second);
+    return true;
+  };
+
+  auto add_target = [&](uint64_t target) {
+    if (!add_callee(target) && seen.insert(target).second) {
+      work_list.push_back(target);
+    }
+  };
+
+  remill::Instruction inst;
+  while (!work_list.empty() &&
+         calls.num_instructions < kMaxInstructionsPerFunction) {
+    const auto pc = work_list.back();
+    work_list.pop_back();
+    if (!DecodeInstruction(arch, program, pc, inst)) {
+      continue;
+    }
+
+    calls.num_instructions += 1u;
+    calls.code_ranges.emplace_back(pc, pc + inst.bytes.size());
+
+    const auto ext_meta = program.FindExtendedMeta(pc);
+    switch (inst.category) {
+      case remill::Instruction::kCategoryNormal:
+      case remill::Instruction::kCategoryNoOp:
+      case remill::Instruction::kCategoryAsyncHyperCall:
+      case remill::Instruction::kCategoryConditionalAsyncHyperCall:
+        if (seen.insert(inst.next_pc).second) {
+          work_list.push_back(inst.next_pc);
+        }
+        break;
+
+      case remill::Instruction::kCategoryDirectJump:
+        add_target(inst.branch_taken_pc);
+        break;
+
+      case remill::Instruction::kCategoryConditionalBranch:
+        add_target(inst.branch_taken_pc);
+        add_target(inst.branch_not_taken_pc);
+        break;
+
+      case remill::Instruction::kCategoryIndirectJump:
+        if (ext_meta) {
+          for (auto target : ext_meta->targets) {
+            add_target(target);
+          }
+        }
+        break;
+
+      case remill::Instruction::kCategoryDirectFunctionCall:
+        add_callee(inst.branch_taken_pc);
+        if (seen.insert(inst.next_pc).second) {
+          work_list.push_back(inst.next_pc);
+        }
+        break;
+
+      case remill::Instruction::kCategoryIndirectFunctionCall:
+        if (ext_meta) {
+          for (auto target : ext_meta->targets) {
+            add_callee(target);
+          }
+        }
+        if (seen.insert(inst.next_pc).second) {
+          work_list.push_back(inst.next_pc);
+        }
+        break;
+
+      default: break;
+    }
+  }
+
+  MergeRanges(calls.code_ranges);
+  return calls;
+}
+
+}  // namespace
+
+// Split the functions of `program` into at most `num_partitions` partitions.
+//
+// NOTE(pag): This greedily grows one partition at a time from its biggest
+//            unassigned function, always adding the unassigned function
+//            with the most call sites to or from the partition, until the
+//            partition holds its share of the instructions. Disconnected
+//            parts of the call graph are started from their biggest function.
+std::vector<ProgramPartition> PartitionProgram(const remill::Arch *arch,
+                                               const Program &program,
+                                               unsigned num_partitions) {
+  const auto funcs = program.Functions();
+  std::vector<ProgramPartition> partitions;
+  if (funcs.empty()) {
+    return partitions;
+  }
+
+  std::unordered_map<uint64_t, size_t> func_indices;
+  for (size_t i = 0u; i < funcs.size(); ++i) {
+    func_indices.emplace(funcs[i]->address, i);
+  }
+
+  // The call graph, without direction, with the number of call sites
+  // between each pair of functions.
+  std::vector<FunctionCalls> calls;
+  std::vector<std::unordered_map<size_t, uint64_t>> neighbors(funcs.size());
+  uint64_t total_insts = 0u;
+  calls.reserve(funcs.size());
+  for (size_t i = 0u; i < funcs.size(); ++i) {
+    calls.push_back(FindCalls(arch, program, *funcs[i], func_indices));
+    total_insts += std::max<uint64_t>(1u, calls[i].num_instructions);
+    for (auto callee : calls[i].callees) {
+      if (callee != i) {
+        neighbors[i][callee] += 1u;
+        neighbors[callee][i] += 1u;
+        gPartitionedCalls.Add();
+      }
+    }
+  }
+
+  num_partitions = static_cast<unsigned>(
+      std::min<size_t>(std::max(1u, num_partitions), funcs.size()));
+  const auto target_insts =
+      (total_insts + num_partitions - 1u) / num_partitions;
+
+  // Seeds, biggest first.
+  std::vector<size_t> seeds(funcs.size());
+  for (size_t i = 0u; i < seeds.size(); ++i) {
+    seeds[i] = i;
+  }
+  std::stable_sort(seeds.begin(), seeds.end(), [&](size_t a, size_t b) {
+    return calls[a].num_instructions > calls[b].num_instructions;
+  });
+
+  constexpr auto kUnassigned = ~0u;
+  std::vector<unsigned> assignment(funcs.size(), kUnassigned);
+  std::vector<uint64_t> gains(funcs.size(), 0u);
+  auto next_seed = seeds.begin();
+
+  partitions.resize(num_partitions);
+  for (auto p = 0u; p < num_partitions; ++p) {
+    auto &partition = partitions[p];
+    const auto is_last = (p + 1u) == num_partitions;
+
+    // Max-heap of candidate functions by their number of call sites to or
+    // from the partition. Entries go stale as the gains grow, and are
+    // skipped once their function has been assigned.
+    std::priority_queue<std::pair<uint64_t, size_t>> frontier;
+    std::vector<size_t> touched;
+
+    auto add = [&](size_t i) {
+      assignment[i] = p;
+      partition.functions.push_back(funcs[i]);
+      partition.num_instructions += calls[i].num_instructions;
+      partition.code_ranges.insert(partition.code_ranges.end(),
+                                   calls[i].code_ranges.begin(),
+                                   calls[i].code_ranges.end());
+      for (const auto &[neighbor, num_calls] : neighbors[i]) {
+        if (assignment[neighbor] == kUnassigned) {
+          if (!gains[neighbor]) {
+            touched.push_back(neighbor);
+          }
+          gains[neighbor] += num_calls;
+          frontier.emplace(gains[neighbor], neighbor);
+        }
+      }
+    };
+
+    uint64_t num_insts = 0u;
+    while (is_last || num_insts < target_insts) {
+      size_t next = funcs.size();
+      while (!frontier.empty()) {
+        const auto [gain, i] = frontier.top();
+        frontier.pop();
+        if (assignment[i] == kUnassigned && gain == gains[i]) {
+          next = i;
+          break;
+        }
+      }
+
+      if (next == funcs.size()) {
+        while (next_seed != seeds.end() &&
+               assignment[*next_seed] != kUnassigned) {
+          ++next_seed;
+        }
+        if (next_seed == seeds.end()) {
+          break;
+        }
+        next = *next_seed;
+      }
+
+      add(next);
+      num_insts += std::max<uint64_t>(1u, calls[next].num_instructions);
+    }
+
+    for (auto i : touched) {
+      gains[i] = 0u;
+    }
+
+    MergeRanges(partition.code_ranges);
+    gPartitionedFunctions.Add(partition.functions.size());
+  }
+
+  // NOTE(pag): Partitions are only left empty if there were fewer
+  //            instructions than partitions.
+  partitions.erase(
+      std::remove_if(partitions.begin(), partitions.end(),
+                     [](const ProgramPartition &partition) {
+                       return partition.functions.empty();
+                     }),
+      partitions.end());
+
+  for (size_t i = 0u; i < funcs.size(); ++i) {
+    for (auto callee : calls[i].callees) {
+      if (assignment[i] != assignment[callee]) {
+        gCutCalls.Add();
+      }
+    }
+  }
+
+  DLOG(INFO) << "Split " << funcs.size() << " functions into "
+             << partitions.size() << " partitions";
+  return partitions;
+}
+
+}  // namespace anvill
@@ -18,15 +18,20 @@
 #include "anvill/Program.h"
 
 #include <glog/logging.h>
+#include <llvm/ADT/DenseSet.h>
 #include <llvm/ADT/SmallVector.h>
 #include <llvm/IR/DerivedTypes.h>
 #include <llvm/IR/Type.h>
+#include <llvm/Support/Allocator.h>
+#include <llvm/Support/StringSaver.h>
 #include <remill/Arch/Arch.h>
 #include <remill/Arch/Name.h>
 #include <remill/BC/Util.h>
 
 #include <algorithm>
-#include <map>
+#include <atomic>
+#include <cstring>
+#include <mutex>
 #include <sstream>
 #include <system_error>
 #include <tuple>
@@ -88,11 +93,130 @@ static_assert(sizeof(Byte::Data) == sizeof(uint8_t),
 static_assert(sizeof(Byte::Meta) == sizeof(uint8_t),
               "Invalid packing of `struct Byte::Meta`.");
 
-enum ProgramEvent {
-  kFunctionDeclared,
-  kFunctionDefined,
-  kGlobalVariableDeclared,
-  kGlobalVariableDefined
+// Number of bytes covered by one lazily-allocated page of metadata.
+static constexpr uint64_t kMetaPageSize = 4096u;
+
+// Backing storage for a mapped range of bytes.
+//
+// NOTE(pag): Externally-backed ranges (e.g. memory-mapped files) don't
+//            copy their data into `data`, and allocate their metadata
+//            lazily, one page at a time, into `meta_pages`. The last byte
+//            of each metadata page is marked as if the next byte starts
+//            a new range, so that `Program::FindNextByte` will go and
+//            find the next page.
+struct RangeStorage {
+  ~RangeStorage(void) {
+    for (size_t i = 0; i < num_meta_pages; ++i) {
+      delete[] meta_pages[i].load(std::memory_order_relaxed);
+    }
+  }
+
+  // Copy of the bytes of the range. Empty if the bytes are externally owned.
+  std::vector<Byte::Data> data;
+
+  // Eagerly-allocated metadata. Empty if metadata is lazily allocated.
+  std::vector<Byte::Meta> meta;
+
+  // Lazily-allocated pages of metadata, used when `meta` is empty.
+  std::unique_ptr<std::atomic<Byte::Meta *>[]> meta_pages;
+  size_t num_meta_pages{0};
+
+  // Initial metadata for each byte in a lazily-allocated page.
+  Byte::Meta default_meta{};
+
+  // Does the byte after the last byte of this range start a new range?
+  bool next_byte_starts_new_range{false};
+};
+
+// An entry in the flat index of mapped ranges. The index is a sorted,
+// contiguous array of these, which is much friendlier to search than
+// walking the nodes of a `std::map`.
+struct MappedRange {
+  uint64_t base_address;
+  uint64_t limit_address;  // Exclusive.
+  Byte::Data *data;
+  Byte::Meta *meta;  // `nullptr` if metadata is lazily allocated.
+  RangeStorage *storage;
+};
+
+// An index of declarations, sorted by address. The declarations are kept as
+// consecutive runs, each of which is sorted by address and is longer than the
+// runs after it. A declaration that arrives in order extends the last run,
+// and one that arrives out of order starts a new run. Whenever the last run
+// grows to the length of the run before it, the two are merged, much like
+// carrying in a binary counter. Adding declarations in any order therefore
+// costs O(log n) time per declaration, and address-ordered specs, the common
+// case, never have more than one run. Lookups binary search every run, and so
+// the index needs no hash table on the side.
+//
+// NOTE(pag): Runs are kept in the order in which they were started, and the
+//            merges are stable, so that the first of several declarations
+//            with the same address is the one that is found.
+template <typename T>
+class DeclIndex {
+ public:
+  void Add(const T *decl) {
+    if (decls.empty() || decl->address < decls.back()->address) {
+      run_starts.push_back(decls.size());
+    }
+    decls.push_back(decl);
+    MergeRuns(false /* all */);
+  }
+
+  void Sort(void) {
+    MergeRuns(true /* all */);
+  }
+
+  // NOTE(pag): The declarations are owned by the program, which hands out
+  //            mutable pointers to them while it's being built.
+  T *Find(uint64_t address) const {
+    for (size_t i = 0; i < run_starts.size(); ++i) {
+      const auto run_begin =
+          decls.begin() + static_cast<ptrdiff_t>(run_starts[i]);
+      const auto run_end =
+          i + 1u < run_starts.size()
+              ? decls.begin() + static_cast<ptrdiff_t>(run_starts[i + 1u])
+              : decls.end();
+      const auto it = std::lower_bound(
+          run_begin, run_end, address,
+          [](const T *decl, uint64_t ea) { return decl->address < ea; });
+      if (it != run_end && (*it)->address == address) {
+        return const_cast<T *>(*it);
+      }
+    }
+    return nullptr;
+  }
+
+  // The declarations. These are only sorted by address after `Sort`.
+  const std::vector<const T *> &Decls(void) const {
+    return decls;
+  }
+
+ private:
+  static bool ByAddress(const T *a, const T *b) {
+    return a->address < b->address;
+  }
+
+  // Merge the last run into the one before it while it is at least as long,
+  // or, if `all` is `true`, until there is only one run.
+  void MergeRuns(bool all) {
+    while (run_starts.size() > 1u) {
+      const auto last_start = run_starts.back();
+      const auto prev_start = run_starts[run_starts.size() - 2u];
+      if (!all && (decls.size() - last_start) < (last_start - prev_start)) {
+        break;
+      }
+      std::inplace_merge(decls.begin() + static_cast<ptrdiff_t>(prev_start),
+                         decls.begin() + static_cast<ptrdiff_t>(last_start),
+                         decls.end(), ByAddress);
+      run_starts.pop_back();
+    }
+  }
+
+  std::vector<const T *> decls;
+
+  // The index in `decls` of the first declaration of each run.
+  std::vector<size_t> run_starts;
 };
 
 // Default implementation of a program.
@@ -114,38 +238,119 @@ class Program::Impl : public std::enable_shared_from_this<Program::Impl> {
   std::tuple<Byte::Data *, Byte::Meta *, size_t> FindBytes(uint64_t address,
                                                            size_t size);
 
-  llvm::Error MapRange(const ByteRange &range);
+  // Map `size` bytes at `range.address`. If `init` is non-empty, then the
+  // program owns the bytes of the range, and `init` writes them into the
+  // program's storage. Otherwise, the bytes of `range` are referenced
+  // in place.
+  llvm::Error MapRange(const ByteRange &range, uint64_t size,
+                       const std::function<llvm::Error(Byte::Data *)> &init);
 
-  void EmitEvent(ProgramEvent event, uint64_t address) {}
+  llvm::Error MapRanges(const std::vector<ByteRange> &ranges);
 
-  // Mapping between addresses and names.
-  std::multimap<uint64_t, std::string> ea_to_name;
-  std::multimap<std::string, uint64_t> name_to_ea;
+  // Find the mapped range containing `address`, or `nullptr`.
+  const MappedRange *FindRange(uint64_t address);
 
-  // Declarations for the functions.
-  bool funcs_are_sorted{true};
-  std::vector<std::unique_ptr<FunctionDecl>> funcs;
-  std::unordered_map<uint64_t, FunctionDecl *> ea_to_func;
+  // Make sure that `func_index` and `var_index` are sorted by address.
+  void SortFunctions(void);
+  void SortVariables(void);
 
-  // Declarations for the variables.
-  bool vars_are_sorted{true};
-  std::vector<std::unique_ptr<GlobalVarDecl>> vars;
-  std::unordered_map<uint64_t, GlobalVarDecl *> ea_to_var;
+  // Make sure that `names_by_address` and `names_by_name` are sorted.
+  void SortNames(void);
 
-  // Values of all bytes mapped in memory, including additional
-  // bits of metadata, and the address at which each byte is
-  // loaded.
+  // Returns an error if this program is frozen, and so `what` can't be done.
+  llvm::Error CheckNotFrozen(const char *what, uint64_t address) const;
+
+  // Returns the interned copy of `name`, or an empty string if `name` was
+  // never added.
+  llvm::StringRef FindName(std::string_view name) const;
+
+  // Get the metadata for the byte at `offset` within `range`, and the number
+  // of bytes, starting at `offset`, with contiguous metadata.
+  static std::pair<Byte::Meta *, uint64_t> FindMeta(const MappedRange &range,
+                                                    uint64_t offset);
+
+  // Queue up `event` for delivery to the subscribers by `DeliverEvents`.
+  void EmitEvent(ProgramEvent event, uint64_t address);
+
+  // Deliver the queued events to the subscribers. This is called once a
+  // public method that changes the program is done with the change.
+  void DeliverEvents(void);
+
+  // Interned names. Each distinct name is stored once in `name_arena`.
+  llvm::BumpPtrAllocator name_arena;
+  llvm::StringSaver name_saver{name_arena};
+  llvm::DenseSet<llvm::StringRef> interned_names;
+
+  // Mapping between addresses and names. `names_by_address` is sorted by
+  // address, and `names_by_name` is sorted by the address of the interned
+  // name's characters, so that all pairs with the same name are contiguous.
+  // Both sorts are stable, so pairs with the same key remain in the order in
+  // which they were added.
   //
-  // The keys of the maps are the address of the last byte in
-  // the range as represented in the mapped vector. The vectors
-  // are sorted in order.
-  std::map<uint64_t,
-           std::pair<std::vector<Byte::Data>, std::vector<Byte::Meta>>>
-      bytes;
+  // NOTE(pag): Names are added while loading the program, and looked up,
+  //            possibly from many threads, afterward, so the sorting is
+  //            deferred to the first lookup.
+  std::vector<NamedAddress> names_by_address;
+  std::vector<NamedAddress> names_by_name;
+  std::atomic<bool> names_are_sorted{true};
+  std::mutex names_lock;
+
+  // Declarations for the functions and variables, and indexes of them by
+  // address. The declarations are allocated from arenas, which pack them
+  // together in the order in which they were declared, rather than spreading
+  // them across the heap, and which destroy them along with the program.
+  llvm::SpecificBumpPtrAllocator<FunctionDecl> func_arena;
+  DeclIndex<FunctionDecl> func_index;
+
+  llvm::SpecificBumpPtrAllocator<GlobalVarDecl> var_arena;
+  DeclIndex<GlobalVarDecl> var_index;
+
+  // Extended metadata of the bytes whose `Byte::Meta::has_extended_meta` is
+  // set.
+  std::unordered_map<uint64_t, ByteExtendedMeta> extended_meta;
+
+  // Values of all bytes mapped in memory, including additional
+  // bits of metadata. These are in the order in which they were mapped.
+  std::vector<std::unique_ptr<RangeStorage>> range_storage;
+
+  // Sorted index over `range_storage`, keyed by `MappedRange::base_address`.
+  // Ranges never overlap, so this is also sorted by
+  // `MappedRange::limit_address`.
+  std::vector<MappedRange> range_index;
+
+  // Index into `range_index` of the last range found by `FindRange`. Most
+  // lookups (e.g. decoding consecutive instructions) hit the same range as
+  // the previous lookup.
+  std::atomic<size_t> last_range_index{0};
 
   // Initial stack pointer.
   uint64_t initial_stack_pointer{0};
   bool has_initial_stack_pointer{false};
+
+  // Has `Program::Freeze` been called?
+  std::atomic<bool> is_frozen{false};
+
+  // A subscription to events. A subscription that is being delivered a batch
+  // of events is shared with `DeliverEvents`, and so unsubscribing only
+  // marks it as inactive. Its callback is destroyed along with the last
+  // reference to it, which is never while the callback is running.
+  struct EventSubscription {
+    explicit EventSubscription(uint64_t id_, ProgramEventCallback callback_)
+        : id(id_),
+          callback(std::move(callback_)) {}
+
+    const uint64_t id;
+    const ProgramEventCallback callback;
+    bool is_active{true};
+  };
+
+  // Subscribers to events, in the order in which they subscribed.
+  std::vector<std::shared_ptr<EventSubscription>> subscribers;
+  uint64_t next_subscriber_id{1u};
+
+  // Events waiting to be delivered, in the order in which they happened.
+  std::vector<std::pair<ProgramEvent, uint64_t>> pending_events;
+  bool is_delivering_events{false};
 };
 
 namespace {
@@ -208,6 +413,37 @@ static size_t EstimateSize(const remill::Arch *arch, llvm::Type *type) {
   }
 }
 
+// Estimate the memory used by the hash table `map`, assuming one
+// heap-allocated node, holding an entry and a link, per entry.
+template <typename Map>
+static uint64_t HashTableBytes(const Map &map) {
+  return map.bucket_count() * sizeof(void *) +
+         map.size() * (sizeof(typename Map::value_type) + sizeof(void *));
+}
+
+template <typename T>
+static uint64_t VectorBytes(const std::vector<T> &vec) {
+  return vec.capacity() * sizeof(T);
+}
+
+// Returns the declarations in the address-sorted `decls` whose addresses are
+// in the range `[begin_address, end_address)`.
+template <typename T>
+static llvm::ArrayRef<const T *>
+DeclsInRange(const std::vector<const T *> &decls, uint64_t begin_address,
+             uint64_t end_address) {
+  const auto by_address = [](const T *decl, uint64_t address) {
+    return decl->address < address;
+  };
+  const auto begin =
+      std::lower_bound(decls.begin(), decls.end(), begin_address, by_address);
+  const auto end =
+      std::lower_bound(begin, decls.end(), end_address, by_address);
+  return llvm::makeArrayRef(decls).slice(
+      static_cast<size_t>(begin - decls.begin()),
+      static_cast<size_t>(end - begin));
+}
+
 template <typename T>
 static llvm::Error CheckValueDecl(const T &decl, llvm::LLVMContext &context,
                                   const char *desc, const FunctionDecl &tpl) {
@@ -295,27 +531,163 @@ static llvm::Error CheckValueDecl(const T &decl, llvm::LLVMContext &context,
   return llvm::Error::success();
 }
 
+// NOTE(pag): The only bit of metadata that can change once a program is
+//            frozen is `is_undefined`, and so the metadata of bytes is read,
+//            and `is_undefined` is updated, with atomic operations on the
+//            whole byte.
+static Byte::Meta LoadMeta(const Byte::Meta *meta) {
+  const auto bits = __atomic_load_n(reinterpret_cast<const uint8_t *>(meta),
+                                    __ATOMIC_RELAXED);
+  Byte::Meta loaded_meta;
+  memcpy(&loaded_meta, &bits, sizeof(bits));
+  return loaded_meta;
+}
+
+// Returns the bit of `Byte::Meta` that `set_bit` sets.
+template <typename SetBit>
+static uint8_t MetaBit(SetBit set_bit) {
+  Byte::Meta meta = {};
+  set_bit(meta);
+  uint8_t bits = 0;
+  memcpy(&bits, &meta, sizeof(bits));
+  return bits;
+}
+
+static const uint8_t kUndefinedBit =
+    MetaBit([](Byte::Meta &meta) { meta.is_undefined = true; });
+static const uint8_t kWriteableBit =
+    MetaBit([](Byte::Meta &meta) { meta.is_writeable = true; });
+static const uint8_t kExecutableBit =
+    MetaBit([](Byte::Meta &meta) { meta.is_executable = true; });
+static const uint8_t kFunctionHeadBit =
+    MetaBit([](Byte::Meta &meta) { meta.is_function_head = true; });
+static const uint8_t kVariableHeadBit =
+    MetaBit([](Byte::Meta &meta) { meta.is_variable_head = true; });
+
+// Eight bytes of metadata, loaded at once.
+typedef uint64_t __attribute__((may_alias)) MetaWord;
+
+// Returns the index of the first of the `size` bytes of metadata at `meta`
+// in which `bit` is set, or is clear if `want_set` is `false`, or `size` if
+// there is no such byte.
+//
+// NOTE(pag): The bytes are tested a whole word at a time. The words are
+//            aligned, and loaded atomically, so that these loads don't race
+//            with the updates of `is_undefined` by `SetUndefinedImpl`.
+static size_t FindFirstMeta(const Byte::Meta *meta, size_t size, uint8_t bit,
+                            bool want_set) {
+  const auto bytes = reinterpret_cast<const uint8_t *>(meta);
+  const auto matches = [=](size_t i) {
+    const auto bits = __atomic_load_n(&(bytes[i]), __ATOMIC_RELAXED);
+    return ((bits & bit) != 0) == want_set;
+  };
+
+  size_t i = 0;
+  for (; i < size && (reinterpret_cast<uintptr_t>(&(bytes[i])) %
+                      sizeof(MetaWord));
+       ++i) {
+    if (matches(i)) {
+      return i;
+    }
+  }
+
+  const auto word_bits = static_cast<MetaWord>(bit) * 0x0101010101010101ull;
+  for (; (i + sizeof(MetaWord)) <= size; i += sizeof(MetaWord)) {
+    auto word = __atomic_load_n(reinterpret_cast<const MetaWord *>(&(bytes[i])),
+                                __ATOMIC_RELAXED);
+    if (!want_set) {
+      word = ~word;
+    }
+    if (word &= word_bits; word) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+      return i + static_cast<size_t>(__builtin_ctzll(word)) / 8u;
+#else
+      return i + static_cast<size_t>(__builtin_clzll(word)) / 8u;
+#endif
+    }
+  }
+
+  for (; i < size; ++i) {
+    if (matches(i)) {
+      return i;
+    }
+  }
+  return size;
+}
+
 }  // namespace
 
 bool Byte::IsWriteableImpl(void) const {
-  return meta->is_writeable;
+  return LoadMeta(meta).is_writeable;
 }
 
 bool Byte::IsExecutableImpl(void) const {
-  return meta->is_executable;
+  return LoadMeta(meta).is_executable;
 }
 
 bool Byte::IsUndefinedImpl(void) const {
-  return meta->is_undefined;
+  return LoadMeta(meta).is_undefined;
+}
+
+bool Byte::HasExtendedMetaImpl(void) const {
+  return LoadMeta(meta).has_extended_meta;
 }
 
 bool Byte::SetUndefinedImpl(bool is_undef) const {
-  if (meta->is_function_head && !meta->is_variable_head) {
-    meta->is_undefined = is_undef;
-    return true;
-  } else {
+  const auto loaded_meta = LoadMeta(meta);
+  if (!loaded_meta.is_function_head || loaded_meta.is_variable_head) {
     return false;
   }
+
+  const auto bits = reinterpret_cast<uint8_t *>(meta);
+  if (is_undef) {
+    __atomic_fetch_or(bits, kUndefinedBit, __ATOMIC_RELAXED);
+  } else {
+    __atomic_fetch_and(bits, static_cast<uint8_t>(~kUndefinedBit),
+                       __ATOMIC_RELAXED);
+  }
+  return true;
+}
+
+// Returns `true` if any byte in this sequence is writeable.
+bool ByteSequence::IsWriteable(void) const {
+  return FindFirstMeta(first_meta, size, kWriteableBit, true) < size;
+}
+
+// Returns `true` if any byte in this sequence is undefined.
+bool ByteSequence::IsUndefined(void) const {
+  return FindFirstMeta(first_meta, size, kUndefinedBit, true) < size;
+}
+
+uint64_t ByteSequence::FindNextExecutable(uint64_t ea) const {
+  return FindNext(ea, kExecutableBit, true);
+}
+
+uint64_t ByteSequence::FindNextNonExecutable(uint64_t ea) const {
+  return FindNext(ea, kExecutableBit, false);
+}
+
+uint64_t ByteSequence::FindNextFunctionHead(uint64_t ea) const {
+  return FindNext(ea, kFunctionHeadBit, true);
+}
+
+uint64_t ByteSequence::FindNextVariableHead(uint64_t ea) const {
+  return FindNext(ea, kVariableHeadBit, true);
+}
+
+// Returns the address of the first byte at or after `ea` in which `bit` of
+// the metadata is set, or is clear if `want_set` is `false`.
+uint64_t ByteSequence::FindNext(uint64_t ea, uint8_t bit,
+                                bool want_set) const {
+  const auto end = address + size;
+  ea = std::max(ea, address);
+  if (ea >= end) {
+    return end;
+  }
+
+  const auto offset = ea - address;
+  return ea + FindFirstMeta(&(first_meta[offset]),
+                            static_cast<size_t>(size - offset), bit, want_set);
 }
 
 // Convert this byte sequence to a string.
@@ -354,6 +726,9 @@ Byte ByteSequence::operator[](uint64_t ea) const {
 // Declare a function in this view.
 llvm::Expected<FunctionDecl *>
 Program::Impl::DeclareFunction(const FunctionDecl &tpl, bool force) {
+  if (auto err = CheckNotFrozen("declare a function", tpl.address)) {
+    return std::move(err);
+  }
 
   const auto [data, meta] = FindByte(tpl.address);
   if (meta) {
@@ -511,19 +886,11 @@ Program::Impl::DeclareFunction(const FunctionDecl &tpl, bool force) {
         tpl.address);
   }
 
-  std::unique_ptr<FunctionDecl> decl(new FunctionDecl(std::move(tpl)));
-  const auto decl_ptr = decl.get();
+  const auto decl_ptr = new (func_arena.Allocate()) FunctionDecl(tpl);
   decl_ptr->return_address = return_address;
   decl_ptr->owner = this;
-  decl->type = func_type;
-
-  if (funcs_are_sorted && !funcs.empty() &&
-      funcs.back()->address > decl->address) {
-    funcs_are_sorted = false;
-  }
-
-  funcs.emplace_back(std::move(decl));
-  ea_to_func.emplace(decl_ptr->address, decl_ptr);
+  decl_ptr->type = func_type;
+  func_index.Add(decl_ptr);
 
   if (meta) {
     meta->is_function_head = true;
@@ -537,17 +904,14 @@ Program::Impl::DeclareFunction(const FunctionDecl &tpl, bool force) {
 
 // Search for a specific function.
 FunctionDecl *Program::Impl::FindFunction(uint64_t address) {
-  const auto it = ea_to_func.find(address);
-  if (it != ea_to_func.end()) {
-    return it->second;
-  } else {
-    return nullptr;
-  }
+  return func_index.Find(address);
 }
 
 // Declare a variable in this view.
 llvm::Error Program::Impl::DeclareVariable(const GlobalVarDecl &tpl) {
-
+  if (auto err = CheckNotFrozen("declare a variable", tpl.address)) {
+    return err;
+  }
 
   if (auto existing_decl = FindVariable(tpl.address); existing_decl) {
     return llvm::createStringError(
@@ -570,18 +934,9 @@ llvm::Error Program::Impl::DeclareVariable(const GlobalVarDecl &tpl) {
   }
 
   auto [data, meta] = FindByte(tpl.address);
-  std::unique_ptr<GlobalVarDecl> decl(new GlobalVarDecl(tpl));
-
-  const auto decl_ptr = decl.get();
+  const auto decl_ptr = new (var_arena.Allocate()) GlobalVarDecl(tpl);
   decl_ptr->owner = this;
-
-  if (vars_are_sorted && !vars.empty() &&
-      vars.back()->address > decl->address) {
-    vars_are_sorted = false;
-  }
-
-  vars.emplace_back(std::move(decl));
-  ea_to_var.emplace(decl_ptr->address, decl_ptr);
+  var_index.Add(decl_ptr);
 
   if (meta) {
     (void) data;
@@ -596,46 +951,94 @@ llvm::Error Program::Impl::DeclareVariable(const GlobalVarDecl &tpl) {
 
 // Search for a specific variable.
 GlobalVarDecl *Program::Impl::FindVariable(uint64_t address) {
-  const auto it = ea_to_var.find(address);
-  if (it != ea_to_var.end()) {
-    return it->second;
+  return var_index.Find(address);
+}
+
+// Find the mapped range containing `address`, or `nullptr`.
+const MappedRange *Program::Impl::FindRange(uint64_t address) {
+  const auto num_ranges = range_index.size();
+  if (!num_ranges) {
+    return nullptr;
+  }
+
+  const auto ranges = range_index.data();
+
+  // Fast path: the same range as the last lookup.
+  const auto last_index = last_range_index.load(std::memory_order_relaxed);
+  if (last_index < num_ranges) {
+    const auto &last = ranges[last_index];
+    if (last.base_address <= address && address < last.limit_address) {
+      return &last;
+    }
+  }
+
+  // Branchless binary search for the last range whose base address is
+  // less than or equal to `address`.
+  auto base = ranges;
+  for (auto n = num_ranges; n > 1u;) {
+    const auto half = n / 2u;
+    base = (base[half].base_address <= address) ? &(base[half]) : base;
+    n -= half;
+  }
+
+  if (base->base_address <= address && address < base->limit_address) {
+    last_range_index.store(static_cast<size_t>(base - ranges),
+                           std::memory_order_relaxed);
+    return base;
   } else {
     return nullptr;
   }
 }
 
-// Access memory, looking for a specific byte. Returns
-// a reference to the found byte, or to an invalid byte.
-std::pair<Byte::Data *, Byte::Meta *>
-Program::Impl::FindByte(uint64_t address) {
-  uint64_t limit_address = 0;
-  std::vector<Byte::Data> *mapped_data = nullptr;
-  std::vector<Byte::Meta> *mapped_meta = nullptr;
-
-  auto it = bytes.upper_bound(address);
-  if (it == bytes.end()) {
-    const auto rit = bytes.rbegin();
-    if (rit == bytes.rend()) {
-      return {nullptr, nullptr};
-
-    } else if (rit->first == address) {
-      limit_address = rit->first;
-      mapped_data = &(rit->second.first);
-      mapped_meta = &(rit->second.second);
+// Get the metadata for the byte at `offset` within `range`, and the number
+// of bytes, starting at `offset`, with contiguous metadata.
+std::pair<Byte::Meta *, uint64_t>
+Program::Impl::FindMeta(const MappedRange &range, uint64_t offset) {
+  const auto range_size = range.limit_address - range.base_address;
+  if (range.meta) {
+    return {&(range.meta[offset]), range_size - offset};
+  }
+
+  const auto storage = range.storage;
+  const auto page_index = offset / kMetaPageSize;
+  const auto page_base = page_index * kMetaPageSize;
+  const auto page_size = std::min(kMetaPageSize, range_size - page_base);
+  const auto page_offset = offset - page_base;
+
+  auto &page_ptr = storage->meta_pages[page_index];
+  auto page = page_ptr.load(std::memory_order_acquire);
+  if (!page) {
+    auto new_page = new Byte::Meta[page_size];
+    std::fill(new_page, &(new_page[page_size]), storage->default_meta);
+
+    auto &last_meta = new_page[page_size - 1u];
+    last_meta.next_byte_is_in_range = false;
+    if ((page_base + page_size) < range_size) {
+      last_meta.next_byte_starts_new_range = true;
     } else {
-      return {nullptr, nullptr};
+      last_meta.next_byte_starts_new_range =
+          storage->next_byte_starts_new_range;
     }
 
-  } else {
-    limit_address = it->first;
-    mapped_data = &(it->second.first);
-    mapped_meta = &(it->second.second);
+    // NOTE(pag): Another thread may have beaten us to allocating this page.
+    if (page_ptr.compare_exchange_strong(page, new_page,
+                                         std::memory_order_acq_rel)) {
+      page = new_page;
+    } else {
+      delete[] new_page;
+    }
   }
 
-  const auto base_address = limit_address - mapped_data->size();
-  if (base_address <= address && address < limit_address) {
-    const auto offset = address - base_address;
-    return {&((*mapped_data)[offset]), &((*mapped_meta)[offset])};
+  return {&(page[page_offset]), page_size - page_offset};
+}
+
+// Access memory, looking for a specific byte. Returns
+// a reference to the found byte, or to an invalid byte.
+std::pair<Byte::Data *, Byte::Meta *>
+Program::Impl::FindByte(uint64_t address) {
+  if (const auto range = FindRange(address); range) {
+    const auto offset = address - range->base_address;
+    return {&(range->data[offset]), FindMeta(*range, offset).first};
   } else {
     return {nullptr, nullptr};
   }
@@ -650,47 +1053,30 @@ Program::Impl::FindBytes(uint64_t address, size_t size) {
     return {nullptr, nullptr, 0};
   }
 
-  uint64_t limit_address = 0;
-  std::vector<Byte::Data> *mapped_data = nullptr;
-  std::vector<Byte::Meta> *mapped_meta = nullptr;
-
-  auto it = bytes.upper_bound(address);
-  if (it == bytes.end()) {
-    const auto rit = bytes.rbegin();
-    if (rit == bytes.rend()) {
-      return {nullptr, nullptr, 0};
-
-    } else if (rit->first == address) {
-      limit_address = rit->first;
-      mapped_data = &(rit->second.first);
-      mapped_meta = &(rit->second.second);
-    } else {
-      return {nullptr, nullptr, 0};
+  if (const auto range = FindRange(address); range) {
+    const auto offset = address - range->base_address;
+    const auto [meta, max_size] = FindMeta(*range, offset);
+    if (size > max_size) {
+      size = static_cast<size_t>(max_size);
     }
-
-  } else {
-    limit_address = it->first;
-    mapped_data = &(it->second.first);
-    mapped_meta = &(it->second.second);
-  }
-
-  const auto base_address = limit_address - mapped_data->size();
-  if (base_address <= address && address < limit_address) {
-    const auto offset = address - base_address;
-    if (size > mapped_data->size()) {
-      size = mapped_data->size();
-    }
-    return {&((*mapped_data)[offset]), &((*mapped_meta)[offset]), size};
+    return {&(range->data[offset]), meta, size};
 
   } else {
     return {nullptr, nullptr, 0};
   }
 }
 
-// Make a byte into the memory of the program.
-llvm::Error Program::Impl::MapRange(const ByteRange &range) {
+// Make a byte into the memory of the program. If `init` is empty, then the
+// bytes of `range` must outlive this program.
+llvm::Error Program::Impl::MapRange(
+    const ByteRange &range, uint64_t size,
+    const std::function<llvm::Error(Byte::Data *)> &init) {
+
+  if (auto err = CheckNotFrozen("map a range", range.address)) {
+    return err;
+  }
 
-  if (range.begin >= range.end) {
+  if (!size) {
     return llvm::createStringError(
         std::make_error_code(std::errc::invalid_argument),
         "Empty or negative-sized byte range for mapped range "
@@ -698,8 +1084,6 @@ llvm::Error Program::Impl::MapRange(const ByteRange &range) {
         range.address);
   }
 
-  const auto size = static_cast<uint64_t>(range.end - range.begin);
-
   // Look for overflow.
   //
   // TODO(pag): I think this is right.
@@ -714,120 +1098,283 @@ llvm::Error Program::Impl::MapRange(const ByteRange &range) {
         range.address);
   }
 
-  // Make sure this range doesn't overlap with another one.
-  for (const auto &existing : bytes) {
-    auto existing_max_address = existing.first;
-    auto existing_min_address =
-        existing_max_address - existing.second.first.size();
-
-    if (existing_min_address >= end_address) {
-      break;
-
-    } else if (existing_max_address <= range.address) {
-      continue;
-
-    } else {
-      return llvm::createStringError(
-          std::make_error_code(std::errc::invalid_argument),
-          "Memory range [%lx, %lx) overlaps with an "
-          "existing range [%lx, %lx)'",
-          range.address, end_address, existing_min_address,
-          existing_max_address);
-    }
+  // Make sure this range doesn't overlap with another one. The ranges in
+  // the index don't overlap, so the only candidate is the first range whose
+  // limit address is after the beginning of this range.
+  const auto next_range = std::upper_bound(
+      range_index.begin(), range_index.end(), range.address,
+      [](uint64_t address, const MappedRange &existing) {
+        return address < existing.limit_address;
+      });
+
+  if (next_range != range_index.end() &&
+      next_range->base_address < end_address) {
+    return llvm::createStringError(
+        std::make_error_code(std::errc::invalid_argument),
+        "Memory range [%lx, %lx) overlaps with an "
+        "existing range [%lx, %lx)'",
+        range.address, end_address, next_range->base_address,
+        next_range->limit_address);
   }
 
-  bool contains_funcs = false;
-
   // Go see if this range is agreeable with any of our function
   // declarations.
-  for (const auto &decl : funcs) {
-    if (range.address <= decl->address && decl->address < end_address) {
-      if (!range.is_executable) {
-        return llvm::createStringError(
-            std::make_error_code(std::errc::invalid_argument),
-            "Memory range [%lx, %lx) is not marked as executable, "
-            "and contains a declared function at %lx",
-            range.address, end_address, decl->address);
-      } else {
-        contains_funcs = true;
-      }
-    }
+  SortFunctions();
+  const auto range_funcs =
+      DeclsInRange(func_index.Decls(), range.address, end_address);
+  if (!range_funcs.empty() && !range.is_executable) {
+    return llvm::createStringError(
+        std::make_error_code(std::errc::invalid_argument),
+        "Memory range [%lx, %lx) is not marked as executable, "
+        "and contains a declared function at %lx",
+        range.address, end_address, range_funcs.front()->address);
   }
 
-  // Make sure the range isn't mapped twice.
-  auto &byte_impls = bytes[end_address];
-  byte_impls.first.reserve(size);
-
   Byte::Meta meta_impl = {};
   meta_impl.is_writeable = range.is_writeable;
   meta_impl.is_executable = range.is_executable;
   meta_impl.next_byte_is_in_range = true;
 
-  byte_impls.first.insert(byte_impls.first.end(), range.begin, range.end);
-  byte_impls.second.insert(byte_impls.second.end(), size, meta_impl);
-  byte_impls.second.back().next_byte_is_in_range = false;
-
-  if (contains_funcs) {
-    for (const auto &decl : funcs) {
-      if (range.address <= decl->address && decl->address < end_address) {
-        if (auto [data, meta] = FindByte(decl->address); meta) {
-          (void) data;
-          meta->is_function_head = true;
-          EmitEvent(kFunctionDefined, decl->address);
-        }
-      }
+  std::unique_ptr<RangeStorage> storage(new RangeStorage);
+  MappedRange index_entry = {range.address, end_address, nullptr, nullptr,
+                             storage.get()};
+
+  if (init) {
+    storage->data.resize(size);
+    if (auto err = init(storage->data.data()); err) {
+      return err;
+    }
+
+    storage->meta.insert(storage->meta.end(), size, meta_impl);
+    storage->meta.back().next_byte_is_in_range = false;
+    index_entry.data = storage->data.data();
+    index_entry.meta = storage->meta.data();
+
+  // NOTE(pag): Nothing ever writes to the data of a byte, so it's safe to
+  //            cast away the `const`.
+  } else {
+    storage->default_meta = meta_impl;
+    storage->num_meta_pages = (size + kMetaPageSize - 1u) / kMetaPageSize;
+    storage->meta_pages.reset(
+        new std::atomic<Byte::Meta *>[storage->num_meta_pages]);
+    for (size_t i = 0; i < storage->num_meta_pages; ++i) {
+      storage->meta_pages[i].store(nullptr, std::memory_order_relaxed);
+    }
+    index_entry.data = const_cast<Byte::Data *>(range.begin);
+  }
+
+  range_storage.emplace_back(std::move(storage));
+
+  // Add the new range into the flat index, keeping it sorted. The range
+  // doesn't overlap with any other, so it goes right before `next_range`.
+  range_index.insert(next_range, index_entry);
+  last_range_index.store(0, std::memory_order_relaxed);
+
+  for (auto decl : range_funcs) {
+    if (auto [data, meta] = FindByte(decl->address); meta) {
+      (void) data;
+      meta->is_function_head = true;
+      EmitEvent(kFunctionDefined, decl->address);
     }
   }
 
   // Go see if this range is agreeable with any of our global
   // variable declarations.
-  for (const auto &decl : vars) {
-    if (range.address <= decl->address && decl->address < end_address) {
-      if (auto [data, meta] = FindByte(decl->address); meta) {
-        (void) data;
-        meta->is_variable_head = true;
-        EmitEvent(kGlobalVariableDefined, decl->address);
-      }
+  SortVariables();
+  for (auto decl :
+       DeclsInRange(var_index.Decls(), range.address, end_address)) {
+    if (auto [data, meta] = FindByte(decl->address); meta) {
+      (void) data;
+      meta->is_variable_head = true;
+      EmitEvent(kGlobalVariableDefined, decl->address);
     }
   }
 
   // Mark the last byte in the previous range, if it exists, as having a
   // subsequent byte.
-  if (auto [prev_data, prev_meta] = FindByte(range.address - 1);
-      prev_meta && range.address) {
-    (void) prev_data;
-    prev_meta->next_byte_is_in_range = false;
-    prev_meta->next_byte_starts_new_range = true;
+  if (auto prev_range = FindRange(range.address - 1);
+      prev_range && range.address) {
+    prev_range->storage->next_byte_starts_new_range = true;
+    if (auto [prev_data, prev_meta] = FindByte(range.address - 1); prev_meta) {
+      (void) prev_data;
+      prev_meta->next_byte_is_in_range = false;
+      prev_meta->next_byte_starts_new_range = true;
+    }
+  }
+
+  return llvm::Error::success();
+}
+
+// Map several ranges of bytes into the memory of the program. The ranges are
+// sorted once up-front, so that each is inserted at the end of (or near to
+// the end of) the range index. Stops at the first range that fails to map.
+llvm::Error Program::Impl::MapRanges(const std::vector<ByteRange> &ranges) {
+  std::vector<const ByteRange *> sorted_ranges;
+  sorted_ranges.reserve(ranges.size());
+  for (const auto &range : ranges) {
+    sorted_ranges.push_back(&range);
+  }
+
+  std::sort(sorted_ranges.begin(), sorted_ranges.end(),
+            [](const ByteRange *a, const ByteRange *b) {
+              return a->address < b->address;
+            });
+
+  range_index.reserve(range_index.size() + ranges.size());
+  range_storage.reserve(range_storage.size() + ranges.size());
+
+  for (auto range : sorted_ranges) {
+    const auto size = range->begin < range->end
+                          ? static_cast<uint64_t>(range->end - range->begin)
+                          : 0u;
+    auto err = MapRange(*range, size, [range, size](Byte::Data *data) {
+      memcpy(data, range->begin, size);
+      return llvm::Error::success();
+    });
+    if (err) {
+      return err;
+    }
+  }
+
+  return llvm::Error::success();
+}
+
+// Make sure that `func_index` is sorted by address.
+void Program::Impl::SortFunctions(void) {
+  func_index.Sort();
+}
+
+// Make sure that `var_index` is sorted by address.
+void Program::Impl::SortVariables(void) {
+  var_index.Sort();
+}
+
+// Queue up `event` for delivery to the subscribers by `DeliverEvents`.
+void Program::Impl::EmitEvent(ProgramEvent event, uint64_t address) {
+  if (!subscribers.empty()) {
+    pending_events.emplace_back(event, address);
+  }
+}
+
+// Deliver the queued events to the subscribers.
+//
+// NOTE(pag): Events are queued up while the program is being changed, and
+//            only delivered afterward, so that callbacks never observe a
+//            half-done change, e.g. while `MapRange` is marking the heads
+//            of the functions in a newly mapped range. Events emitted by
+//            callbacks are delivered by the outermost call, in order.
+void Program::Impl::DeliverEvents(void) {
+  if (is_delivering_events) {
+    return;
   }
 
+  is_delivering_events = true;
+  std::vector<std::pair<ProgramEvent, uint64_t>> events;
+  while (!pending_events.empty()) {
+    events.clear();
+    events.swap(pending_events);
+
+    // NOTE(pag): Callbacks may subscribe or unsubscribe, so deliver this
+    //            batch to the subscribers as of its start, skipping any that
+    //            unsubscribe along the way.
+    const auto batch_subscribers = subscribers;
+    for (auto [event, address] : events) {
+      for (const auto &sub : batch_subscribers) {
+        if (sub->is_active) {
+          sub->callback(event, address);
+        }
+      }
+    }
+  }
+  is_delivering_events = false;
+}
+
+// Returns an error if this program is frozen, and so `what` can't be done.
+llvm::Error Program::Impl::CheckNotFrozen(const char *what,
+                                          uint64_t address) const {
+  if (is_frozen.load(std::memory_order_acquire)) {
+    return llvm::createStringError(
+        std::make_error_code(std::errc::operation_not_permitted),
+        "Cannot %s at '%lx' in a frozen program", what, address);
+  }
   return llvm::Error::success();
 }
 
+// Make sure that `names_by_address` and `names_by_name` are sorted.
+void Program::Impl::SortNames(void) {
+  if (names_are_sorted.load(std::memory_order_acquire)) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> locker(names_lock);
+  if (names_are_sorted.load(std::memory_order_relaxed)) {
+    return;
+  }
+
+  std::stable_sort(names_by_address.begin(), names_by_address.end(),
+                   [](const NamedAddress &a, const NamedAddress &b) {
+                     return a.address < b.address;
+                   });
+
+  names_by_name = names_by_address;
+  std::stable_sort(names_by_name.begin(), names_by_name.end(),
+                   [](const NamedAddress &a, const NamedAddress &b) {
+                     return std::less<const char *>()(a.name.data(),
+                                                      b.name.data());
+                   });
+
+  names_are_sorted.store(true, std::memory_order_release);
+}
+
+// Returns the interned copy of `name`, or an empty string if `name` was
+// never added.
+llvm::StringRef Program::Impl::FindName(std::string_view name) const {
+  if (const auto it =
+          interned_names.find(llvm::StringRef(name.data(), name.size()));
+      it != interned_names.end()) {
+    return *it;
+  }
+  return {};
+}
+
 Program::Program(void) : impl(std::make_shared<Impl>()) {}
 
 Program::~Program(void) {}
 
+// Finalize the indexes of this program.
+void Program::Freeze(void) const {
+  if (impl->is_frozen.load(std::memory_order_acquire)) {
+    return;
+  }
+
+  impl->SortFunctions();
+  impl->SortVariables();
+  impl->SortNames();
+  impl->is_frozen.store(true, std::memory_order_release);
+}
+
+// Returns `true` if this program has been frozen.
+bool Program::IsFrozen(void) const {
+  return impl->is_frozen.load(std::memory_order_acquire);
+}
+
 // Declare a function in this view. This takes in a function
 // declaration that will act as a sort of "template" for the
 // declaration that we will make and will be owned by `Program`.
 llvm::Expected<FunctionDecl *>
 Program::DeclareFunction(const FunctionDecl &decl, bool force) const {
-  return impl->DeclareFunction(decl, force);
+  auto decl_ptr = impl->DeclareFunction(decl, force);
+  impl->DeliverEvents();
+  return decl_ptr;
 }
 
 // Internal iterator over all functions.
 void Program::ForEachFunction(
     std::function<bool(const FunctionDecl *)> callback) const {
-  if (!impl->funcs_are_sorted) {
-    std::sort(impl->vars.begin(), impl->vars.end(),
-              [](const std::unique_ptr<GlobalVarDecl> &a,
-                 const std::unique_ptr<GlobalVarDecl> &b) {
-                return a->address < b->address;
-              });
-    impl->funcs_are_sorted = true;
-  }
-  for (size_t i = 0; i < impl->funcs.size(); ++i) {
-    if (const auto decl = impl->funcs[i].get()) {
+  impl->SortFunctions();
+  const auto &decls = impl->func_index.Decls();
+  for (size_t i = 0; i < decls.size(); ++i) {
+    if (const auto decl = decls[i]) {
       if (!callback(decl)) {
         return;
       }
@@ -835,6 +1382,20 @@ void Program::ForEachFunction(
   }
 }
 
+// Returns all functions, ordered by address.
+llvm::ArrayRef<const FunctionDecl *> Program::Functions(void) const {
+  impl->SortFunctions();
+  return impl->func_index.Decls();
+}
+
+// Returns the functions whose addresses are in the range
+// `[begin_address, end_address)`, ordered by address.
+llvm::ArrayRef<const FunctionDecl *>
+Program::FunctionsInRange(uint64_t begin_address, uint64_t end_address) const {
+  impl->SortFunctions();
+  return DeclsInRange(impl->func_index.Decls(), begin_address, end_address);
+}
+
 // Search for a specific function by its address.
 const FunctionDecl *Program::FindFunction(uint64_t address) const {
   return impl->FindFunction(address);
@@ -845,12 +1406,9 @@ const FunctionDecl *Program::FindFunction(uint64_t address) const {
 void Program::ForEachFunctionWithName(
     const std::string &name,
     std::function<bool(const FunctionDecl *)> callback) const {
-  const auto func_it_end = impl->ea_to_func.end();
-  for (auto it = impl->name_to_ea.find(name), it_end = impl->name_to_ea.end();
-       it != it_end && it->first == name; ++it) {
-    if (auto func_it = impl->ea_to_func.find(it->second);
-        func_it != func_it_end) {
-      if (!callback(func_it->second)) {
+  for (const auto &named : AddressesOfName(name)) {
+    if (auto decl = impl->func_index.Find(named.address); decl) {
+      if (!callback(decl)) {
         return;
       }
     }
@@ -866,9 +1424,8 @@ void Program::ForEachNameOfAddress(
   const auto func = FindFunction(ea);
   const auto var = FindVariable(ea);
 
-  for (auto it = impl->ea_to_name.find(ea), it_end = impl->ea_to_name.end();
-       it != it_end && it->first == ea; ++it) {
-    if (!callback(it->second, func, var)) {
+  for (const auto &named : NamesOfAddress(ea)) {
+    if (!callback(std::string(named.name), func, var)) {
       return;
     }
   }
@@ -880,9 +1437,8 @@ void Program::ForEachAddressOfName(
     std::function<bool(uint64_t, const FunctionDecl *, const GlobalVarDecl *)>
         callback) const {
 
-  for (auto it = impl->name_to_ea.find(name), it_end = impl->name_to_ea.end();
-       it != it_end && it->first == name; ++it) {
-    const auto ea = it->second;
+  for (const auto &named : AddressesOfName(name)) {
+    const auto ea = named.address;
     const auto func = FindFunction(ea);
     const auto var = FindVariable(ea);
     if (!callback(ea, func, var)) {
@@ -896,48 +1452,99 @@ void Program::ForEachNamedAddress(
     std::function<bool(uint64_t, const std::string &, const FunctionDecl *,
                        const GlobalVarDecl *)>
         callback) const {
-  for (auto it = impl->ea_to_name.begin(), it_end = impl->ea_to_name.end();
-       it != it_end; ++it) {
-    const auto ea = it->first;
+  for (const auto &named : NamedAddresses()) {
+    const auto ea = named.address;
     const auto func = FindFunction(ea);
     const auto var = FindVariable(ea);
-    if (!callback(ea, it->second, func, var)) {
+    if (!callback(ea, std::string(named.name), func, var)) {
       return;
     }
   }
 }
 
+// Returns the names of the address `address`, in the order in which they
+// were added.
+llvm::ArrayRef<NamedAddress> Program::NamesOfAddress(uint64_t address) const {
+  impl->SortNames();
+  const auto [begin, end] = std::equal_range(
+      impl->names_by_address.begin(), impl->names_by_address.end(),
+      NamedAddress{address, {}},
+      [](const NamedAddress &a, const NamedAddress &b) {
+        return a.address < b.address;
+      });
+  return llvm::makeArrayRef(impl->names_by_address)
+      .slice(static_cast<size_t>(begin - impl->names_by_address.begin()),
+             static_cast<size_t>(end - begin));
+}
+
+// Returns the addresses of the named symbol `name`, in the order in which
+// they were added.
+llvm::ArrayRef<NamedAddress>
+Program::AddressesOfName(std::string_view name) const {
+  const auto interned = impl->FindName(name);
+  if (interned.empty()) {
+    return {};
+  }
+
+  impl->SortNames();
+  const auto [begin, end] = std::equal_range(
+      impl->names_by_name.begin(), impl->names_by_name.end(),
+      NamedAddress{0, std::string_view(interned.data(), interned.size())},
+      [](const NamedAddress &a, const NamedAddress &b) {
+        return std::less<const char *>()(a.name.data(), b.name.data());
+      });
+  return llvm::makeArrayRef(impl->names_by_name)
+      .slice(static_cast<size_t>(begin - impl->names_by_name.begin()),
+             static_cast<size_t>(end - begin));
+}
+
+// Returns every address/name pair, ordered by address.
+llvm::ArrayRef<NamedAddress> Program::NamedAddresses(void) const {
+  impl->SortNames();
+  return impl->names_by_address;
+}
+
 // Add a name to an address.
 void Program::AddNameToAddress(const std::string &name,
                                uint64_t address) const {
-  if (!name.empty() && address) {
-    impl->name_to_ea.emplace(name, address);
-    impl->ea_to_name.emplace(address, name);
+  if (name.empty() || !address) {
+    return;
+  }
+
+  if (auto err = impl->CheckNotFrozen("add a name", address)) {
+    LOG(ERROR) << llvm::toString(std::move(err));
+    return;
   }
+
+  auto interned = impl->FindName(name);
+  if (interned.empty()) {
+    interned = impl->name_saver.save(name);
+    impl->interned_names.insert(interned);
+  }
+
+  impl->names_by_address.push_back(
+      {address, std::string_view(interned.data(), interned.size())});
+  impl->names_are_sorted.store(false, std::memory_order_relaxed);
 }
 
 // Declare a variable in this view. This takes in a variable
 // declaration that will act as a sort of "template" for the
 // declaration that we will make and will be owned by `Program`.
 llvm::Error Program::DeclareVariable(const GlobalVarDecl &decl) const {
-  return impl->DeclareVariable(decl);
+  auto err = impl->DeclareVariable(decl);
+  impl->DeliverEvents();
+  return err;
 }
 
 // Internal iterator over all vars.
 void Program::ForEachVariable(
     std::function<bool(const GlobalVarDecl *)> callback) const {
-  if (!impl->vars_are_sorted) {
-    std::sort(impl->vars.begin(), impl->vars.end(),
-              [](const std::unique_ptr<GlobalVarDecl> &a,
-                 const std::unique_ptr<GlobalVarDecl> &b) {
-                return a->address < b->address;
-              });
-    impl->vars_are_sorted = true;
-  }
+  impl->SortVariables();
 
   // NOTE(pag): Size of variables may change.
-  for (size_t i = 0; i < impl->vars.size(); ++i) {
-    if (const auto decl = impl->vars[i].get(); decl) {
+  const auto &decls = impl->var_index.Decls();
+  for (size_t i = 0; i < decls.size(); ++i) {
+    if (const auto decl = decls[i]; decl) {
       if (!callback(decl)) {
         return;
       }
@@ -945,6 +1552,20 @@ void Program::ForEachVariable(
   }
 }
 
+// Returns all variables, ordered by address.
+llvm::ArrayRef<const GlobalVarDecl *> Program::Variables(void) const {
+  impl->SortVariables();
+  return impl->var_index.Decls();
+}
+
+// Returns the variables whose addresses are in the range
+// `[begin_address, end_address)`, ordered by address.
+llvm::ArrayRef<const GlobalVarDecl *>
+Program::VariablesInRange(uint64_t begin_address, uint64_t end_address) const {
+  impl->SortVariables();
+  return DeclsInRange(impl->var_index.Decls(), begin_address, end_address);
+}
+
 // Search for a specific variable by its address.
 const GlobalVarDecl *Program::FindVariable(uint64_t address) const {
   return impl->FindVariable(address);
@@ -954,11 +1575,9 @@ const GlobalVarDecl *Program::FindVariable(uint64_t address) const {
 void Program::ForEachVariableWithName(
     const std::string &name,
     std::function<bool(const GlobalVarDecl *)> callback) const {
-  const auto var_it_end = impl->ea_to_var.end();
-  for (auto it = impl->name_to_ea.find(name), it_end = impl->name_to_ea.end();
-       it != it_end && it->first == name; ++it) {
-    if (auto var_it = impl->ea_to_var.find(it->second); var_it != var_it_end) {
-      if (!callback(var_it->second)) {
+  for (const auto &named : AddressesOfName(name)) {
+    if (auto decl = impl->var_index.Find(named.address); decl) {
+      if (!callback(decl)) {
         return;
       }
     }
@@ -972,13 +1591,71 @@ Byte Program::FindByte(uint64_t address) const {
   return Byte(address, data, meta);
 }
 
+// Attach the extended metadata `meta` to the mapped byte at `address`.
+llvm::Error Program::SetExtendedMeta(uint64_t address,
+                                     ByteExtendedMeta meta) const {
+  if (auto err = impl->CheckNotFrozen("set extended metadata", address)) {
+    return err;
+  }
+
+  auto [data, byte_meta] = impl->FindByte(address);
+  if (!byte_meta) {
+    (void) data;
+    return llvm::createStringError(
+        std::make_error_code(std::errc::bad_address),
+        "Cannot set extended metadata of unmapped byte at '%lx'", address);
+  }
+
+  byte_meta->has_extended_meta = true;
+  impl->extended_meta[address] = std::move(meta);
+  return llvm::Error::success();
+}
+
+// Returns the extended metadata of the byte at `address`, or `nullptr` if it
+// has none.
+//
+// NOTE(pag): The byte's own metadata is checked first, so that the common
+//            case of a byte without extended metadata doesn't need to look
+//            in `extended_meta`.
+const ByteExtendedMeta *Program::FindExtendedMeta(uint64_t address) const {
+  if (impl->extended_meta.empty() || !FindByte(address).HasExtendedMeta()) {
+    return nullptr;
+  }
+
+  const auto it = impl->extended_meta.find(address);
+  if (it != impl->extended_meta.end()) {
+    return &(it->second);
+  } else {
+    return nullptr;
+  }
+}
+
+// Apply a function `cb` to the address and extended metadata of each byte
+// with extended metadata, in order of address.
+void Program::ForEachExtendedMeta(
+    std::function<bool(uint64_t, const ByteExtendedMeta &)> cb) const {
+  std::vector<uint64_t> addresses;
+  addresses.reserve(impl->extended_meta.size());
+  for (const auto &entry : impl->extended_meta) {
+    addresses.push_back(entry.first);
+  }
+
+  std::sort(addresses.begin(), addresses.end());
+  for (auto address : addresses) {
+    if (!cb(address, impl->extended_meta[address])) {
+      return;
+    }
+  }
+}
+
 // Find the next byte.
 Byte Program::FindNextByte(Byte byte) const {
   if (byte.meta) {
-    if (byte.meta->next_byte_is_in_range) {
+    const auto meta = LoadMeta(byte.meta);
+    if (meta.next_byte_is_in_range) {
       return Byte(byte.addr + 1u, &(byte.data[1]), &(byte.meta[1]));
 
-    } else if (byte.meta->next_byte_starts_new_range) {
+    } else if (meta.next_byte_starts_new_range) {
       return FindByte(byte.addr + 1u);
     }
   }
@@ -993,13 +1670,131 @@ ByteSequence Program::FindBytes(uint64_t address, size_t size) const {
   return ByteSequence(address, data, meta, found_size);
 }
 
+// Estimate the memory used by this program.
+ProgramMemoryUsage Program::MemoryUsage(void) const {
+  ProgramMemoryUsage usage;
+
+  for (const auto &range : impl->range_index) {
+    usage.mapped_bytes += range.limit_address - range.base_address;
+  }
+  usage.range_index_bytes = VectorBytes(impl->range_index);
+
+  for (const auto &storage : impl->range_storage) {
+    usage.copied_bytes += VectorBytes(storage->data);
+    usage.meta_bytes += VectorBytes(storage->meta);
+    usage.meta_bytes +=
+        storage->num_meta_pages * sizeof(std::atomic<Byte::Meta *>);
+    for (size_t i = 0; i < storage->num_meta_pages; ++i) {
+      if (storage->meta_pages[i].load(std::memory_order_acquire)) {
+        usage.meta_bytes += kMetaPageSize * sizeof(Byte::Meta);
+      }
+    }
+  }
+  usage.range_index_bytes +=
+      VectorBytes(impl->range_storage) +
+      impl->range_storage.size() * sizeof(RangeStorage);
+
+  usage.extended_meta_bytes = HashTableBytes(impl->extended_meta);
+  for (const auto &[ea, meta] : impl->extended_meta) {
+    usage.extended_meta_bytes += VectorBytes(meta.targets);
+  }
+
+  const auto &funcs = impl->func_index.Decls();
+  usage.function_decl_bytes =
+      VectorBytes(funcs) + funcs.size() * sizeof(FunctionDecl);
+  for (const auto decl : funcs) {
+    usage.function_decl_bytes +=
+        VectorBytes(decl->params) + VectorBytes(decl->returns);
+    for (const auto &param : decl->params) {
+      usage.function_decl_bytes += param.name.capacity();
+    }
+  }
+
+  const auto &vars = impl->var_index.Decls();
+  usage.variable_decl_bytes =
+      VectorBytes(vars) + vars.size() * sizeof(GlobalVarDecl);
+
+  usage.symbol_bytes = impl->name_arena.getTotalMemory() +
+                       impl->interned_names.getMemorySize() +
+                       VectorBytes(impl->names_by_address) +
+                       VectorBytes(impl->names_by_name);
+
+  return usage;
+}
+
 // Map a range of bytes into the program.
 //
 // This expects that none of the bytes already in that range
 // are mapped. There are no requirements on the alignment
 // of the mapped bytes.
 llvm::Error Program::MapRange(const ByteRange &range) {
-  return impl->MapRange(range);
+  const auto size =
+      range.begin < range.end ? static_cast<uint64_t>(range.end - range.begin)
+                              : 0u;
+  auto err = impl->MapRange(range, size, [&range, size](Byte::Data *data) {
+    memcpy(data, range.begin, size);
+    return llvm::Error::success();
+  });
+  impl->DeliverEvents();
+  return err;
+}
+
+// Map a range of `size` bytes into the program, where the bytes are written
+// directly into the program's storage for the range by `init`.
+llvm::Error
+Program::MapRange(uint64_t address, size_t size, bool is_writeable,
+                  bool is_executable,
+                  std::function<llvm::Error(uint8_t *)> init) {
+  ByteRange range;
+  range.address = address;
+  range.is_writeable = is_writeable;
+  range.is_executable = is_executable;
+  auto err = impl->MapRange(range, size, init);
+  impl->DeliverEvents();
+  return err;
+}
+
+// Map several ranges of bytes into the program.
+//
+// This has the same requirements as `MapRange`, but sorts the ranges once
+// up-front, which makes mapping many ranges much cheaper.
+llvm::Error Program::MapRanges(const std::vector<ByteRange> &ranges) {
+  auto err = impl->MapRanges(ranges);
+  impl->DeliverEvents();
+  return err;
+}
+
+// Map a range of bytes into the program without copying them.
+//
+// This has the same requirements as `MapRange`, and additionally requires
+// that the bytes in `[range.begin, range.end)` outlive this program.
+llvm::Error Program::MapExternalRange(const ByteRange &range) {
+  const auto size =
+      range.begin < range.end ? static_cast<uint64_t>(range.end - range.begin)
+                              : 0u;
+  auto err = impl->MapRange(range, size, nullptr);
+  impl->DeliverEvents();
+  return err;
+}
+
+// Subscribe `callback` to the events of this program.
+uint64_t Program::SubscribeToEvents(ProgramEventCallback callback) const {
+  const auto id = impl->next_subscriber_id++;
+  impl->subscribers.push_back(std::make_shared<Impl::EventSubscription>(
+      id, std::move(callback)));
+  return id;
+}
+
+// Stop delivering events to the subscription `id`.
+void Program::UnsubscribeFromEvents(uint64_t id) const {
+  auto &subscribers = impl->subscribers;
+  for (auto it = subscribers.begin(); it != subscribers.end(); ++it) {
+    if ((*it)->id == id) {
+      (*it)->is_active = false;
+      subscribers.erase(it);
+      return;
+    }
+  }
 }
 
 Program::Program(void *opaque)
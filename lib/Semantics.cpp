@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2020 Trail of Bits, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "anvill/Semantics.h"
+
+#include <glog/logging.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/IR/DebugInfo.h>
+#include <llvm/IRReader/IRReader.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/SourceMgr.h>
+#include <llvm/Support/raw_ostream.h>
+#include <remill/Arch/Arch.h>
+#include <remill/Arch/Name.h>
+#include <remill/OS/OS.h>
+
+#include <cctype>
+
+#include "anvill/Stats.h"
+#include "anvill/Version.h"
+
+namespace anvill {
+namespace {
+
+// Bump this whenever the preparation of snapshots changes.
+static constexpr unsigned kSemanticsSnapshotVersion = 1u;
+
+// Returns the path of the snapshot of the semantics of `arch`.
+static std::string SnapshotPath(const remill::Arch *arch,
+                                const std::string &snapshot_dir) {
+  std::string name;
+  llvm::raw_string_ostream os(name);
+  os << remill::GetArchName(arch->arch_name) << '-'
+     << remill::GetOSName(arch->os_name) << "-anvill-"
+     << Version::GetVersionString() << '-' << Version::GetCommitHash()
+     << "-llvm-" << LLVM_VERSION_STRING << "-v" << kSemanticsSnapshotVersion
+     << ".bc";
+  os.flush();
+
+  // NOTE(pag): The version strings can be empty, or contain spaces.
+  for (auto &ch : name) {
+    if (!isalnum(static_cast<unsigned char>(ch)) && ch != '.' && ch != '-' &&
+        ch != '_') {
+      ch = '_';
+    }
+  }
+
+  llvm::SmallString<256> path(snapshot_dir);
+  llvm::sys::path::append(path, name);
+  return path.str().str();
+}
+
+// Prepare the freshly loaded `semantics` to be snapshotted.
+static void PrepareSnapshot(llvm::Module &semantics) {
+  llvm::StripDebugInfo(semantics);
+}
+
+}  // namespace
+
+// Write a snapshot of the semantics of `arch` into `snapshot_dir`, replacing
+// any existing snapshot.
+//
+// NOTE(pag): The snapshot is written to a temporary file that is then renamed,
+//            so that concurrent runs never load partially written snapshots.
+llvm::Error WriteSemanticsSnapshot(const remill::Arch *arch,
+                                   const std::string &snapshot_dir) {
+  ScopedStatTimer timer("WriteSemanticsSnapshot");
+  auto semantics = remill::LoadArchSemantics(arch);
+  if (!semantics) {
+    return llvm::createStringError(
+        std::make_error_code(std::errc::no_such_file_or_directory),
+        "Unable to load the semantics of architecture '%s'",
+        remill::GetArchName(arch->arch_name).c_str());
+  }
+
+  PrepareSnapshot(*semantics);
+
+  if (auto ec = llvm::sys::fs::create_directories(snapshot_dir); ec) {
+    return llvm::createStringError(
+        ec, "Unable to create semantics snapshot directory '%s'",
+        snapshot_dir.c_str());
+  }
+
+  llvm::SmallString<256> tmp_model(snapshot_dir);
+  llvm::sys::path::append(tmp_model, "%%%%%%%%%%%%.tmp");
+
+  int fd = -1;
+  llvm::SmallString<256> tmp_path;
+  if (auto ec = llvm::sys::fs::createUniqueFile(tmp_model, fd, tmp_path); ec) {
+    return llvm::createStringError(
+        ec, "Unable to create temporary file in snapshot directory '%s'",
+        snapshot_dir.c_str());
+  }
+
+  {
+    llvm::raw_fd_ostream os(fd, true /* shouldClose */);
+    llvm::WriteBitcodeToFile(*semantics, os);
+    os.close();
+
+    if (os.has_error()) {
+      os.clear_error();
+      llvm::sys::fs::remove(tmp_path);
+      return llvm::createStringError(
+          std::make_error_code(std::errc::io_error),
+          "Unable to write semantics snapshot into '%s'",
+          snapshot_dir.c_str());
+    }
+  }
+
+  const auto path = SnapshotPath(arch, snapshot_dir);
+  if (auto ec = llvm::sys::fs::rename(tmp_path, path); ec) {
+    llvm::sys::fs::remove(tmp_path);
+    return llvm::createStringError(
+        ec, "Unable to create semantics snapshot '%s'", path.c_str());
+  }
+
+  return llvm::Error::success();
+}
+
+// Load the semantics of `arch`, possibly from a snapshot in `snapshot_dir`.
+llvm::Expected<std::unique_ptr<llvm::Module>>
+LoadSemantics(const remill::Arch *arch, const std::string &snapshot_dir) {
+  if (snapshot_dir.empty()) {
+    ScopedStatTimer timer("LoadArchSemantics");
+    if (auto semantics = remill::LoadArchSemantics(arch); semantics) {
+      return semantics;
+    }
+    return llvm::createStringError(
+        std::make_error_code(std::errc::no_such_file_or_directory),
+        "Unable to load the semantics of architecture '%s'",
+        remill::GetArchName(arch->arch_name).c_str());
+  }
+
+  const auto path = SnapshotPath(arch, snapshot_dir);
+  if (!llvm::sys::fs::exists(path)) {
+    if (auto err = WriteSemanticsSnapshot(arch, snapshot_dir); err) {
+      return std::move(err);
+    }
+  }
+
+  ScopedStatTimer timer("LoadSemanticsSnapshot");
+  llvm::SMDiagnostic diag;
+  auto semantics = llvm::getLazyIRFileModule(path, diag, *(arch->context));
+  if (!semantics) {
+    return llvm::createStringError(
+        std::make_error_code(std::errc::invalid_argument),
+        "Unable to load semantics snapshot '%s': %s", path.c_str(),
+        diag.getMessage().str().c_str());
+  }
+
+  // The lifter clones the body of `__remill_basic_block` into every lifted
+  // function.
+  if (auto bb_func = semantics->getFunction("__remill_basic_block");
+      bb_func && bb_func->isMaterializable()) {
+    if (auto err = bb_func->materialize(); err) {
+      return std::move(err);
+    }
+  }
+
+  return semantics;
+}
+
+}  // namespace anvill
@@ -0,0 +1,266 @@
+/*
+ * Copyright (c) 2020 Trail of Bits, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "anvill/Shard.h"
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/GlobalVariable.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "anvill/Stats.h"
+#include "Extract.h"
+
+namespace anvill {
+namespace {
+
+static StatCounter gShardsWritten("output.shards_written");
+
+// The definitions that go into one shard.
+struct Shard {
+  std::string file_name;
+  std::vector<llvm::GlobalValue *> defs;
+  uint64_t num_insts{0};
+};
+
+static void WriteString(llvm::raw_ostream &os, llvm::StringRef str) {
+  os << '"';
+  for (auto ch : str) {
+    if (ch == '"' || ch == '\\') {
+      os << '\\' << ch;
+    } else if (static_cast<unsigned char>(ch) < 0x20) {
+      os << llvm::format("\\u%04x", static_cast<unsigned>(ch));
+    } else {
+      os << ch;
+    }
+  }
+  os << '"';
+}
+
+// Write the file `name` in the directory `dir` with `write_contents`.
+//
+// NOTE(pag): The data is written to a temporary file that is then renamed,
+//            so that a tool watching `dir` never observes partially written
+//            shards.
+static llvm::Error
+WriteFile(const std::string &dir, const std::string &name,
+          const std::function<void(llvm::raw_ostream &)> &write_contents) {
+  llvm::SmallString<256> tmp_model(dir);
+  llvm::sys::path::append(tmp_model, "%%%%%%%%%%%%.tmp");
+
+  int fd = -1;
+  llvm::SmallString<256> tmp_path;
+  if (auto ec = llvm::sys::fs::createUniqueFile(tmp_model, fd, tmp_path); ec) {
+    return llvm::createStringError(
+        ec, "Unable to create temporary file in shard directory '%s'",
+        dir.c_str());
+  }
+
+  {
+    llvm::raw_fd_ostream os(fd, true /* shouldClose */);
+    write_contents(os);
+    os.close();
+
+    if (os.has_error()) {
+      os.clear_error();
+      llvm::sys::fs::remove(tmp_path);
+      return llvm::createStringError(std::make_error_code(std::errc::io_error),
+                                     "Unable to write '%s' into '%s'",
+                                     name.c_str(), dir.c_str());
+    }
+  }
+
+  llvm::SmallString<256> path(dir);
+  llvm::sys::path::append(path, name);
+  if (auto ec = llvm::sys::fs::rename(tmp_path, path); ec) {
+    llvm::sys::fs::remove(tmp_path);
+    return llvm::createStringError(ec, "Unable to create '%s'",
+                                   path.c_str());
+  }
+
+  return llvm::Error::success();
+}
+
+// Spread the definitions of `module` across `num_shards` shards. Functions
+// are added from largest to smallest, each to the shard with the fewest
+// instructions so far, and variables (and aliases) go into the first shard.
+static std::vector<Shard> PartitionModule(llvm::Module &module,
+                                          unsigned num_shards) {
+  std::vector<std::pair<uint64_t, llvm::Function *>> funcs;
+  for (auto &func : module) {
+    if (!func.isDeclaration() && !func.hasLocalLinkage()) {
+      funcs.emplace_back(func.getInstructionCount(), &func);
+    }
+  }
+
+  num_shards = std::max<unsigned>(
+      1u, std::min<size_t>(num_shards, std::max<size_t>(1u, funcs.size())));
+
+  std::vector<Shard> shards(num_shards);
+  std::stable_sort(
+      funcs.begin(), funcs.end(),
+      [](const auto &a, const auto &b) { return a.first > b.first; });
+
+  std::unordered_map<llvm::GlobalValue *, unsigned> shard_of;
+  for (auto [num_insts, func] : funcs) {
+    auto smallest = 0u;
+    for (auto i = 1u; i < num_shards; ++i) {
+      if (shards[i].num_insts < shards[smallest].num_insts) {
+        smallest = i;
+      }
+    }
+    shards[smallest].num_insts += num_insts + 1u;
+    shard_of.emplace(func, smallest);
+  }
+
+  // NOTE(pag): Definitions are listed in module order, so that the shards and
+  //            the manifest don't depend on how the sort broke ties.
+  for (auto &gv : module.global_values()) {
+    if (auto it = shard_of.find(&gv); it != shard_of.end()) {
+      shards[it->second].defs.push_back(&gv);
+    } else if (!llvm::isa<llvm::Function>(gv) && !gv.isDeclaration() &&
+               !gv.hasLocalLinkage()) {
+      shards[0].defs.push_back(&gv);
+    }
+  }
+
+  return shards;
+}
+
+// Drop the definitions of `shard` from the module, now that they are saved.
+static void DropDefinitions(Shard &shard) {
+  for (auto gv : shard.defs) {
+    if (auto func = llvm::dyn_cast<llvm::Function>(gv); func) {
+      func->deleteBody();
+      func->setComdat(nullptr);
+
+    } else if (auto var = llvm::dyn_cast<llvm::GlobalVariable>(gv); var) {
+      if (var->hasAppendingLinkage()) {
+        var->eraseFromParent();
+      } else {
+        var->setInitializer(nullptr);
+        var->setLinkage(llvm::GlobalValue::ExternalLinkage);
+        var->setComdat(nullptr);
+      }
+    }
+  }
+}
+
+// Write the manifest, which lists each shard and the definitions in it.
+static void WriteManifest(llvm::raw_ostream &os,
+                          const std::vector<Shard> &shards,
+                          const std::vector<std::vector<std::string>> &funcs,
+                          const std::vector<std::vector<std::string>> &vars) {
+  const auto write_names = [&](const std::vector<std::string> &names) {
+    os << '[';
+    auto sep = "";
+    for (const auto &name : names) {
+      os << sep;
+      WriteString(os, name);
+      sep = ", ";
+    }
+    os << ']';
+  };
+
+  os << "{\n  \"shards\": [";
+  auto sep = "\n    ";
+  for (auto i = 0u; i < shards.size(); ++i) {
+    os << sep << "{\"path\": ";
+    WriteString(os, shards[i].file_name);
+    os << ", \"functions\": ";
+    write_names(funcs[i]);
+    os << ", \"variables\": ";
+    write_names(vars[i]);
+    os << '}';
+    sep = ",\n    ";
+  }
+  os << "\n  ]\n}\n";
+}
+
+}  // namespace
+
+// Write `module` out as up to `num_shards` bitcode files in the directory
+// `dir`, along with a manifest.
+llvm::Error WriteModuleShards(llvm::Module &module, const std::string &dir,
+                              unsigned num_shards, bool textual_ir) {
+  ScopedStatTimer timer("WriteModuleShards");
+
+  if (auto ec = llvm::sys::fs::create_directories(dir); ec) {
+    return llvm::createStringError(
+        ec, "Unable to create shard directory '%s'", dir.c_str());
+  }
+
+  auto shards = PartitionModule(module, num_shards);
+
+  // NOTE(pag): The names are recorded up-front, as the definitions are
+  //            dropped from `module` as the shards are written.
+  std::vector<std::vector<std::string>> func_names(shards.size());
+  std::vector<std::vector<std::string>> var_names(shards.size());
+  for (auto i = 0u; i < shards.size(); ++i) {
+    auto &shard = shards[i];
+    std::string file_name;
+    llvm::raw_string_ostream os(file_name);
+    os << "shard-" << llvm::format("%04u", i) << (textual_ir ? ".ll" : ".bc");
+    os.flush();
+    shard.file_name = std::move(file_name);
+
+    for (auto gv : shard.defs) {
+      auto &names = llvm::isa<llvm::Function>(gv) ? func_names[i]
+                                                  : var_names[i];
+      names.push_back(gv->getName().str());
+    }
+  }
+
+  for (auto &shard : shards) {
+    ScopedStatTimer shard_timer("WriteModuleShards.Shard");
+    std::vector<const llvm::GlobalValue *> defs(shard.defs.begin(),
+                                                shard.defs.end());
+    auto extracted = ExtractDefinitions(module, defs);
+    auto err = WriteFile(dir, shard.file_name, [&](llvm::raw_ostream &os) {
+      if (textual_ir) {
+        extracted->print(os, nullptr);
+      } else {
+        llvm::WriteBitcodeToFile(*extracted, os);
+      }
+    });
+    if (err) {
+      return err;
+    }
+
+    extracted.reset();
+    DropDefinitions(shard);
+    gShardsWritten.Add();
+  }
+
+  return WriteFile(dir, "manifest.json", [&](llvm::raw_ostream &os) {
+    WriteManifest(os, shards, func_names, var_names);
+  });
+}
+
+}  // namespace anvill
@@ -0,0 +1,351 @@
+/*
+ * Copyright (c) 2020 Trail of Bits, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "anvill/Stats.h"
+
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/raw_ostream.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#ifdef __APPLE__
+#  include <mach/mach.h>
+#endif
+
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace anvill {
+namespace {
+
+// One execution of a timed phase.
+struct PhaseEvent {
+  const char *name;
+  unsigned thread_id;
+  int64_t start_us;
+  int64_t duration_us;
+};
+
+// One notable event, recorded by `RecordStatEvent`.
+struct NoteEvent {
+  const char *name;
+  std::string description;
+  unsigned thread_id;
+  int64_t time_us;
+};
+
+static std::atomic<bool> gStatsEnabled(false);
+
+// NOTE(pag): These are constant-initialized, and so they are usable by the
+//            constructors of global `StatCounter`s in other files.
+static StatCounter *gFirstCounter = nullptr;
+static StatCounter **gNextCounter = &gFirstCounter;
+
+static std::chrono::steady_clock::time_point &StartTime(void) {
+  static std::chrono::steady_clock::time_point start_time;
+  return start_time;
+}
+
+static std::mutex &EventsLock(void) {
+  static std::mutex events_lock;
+  return events_lock;
+}
+
+static std::vector<PhaseEvent> &Events(void) {
+  static std::vector<PhaseEvent> events;
+  return events;
+}
+
+static std::vector<NoteEvent> &Notes(void) {
+  static std::vector<NoteEvent> notes;
+  return notes;
+}
+
+static int64_t NowUs(void) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now() - StartTime())
+      .count();
+}
+
+// Small, stable identifiers for threads, in the order that they first
+// finish a timed phase.
+static unsigned ThreadId(void) {
+  static std::atomic<unsigned> next_thread_id(1u);
+  thread_local const unsigned thread_id = next_thread_id.fetch_add(1u);
+  return thread_id;
+}
+
+static void WriteString(llvm::raw_ostream &os, llvm::StringRef str) {
+  os << '"';
+  for (auto ch : str) {
+    if (ch == '"' || ch == '\\') {
+      os << '\\' << ch;
+    } else if (static_cast<unsigned char>(ch) < 0x20) {
+      os << llvm::format("\\u%04x", static_cast<unsigned>(ch));
+    } else {
+      os << ch;
+    }
+  }
+  os << '"';
+}
+
+using CounterValues = std::vector<std::pair<const char *, uint64_t>>;
+
+// Report the total time spent in each phase, the value of each counter, and
+// every notable event.
+static void WriteJSON(llvm::raw_ostream &os,
+                      const std::vector<PhaseEvent> &events,
+                      const std::vector<NoteEvent> &notes,
+                      const CounterValues &counters) {
+  struct PhaseTotal {
+    uint64_t count{0};
+    int64_t total_us{0};
+  };
+
+  std::map<std::string, PhaseTotal> totals;
+  for (const auto &event : events) {
+    auto &total = totals[event.name];
+    total.count += 1u;
+    total.total_us += event.duration_us;
+  }
+
+  os << "{\n  \"phases\": {";
+  auto sep = "\n    ";
+  for (const auto &[name, total] : totals) {
+    os << sep;
+    WriteString(os, name);
+    os << ": {\"count\": " << total.count
+       << ", \"total_ms\": " << llvm::format("%.3f", total.total_us / 1000.0)
+       << '}';
+    sep = ",\n    ";
+  }
+
+  os << "\n  },\n  \"counters\": {";
+  sep = "\n    ";
+  for (const auto &[name, value] : counters) {
+    os << sep;
+    WriteString(os, name);
+    os << ": " << value;
+    sep = ",\n    ";
+  }
+
+  os << "\n  },\n  \"events\": [";
+  sep = "\n    ";
+  for (const auto &note : notes) {
+    os << sep << "{\"name\": ";
+    WriteString(os, note.name);
+    os << ", \"description\": ";
+    WriteString(os, note.description);
+    os << '}';
+    sep = ",\n    ";
+  }
+  os << "\n  ]\n}\n";
+}
+
+// Report every timed phase as a complete ("X") event, every notable event as
+// an instant ("i") event, and the counters as one counter ("C") event at the
+// end of the trace.
+static void WriteChromeTrace(llvm::raw_ostream &os,
+                             const std::vector<PhaseEvent> &events,
+                             const std::vector<NoteEvent> &notes,
+                             const CounterValues &counters) {
+  os << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+  auto sep = "\n  ";
+  for (const auto &event : events) {
+    os << sep << "{\"name\": ";
+    WriteString(os, event.name);
+    os << ", \"cat\": \"anvill\", \"ph\": \"X\", \"pid\": 1, \"tid\": "
+       << event.thread_id << ", \"ts\": " << event.start_us
+       << ", \"dur\": " << event.duration_us << '}';
+    sep = ",\n  ";
+  }
+
+  for (const auto &note : notes) {
+    os << sep << "{\"name\": ";
+    WriteString(os, note.name);
+    os << ", \"cat\": \"anvill\", \"ph\": \"i\", \"s\": \"t\", \"pid\": 1, "
+       << "\"tid\": " << note.thread_id << ", \"ts\": " << note.time_us
+       << ", \"args\": {\"description\": ";
+    WriteString(os, note.description);
+    os << "}}";
+    sep = ",\n  ";
+  }
+
+  os << sep << "{\"name\": \"counters\", \"cat\": \"anvill\", \"ph\": \"C\", "
+     << "\"pid\": 1, \"tid\": 0, \"ts\": " << NowUs() << ", \"args\": {";
+  sep = "";
+  for (const auto &[name, value] : counters) {
+    os << sep;
+    WriteString(os, name);
+    os << ": " << value;
+    sep = ", ";
+  }
+  os << "}}\n]}\n";
+}
+
+}  // namespace
+
+// Start recording timers and counters.
+void EnableStats(void) {
+  if (!gStatsEnabled.exchange(true)) {
+    StartTime() = std::chrono::steady_clock::now();
+  }
+}
+
+// Returns `true` if timers and counters are being recorded.
+bool StatsEnabled(void) {
+  return gStatsEnabled.load(std::memory_order_relaxed);
+}
+
+// Returns the peak resident set size of this process so far, in KiB.
+uint64_t PeakResidentSetSizeKiB(void) {
+  struct rusage usage = {};
+  if (getrusage(RUSAGE_SELF, &usage)) {
+    return 0u;
+  }
+
+  // NOTE(pag): macOS reports `ru_maxrss` in bytes, and Linux in KiB.
+#ifdef __APPLE__
+  return static_cast<uint64_t>(usage.ru_maxrss) / 1024u;
+#else
+  return static_cast<uint64_t>(usage.ru_maxrss);
+#endif
+}
+
+// Returns the current resident set size of this process, in KiB, or zero if
+// it can't be determined.
+uint64_t ResidentSetSizeKiB(void) {
+#ifdef __APPLE__
+  mach_task_basic_info_data_t info = {};
+  mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+  if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO,
+                reinterpret_cast<task_info_t>(&info), &count)) {
+    return 0u;
+  }
+  return static_cast<uint64_t>(info.resident_size) / 1024u;
+#else
+
+  // NOTE(pag): The second field of `statm` is the number of resident pages.
+  auto statm = fopen("/proc/self/statm", "r");
+  if (!statm) {
+    return 0u;
+  }
+
+  unsigned long long num_pages = 0;
+  unsigned long long num_resident_pages = 0;
+  const auto num_read =
+      fscanf(statm, "%llu %llu", &num_pages, &num_resident_pages);
+  fclose(statm);
+
+  const auto page_size = sysconf(_SC_PAGESIZE);
+  if (num_read != 2 || page_size <= 0) {
+    return 0u;
+  }
+  return static_cast<uint64_t>(num_resident_pages) *
+         static_cast<uint64_t>(page_size) / 1024u;
+#endif
+}
+
+StatCounter::StatCounter(const char *name_) : name(name_) {
+  *gNextCounter = this;
+  gNextCounter = &next;
+}
+
+ScopedStatTimer::ScopedStatTimer(const char *name_) : name(name_) {
+  if (StatsEnabled()) {
+    start_us = NowUs();
+  }
+}
+
+ScopedStatTimer::~ScopedStatTimer(void) {
+  if (start_us < 0) {
+    return;
+  }
+
+  const auto end_us = NowUs();
+  const auto thread_id = ThreadId();
+  std::lock_guard<std::mutex> locker(EventsLock());
+  Events().push_back({name, thread_id, start_us, end_us - start_us});
+}
+
+// Record a notable event, along with a description of the event.
+void RecordStatEvent(const char *name, std::string description) {
+  if (!StatsEnabled()) {
+    return;
+  }
+
+  const auto time_us = NowUs();
+  const auto thread_id = ThreadId();
+  std::lock_guard<std::mutex> locker(EventsLock());
+  Notes().push_back({name, std::move(description), thread_id, time_us});
+}
+
+// Write out the recorded timers, counters, and events to the file at `path`.
+llvm::Error WriteStats(const std::string &path, const std::string &format) {
+  if (format != "json" && format != "chrome") {
+    return llvm::createStringError(
+        std::make_error_code(std::errc::invalid_argument),
+        "Unsupported stats format '%s'; expected 'json' or 'chrome'",
+        format.c_str());
+  }
+
+  CounterValues counters;
+  for (auto counter = gFirstCounter; counter; counter = counter->next) {
+    counters.emplace_back(counter->name,
+                          counter->value.load(std::memory_order_relaxed));
+  }
+  counters.emplace_back("process.peak_rss_kib", PeakResidentSetSizeKiB());
+
+  std::vector<PhaseEvent> events;
+  std::vector<NoteEvent> notes;
+  {
+    std::lock_guard<std::mutex> locker(EventsLock());
+    events = Events();
+    notes = Notes();
+  }
+
+  std::error_code ec;
+  llvm::raw_fd_ostream os(path, ec, llvm::sys::fs::OF_Text);
+  if (ec) {
+    return llvm::createStringError(ec, "Unable to open stats file '%s'",
+                                   path.c_str());
+  }
+
+  if (format == "json") {
+    WriteJSON(os, events, notes, counters);
+  } else {
+    WriteChromeTrace(os, events, notes, counters);
+  }
+
+  os.close();
+  if (os.has_error()) {
+    os.clear_error();
+    return llvm::createStringError(std::make_error_code(std::errc::io_error),
+                                   "Unable to write stats file '%s'",
+                                   path.c_str());
+  }
+
+  return llvm::Error::success();
+}
+
+}  // namespace anvill
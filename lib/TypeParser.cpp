@@ -17,40 +17,108 @@
 
 #include "anvill/TypeParser.h"
 
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/Twine.h>
 #include <llvm/IR/DerivedTypes.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/Type.h>
 #include <remill/BC/Compat/Error.h>
 
+#include <cctype>
 #include <cstddef>
-#include <sstream>
+#include <cstdint>
+#include <cstring>
+#include <limits>
 #include <vector>
 
 namespace anvill {
 namespace {
 
-// Parse some characters out of `spec` starting at index `i`, where
-// the characters are accepted by the predicate `filter`, and store
-// the result in `*out`.
-template <typename Filter, typename T>
-static bool Parse(llvm::StringRef spec, size_t &i, Filter filter, T *out) {
-  std::stringstream ss;
-  auto found = false;
+using NestedTypes = llvm::StringMap<llvm::Type *>;
+
+// Parse a decimal number out of `spec` starting at index `i`, and store
+// the result in `*out`. Returns `false` if there are no digits at `i`, or
+// if the number doesn't fit in a `T`.
+template <typename T>
+static bool ParseNumber(llvm::StringRef spec, size_t &i, T *out) {
+  static constexpr uint64_t kMax = std::numeric_limits<T>::max();
+  const auto begin = i;
+  uint64_t val = 0;
+  for (; i < spec.size() && isdigit(static_cast<unsigned char>(spec[i]));
+       ++i) {
+    const auto digit = static_cast<uint64_t>(spec[i] - '0');
+    if (val > (kMax - digit) / 10u) {
+      return false;
+    }
+    val = (val * 10u) + digit;
+  }
+
+  *out = static_cast<T>(val);
+  return i != begin;
+}
+
+// If the type specification at index `i` of `spec` is a bracketed type, e.g.
+// a structure, then return the index one past its closing bracket. Returns
+// zero if the type isn't bracketed, if it is malformed, or if it contains
+// type IDs, which mean different things in different specifications.
+static size_t FindNestedTypeEnd(llvm::StringRef spec, size_t i) {
+  if (i >= spec.size() || !strchr("{[<(", spec[i])) {
+    return 0;
+  }
+
+  size_t depth = 0;
   for (; i < spec.size(); ++i) {
-    if (filter(spec[i])) {
-      ss << spec[i];
-      found = true;
-    } else {
-      break;
+    switch (spec[i]) {
+      case '{':
+      case '[':
+      case '<':
+      case '(': ++depth; break;
+      case '}':
+      case ']':
+      case '>':
+      case ')':
+        if (!--depth) {
+          return i + 1u;
+        }
+        break;
+      case '=':
+      case '%': return 0;
+      default: break;
     }
   }
+  return 0;
+}
 
-  if (!found) {
-    return false;
+static llvm::Expected<llvm::Type *>
+ParseType(llvm::LLVMContext &context, std::vector<llvm::Type *> &ids,
+          llvm::SmallPtrSetImpl<llvm::Type *> &size_checked,
+          NestedTypes *nested_types, llvm::StringRef spec, size_t &i);
+
+// Parse the type specification at index `i` of `spec`, which is nested
+// inside of another type specification. If `nested_types` is non-null, then
+// the types of bracketed specifications are memoized there.
+static llvm::Expected<llvm::Type *>
+ParseNestedType(llvm::LLVMContext &context, std::vector<llvm::Type *> &ids,
+                llvm::SmallPtrSetImpl<llvm::Type *> &size_checked,
+                NestedTypes *nested_types, llvm::StringRef spec, size_t &i) {
+  const auto begin = i;
+  const auto end = nested_types ? FindNestedTypeEnd(spec, i) : 0u;
+  if (end) {
+    if (auto it = nested_types->find(spec.slice(begin, end));
+        it != nested_types->end()) {
+      i = end;
+      return it->second;
+    }
   }
 
-  ss >> *out;
-  return !ss.bad();
+  auto ret = ParseType(context, ids, size_checked, nested_types, spec, i);
+  if (end && i == end && !remill::IsError(ret)) {
+    if (auto type = remill::GetReference(ret); type) {
+      nested_types->try_emplace(spec.slice(begin, end), type);
+    }
+  }
+  return ret;
 }
 
 // Parse a type specification into an LLVM type. See TypeParser.h
@@ -59,7 +127,7 @@ static bool Parse(llvm::StringRef spec, size_t &i, Filter filter, T *out) {
 static llvm::Expected<llvm::Type *>
 ParseType(llvm::LLVMContext &context, std::vector<llvm::Type *> &ids,
           llvm::SmallPtrSetImpl<llvm::Type *> &size_checked,
-          llvm::StringRef spec, size_t &i) {
+          NestedTypes *nested_types, llvm::StringRef spec, size_t &i) {
 
   llvm::StructType *struct_type = nullptr;
 
@@ -70,7 +138,8 @@ ParseType(llvm::LLVMContext &context, std::vector<llvm::Type *> &ids,
       case '{': {
         llvm::SmallVector<llvm::Type *, 4> elem_types;
         for (i += 1; i < spec.size() && spec[i] != '}';) {
-          auto maybe_elem_type = ParseType(context, ids, size_checked, spec, i);
+          auto maybe_elem_type = ParseNestedType(context, ids, size_checked,
+                                                 nested_types, spec, i);
           if (remill::IsError(maybe_elem_type)) {
             return maybe_elem_type;
           } else {
@@ -115,7 +184,8 @@ ParseType(llvm::LLVMContext &context, std::vector<llvm::Type *> &ids,
       // Parse an array type.
       case '[': {
         i += 1;
-        auto maybe_elem_type = ParseType(context, ids, size_checked, spec, i);
+        auto maybe_elem_type = ParseNestedType(context, ids, size_checked,
+                                               nested_types, spec, i);
         if (remill::IsError(maybe_elem_type)) {
           return maybe_elem_type;
         }
@@ -137,7 +207,7 @@ ParseType(llvm::LLVMContext &context, std::vector<llvm::Type *> &ids,
 
         i += 1;
         size_t num_elems = 0;
-        if (!Parse(spec, i, isdigit, &num_elems)) {
+        if (!ParseNumber(spec, i, &num_elems)) {
           return llvm::createStringError(
               std::make_error_code(std::errc::invalid_argument),
               "Unable to parse array size in type specification '%s'",
@@ -165,7 +235,8 @@ ParseType(llvm::LLVMContext &context, std::vector<llvm::Type *> &ids,
       // Parse a vector type.
       case '<': {
         i += 1;
-        auto maybe_elem_type = ParseType(context, ids, size_checked, spec, i);
+        auto maybe_elem_type = ParseNestedType(context, ids, size_checked,
+                                               nested_types, spec, i);
         if (remill::IsError(maybe_elem_type)) {
           return maybe_elem_type;
         }
@@ -187,7 +258,7 @@ ParseType(llvm::LLVMContext &context, std::vector<llvm::Type *> &ids,
 
         i += 1;
         unsigned num_elems = 0;
-        if (!Parse(spec, i, isdigit, &num_elems)) {
+        if (!ParseNumber(spec, i, &num_elems)) {
           return llvm::createStringError(
               std::make_error_code(std::errc::invalid_argument),
               "Unable to parse vector size in type specification '%s'",
@@ -215,7 +286,8 @@ ParseType(llvm::LLVMContext &context, std::vector<llvm::Type *> &ids,
       // Parse a pointer type.
       case '*': {
         i += 1;
-        auto maybe_elem_type = ParseType(context, ids, size_checked, spec, i);
+        auto maybe_elem_type = ParseNestedType(context, ids, size_checked,
+                                               nested_types, spec, i);
         if (remill::IsError(maybe_elem_type)) {
           return maybe_elem_type;
         }
@@ -247,7 +319,8 @@ ParseType(llvm::LLVMContext &context, std::vector<llvm::Type *> &ids,
       case '(': {
         llvm::SmallVector<llvm::Type *, 4> elem_types;
         for (i += 1; i < spec.size() && spec[i] != ')';) {
-          auto maybe_elem_type = ParseType(context, ids, size_checked, spec, i);
+          auto maybe_elem_type = ParseNestedType(context, ids, size_checked,
+                                                 nested_types, spec, i);
           if (remill::IsError(maybe_elem_type)) {
             return maybe_elem_type;
           } else {
@@ -355,7 +428,7 @@ ParseType(llvm::LLVMContext &context, std::vector<llvm::Type *> &ids,
       case '=': {
         i += 1;
         unsigned type_id = 0;
-        if (!Parse(spec, i, isdigit, &type_id)) {
+        if (!ParseNumber(spec, i, &type_id)) {
           return llvm::createStringError(
               std::make_error_code(std::errc::invalid_argument),
               "Unable to parse type ID in type specification '%s'",
@@ -378,9 +451,8 @@ ParseType(llvm::LLVMContext &context, std::vector<llvm::Type *> &ids,
               type_id, spec.str().c_str());
         }
 
-        std::stringstream ss;
-        ss << "anvill.struct." << type_id;
-        struct_type = llvm::StructType::create(context, ss.str());
+        struct_type = llvm::StructType::create(
+            context, ("anvill.struct." + llvm::Twine(type_id)).str());
         ids.push_back(struct_type);
 
         // Jump to the next iteration, which will parse the struct.
@@ -391,7 +463,7 @@ ParseType(llvm::LLVMContext &context, std::vector<llvm::Type *> &ids,
       case '%': {
         i += 1;
         unsigned type_id = 0;
-        if (!Parse(spec, i, isdigit, &type_id)) {
+        if (!ParseNumber(spec, i, &type_id)) {
           return llvm::createStringError(
               std::make_error_code(std::errc::invalid_argument),
               "Unable to parse type ID in type specification '%s'",
@@ -462,14 +534,15 @@ ParseType(llvm::LLVMContext &context, std::vector<llvm::Type *> &ids,
   return nullptr;
 }
 
-}  // namespace
-
-llvm::Expected<llvm::Type *> ParseType(llvm::LLVMContext &context,
-                                       llvm::StringRef spec) {
+// Parse a whole type specification, checking that it corresponds with a
+// sized type.
+static llvm::Expected<llvm::Type *>
+ParseTopLevelType(llvm::LLVMContext &context, llvm::StringRef spec,
+                  NestedTypes *nested_types) {
   std::vector<llvm::Type *> ids;
   size_t i = 0;
   llvm::SmallPtrSet<llvm::Type *, 8> size_checked;
-  auto ret = ParseType(context, ids, size_checked, spec, i);
+  auto ret = ParseType(context, ids, size_checked, nested_types, spec, i);
   if (!remill::IsError(ret)) {
     if (i < spec.size()) {
       return llvm::createStringError(
@@ -479,7 +552,12 @@ llvm::Expected<llvm::Type *> ParseType(llvm::LLVMContext &context,
     }
 
     auto type = remill::GetReference(ret);
-    if (!type->isSized(&size_checked)) {
+    if (!type) {
+      return llvm::createStringError(
+          std::make_error_code(std::errc::invalid_argument),
+          "Empty type specification");
+
+    } else if (!type->isSized(&size_checked)) {
       return llvm::createStringError(
           std::make_error_code(std::errc::invalid_argument),
           "Type specification '%s' does not correspond with a sized type",
@@ -490,4 +568,29 @@ llvm::Expected<llvm::Type *> ParseType(llvm::LLVMContext &context,
   return ret;
 }
 
+}  // namespace
+
+llvm::Expected<llvm::Type *> ParseType(llvm::LLVMContext &context,
+                                       llvm::StringRef spec) {
+  return ParseTopLevelType(context, spec, nullptr);
+}
+
+TypeCache::TypeCache(llvm::LLVMContext &context_) : context(context_) {}
+
+TypeCache::~TypeCache(void) {}
+
+// Parse a type specification into an LLVM type, or return the type that
+// was previously parsed from `spec`.
+llvm::Expected<llvm::Type *> TypeCache::ParseType(llvm::StringRef spec) {
+  if (auto it = types.find(spec); it != types.end()) {
+    return it->second;
+  }
+
+  auto ret = ParseTopLevelType(context, spec, &nested_types);
+  if (!remill::IsError(ret)) {
+    types.try_emplace(spec, remill::GetReference(ret));
+  }
+  return ret;
+}
+
 }  // namespace anvill
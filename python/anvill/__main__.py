@@ -29,6 +29,14 @@ def main():
         "--spec_out", help="Path to output JSON specification.", required=True
     )
 
+    arg_parser.add_argument(
+        "--spec_format",
+        choices=["json", "binary"],
+        default="json",
+        help="Format of the output specification. The binary format stores "
+        "memory as raw bytes rather than as hex-encoded strings.",
+    )
+
     arg_parser.add_argument(
         "--entry_point",
         type=str,
@@ -65,7 +73,10 @@ def main():
         p.add_symbol(f.address(), f.name())
         p.add_function_definition(f.address(), False)
 
-    open(args.spec_out, "w").write(p.proto())
+    if args.spec_format == "binary":
+        open(args.spec_out, "wb").write(p.binary_proto())
+    else:
+        open(args.spec_out, "w").write(p.proto())
 
 
 if __name__ == "__main__":
@@ -13,6 +13,8 @@
 # You should have received a copy of the GNU Affero General Public License
 # along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
+import collections
+
 import binaryninja as bn
 
 from .arch import *
@@ -226,8 +228,12 @@ def _convert_binja_type(tinfo, cache):
         raise UnhandledTypeException("Unhandled type: {}".format(str(tinfo)), tinfo)
 
 
-def get_type(ty):
-    """Type class that gives access to type sizes, printings, etc."""
+def get_type(ty, cache=None):
+    """Type class that gives access to type sizes, printings, etc. If `cache`
+    isn't `None`, then it is a dictionary of the types that were already
+    converted, e.g. the program-wide type cache of a `BNProgram`. The types
+    converted along the way are only added to `cache` if the whole conversion
+    succeeds."""
 
     if isinstance(ty, Type):
         return ty
@@ -236,7 +242,13 @@ def get_type(ty):
         return ty.type()
 
     elif isinstance(ty, bn.Type):
-        return _convert_binja_type(ty, {})
+        if cache is None:
+            return _convert_binja_type(ty, {})
+
+        new_types = {}
+        ret = _convert_binja_type(ty, collections.ChainMap(new_types, cache))
+        cache.update(new_types)
+        return ret
 
     if not ty:
         return VoidType()
@@ -336,22 +348,29 @@ class BNFunction(Function):
             program.try_add_referenced_entity(ref_ea, add_refs_as_defs)
 
     def _fill_bytes(self, memory, start, end, ref_eas):
-        br = bn.BinaryReader(self._bv)
         for bb in self._bn_func.basic_blocks:
             ea = bb.start
             while ea < bb.end:
                 seg = self._bv.get_segment_at(ea)
-                can_read = seg.readable
-                can_exec = seg.executable
-                can_write = seg.writable
-
-                br.seek(ea)
-                byte = br.read8()
-                memory.map_byte(ea, byte, can_write, can_exec)
+                if not seg:
+                    break
+
+                # Read the rest of the block, or of the segment, at once.
+                # The bytes past the end of the segment's data read as zero.
+                end_ea = min(bb.end, seg.end)
+                data = self._bv.read(ea, end_ea - ea)
+                data = data + b"\x00" * (end_ea - ea - len(data))
+                memory.map_bytes(ea, data, seg.writable, seg.executable)
+                ea = end_ea
+
+            # Only instructions have lifted IL, so visit just the start of
+            # each instruction in the block.
+            ea = bb.start
+            for _, length in bb:
                 insn = self._bn_func.get_lifted_il_at(ea)
                 if insn:
                     _collect_code_xrefs_from_insn(self._bv, insn, ref_eas)
-                ea += 1
+                ea += length
 
 class BNProgram(Program):
     def __init__(self, path_or_bv):
@@ -363,6 +382,9 @@ class BNProgram(Program):
             self._bv = bn.BinaryViewType.get_view_of_file(self._path)
         super(BNProgram, self).__init__(get_arch(self._bv), get_os(self._bv))
 
+        # Types converted so far, shared by all functions.
+        self._type_cache = {}
+
     def get_function_impl(self, address):
         """Given an architecture and an address, return a `Function` instance or
     raise an `InvalidFunctionException` exception."""
@@ -380,7 +402,7 @@ class BNProgram(Program):
             )
 
         # print binja_func.name, binja_func.function_type
-        func_type = get_type(binja_func.function_type)
+        func_type = get_type(binja_func.function_type, self._type_cache)
         calling_conv = CallingConvention(arch, binja_func)
 
         index = 0
@@ -388,7 +410,7 @@ class BNProgram(Program):
         for var in binja_func.parameter_vars:
             source_type = var.source_type
             var_type = var.type
-            arg_type = get_type(var_type)
+            arg_type = get_type(var_type, self._type_cache)
 
             if source_type == bn.VariableSourceType.RegisterVariableSourceType:
                 if (
@@ -420,7 +442,7 @@ class BNProgram(Program):
             index += 1
 
         ret_list = []
-        retTy = get_type(binja_func.return_type)
+        retTy = get_type(binja_func.return_type, self._type_cache)
         if not isinstance(retTy, VoidType):
             for reg in calling_conv.return_regs:
                 loc = Location()
@@ -14,6 +14,7 @@
 # along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 
+import collections
 import itertools
 
 import idc
@@ -103,6 +104,16 @@ TYPE_CONTEXT_RETURN = 4
 _FLOAT_SIZES = (2, 4, 8, 10, 12, 16)
 
 
+def _type_cache_key(tinfo, context):
+    """Returns the key of `tinfo` in a type cache. Types are keyed by their
+  serialized form, so that distinct `tinfo_t` instances of the same type share
+  one entry, and by `context`, which affects how they are converted."""
+    serialized = tinfo.serialize()
+    if not serialized:
+        return (tinfo.dstr(), context)
+    return (serialized[0], serialized[1], context)
+
+
 def _convert_ida_type(tinfo, cache, depth, context):
     """Convert an IDA `tinfo_t` instance into a `Type` instance."""
     assert isinstance(tinfo, ida_typeinf.tinfo_t)
@@ -110,8 +121,9 @@ def _convert_ida_type(tinfo, cache, depth, context):
     if 0 < depth:
         context = TYPE_CONTEXT_NESTED
 
-    if tinfo in cache and context in (TYPE_CONTEXT_NESTED, TYPE_CONTEXT_FUNCTION):
-        return cache[tinfo]
+    key = _type_cache_key(tinfo, context)
+    if key in cache:
+        return cache[key]
 
     # Void type.
     elif tinfo.empty() or tinfo.is_void():
@@ -121,7 +133,7 @@ def _convert_ida_type(tinfo, cache, depth, context):
     elif tinfo.is_paf():
         if tinfo.is_ptr():
             ret = PointerType()
-            cache[tinfo] = ret
+            cache[key] = ret
             ret.set_element_type(
                 _convert_ida_type(tinfo.get_pointed_object(), cache, depth + 1, context)
             )
@@ -129,7 +141,7 @@ def _convert_ida_type(tinfo, cache, depth, context):
 
         elif tinfo.is_func():
             ret = FunctionType()
-            cache[tinfo] = ret
+            cache[key] = ret
             ret.set_return_type(
                 _convert_ida_type(tinfo.get_rettype(), cache, depth + 1, context)
             )
@@ -164,7 +176,7 @@ def _convert_ida_type(tinfo, cache, depth, context):
                     )
                 else:
                     ret = PointerType()
-                    cache[tinfo] = ret
+                    cache[key] = ret
                     ret.set_element_type(
                         _convert_ida_type(
                             tinfo.get_array_element(), cache, depth + 1, context
@@ -173,7 +185,7 @@ def _convert_ida_type(tinfo, cache, depth, context):
                     return ret
             else:
                 ret = ArrayType()
-                cache[tinfo] = ret
+                cache[key] = ret
                 ret.set_element_type(
                     _convert_ida_type(
                         tinfo.get_array_element(), cache, depth + 1, context
@@ -191,7 +203,7 @@ def _convert_ida_type(tinfo, cache, depth, context):
     # Vector types.
     elif tinfo.is_sse_type():
         ret = VectorType()
-        cache[tinfo] = ret
+        cache[key] = ret
         size = tinfo.get_size()
 
         # TODO(pag): Do better than this.
@@ -204,7 +216,7 @@ def _convert_ida_type(tinfo, cache, depth, context):
     elif tinfo.is_sue():
         if tinfo.is_udt():  # Structure or union type.
             ret = tinfo.is_struct() and StructureType() or UnionType()
-            cache[tinfo] = ret
+            cache[key] = ret
             i = 0
             max_i = tinfo.get_udt_nmembers()
             while i < max_i:
@@ -222,7 +234,7 @@ def _convert_ida_type(tinfo, cache, depth, context):
 
         elif tinfo.is_enum():
             ret = EnumType()
-            cache[tinfo] = ret
+            cache[key] = ret
             base_type = ida_typeinf.tinfo_t(tinfo.get_enum_base_type())
             ret.set_underlying_type(_convert_ida_type(base_type, cache, depth, context))
             return ret
@@ -266,12 +278,12 @@ def _convert_ida_type(tinfo, cache, depth, context):
     # NOTE(pag): We return the underlying type because it may be void.
     elif tinfo.is_typeref():
         ret = TypedefType()
-        cache[tinfo] = ret
+        cache[key] = ret
         utype = _convert_ida_type(
             ida_typeinf.tinfo_t(tinfo.get_realtype(True)), cache, depth, context
         )
         ret.set_underlying_type(utype)
-        cache[tinfo] = utype
+        cache[key] = utype
         return utype
 
     else:
@@ -310,8 +322,24 @@ def _get_os():
         )
 
 
-def get_type(ty, context):
-    """Type class that gives access to type sizes, printings, etc."""
+def _convert_ida_type_cached(tinfo, cache, context):
+    """Convert `tinfo` into a `Type` instance, reusing and adding to the types
+  in `cache`, if it isn't `None`. The types converted along the way are only
+  added to `cache` if the whole conversion succeeds, so that the cache never
+  holds the partially converted types of an unhandled type."""
+    if cache is None:
+        return _convert_ida_type(tinfo, {}, 0, context)
+
+    new_types = {}
+    ret = _convert_ida_type(tinfo, collections.ChainMap(new_types, cache), 0, context)
+    cache.update(new_types)
+    return ret
+
+
+def get_type(ty, context, cache=None):
+    """Type class that gives access to type sizes, printings, etc. If `cache`
+  isn't `None`, then it is a dictionary of the types that were already
+  converted, e.g. the program-wide type cache of an `IDAProgram`."""
 
     if isinstance(ty, Type):
         return ty
@@ -323,7 +351,7 @@ def get_type(ty, context):
         return ty.type()
 
     elif isinstance(ty, ida_typeinf.tinfo_t):
-        return _convert_ida_type(ty, {}, 0, context)
+        return _convert_ida_type_cached(ty, cache, context)
 
     tif = ida_typeinf.tinfo_t()
     try:
@@ -333,7 +361,7 @@ def get_type(ty, context):
         pass
 
     if not tif.empty():
-        return _convert_ida_type(tif, {}, 0, context)
+        return _convert_ida_type_cached(tif, cache, context)
 
     if not ty:
         return VoidType()
@@ -571,6 +599,53 @@ def _try_map_byte(memory, ea, seg_ref):
     return True
 
 
+def _read_bytes(ea, size):
+    """Read `size` bytes starting at `ea`. Bytes without a value, e.g. the
+  bytes of a `.bss` segment, are read as zero. Returns `None` if the bytes
+  can't be read in bulk."""
+    try:
+        data, mask = ida_bytes.get_bytes_and_mask(ea, size)
+    except:
+        return None
+
+    if data is None or mask is None or len(data) != size:
+        return None
+
+    data = bytearray(data)
+    if mask.count(0xFF) != len(mask):
+        for i, bits in enumerate(mask):
+            if bits == 0xFF:
+                continue
+            for j in range(i * 8, min(i * 8 + 8, size)):
+                if not bits & (1 << (j - i * 8)):
+                    data[j] = 0
+    return data
+
+
+def _try_map_range(memory, ea, max_ea, seg_ref):
+    """Try to map the bytes of `[ea, max_ea)` into memory, a segment at a time.
+  Returns the address of the first byte that wasn't mapped, i.e. `max_ea`
+  unless the range runs past the mapped segments."""
+    while ea < max_ea:
+        seg = _find_segment_containing_ea(ea, seg_ref)
+        if not seg:
+            break
+
+        end_ea = min(max_ea, seg.end_ea)
+        data = _read_bytes(ea, end_ea - ea)
+        if data is None:
+            while ea < end_ea and _try_map_byte(memory, ea, seg_ref):
+                ea += 1
+            continue
+
+        can_write = 0 != (seg.perm & ida_segment.SEGPERM_WRITE)
+        can_exec = _is_executable_seg(seg)
+        memory.map_bytes(ea, data, can_write, can_exec)
+        ea = end_ea
+
+    return ea
+
+
 def _get_function_bounds(func, seg_ref):
     """Get the bounds of the function containing `ea`. We want to discover jump
   table targets that are missed by IDA, and it's possible that they aren't
@@ -709,6 +784,28 @@ def _collect_xrefs_from_func(pfn, ea, out_ref_eas, seg_ref):
             _add_real_xref(ea, ref_ea, out_ref_eas)
 
 
+def _collect_xrefs_from_range(pfn, ea, max_ea, out_ref_eas, seg_ref):
+    """Collect the cross-references from `[ea, max_ea)` in `pfn` that target
+  code/data outside of `pfn`. Save them into `out_ref_eas`.
+
+  NOTE(pag): IDA only records cross-references from the heads of items, so
+  this only visits the heads, and the fixups, which may be in the middle of
+  an instruction, rather than every byte in the range."""
+    head_ea = ea
+    if not ida_bytes.is_head(ida_bytes.get_full_flags(head_ea)):
+        head_ea = ida_bytes.next_head(head_ea, max_ea)
+
+    while head_ea != ida_idaapi.BADADDR and head_ea < max_ea:
+        _collect_xrefs_from_func(pfn, head_ea, out_ref_eas, seg_ref)
+        head_ea = ida_bytes.next_head(head_ea, max_ea)
+
+    fixup_ea = ida_fixup.get_next_fixup_ea(ea - 1) if ea else ea
+    while fixup_ea != ida_idaapi.BADADDR and fixup_ea < max_ea:
+        if not ida_bytes.is_head(ida_bytes.get_full_flags(fixup_ea)):
+            _collect_xrefs_from_func(pfn, fixup_ea, out_ref_eas, seg_ref)
+        fixup_ea = ida_fixup.get_next_fixup_ea(fixup_ea)
+
+
 def _invent_var_type(ea, seg_ref, min_size=1):
     """Try to invent a variable type. This will basically be an array of bytes
   that spans what we need. We will, however, try to be slightly smarter and
@@ -798,12 +895,8 @@ class IDAFunction(Function):
         # function. We might get a bit beyond that, as our function bounds stuff
         # looks for previous and next function locations.
         ea, max_ea = _get_function_bounds(self._pfn, seg_ref)
-
-        while ea < max_ea:
-            if not _try_map_byte(memory, ea, seg_ref):
-                break
-            _collect_xrefs_from_func(self._pfn, ea, ref_eas, seg_ref)
-            ea += 1
+        max_ea = _try_map_range(memory, ea, max_ea, seg_ref)
+        _collect_xrefs_from_range(self._pfn, ea, max_ea, ref_eas, seg_ref)
 
         # Map the bytes of function chunks. These are discontinuous parts of a
         # function, e.g. cold code put off the critical path to reduce icache
@@ -813,12 +906,8 @@ class IDAFunction(Function):
         while ok:
             chunk = fti.chunk()
             ea = chunk.start_ea
-            max_ea = chunk.end_ea
-            while ea < max_ea:
-                if not _try_map_byte(memory, ea, seg_ref):
-                    break
-                _collect_xrefs_from_func(self._pfn, ea, ref_eas, seg_ref)
-                ea += 1
+            max_ea = _try_map_range(memory, ea, chunk.end_ea, seg_ref)
+            _collect_xrefs_from_range(self._pfn, ea, max_ea, ref_eas, seg_ref)
 
             ok = fti.next()
 
@@ -901,6 +990,9 @@ class IDAProgram(Program):
     def __init__(self, *args, **kargs):
         super(IDAProgram, self).__init__(kargs["arch"], kargs["os"])
 
+        # Types converted so far, shared by all functions and variables.
+        self._type_cache = {}
+
     def get_variable_impl(self, address):
         """Given an address, return a `Variable` instance, or
     raise an `InvalidVariableException` exception."""
@@ -922,7 +1014,7 @@ class IDAProgram(Program):
 
         # Try to handle a variable type, otherwise make it big and empty.
         try:
-            var_type = get_type(tif, TYPE_CONTEXT_GLOBAL_VAR)
+            var_type = get_type(tif, TYPE_CONTEXT_GLOBAL_VAR, self._type_cache)
             if isinstance(var_type, VoidType):
                 var_type = backup_var_type
 
@@ -1001,7 +1093,7 @@ class IDAProgram(Program):
         # not be the final signature that we go with, but it's a good way to make
         # sure we can handle the relevant types.
         try:
-            func_type = get_type(tif, TYPE_CONTEXT_FUNCTION)
+            func_type = get_type(tif, TYPE_CONTEXT_FUNCTION, self._type_cache)
         except UnhandledTypeException as e:
             raise InvalidFunctionException(
                 "Could not assign type to function at address {:x}: {}".format(
@@ -1025,7 +1117,7 @@ class IDAProgram(Program):
             funcarg = ftd[i]
             i += 1
 
-            arg_type = get_type(funcarg.type, TYPE_CONTEXT_PARAMETER)
+            arg_type = get_type(funcarg.type, TYPE_CONTEXT_PARAMETER, self._type_cache)
             arg_type_str = arg_type.serialize(arch, {})
 
             j = len(param_list)
@@ -1044,7 +1136,7 @@ class IDAProgram(Program):
 
         # Build up the list of return values.
         ret_list = []
-        ret_type = get_type(ftd.rettype, TYPE_CONTEXT_RETURN)
+        ret_type = get_type(ftd.rettype, TYPE_CONTEXT_RETURN, self._type_cache)
         if not isinstance(ret_type, VoidType):
             _expand_locations(arch, pfn, ret_type, ftd.retloc, ret_list)
 
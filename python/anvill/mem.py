@@ -13,52 +13,103 @@
 # You should have received a copy of the GNU Affero General Public License
 # along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
+import binascii
+import bisect
+
 
 class Memory(object):
+    """The mapped bytes of a program, as a sorted list of non-overlapping
+    ranges. Each range is a list of `[address, data, is_writeable,
+    is_executable]`, where `data` is a `bytearray`. Ranges with the same
+    permissions that touch or overlap are merged as they are mapped, so
+    that mapping a function or segment at a time stays cheap."""
+
     def __init__(self):
-        self._bytes = {}
+        self._ranges = []
+        self._range_eas = []
 
     def map_byte(self, ea, val, can_write, can_exec):
-        self._bytes[ea] = (int(val & 0xFF), can_write, can_exec)
-
-    def _extend_range(self, range_proto, ea, val, can_write, can_exec):
-        if not len(range_proto):
-            range_proto["address"] = ea
-            range_proto["is_writeable"] = can_write
-            range_proto["is_executable"] = can_exec
-            range_proto["data"] = "{:02x}".format(val)
-            return True
-
-        elif (
-            range_proto["is_writeable"] == can_write
-            and range_proto["is_executable"] == can_exec
-        ):
-
-            next_ea = range_proto["address"] + (len(range_proto["data"]) / 2)
-            if next_ea != ea:
-                return False
-            else:
-                range_proto["data"] += "{:02x}".format(val)
-                return True
-        else:
-            return False
+        self.map_bytes(ea, bytes((int(val) & 0xFF,)), can_write, can_exec)
 
-    def proto(self):
-        proto = []
-        if not len(self._bytes):
-            return proto
+    def map_bytes(self, ea, data, can_write, can_exec):
+        """Map the bytes of `data` starting at `ea`. Bytes that were already
+        mapped take on the new values and permissions."""
+        if not len(data):
+            return
+
+        end_ea = ea + len(data)
+        first = bisect.bisect_left(self._range_eas, ea) - 1
+        if first < 0 or self._range_end_ea(first) < ea:
+            first += 1
+        last = bisect.bisect_right(self._range_eas, end_ea)
+
+        merged_ea, merged = ea, None
+        before, after = [], []
+        for entry in self._ranges[first:last]:
+            range_ea, range_data, range_write, range_exec = entry
+            range_end_ea = range_ea + len(range_data)
+
+            # Keep the parts of ranges with other permissions that aren't
+            # being replaced.
+            if range_write != can_write or range_exec != can_exec:
+                if range_end_ea <= ea:
+                    before.append(entry)
+                    continue
+                elif range_ea >= end_ea:
+                    after.append(entry)
+                    continue
 
-        range_proto = {}
-        for ea in sorted(self._bytes.keys()):
+                if range_end_ea > end_ea:
+                    tail = range_data[end_ea - range_ea :]
+                    after.append([end_ea, tail, range_write, range_exec])
+                if range_ea < ea:
+                    del range_data[ea - range_ea :]
+                    before.append(entry)
+                continue
 
-            val, can_write, can_exec = self._bytes[ea]
-            if not self._extend_range(range_proto, ea, val, can_write, can_exec):
-                proto.append(range_proto)
-                range_proto = {}
-                ret = self._extend_range(range_proto, ea, val, can_write, can_exec)
-                assert ret
+            # Merge ranges with the same permissions, extending the range
+            # that starts before `ea` in place if there is one.
+            suffix = None
+            if range_end_ea > end_ea:
+                suffix = range_data[max(range_ea, end_ea) - range_ea :]
 
-        if len(range_proto):
-            proto.append(range_proto)
+            if range_ea < ea:
+                del range_data[ea - range_ea :]
+                range_data.extend(data)
+                merged_ea, merged = range_ea, range_data
+            elif merged is None:
+                merged = bytearray(data)
 
+            if suffix:
+                merged.extend(suffix)
+
+        if merged is None:
+            merged = bytearray(data)
+
+        new_ranges = before + [[merged_ea, merged, can_write, can_exec]] + after
+        self._ranges[first:last] = new_ranges
+        self._range_eas[first:last] = [entry[0] for entry in new_ranges]
+
+    def _range_end_ea(self, index):
+        range_ea, range_data, _, _ = self._ranges[index]
+        return range_ea + len(range_data)
+
+    def ranges(self):
+        """Yields `(address, data, is_writeable, is_executable)` tuples for
+        each maximal run of contiguous bytes with the same permissions, in
+        order of address. `data` is a `bytearray`."""
+        for range_ea, range_data, can_write, can_exec in self._ranges:
+            yield (range_ea, range_data, can_write, can_exec)
+
+    def proto(self):
+        proto = []
+        for ea, data, can_write, can_exec in self.ranges():
+            proto.append(
+                {
+                    "address": ea,
+                    "is_writeable": can_write,
+                    "is_executable": can_exec,
+                    "data": binascii.hexlify(data).decode("ascii"),
+                }
+            )
         return proto
@@ -16,6 +16,7 @@
 
 import collections
 import json
+import struct
 
 from .function import *
 from .var import *
@@ -35,6 +36,7 @@ class Program(object):
         self._func_defs = {}
         self._func_decls = {}
         self._symbols = collections.defaultdict(set)
+        self._extended_meta = {}
 
     def get_function(self, ea):
         if ea in self._func_defs:
@@ -62,6 +64,21 @@ class Program(object):
         if len(name):
             self._symbols[ea].add(name)
 
+    def add_extended_meta(
+        self, ea, is_instruction_start=False, targets=(), jump_table=None
+    ):
+        """Record what is known about the instruction starting at `ea`, e.g.
+        the targets of an indirect jump or call, and the `(address, size)` of
+        the jump table that it reads."""
+        meta = {"address": ea}
+        if is_instruction_start:
+            meta["is_instruction_start"] = True
+        if len(targets):
+            meta["targets"] = sorted(set(targets))
+        if jump_table is not None:
+            meta["jump_table"] = {"address": jump_table[0], "size": jump_table[1]}
+        self._extended_meta[ea] = meta
+
     def add_variable_declaration(self, ea, add_refs_as_defs=False):
         var = self.get_variable(ea)
         if isinstance(var, Variable):
@@ -130,7 +147,7 @@ class Program(object):
     def memory(self):
         return self._memory
 
-    def proto(self):
+    def _proto(self, memory, max_addr):
         proto = {}
         proto["arch"] = self._arch.name()
         proto["os"] = self._os.name()
@@ -154,7 +171,12 @@ class Program(object):
         for var in self._var_defs.values():
             proto["variables"].append(var.proto())
 
-        proto["memory"] = self._memory.proto()
+        proto["memory"] = memory
+
+        if len(self._extended_meta):
+            proto["extended_meta"] = [
+                self._extended_meta[ea] for ea in sorted(self._extended_meta)
+            ]
 
         if self._arch.pointer_size() == 4:
             stack_mask = 0x7FFFFFFF
@@ -165,13 +187,6 @@ class Program(object):
 
         int_type = stack_mask.__class__
 
-        # Go find the maximum address.
-        max_addr = 0
-        for range_proto in proto["memory"]:
-            max_addr = max(
-                max_addr, range_proto["address"] + (len(range_proto["data"]) / 2)
-            )
-
         stack_base = (
             int_type(max_addr + int_type((stack_mask - max_addr) * 5.0 / 8.0))
             & page_mask
@@ -179,4 +194,79 @@ class Program(object):
 
         proto["stack"] = {"address": stack_base, "size": 24576, "start_offset": 4096}
 
-        return json.dumps(proto)
+        return proto
+
+    def proto(self):
+        memory = self._memory.proto()
+
+        # Go find the maximum address.
+        max_addr = 0
+        for range_proto in memory:
+            max_addr = max(
+                max_addr, range_proto["address"] + (len(range_proto["data"]) // 2)
+            )
+
+        return json.dumps(self._proto(memory, max_addr))
+
+    def binary_proto(self):
+        """Returns the specification in Anvill's binary container format.
+
+        The container begins with a 32-byte little-endian header:
+
+            char     magic[8]     = "ANVLSPEC"
+            uint32_t version      = 1
+            uint32_t reserved     = 0
+            uint64_t json_offset
+            uint64_t json_size
+
+        The JSON specification follows the header. Instead of hex-encoded
+        `data`, each entry in its `memory` array has an `offset` and `size`
+        that locate that range's raw bytes within the container. Each range's
+        bytes start on a page-aligned offset so that the decompiler can map
+        them from the file without copying them.
+        """
+        page_size = 4096
+        ranges = list(self._memory.ranges())
+        memory = []
+        for ea, data, can_write, can_exec in ranges:
+            memory.append(
+                {
+                    "address": ea,
+                    "is_writeable": can_write,
+                    "is_executable": can_exec,
+                    "offset": 0,
+                    "size": len(data),
+                }
+            )
+
+        # Go find the maximum address.
+        max_addr = 0
+        for range_proto in memory:
+            max_addr = max(max_addr, range_proto["address"] + range_proto["size"])
+
+        proto = self._proto(memory, max_addr)
+
+        # The offsets of the byte sections depend on the size of the JSON,
+        # which depends on the offsets, so lay out the sections relative to
+        # an estimate of the JSON size, and grow the estimate until it fits.
+        header_size = 32
+        json_limit = page_size
+        while True:
+            offset = json_limit
+            for range_proto, (_, data, _, _) in zip(memory, ranges):
+                range_proto["offset"] = offset
+                offset += (len(data) + page_size - 1) & ~(page_size - 1)
+
+            json_data = json.dumps(proto).encode("utf-8")
+            if header_size + len(json_data) <= json_limit:
+                break
+            json_limit = (header_size + len(json_data) + page_size) & ~(page_size - 1)
+
+        out = bytearray()
+        out += struct.pack("<8sIIQQ", b"ANVLSPEC", 1, 0, header_size, len(json_data))
+        out += json_data
+        for range_proto, (_, data, _, _) in zip(memory, ranges):
+            out += b"\x00" * (range_proto["offset"] - len(out))
+            out += data
+
+        return bytes(out)
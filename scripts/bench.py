@@ -0,0 +1,162 @@
+#!/usr/bin/env python3
+
+# Copyright (c) 2020 Trail of Bits, Inc.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Affero General Public License as
+# published by the Free Software Foundation, either version 3 of the
+# License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Affero General Public License for more details.
+#
+# You should have received a copy of the GNU Affero General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+# Benchmark the decompiler over the roundtrip tests, and over any other specs
+# given with `--spec`. Each spec is decompiled `--repeat` times, and the per
+# phase wall times, the peak resident set size, and the counters (e.g. the
+# number of lifted and optimized IR instructions) recorded by `--stats_out`
+# are reported as JSON.
+
+import argparse
+import json
+import os
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+
+def run_cmd(cmd, timeout):
+    sys.stderr.write("Running: %s\n" % " ".join(cmd))
+    return subprocess.run(
+        cmd,
+        stdout=subprocess.PIPE,
+        stderr=subprocess.PIPE,
+        timeout=timeout,
+        universal_newlines=True,
+    )
+
+
+def specify_test(clang, specifier, path, tempdir, timeout):
+    """Compile the C file at `path`, and produce a spec of the binary."""
+    name = os.path.splitext(os.path.basename(path))[0]
+    compiled = os.path.join(tempdir, f"{name}_compiled")
+    p = run_cmd([clang, path, "-o", compiled], timeout)
+    if p.returncode:
+        sys.stderr.write(f"Unable to compile {path}: {p.stderr}\n")
+        return None
+
+    spec = os.path.join(tempdir, f"{name}.json")
+    cmd = list(specifier)
+    cmd.extend(["--bin_in", compiled, "--spec_out", spec])
+    cmd.extend(["--entry_point", "main"])
+    p = run_cmd(cmd, timeout)
+    if p.returncode:
+        sys.stderr.write(f"Unable to specify {compiled}: {p.stderr}\n")
+        return None
+
+    return spec
+
+
+def summarize(values):
+    return {
+        "min": min(values),
+        "median": statistics.median(values),
+        "max": max(values),
+    }
+
+
+def bench_spec(decompiler, spec, tempdir, repeat, timeout, extra_args):
+    """Decompile `spec` `repeat` times, and summarize the stats of the runs."""
+    wall_ms = []
+    phase_ms = {}
+    counters = {}
+    for i in range(repeat):
+        stats_out = os.path.join(tempdir, "stats.json")
+        bc_out = os.path.join(tempdir, "out.bc")
+        cmd = [decompiler, "--spec", spec, "--bc_out", bc_out]
+        cmd.extend(["--stats_out", stats_out, "--stats_format", "json"])
+        cmd.extend(extra_args)
+
+        start = time.monotonic()
+        p = run_cmd(cmd, timeout)
+        wall_ms.append((time.monotonic() - start) * 1000.0)
+        if p.returncode:
+            return {"error": p.stderr}
+
+        with open(stats_out) as f:
+            stats = json.load(f)
+
+        for name, phase in stats["phases"].items():
+            phase_ms.setdefault(name, []).append(phase["total_ms"])
+
+        # NOTE: The counters, other than the peak RSS, should be the same in
+        #       every run, so keep the maximum of each.
+        for name, value in stats["counters"].items():
+            counters[name] = max(counters.get(name, 0), value)
+
+    return {
+        "wall_ms": summarize(wall_ms),
+        "phases_ms": {name: summarize(ms) for name, ms in phase_ms.items()},
+        "peak_rss_kib": counters.get("process.peak_rss_kib", 0),
+        "counters": counters,
+    }
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser()
+    parser.add_argument("anvill", help="path to anvill-decompile-json")
+    parser.add_argument("--tests", help="path to the roundtrip test directory")
+    parser.add_argument("--clang", help="path to clang, to compile the tests")
+    parser.add_argument(
+        "--spec", action="append", default=[],
+        help="path to an additional spec to benchmark; can be repeated")
+    parser.add_argument(
+        "--repeat", help="number of times to decompile each spec", type=int,
+        default=5)
+    parser.add_argument("-t", "--timeout", help="set timeout in seconds",
+                        type=int)
+    parser.add_argument("--output", help="path to save the report to")
+    parser.add_argument(
+        "--anvill_args", default="",
+        help="extra arguments for the decompiler, e.g. '--jobs 8'")
+
+    args = parser.parse_args()
+    if args.tests and not args.clang:
+        parser.error("--tests requires --clang")
+
+    report = {"repeat": args.repeat, "benchmarks": {}}
+    with tempfile.TemporaryDirectory() as tempdir:
+        specs = [(os.path.basename(spec), spec) for spec in args.spec]
+        if args.tests:
+            specifier = ["python3", "-m", "anvill"]
+            for item in sorted(os.scandir(args.tests), key=lambda e: e.name):
+                spec = specify_test(args.clang, specifier, item.path, tempdir,
+                                    args.timeout)
+                if spec:
+                    specs.append((item.name, spec))
+
+        for name, spec in specs:
+            report["benchmarks"][name] = bench_spec(
+                args.anvill, spec, tempdir, args.repeat, args.timeout,
+                args.anvill_args.split())
+
+    failed = [name for name, bench in report["benchmarks"].items()
+              if "error" in bench]
+
+    if args.output:
+        with open(args.output, "w") as f:
+            json.dump(report, f, indent=2, sort_keys=True)
+            f.write("\n")
+    else:
+        json.dump(report, sys.stdout, indent=2, sort_keys=True)
+        sys.stdout.write("\n")
+
+    for name in failed:
+        sys.stderr.write(f"Unable to decompile {name}\n")
+    sys.exit(1 if failed else 0)
@@ -0,0 +1,215 @@
+#!/usr/bin/env python3
+
+# Copyright (c) 2020 Trail of Bits, Inc.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Affero General Public License as
+# published by the Free Software Foundation, either version 3 of the
+# License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Affero General Public License for more details.
+#
+# You should have received a copy of the GNU Affero General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+# Benchmark how the decompiler scales with the size of its input. Synthetic
+# specs are made by `anvill-bench-synthetic-spec`, sweeping one dimension of
+# the spec at a time (the number of functions, the number of instructions in
+# each function, etc.) while the other dimensions keep their base values.
+# Each spec is benchmarked as by `bench.py`, and the report gives, for each
+# phase, its wall time at every point of a sweep, and the slope of the time on
+# a log-log scale, i.e. the exponent `k` of a fitted `time ~ size^k`. Phases
+# whose slope exceeds `--superlinear` are reported as superlinear.
+
+import argparse
+import json
+import math
+import os
+import sys
+import tempfile
+
+from bench import bench_spec, run_cmd
+
+# The dimensions that are swept, with their base values and default points.
+DIMENSIONS = {
+    "functions": (250, [250, 500, 1000, 2000, 4000]),
+    "instructions": (32, [16, 32, 64, 128, 256]),
+    "calls": (2, [0, 1, 2, 4, 8]),
+    "ranges": (1, [1, 4, 16, 64, 256]),
+    "symbols": (1, [1, 2, 4, 8, 16]),
+}
+
+CALL_GRAPHS = ["none", "chain", "tree", "star", "random"]
+
+# The phases whose scaling is reported.
+PHASES = [
+    "ScanSpec",
+    "ParseSpec",
+    "ParseSpec.MapRanges",
+    "LiftCodeIntoModule",
+    "OptimizeModule",
+]
+
+
+def log_log_slope(points):
+    """Least-squares slope of `log(ms)` against `log(size)`, or `None`."""
+    points = [(math.log(x), math.log(y)) for x, y in points if x > 0 and y > 0]
+    if len(points) < 2:
+        return None
+
+    mean_x = sum(x for x, _ in points) / len(points)
+    mean_y = sum(y for _, y in points) / len(points)
+    var_x = sum((x - mean_x) ** 2 for x, _ in points)
+    if not var_x:
+        return None
+
+    cov = sum((x - mean_x) * (y - mean_y) for x, y in points)
+    return cov / var_x
+
+
+def generate_spec(generator, path, config, timeout):
+    cmd = [generator, "--spec_out", path]
+    for name, value in sorted(config.items()):
+        cmd.extend([f"--{name}", str(value)])
+
+    p = run_cmd(cmd, timeout)
+    if p.returncode:
+        sys.stderr.write(f"Unable to generate {path}: {p.stderr}\n")
+        return False
+    return True
+
+
+def bench_point(args, config, tempdir):
+    spec = os.path.join(tempdir, "synthetic.json")
+    if not generate_spec(args.generator, spec, config, args.timeout):
+        return {"config": config, "error": "Unable to generate spec"}
+
+    bench = bench_spec(args.anvill, spec, tempdir, args.repeat, args.timeout,
+                       args.anvill_args.split())
+    bench["config"] = dict(config)
+    os.remove(spec)
+    return bench
+
+
+def phase_times(bench):
+    """Median wall time of each reported phase, and of the whole run."""
+    times = {"wall": bench["wall_ms"]["median"]}
+    for name in PHASES:
+        if name in bench["phases_ms"]:
+            times[name] = bench["phases_ms"][name]["median"]
+    return times
+
+
+def sweep_dimension(args, dim, points, base, tempdir):
+    sweep = {"points": [], "slopes": {}, "superlinear": []}
+    series = {}
+    for value in points:
+        config = dict(base)
+        config[dim] = value
+        bench = bench_point(args, config, tempdir)
+        sweep["points"].append(bench)
+        if "error" in bench:
+            continue
+
+        for name, ms in phase_times(bench).items():
+            series.setdefault(name, []).append((value, ms))
+
+    for name, values in sorted(series.items()):
+        slope = log_log_slope(values)
+        sweep["slopes"][name] = slope
+        if slope is not None and slope > args.superlinear:
+            sweep["superlinear"].append(name)
+
+    return sweep
+
+
+def parse_points(text):
+    return [int(value) for value in text.split(",") if value]
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser()
+    parser.add_argument("anvill", help="path to anvill-decompile-json")
+    parser.add_argument("generator", help="path to anvill-bench-synthetic-spec")
+    for dim, (base, points) in DIMENSIONS.items():
+        parser.add_argument(
+            f"--{dim}", type=parse_points, default=points,
+            help=f"comma-separated points of the {dim} sweep; an empty list "
+                 f"skips the sweep (default: {','.join(map(str, points))})")
+        parser.add_argument(
+            f"--base_{dim}", type=int, default=base,
+            help=f"value of {dim} in the other sweeps (default: {base})")
+    parser.add_argument(
+        "--call_graph", default="random", choices=CALL_GRAPHS,
+        help="shape of the call graph in the dimension sweeps")
+    parser.add_argument(
+        "--no_call_graph_sweep", action="store_true",
+        help="don't compare the shapes of call graphs")
+    parser.add_argument(
+        "--repeat", help="number of times to decompile each spec", type=int,
+        default=3)
+    parser.add_argument("-t", "--timeout", help="set timeout in seconds",
+                        type=int)
+    parser.add_argument(
+        "--superlinear", type=float, default=1.3,
+        help="log-log slope above which a phase is reported as superlinear")
+    parser.add_argument(
+        "--fail_on_superlinear", action="store_true",
+        help="exit with an error if any phase scales superlinearly")
+    parser.add_argument("--output", help="path to save the report to")
+    parser.add_argument(
+        "--anvill_args", default="",
+        help="extra arguments for the decompiler, e.g. '--jobs 8'")
+
+    args = parser.parse_args()
+
+    base = {dim: getattr(args, f"base_{dim}") for dim in DIMENSIONS}
+    base["call_graph"] = args.call_graph
+
+    report = {"repeat": args.repeat, "base": base, "sweeps": {}}
+    with tempfile.TemporaryDirectory() as tempdir:
+        for dim in DIMENSIONS:
+            points = getattr(args, dim)
+            if points:
+                report["sweeps"][dim] = sweep_dimension(
+                    args, dim, points, base, tempdir)
+
+        # NOTE: The shape of the call graph isn't a size, and so there is no
+        #       slope to fit, only the times of each shape to compare.
+        if not args.no_call_graph_sweep:
+            shapes = {}
+            for shape in CALL_GRAPHS:
+                config = dict(base)
+                config["call_graph"] = shape
+                shapes[shape] = bench_point(args, config, tempdir)
+            report["call_graphs"] = shapes
+
+    benches = [bench for sweep in report["sweeps"].values()
+               for bench in sweep["points"]]
+    benches.extend(report.get("call_graphs", {}).values())
+    failed = [bench["config"] for bench in benches if "error" in bench]
+
+    superlinear = [(dim, name) for dim, sweep in report["sweeps"].items()
+                   for name in sweep["superlinear"]]
+
+    if args.output:
+        with open(args.output, "w") as f:
+            json.dump(report, f, indent=2, sort_keys=True)
+            f.write("\n")
+    else:
+        json.dump(report, sys.stdout, indent=2, sort_keys=True)
+        sys.stdout.write("\n")
+
+    for config in failed:
+        sys.stderr.write(f"Unable to benchmark {json.dumps(config)}\n")
+    for dim, name in superlinear:
+        slope = report["sweeps"][dim]["slopes"][name]
+        sys.stderr.write(f"{name} scales superlinearly with {dim} "
+                         f"(slope {slope:.2f})\n")
+
+    if failed or (superlinear and args.fail_on_superlinear):
+        sys.exit(1)
+    sys.exit(0)
@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2020 Trail of Bits, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Tests of the events of `anvill::Program`, and of subscribing to and
+// unsubscribing from them, including from within callbacks.
+
+#include <anvill/Decl.h>
+#include <anvill/Program.h>
+#include <glog/logging.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Type.h>
+#include <remill/BC/Util.h>
+
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+
+using EventLog = std::vector<std::pair<anvill::ProgramEvent, uint64_t>>;
+
+static void DeclareVariable(const anvill::Program &program,
+                            llvm::LLVMContext &context, uint64_t address) {
+  anvill::GlobalVarDecl decl;
+  decl.type = llvm::Type::getInt32Ty(context);
+  decl.address = address;
+  auto err = program.DeclareVariable(decl);
+  CHECK(!remill::IsError(err)) << remill::GetErrorString(err);
+}
+
+static void MapRange(anvill::Program &program, const std::vector<uint8_t> &data,
+                     uint64_t address) {
+  anvill::ByteRange range;
+  range.address = address;
+  range.begin = data.data();
+  range.end = data.data() + data.size();
+  auto err = program.MapRange(range);
+  CHECK(!remill::IsError(err)) << remill::GetErrorString(err);
+}
+
+// Subscribers get the events of every change, in order, until they
+// unsubscribe.
+static void TestSubscribeAndDeliver(llvm::LLVMContext &context) {
+  anvill::Program program;
+  EventLog log;
+  const auto id = program.SubscribeToEvents(
+      [&](anvill::ProgramEvent event, uint64_t address) {
+        log.emplace_back(event, address);
+      });
+  CHECK_NE(id, 0u);
+
+  const std::vector<uint8_t> data(16u, 0u);
+  DeclareVariable(program, context, 0x1000u);
+  MapRange(program, data, 0x1000u);
+  DeclareVariable(program, context, 0x1008u);
+
+  const EventLog expected = {
+      {anvill::kGlobalVariableDeclared, 0x1000u},
+      {anvill::kGlobalVariableDefined, 0x1000u},
+      {anvill::kGlobalVariableDefined, 0x1008u}};
+  CHECK(log == expected);
+
+  program.UnsubscribeFromEvents(id);
+  DeclareVariable(program, context, 0x2000u);
+  CHECK_EQ(log.size(), expected.size());
+}
+
+// A callback that unsubscribes itself keeps running, with its captures
+// intact, and gets no more events.
+static void TestUnsubscribeSelf(llvm::LLVMContext &context) {
+  anvill::Program program;
+  auto num_calls = std::make_shared<unsigned>(0u);
+  auto id = std::make_shared<uint64_t>(0u);
+  const std::string name(64u, 'x');
+
+  *id = program.SubscribeToEvents(
+      [&program, num_calls, id, name](anvill::ProgramEvent, uint64_t) {
+        program.UnsubscribeFromEvents(*id);
+
+        // NOTE(pag): These use the captures of the callback after it has
+        //            unsubscribed, which must still be alive.
+        *num_calls += 1u;
+        CHECK_EQ(name.size(), 64u);
+      });
+
+  DeclareVariable(program, context, 0x1000u);
+  DeclareVariable(program, context, 0x2000u);
+  CHECK_EQ(*num_calls, 1u);
+
+  // The program's reference to the callback is gone.
+  CHECK_EQ(num_calls.use_count(), 1);
+}
+
+// A callback that unsubscribes another subscriber during delivery stops the
+// other subscriber from getting the rest of the events, including the one
+// being delivered.
+static void TestUnsubscribeOther(llvm::LLVMContext &context) {
+  anvill::Program program;
+  EventLog first_log;
+  EventLog second_log;
+  uint64_t second_id = 0u;
+
+  program.SubscribeToEvents(
+      [&](anvill::ProgramEvent event, uint64_t address) {
+        first_log.emplace_back(event, address);
+        if (event == anvill::kGlobalVariableDefined) {
+          program.UnsubscribeFromEvents(second_id);
+        }
+      });
+  second_id = program.SubscribeToEvents(
+      [&](anvill::ProgramEvent event, uint64_t address) {
+        second_log.emplace_back(event, address);
+      });
+
+  DeclareVariable(program, context, 0x1000u);
+  DeclareVariable(program, context, 0x1008u);
+
+  // Mapping the range defines both variables, and so delivers two events in
+  // one batch. The second subscriber is unsubscribed by the first event.
+  const std::vector<uint8_t> data(16u, 0u);
+  MapRange(program, data, 0x1000u);
+
+  const EventLog expected_first = {
+      {anvill::kGlobalVariableDeclared, 0x1000u},
+      {anvill::kGlobalVariableDeclared, 0x1008u},
+      {anvill::kGlobalVariableDefined, 0x1000u},
+      {anvill::kGlobalVariableDefined, 0x1008u}};
+  const EventLog expected_second = {
+      {anvill::kGlobalVariableDeclared, 0x1000u},
+      {anvill::kGlobalVariableDeclared, 0x1008u}};
+  CHECK(first_log == expected_first);
+  CHECK(second_log == expected_second);
+}
+
+// Changes made by callbacks are delivered after the rest of the events of
+// the current change.
+static void TestChangeFromCallback(llvm::LLVMContext &context) {
+  anvill::Program program;
+  EventLog log;
+  program.SubscribeToEvents(
+      [&](anvill::ProgramEvent event, uint64_t address) {
+        log.emplace_back(event, address);
+        if (address == 0x1000u) {
+          DeclareVariable(program, context, 0x2000u);
+        }
+      });
+
+  DeclareVariable(program, context, 0x1000u);
+
+  const EventLog expected = {
+      {anvill::kGlobalVariableDeclared, 0x1000u},
+      {anvill::kGlobalVariableDeclared, 0x2000u}};
+  CHECK(log == expected);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  google::InitGoogleLogging(argv[0]);
+
+  llvm::LLVMContext context;
+  TestSubscribeAndDeliver(context);
+  TestUnsubscribeSelf(context);
+  TestUnsubscribeOther(context);
+  TestChangeFromCallback(context);
+
+  return EXIT_SUCCESS;
+}